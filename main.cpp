@@ -2,10 +2,50 @@
 #include <cstring> // For basic string operations
 #include <fstream> // For file operations
 #include <cstdio>  // For file system operations
+#include <cmath>   // For rating statistics
+#include <chrono>  // For time-decayed trending scores
+#include <thread>  // For the batch job thread pool
+#include <mutex>
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <condition_variable>
+#include <string>  // For network buffers
+#include <vector>
+#include <memory> // For snapshot parts shared between versions
+#include <unordered_map>
+#include <map>
+#include <algorithm>
+#include <csignal>
+#include <cstdlib>
+#include <climits>
+#include <cstddef> // For offsetof
+#ifdef __linux__
+#include <sys/socket.h> // For the query server
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h> // For reloading the database file when it changes
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h> // For the server's bind address
+#include <unistd.h>
+#include <cerrno>
+#endif
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+#include <coroutine> // For the async API (C++20 builds only)
+#define MOVIEDB_COROUTINES 1
+#endif
+#if defined(__x86_64__) && defined(__GNUC__)
+#define MOVIEDB_CRC32C_SSE42 1 // Hardware CRC32C through compiler builtins, checked at run time
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h> // For hardware CRC32C (ARMv8 CRC extension)
+#define MOVIEDB_CRC32C_ARM 1
+#endif
 
 // Maximum sizes for arrays
 const int MAX_MOVIES = 50;
-const int MAX_USERS = 20;
+const int MAX_USERS = 1024;
 const int MAX_CAST = 5;
 const int MAX_STRING_LENGTH = 100;
 const char *DB_FILENAME = "movies_database.dat";
@@ -23,6 +63,13 @@ public:
     float rating;
     int duration;
 
+    // Name dictionary IDs of the genre, director and cast (see
+    // NameDictionary); -1 until the movie is added to a database
+    int genreId;
+    int directorId;
+    int castIds[MAX_CAST];
+    int reserved; // Keeps the size a multiple of 16 bytes, so sorting copies stay vectorized
+
     // Constructor
     Movie()
     {
@@ -33,6 +80,13 @@ public:
         genre[0] = '\0';
         rating = 0.0f;
         duration = 0;
+        genreId = -1;
+        directorId = -1;
+        for (int i = 0; i < MAX_CAST; i++)
+        {
+            castIds[i] = -1;
+        }
+        reserved = 0;
     }
 
     // Initialize movie with data
@@ -74,6 +128,11 @@ public:
     }
 };
 
+// Movie records in version 100 database files and replication logs end
+// before the name IDs
+const size_t MOVIE_RECORD_V100 = offsetof(Movie, genreId);
+static_assert(sizeof(Movie) % 16 == 0, "movie records are copied in 16-byte blocks");
+
 // User class for storing user ratings
 class User
 {
@@ -110,55 +169,74 @@ public:
         strcpy(username, name);
     }
 
-    // Rate a movie
-    void rateMovie(const char *movieTitle, float rating)
+    // Outcome of setting a rating
+    enum RatingResult
+    {
+        RATING_ADDED,
+        RATING_UPDATED,
+        RATING_INVALID,
+        RATING_FULL
+    };
+
+    // Set a rating without printing anything
+    RatingResult setRating(const char *movieTitle, float rating)
     {
-        if (rating >= 0 && rating <= 10)
+        if (rating < 0 || rating > 10)
         {
-            // Check if movie is already rated
-            for (int i = 0; i < MAX_MOVIES; i++)
-            {
-                if (ratings[i].used && strcmp(ratings[i].movieTitle, movieTitle) == 0)
-                {
-                    ratings[i].rating = rating;
-                    std::cout << "Rating updated successfully!" << std::endl;
-                    return;
-                }
-            }
+            return RATING_INVALID;
+        }
 
-            // Find empty slot for new rating
-            if (ratingCount < MAX_MOVIES)
+        // Check if movie is already rated
+        for (int i = 0; i < MAX_MOVIES; i++)
+        {
+            if (ratings[i].used && strcmp(ratings[i].movieTitle, movieTitle) == 0)
             {
-                int index = 0;
-                while (index < MAX_MOVIES && ratings[index].used)
-                {
-                    index++;
-                }
-
-                if (index < MAX_MOVIES)
-                {
-                    strcpy(ratings[index].movieTitle, movieTitle);
-                    ratings[index].rating = rating;
-                    ratings[index].used = true;
-                    ratingCount++;
-                    std::cout << "Rating added successfully!" << std::endl;
-                }
-                else
-                {
-                    std::cout << "Error: No more space for ratings." << std::endl;
-                }
+                ratings[i].rating = rating;
+                return RATING_UPDATED;
             }
-            else
+        }
+
+        // Find empty slot for new rating
+        for (int index = 0; index < MAX_MOVIES && ratingCount < MAX_MOVIES; index++)
+        {
+            if (!ratings[index].used)
             {
-                std::cout << "Error: Maximum ratings reached." << std::endl;
+                strcpy(ratings[index].movieTitle, movieTitle);
+                ratings[index].rating = rating;
+                ratings[index].used = true;
+                ratingCount++;
+                return RATING_ADDED;
             }
         }
-        else
+        return RATING_FULL;
+    }
+
+    // Print the message for the outcome of a rating
+    static void printRatingResult(RatingResult result)
+    {
+        switch (result)
         {
+        case RATING_ADDED:
+            std::cout << "Rating added successfully!" << std::endl;
+            break;
+        case RATING_UPDATED:
+            std::cout << "Rating updated successfully!" << std::endl;
+            break;
+        case RATING_INVALID:
             std::cout << "Invalid rating! Please enter a rating between 0 and 10." << std::endl;
+            break;
+        case RATING_FULL:
+            std::cout << "Error: Maximum ratings reached." << std::endl;
+            break;
         }
     }
 
+    // Rate a movie
+    void rateMovie(const char *movieTitle, float rating)
+    {
+        printRatingResult(setRating(movieTitle, rating));
+    }
+
     // Check if user has rated a movie
     bool hasRated(const char *movieTitle) const
     {
@@ -205,1034 +283,11078 @@ public:
     }
 };
 
-// Database class to manage movies and users
-class MovieDatabase
+// Weight of the catalog rating when blending it with user ratings.
+// Acts like this many "virtual" votes at the catalog rating.
+const float BAYES_PRIOR_WEIGHT = 5.0f;
+const int RATING_TABLE_SIZE = 128; // Power of two, at least 2 * MAX_MOVIES
+
+// FNV-1a hash of a title, used by the hash tables keyed by title
+unsigned int hashTitle(const char *title)
 {
-private:
-    Movie movies[MAX_MOVIES];
-    int movieCount;
+    unsigned int hash = 2166136261u;
+    for (const char *p = title; *p != '\0'; p++)
+    {
+        hash ^= (unsigned char)*p;
+        hash *= 16777619u;
+    }
+    return hash;
+}
 
-    User users[MAX_USERS];
-    int userCount;
-    int currentUserId;
+// Running statistics of the user ratings for one movie.
+// Uses Welford's algorithm so every insert, removal or change is O(1).
+struct RatingStats
+{
+    int count;
+    double mean;
+    double m2; // Sum of squared differences from the mean
 
-public:
-    MovieDatabase() : movieCount(0), userCount(0), currentUserId(-1) {}
+    RatingStats() : count(0), mean(0.0), m2(0.0) {}
 
-    // Save database to file
-    bool saveToFile(const char *filename = DB_FILENAME)
+    void add(float rating)
     {
-        std::cout << "Attempting to save database to " << filename << std::endl;
-        std::cout << "Current movies: " << movieCount << ", Current users: " << userCount << std::endl;
+        count++;
+        double delta = rating - mean;
+        mean += delta / count;
+        m2 += delta * (rating - mean);
+    }
 
-        FILE *fp = fopen(filename, "wb");
-        if (!fp)
+    void remove(float rating)
+    {
+        if (count <= 1)
         {
-            std::cout << "Error: Could not open file for writing! Make sure you have write permissions." << std::endl;
-            perror("File open error");
-            return false;
+            count = 0;
+            mean = 0.0;
+            m2 = 0.0;
+            return;
         }
-
-        // Write file signature
-        const char signature[8] = "MVDB100";
-        size_t sigWritten = fwrite(signature, sizeof(char), 8, fp);
-        if (sigWritten != 8)
+        double oldMean = mean;
+        mean = (count * mean - rating) / (count - 1);
+        m2 -= (rating - oldMean) * (rating - mean);
+        if (m2 < 0.0)
         {
-            std::cout << "Error: Failed to write file signature." << std::endl;
-            perror("Write error");
-            fclose(fp);
-            return false;
+            m2 = 0.0; // Guard against rounding drift
         }
+        count--;
+    }
 
-        // Write movie count
-        size_t countWritten = fwrite(&movieCount, sizeof(int), 1, fp);
-        if (countWritten != 1)
-        {
-            std::cout << "Error: Failed to write movie count." << std::endl;
-            perror("Write error");
-            fclose(fp);
-            return false;
-        }
+    void change(float oldRating, float newRating)
+    {
+        remove(oldRating);
+        add(newRating);
+    }
 
-        // Write each movie
-        for (int i = 0; i < movieCount; i++)
-        {
-            size_t movieWritten = fwrite(&movies[i], sizeof(Movie), 1, fp);
-            if (movieWritten != 1)
-            {
-                std::cout << "Error: Failed to write movie data for movie " << i << "." << std::endl;
-                perror("Write error");
-                fclose(fp);
-                return false;
-            }
-        }
+    double variance() const
+    {
+        return (count > 1) ? m2 / (count - 1) : 0.0;
+    }
 
-        // Write user count
-        size_t userCountWritten = fwrite(&userCount, sizeof(int), 1, fp);
-        if (userCountWritten != 1)
-        {
-            std::cout << "Error: Failed to write user count." << std::endl;
-            perror("Write error");
-            fclose(fp);
-            return false;
-        }
+    // Bayesian average that starts at the catalog rating and moves
+    // towards the user mean as more ratings come in
+    float bayesianScore(float priorRating) const
+    {
+        return (float)((BAYES_PRIOR_WEIGHT * priorRating + count * mean) / (BAYES_PRIOR_WEIGHT + count));
+    }
+};
 
-        // Write each user
-        for (int i = 0; i < userCount; i++)
+// Hash table of rating statistics keyed by movie title (linear probing)
+class RatingAggregates
+{
+private:
+    struct Entry
+    {
+        char title[MAX_STRING_LENGTH];
+        RatingStats stats;
+        bool used;
+    };
+    Entry entries[RATING_TABLE_SIZE];
+
+    int findSlot(const char *title) const
+    {
+        int slot = hashTitle(title) & (RATING_TABLE_SIZE - 1);
+        while (entries[slot].used)
         {
-            size_t userWritten = fwrite(&users[i], sizeof(User), 1, fp);
-            if (userWritten != 1)
+            if (strcmp(entries[slot].title, title) == 0)
             {
-                std::cout << "Error: Failed to write user data for user " << i << "." << std::endl;
-                perror("Write error");
-                fclose(fp);
-                return false;
+                return slot;
             }
+            slot = (slot + 1) & (RATING_TABLE_SIZE - 1);
         }
+        return slot; // First empty slot
+    }
 
-        // Flush and close the file
-        fflush(fp);
-        fclose(fp);
-
-        // Verify file was created with non-zero size
-        FILE *check = fopen(filename, "rb");
-        if (!check)
-        {
-            std::cout << "Warning: Could not verify database file was created." << std::endl;
-            return false;
-        }
-
-        // Get file size
-        fseek(check, 0, SEEK_END);
-        long fileSize = ftell(check);
-        fclose(check);
-
-        if (fileSize > 0)
-        {
-            std::cout << "Database saved successfully to " << filename << " (" << fileSize << " bytes)" << std::endl;
-            return true;
-        }
-        else
-        {
-            std::cout << "Error: Database file was created but appears to be empty!" << std::endl;
-            return false;
-        }
+public:
+    RatingAggregates()
+    {
+        clear();
     }
 
-    // Load database from file
-    bool loadFromFile(const char *filename = DB_FILENAME)
+    void clear()
     {
-        FILE *fp = fopen(filename, "rb");
-        if (!fp)
+        for (int i = 0; i < RATING_TABLE_SIZE; i++)
         {
-            std::cout << "Warning: Could not open database file for reading. Creating a new database." << std::endl;
-            return false;
+            entries[i].used = false;
         }
+    }
 
-        // Read and verify file signature
-        char signature[8];
-        if (fread(signature, sizeof(char), 8, fp) != 8 || strncmp(signature, "MVDB100", 7) != 0)
-        {
-            std::cout << "Error: Invalid database file format. Creating a new database." << std::endl;
-            fclose(fp);
-            return false;
-        }
+    // Get statistics for a title, or nullptr if it has no ratings
+    const RatingStats *get(const char *title) const
+    {
+        int slot = findSlot(title);
+        return entries[slot].used ? &entries[slot].stats : nullptr;
+    }
 
-        // Read movie count
-        if (fread(&movieCount, sizeof(int), 1, fp) != 1)
+    // Get statistics for a title, creating an empty entry if needed
+    RatingStats *getOrCreate(const char *title)
+    {
+        int slot = findSlot(title);
+        if (!entries[slot].used)
         {
-            std::cout << "Error: Failed to read movie count. Creating a new database." << std::endl;
-            fclose(fp);
-            return false;
+            strcpy(entries[slot].title, title);
+            entries[slot].stats = RatingStats();
+            entries[slot].used = true;
         }
+        return &entries[slot].stats;
+    }
 
-        if (movieCount < 0 || movieCount > MAX_MOVIES)
+    // Remove a title, shifting back later entries of the probe chain
+    void remove(const char *title)
+    {
+        int slot = findSlot(title);
+        if (!entries[slot].used)
         {
-            std::cout << "Error: Corrupted database file (invalid movie count). Creating a new database." << std::endl;
-            fclose(fp);
-            movieCount = 0;
-            return false;
+            return;
         }
+        entries[slot].used = false;
 
-        // Read each movie
-        for (int i = 0; i < movieCount; i++)
+        int next = (slot + 1) & (RATING_TABLE_SIZE - 1);
+        while (entries[next].used)
         {
-            if (fread(&movies[i], sizeof(Movie), 1, fp) != 1)
+            int home = hashTitle(entries[next].title) & (RATING_TABLE_SIZE - 1);
+            // Move the entry back if its home slot is not between the hole and its position
+            bool movable = (slot <= next) ? (home <= slot || home > next) : (home <= slot && home > next);
+            if (movable)
             {
-                std::cout << "Error: Failed to read movie data. Creating a new database." << std::endl;
-                fclose(fp);
-                movieCount = 0;
-                return false;
+                entries[slot] = entries[next];
+                entries[next].used = false;
+                slot = next;
             }
+            next = (next + 1) & (RATING_TABLE_SIZE - 1);
         }
+    }
+};
 
-        // Read user count
-        if (fread(&userCount, sizeof(int), 1, fp) != 1)
-        {
-            std::cout << "Error: Failed to read user count. Creating a new database." << std::endl;
-            fclose(fp);
-            movieCount = 0;
-            userCount = 0;
-            return false;
-        }
+// User lookup table size: power of two, at least 2 * MAX_USERS
+const int USER_INDEX_SIZE = 2048;
 
-        if (userCount < 0 || userCount > MAX_USERS)
-        {
-            std::cout << "Error: Corrupted database file (invalid user count). Creating a new database." << std::endl;
-            fclose(fp);
-            movieCount = 0;
-            userCount = 0;
-            return false;
-        }
+// Hash index from user ID and from username to the user's slot in the
+// users array, so logins and session lookups don't scan every user.
+// Users are never removed, so entries are only added until the next rebuild.
+class UserIndex
+{
+private:
+    struct Entry
+    {
+        int slot;         // Position in the users array, -1 when empty
+        unsigned int key; // User ID, or the hash of the username
+    };
+    Entry byId[USER_INDEX_SIZE];
+    Entry byName[USER_INDEX_SIZE];
+    unsigned long long changes; // Copies keep it, so equal counts mean equal contents
 
-        // Read each user
-        for (int i = 0; i < userCount; i++)
+    static int home(unsigned int key)
+    {
+        return (int)((key * 2654435761u) >> 16) & (USER_INDEX_SIZE - 1);
+    }
+
+    static void insertInto(Entry table[], unsigned int key, int slot)
+    {
+        int i = home(key);
+        while (table[i].slot != -1)
         {
-            if (fread(&users[i], sizeof(User), 1, fp) != 1)
-            {
-                std::cout << "Error: Failed to read user data. Creating a new database." << std::endl;
-                fclose(fp);
-                movieCount = 0;
-                userCount = 0;
-                return false;
-            }
+            i = (i + 1) & (USER_INDEX_SIZE - 1);
         }
+        table[i].slot = slot;
+        table[i].key = key;
+    }
 
-        fclose(fp);
-        std::cout << "Database loaded successfully from " << filename << std::endl;
-        std::cout << "Loaded " << movieCount << " movies and " << userCount << " users." << std::endl;
-        return true;
+public:
+    UserIndex() : changes(0)
+    {
+        clear();
     }
 
-    // Add a movie to the database
-    void addMovie(const Movie &movie)
+    void clear()
     {
-        if (movieCount < MAX_MOVIES)
-        {
-            movies[movieCount++] = movie;
-            std::cout << "Movie added successfully!" << std::endl;
-        }
-        else
+        changes++;
+        for (int i = 0; i < USER_INDEX_SIZE; i++)
         {
-            std::cout << "Error: Database is full." << std::endl;
+            byId[i].slot = -1;
+            byName[i].slot = -1;
         }
     }
 
-    // Add a user to the database
-    void addUser(const User &user)
+    void insert(int slot, int userId, const char *username)
     {
-        if (userCount < MAX_USERS)
-        {
-            users[userCount++] = user;
-            std::cout << "User added successfully!" << std::endl;
-        }
-        else
-        {
-            std::cout << "Error: Maximum users reached." << std::endl;
-        }
+        changes++;
+        insertInto(byId, (unsigned int)userId, slot);
+        insertInto(byName, hashTitle(username), slot);
     }
 
-    // Get movie by title
-    Movie *getMovieByTitle(const char *title)
+    unsigned long long version() const
     {
-        for (int i = 0; i < movieCount; i++)
-        {
-            if (strcmp(movies[i].title, title) == 0)
-            {
-                return &movies[i];
-            }
-        }
-        return nullptr;
+        return changes;
     }
 
-    // Linear search movies by partial title
-    void searchByTitle(const char *title)
+    // Slot of the user with this ID, or -1. Equal keys are probed in
+    // insertion order, so duplicates resolve to the first slot like a scan.
+    int findId(int userId) const
     {
-        bool found = false;
-        for (int i = 0; i < movieCount; i++)
+        for (int i = home((unsigned int)userId); byId[i].slot != -1; i = (i + 1) & (USER_INDEX_SIZE - 1))
         {
-            // Basic substring search
-            const char *result = strstr(movies[i].title, title);
-            if (result != nullptr)
+            if (byId[i].key == (unsigned int)userId)
             {
-                movies[i].display();
-                found = true;
+                return byId[i].slot;
             }
         }
-        if (!found)
-        {
-            std::cout << "No movies found with title: " << title << std::endl;
-        }
+        return -1;
     }
 
-    // Search by exact year
-    void searchByYear(int year)
+    // Slot of the user with this name, or -1. nameOf(slot) gives the
+    // username stored in a slot, to rule out hash collisions.
+    int findName(const char *username, const std::function<const char *(int)> &nameOf) const
     {
-        bool found = false;
-        for (int i = 0; i < movieCount; i++)
+        unsigned int hash = hashTitle(username);
+        for (int i = home(hash); byName[i].slot != -1; i = (i + 1) & (USER_INDEX_SIZE - 1))
         {
-            if (movies[i].releaseYear == year)
+            if (byName[i].key == hash && strcmp(nameOf(byName[i].slot), username) == 0)
             {
-                movies[i].display();
-                found = true;
+                return byName[i].slot;
             }
         }
-        if (!found)
-        {
-            std::cout << "No movies found with release year: " << year << std::endl;
-        }
+        return -1;
     }
+};
 
-    // Search by genre
-    void searchByGenre(const char *genre)
-    {
-        bool found = false;
-        for (int i = 0; i < movieCount; i++)
+// Login state of one client: the menu, or one server connection. Every
+// client owns its session, so concurrent sessions share no mutable state.
+struct Session
+{
+    int userId; // -1 when nobody is logged in
+
+    Session() : userId(-1) {}
+
+    bool loggedIn() const { return userId != -1; }
+};
+
+// Trending tracker settings
+const int TRENDING_CAPACITY = 32;       // Movies tracked in the overall trending list
+const int TRENDING_GENRE_CAPACITY = 8;  // Movies tracked per genre
+const int TRENDING_MAX_GENRES = 16;     // Genres tracked separately
+const int SKETCH_DEPTH = 4;             // Count-Min sketch rows
+const int SKETCH_WIDTH = 1024;          // Count-Min sketch columns (power of two)
+const double TRENDING_HALF_LIFE = 3600.0; // Seconds for an event's weight to halve
+const float TRENDING_RATING_WEIGHT = 3.0f;
+const float TRENDING_SEARCH_WEIGHT = 1.0f;
+
+// Count-Min sketch of decayed event weights keyed by title hash.
+// Estimates never undercount, and memory stays fixed however many titles appear.
+class CountMinSketch
+{
+private:
+    double counts[SKETCH_DEPTH][SKETCH_WIDTH];
+
+    static int column(unsigned int hash, int row)
+    {
+        // Derive one independent-enough hash per row from the title hash
+        unsigned int h = hash * (2654435761u + 2u * row) + row * 40503u;
+        h ^= h >> 15;
+        return h & (SKETCH_WIDTH - 1);
+    }
+
+public:
+    CountMinSketch()
+    {
+        clear();
+    }
+
+    void clear()
+    {
+        for (int r = 0; r < SKETCH_DEPTH; r++)
         {
-            if (strcmp(movies[i].genre, genre) == 0)
+            for (int c = 0; c < SKETCH_WIDTH; c++)
             {
-                movies[i].display();
-                found = true;
+                counts[r][c] = 0.0;
             }
         }
-        if (!found)
-        {
-            std::cout << "No movies found with genre: " << genre << std::endl;
-        }
     }
 
-    // Search by director
-    void searchByDirector(const char *director)
+    // Add a weight and return the new estimate (conservative update)
+    double add(unsigned int hash, double weight)
     {
-        bool found = false;
-        for (int i = 0; i < movieCount; i++)
+        double estimate = this->estimate(hash) + weight;
+        for (int r = 0; r < SKETCH_DEPTH; r++)
         {
-            if (strcmp(movies[i].director, director) == 0)
+            double &cell = counts[r][column(hash, r)];
+            if (cell < estimate)
             {
-                movies[i].display();
-                found = true;
+                cell = estimate;
             }
         }
-        if (!found)
+        return estimate;
+    }
+
+    double estimate(unsigned int hash) const
+    {
+        double result = counts[0][column(hash, 0)];
+        for (int r = 1; r < SKETCH_DEPTH; r++)
         {
-            std::cout << "No movies found with director: " << director << std::endl;
+            double value = counts[r][column(hash, r)];
+            if (value < result)
+            {
+                result = value;
+            }
         }
+        return result;
     }
 
-    // Delete a movie
-    void deleteMovie(const char *title)
+    void scale(double factor)
     {
-        for (int i = 0; i < movieCount; i++)
+        for (int r = 0; r < SKETCH_DEPTH; r++)
         {
-            if (strcmp(movies[i].title, title) == 0)
+            for (int c = 0; c < SKETCH_WIDTH; c++)
             {
-                // Shift remaining movies
-                for (int j = i; j < movieCount - 1; j++)
-                {
-                    movies[j] = movies[j + 1];
-                }
-                movieCount--;
-                std::cout << "Movie deleted successfully!" << std::endl;
-                return;
+                counts[r][c] *= factor;
             }
         }
-        std::cout << "Movie not found!" << std::endl;
     }
+};
 
-    // View all movies
-    void viewAllMovies()
+// Fixed-size list of the highest scoring titles, kept sorted by score
+class TrendingList
+{
+public:
+    struct Entry
+    {
+        char title[MAX_STRING_LENGTH];
+        unsigned int hash;
+        double score;
+    };
+
+private:
+    Entry entries[TRENDING_CAPACITY];
+    int capacity;
+    int count;
+
+public:
+    TrendingList() : capacity(TRENDING_CAPACITY), count(0) {}
+
+    void setCapacity(int cap)
+    {
+        capacity = (cap > TRENDING_CAPACITY) ? TRENDING_CAPACITY : cap;
+    }
+
+    int size() const { return count; }
+    const Entry &at(int i) const { return entries[i]; }
+
+    // Offer a title with its latest score estimate. Scores of tracked titles
+    // only grow, so the entry just bubbles up towards the front.
+    void offer(const char *title, unsigned int hash, double score)
     {
-        if (movieCount == 0)
+        int pos = -1;
+        for (int i = 0; i < count; i++)
         {
-            std::cout << "No movies in the database." << std::endl;
-            return;
+            if (entries[i].hash == hash && strcmp(entries[i].title, title) == 0)
+            {
+                pos = i;
+                break;
+            }
         }
 
-        for (int i = 0; i < movieCount; i++)
+        if (pos == -1)
+        {
+            if (count < capacity)
+            {
+                pos = count++;
+            }
+            else if (score > entries[count - 1].score)
+            {
+                pos = count - 1; // Evict the lowest scoring title
+            }
+            else
+            {
+                return;
+            }
+            strcpy(entries[pos].title, title);
+            entries[pos].hash = hash;
+        }
+        entries[pos].score = score;
+
+        while (pos > 0 && entries[pos - 1].score < entries[pos].score)
         {
-            movies[i].display();
+            Entry temp = entries[pos - 1];
+            entries[pos - 1] = entries[pos];
+            entries[pos] = temp;
+            pos--;
         }
     }
 
-    // Sort movies by rating using bubble sort
-    void sortByRatingBubble()
+    void remove(const char *title)
     {
-        for (int i = 0; i < movieCount; i++)
+        for (int i = 0; i < count; i++)
         {
-            for (int j = 0; j < movieCount - i - 1; j++)
+            if (strcmp(entries[i].title, title) == 0)
             {
-                if (movies[j].rating < movies[j + 1].rating)
+                for (int j = i; j < count - 1; j++)
                 {
-                    // Swap movies
-                    Movie temp = movies[j];
-                    movies[j] = movies[j + 1];
-                    movies[j + 1] = temp;
+                    entries[j] = entries[j + 1];
                 }
+                count--;
+                return;
             }
         }
-        std::cout << "Movies sorted by rating (Bubble Sort)!" << std::endl;
     }
 
-    // Sort movies by rating using selection sort
-    void sortByRatingSelection()
+    void scale(double factor)
     {
-        for (int i = 0; i < movieCount; i++)
+        for (int i = 0; i < count; i++)
         {
-            int maxIndex = i;
-            for (int j = i + 1; j < movieCount; j++)
-            {
-                if (movies[j].rating > movies[maxIndex].rating)
-                {
-                    maxIndex = j;
-                }
-            }
-            // Swap movies
-            if (maxIndex != i)
-            {
-                Movie temp = movies[i];
-                movies[i] = movies[maxIndex];
-                movies[maxIndex] = temp;
-            }
+            entries[i].score *= factor;
         }
-        std::cout << "Movies sorted by rating (Selection Sort)!" << std::endl;
     }
+};
 
-    // Login as a user
-    bool loginUser(int userId)
+// Streaming tracker of trending movies from rating and search events.
+// Scores decay exponentially over time using forward decay: each event is
+// weighted by exp(lambda * (t - landmark)), so stored scores never need to be
+// decayed one by one and all titles keep their relative order between events.
+class TrendingTracker
+{
+private:
+    CountMinSketch sketch;
+    TrendingList overall;
+    int genreIds[TRENDING_MAX_GENRES]; // Name dictionary IDs, so spellings of a genre share a list
+    TrendingList genreLists[TRENDING_MAX_GENRES];
+    int genreCount;
+    double lambda;   // Decay rate per second
+    double landmark; // Time (seconds) where stored weights equal 1
+    long long eventCount;
+
+    int findGenre(int genreId, bool create)
     {
-        for (int i = 0; i < userCount; i++)
+        for (int i = 0; i < genreCount; i++)
         {
-            if (users[i].userId == userId)
+            if (genreIds[i] == genreId)
             {
-                currentUserId = userId;
-                std::cout << "Logged in as " << users[i].username << std::endl;
-                return true;
+                return i;
             }
         }
-        std::cout << "User not found!" << std::endl;
-        return false;
+        if (!create || genreId < 0 || genreCount == TRENDING_MAX_GENRES)
+        {
+            return -1;
+        }
+        genreIds[genreCount] = genreId;
+        genreLists[genreCount] = TrendingList();
+        genreLists[genreCount].setCapacity(TRENDING_GENRE_CAPACITY);
+        return genreCount++;
     }
 
-    // Create a new user
-    void createUser(const char *username)
+    // Move the landmark forward before the weights grow too large
+    void renormalize(double now)
     {
-        if (userCount < MAX_USERS)
+        double factor = exp(-lambda * (now - landmark));
+        sketch.scale(factor);
+        overall.scale(factor);
+        for (int i = 0; i < genreCount; i++)
         {
-            int newId = userCount + 1;
-            User newUser;
-            newUser.initialize(newId, username);
-            users[userCount++] = newUser;
-            currentUserId = newId;
-            std::cout << "Created user " << username << " with ID " << newId << std::endl;
+            genreLists[i].scale(factor);
         }
-        else
+        landmark = now;
+    }
+
+    void printList(const TrendingList &list, int k, double now) const
+    {
+        double decay = exp(-lambda * (now - landmark));
+        int limit = (k < list.size()) ? k : list.size();
+        for (int i = 0; i < limit; i++)
         {
-            std::cout << "Error: Maximum users reached." << std::endl;
+            std::cout << i + 1 << ". " << list.at(i).title << " (score " << list.at(i).score * decay << ")" << std::endl;
         }
     }
 
-    // Rate a movie
-    void rateMovie(const char *title, float rating)
+public:
+    TrendingTracker() : genreCount(0), lambda(log(2.0) / TRENDING_HALF_LIFE), landmark(0.0), eventCount(0)
+    {
+        landmark = currentTime();
+    }
+
+    // Seconds on a monotonic clock
+    static double currentTime()
     {
-        if (currentUserId == -1)
+        return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    // Record an event for a movie at the given time. O(1), never touches the catalog.
+    void recordEvent(const char *title, int genreId, float weight, double now)
+    {
+        if (lambda * (now - landmark) > 50.0)
         {
-            std::cout << "Please login first!" << std::endl;
-            return;
+            renormalize(now);
         }
+        unsigned int hash = hashTitle(title);
+        double score = sketch.add(hash, weight * exp(lambda * (now - landmark)));
+        overall.offer(title, hash, score);
 
-        // Find the movie
-        bool movieFound = false;
-        for (int i = 0; i < movieCount; i++)
+        int g = findGenre(genreId, true);
+        if (g != -1)
         {
-            if (strcmp(movies[i].title, title) == 0)
-            {
-                movieFound = true;
-                break;
-            }
+            genreLists[g].offer(title, hash, score);
         }
+        eventCount++;
+    }
+
+    void recordRating(const Movie &movie)
+    {
+        recordEvent(movie.title, movie.genreId, TRENDING_RATING_WEIGHT, currentTime());
+    }
+
+    void recordSearch(const Movie &movie)
+    {
+        recordEvent(movie.title, movie.genreId, TRENDING_SEARCH_WEIGHT, currentTime());
+    }
 
-        if (!movieFound)
+    // Forget a deleted movie
+    void removeMovie(const Movie &movie)
+    {
+        overall.remove(movie.title);
+        int g = findGenre(movie.genreId, false);
+        if (g != -1)
         {
-            std::cout << "Movie not found!" << std::endl;
-            return;
+            genreLists[g].remove(movie.title);
         }
+    }
 
-        // Find the user and add rating
-        for (int i = 0; i < userCount; i++)
+    long long getEventCount() const { return eventCount; }
+
+    // Display the top K trending movies, overall or for one genre given
+    // by its name and its dictionary ID (-1 if the name is unknown)
+    void displayTrending(const char *genre, int genreId, int k)
+    {
+        double now = currentTime();
+        if (genre == nullptr || genre[0] == '\0')
         {
-            if (users[i].userId == currentUserId)
+            if (overall.size() == 0)
             {
-                users[i].rateMovie(title, rating);
+                std::cout << "No trending movies yet. Search and rate some movies first." << std::endl;
                 return;
             }
+            std::cout << "Trending now:" << std::endl;
+            printList(overall, k, now);
+            return;
         }
-    }
 
-    // Display user ratings
-    void displayUserRatings()
-    {
-        if (currentUserId == -1)
+        int g = findGenre(genreId, false);
+        if (g == -1 || genreLists[g].size() == 0)
         {
-            std::cout << "Please login first!" << std::endl;
+            std::cout << "No trending movies in genre: " << genre << std::endl;
             return;
         }
+        std::cout << "Trending now in " << genre << ":" << std::endl;
+        printList(genreLists[g], k, now);
+    }
+};
 
-        for (int i = 0; i < userCount; i++)
-        {
-            if (users[i].userId == currentUserId)
-            {
-                users[i].displayRatings();
-                return;
-            }
-        }
+// Recommendations kept per user by the batch job
+const int RECOMMENDATION_COUNT = 5;
+
+// Similarity between two movies given their user scores
+float scoreSimilarity(const Movie &movie1, float score1, const Movie &movie2, float score2)
+{
+    float similarity = 0.0f;
+
+    // Same genre is a strong indicator
+    if (movie1.genreId == movie2.genreId)
+    {
+        similarity += 3.0f;
     }
 
-    // Calculate similarity between two movies
-    float calculateMovieSimilarity(const Movie &movie1, const Movie &movie2)
+    // Same director is also significant
+    if (movie1.directorId == movie2.directorId)
     {
-        float similarity = 0.0f;
+        similarity += 2.0f;
+    }
 
-        // Same genre is a strong indicator
-        if (strcmp(movie1.genre, movie2.genre) == 0)
-        {
-            similarity += 3.0f;
-        }
+    // Rating similarity (inverse of difference), using the user-weighted score
+    similarity += (10.0f - abs(score1 - score2)) * 0.5f;
 
-        // Same director is also significant
-        if (strcmp(movie1.director, movie2.director) == 0)
-        {
-            similarity += 2.0f;
-        }
+    // Release year similarity (closer years get higher scores)
+    float yearDiff = abs(movie1.releaseYear - movie2.releaseYear) / 10.0f;
+    similarity += (5.0f - (yearDiff > 5.0f ? 5.0f : yearDiff)) * 0.2f;
 
-        // Rating similarity (inverse of difference)
-        similarity += (10.0f - abs(movie1.rating - movie2.rating)) * 0.5f;
+    return similarity;
+}
 
-        // Release year similarity (closer years get higher scores)
-        float yearDiff = abs(movie1.releaseYear - movie2.releaseYear) / 10.0f;
-        similarity += (5.0f - (yearDiff > 5.0f ? 5.0f : yearDiff)) * 0.2f;
+// Keeps the best scoring positions seen so far, best first.
+// Ties keep the position offered first (catalog order).
+struct TopSimilar
+{
+    int count;
+    int limit;
+    int positions[RECOMMENDATION_COUNT];
+    float scores[RECOMMENDATION_COUNT];
 
-        return similarity;
+    TopSimilar(int maxResults = RECOMMENDATION_COUNT) : count(0)
+    {
+        limit = (maxResults > RECOMMENDATION_COUNT) ? RECOMMENDATION_COUNT : (maxResults < 0 ? 0 : maxResults);
     }
 
-    // Find similar movies
-    void findSimilarMovies(const char *title)
+    void offer(int position, float score)
     {
-        Movie *targetMovie = getMovieByTitle(title);
-        if (targetMovie == nullptr)
+        if (limit == 0 || (count == limit && score <= scores[count - 1]))
         {
-            std::cout << "Movie not found!" << std::endl;
             return;
         }
-
-        // Store similarity scores
-        struct MovieSimilarity
+        int pos = (count < limit) ? count++ : count - 1;
+        while (pos > 0 && scores[pos - 1] < score)
         {
-            int movieIndex;
-            float score;
-        };
-        MovieSimilarity similarities[MAX_MOVIES];
-        int simCount = 0;
+            scores[pos] = scores[pos - 1];
+            positions[pos] = positions[pos - 1];
+            pos--;
+        }
+        scores[pos] = score;
+        positions[pos] = position;
+    }
+};
 
-        // Calculate similarities
-        for (int i = 0; i < movieCount; i++)
+// Thread pool where every worker owns a task queue. A worker takes the newest
+// task from its own queue and, when that runs dry, steals the oldest task from
+// another worker, so uneven tasks still keep every core busy.
+// Batch jobs queue tasks and call run(); servers call start() once and keep
+// submitting until shutdown().
+class WorkStealingPool
+{
+private:
+    struct WorkerQueue
+    {
+        std::mutex lock;
+        std::deque<std::function<void()>> tasks;
+    };
+
+    int workerCount;
+    WorkerQueue *queues;
+    std::atomic<int> nextQueue;
+    std::atomic<int> pending; // Submitted but not finished
+    std::atomic<int> queued;  // Submitted but not yet taken by a worker
+
+    // Service mode
+    std::thread *serviceThreads;
+    std::atomic<bool> serving;
+    std::mutex idleLock;
+    std::condition_variable idle;
+
+    bool takeTask(int self, std::function<void()> &task)
+    {
         {
-            if (strcmp(movies[i].title, title) != 0)
-            { // Skip the target movie
-                similarities[simCount].movieIndex = i;
-                similarities[simCount].score = calculateMovieSimilarity(*targetMovie, movies[i]);
-                simCount++;
+            std::lock_guard<std::mutex> guard(queues[self].lock);
+            if (!queues[self].tasks.empty())
+            {
+                task = std::move(queues[self].tasks.back());
+                queues[self].tasks.pop_back();
+                queued--;
+                return true;
             }
         }
-
-        // Sort by similarity (bubble sort)
-        for (int i = 0; i < simCount; i++)
+        for (int i = 1; i < workerCount; i++)
         {
-            for (int j = 0; j < simCount - i - 1; j++)
+            WorkerQueue &victim = queues[(self + i) % workerCount];
+            std::lock_guard<std::mutex> guard(victim.lock);
+            if (!victim.tasks.empty())
             {
-                if (similarities[j].score < similarities[j + 1].score)
-                {
-                    // Swap
-                    MovieSimilarity temp = similarities[j];
-                    similarities[j] = similarities[j + 1];
-                    similarities[j + 1] = temp;
-                }
+                task = std::move(victim.tasks.front());
+                victim.tasks.pop_front();
+                queued--;
+                return true;
             }
         }
+        return false;
+    }
 
-        // Display the top 5 similar movies
-        std::cout << "Similar movies to " << title << ":" << std::endl;
-        int limit = (simCount < 5) ? simCount : 5;
-        for (int i = 0; i < limit; i++)
+    void workerLoop(int self)
+    {
+        std::function<void()> task;
+        while (pending.load() > 0)
         {
-            movies[similarities[i].movieIndex].display();
+            if (takeTask(self, task))
+            {
+                task();
+                pending--;
+            }
+            else
+            {
+                std::this_thread::yield();
+            }
         }
     }
 
-    // Get recommendations based on user's highest rated movie
-    void getRecommendations()
+    // Long-running worker: sleeps while there is nothing queued
+    void serviceLoop(int self)
     {
-        if (currentUserId == -1)
+        std::function<void()> task;
+        while (serving.load())
         {
-            std::cout << "Please login first!" << std::endl;
-            return;
+            if (takeTask(self, task))
+            {
+                task();
+                pending--;
+                continue;
+            }
+            std::unique_lock<std::mutex> lock(idleLock);
+            idle.wait(lock, [this]()
+                      { return queued.load() > 0 || !serving.load(); });
         }
+    }
 
-        // Find the current user
-        User *currentUser = nullptr;
-        for (int i = 0; i < userCount; i++)
+public:
+    WorkStealingPool(int workers = defaultWorkerCount())
+        : workerCount(workers < 1 ? 1 : workers), nextQueue(0), pending(0), queued(0),
+          serviceThreads(nullptr), serving(false)
+    {
+        queues = new WorkerQueue[workerCount];
+    }
+
+    ~WorkStealingPool()
+    {
+        shutdown();
+        delete[] queues;
+    }
+
+    // Start long-running workers that execute tasks as they are submitted
+    void start()
+    {
+        serving = true;
+        serviceThreads = new std::thread[workerCount];
+        for (int i = 0; i < workerCount; i++)
         {
-            if (users[i].userId == currentUserId)
-            {
-                currentUser = &users[i];
-                break;
-            }
+            serviceThreads[i] = std::thread(&WorkStealingPool::serviceLoop, this, i);
         }
+    }
 
-        if (currentUser == nullptr || currentUser->ratingCount == 0)
+    // Stop the long-running workers after they finish their current task
+    void shutdown()
+    {
+        if (serviceThreads == nullptr)
         {
-            std::cout << "Please rate some movies first to get recommendations." << std::endl;
             return;
         }
+        {
+            std::lock_guard<std::mutex> guard(idleLock);
+            serving = false;
+        }
+        idle.notify_all();
+        for (int i = 0; i < workerCount; i++)
+        {
+            serviceThreads[i].join();
+        }
+        delete[] serviceThreads;
+        serviceThreads = nullptr;
+    }
 
-        std::cout << "\n--- Recommendations for " << currentUser->username << " ---" << std::endl;
+    // One worker per hardware thread
+    static int defaultWorkerCount()
+    {
+        unsigned int cores = std::thread::hardware_concurrency();
+        return (cores == 0) ? 1 : (int)cores;
+    }
 
-        // Find highest rated movie
-        char highestRatedMovie[MAX_STRING_LENGTH] = "";
-        float highestRating = 0;
+    int getWorkerCount() const { return workerCount; }
 
-        for (int i = 0; i < MAX_MOVIES; i++)
+    // Queue a task; tasks are spread round-robin over the worker queues
+    void submit(std::function<void()> task)
+    {
+        WorkerQueue &queue = queues[(unsigned int)nextQueue++ % workerCount];
         {
-            if (currentUser->ratings[i].used && currentUser->ratings[i].rating > highestRating)
-            {
-                highestRating = currentUser->ratings[i].rating;
-                strcpy(highestRatedMovie, currentUser->ratings[i].movieTitle);
-            }
+            std::lock_guard<std::mutex> guard(queue.lock);
+            queue.tasks.push_back(std::move(task));
+            pending++;
+            queued++;
         }
-
-        // Find similar movies to the highest rated
-        if (highestRatedMovie[0] != '\0')
+        if (serviceThreads != nullptr)
         {
-            std::cout << "Based on your highest rated movie (" << highestRatedMovie << "):" << std::endl;
-            findSimilarMovies(highestRatedMovie);
+            std::lock_guard<std::mutex> guard(idleLock);
+            idle.notify_one();
         }
     }
 
-    // Modified runMenu to handle database saving
-    void runMenu()
+    // Run every queued task to completion. The calling thread is worker 0.
+    void run()
     {
-        // If no data loaded from file, add sample users
-        if (userCount == 0)
+        std::thread *threads = new std::thread[workerCount - 1];
+        for (int i = 1; i < workerCount; i++)
         {
-            User user1;
-            user1.initialize(1, "Alice");
-            addUser(user1);
+            threads[i - 1] = std::thread(&WorkStealingPool::workerLoop, this, i);
+        }
+        workerLoop(0);
+        for (int i = 0; i < workerCount - 1; i++)
+        {
+            threads[i].join();
+        }
+        delete[] threads;
+    }
 
-            User user2;
-            user2.initialize(2, "Bob");
-            addUser(user2);
+    // Split [0, count) into chunks of at most grain items and run them in parallel
+    void parallelFor(int count, int grain, const std::function<void(int, int)> &body)
+    {
+        if (grain < 1)
+        {
+            grain = 1;
+        }
+        for (int begin = 0; begin < count; begin += grain)
+        {
+            int end = (begin + grain < count) ? begin + grain : count;
+            submit([&body, begin, end]()
+                   { body(begin, end); });
+        }
+        run();
+    }
+};
 
-            User user3;
-            user3.initialize(3, "Charlie");
-            addUser(user3);
+// One user's precomputed recommendations. Movies are stored by position
+// in the catalog, so a row is only valid for the layout it was built on.
+struct RecommendationRow
+{
+    int userId;
+    short basedOn; // Position of the user's highest rated movie, -1 if none
+    short count;   // Number of recommendations, -1 if the row is stale
+    short movieIndex[RECOMMENDATION_COUNT];
+};
+
+// Table of precomputed recommendations with one row per user slot
+class RecommendationTable
+{
+public:
+    RecommendationRow rows[MAX_USERS];
+    int rowCount;
+    int layoutVersion; // Catalog layout the rows were computed against
+    bool valid;
+
+    RecommendationTable() : rowCount(0), layoutVersion(0), valid(false) {}
+
+    void clear()
+    {
+        rowCount = 0;
+        valid = false;
+    }
+
+    // Get the row for a user slot if it is still usable, otherwise nullptr
+    const RecommendationRow *lookup(int userSlot, int userId, int currentLayout) const
+    {
+        if (!valid || layoutVersion != currentLayout || userSlot >= rowCount)
+        {
+            return nullptr;
         }
+        const RecommendationRow &row = rows[userSlot];
+        return (row.userId == userId && row.count >= 0) ? &row : nullptr;
+    }
 
-        int choice;
-        do
+    // Mark a single user's row stale (e.g. after they rate a movie)
+    void invalidateUser(int userSlot)
+    {
+        if (userSlot < rowCount)
         {
-            std::cout << "\nMovie Database Search System\n";
-            std::cout << "1. Search by Title\n";
-            std::cout << "2. Search by Release Year\n";
-            std::cout << "3. Add Movie\n";
-            std::cout << "4. Delete Movie\n";
-            std::cout << "5. View All Movies\n";
-            std::cout << "6. Search by Genre\n";
-            std::cout << "7. Search by Director\n";
-            std::cout << "8. Sort by Rating (Bubble Sort)\n";
-            std::cout << "9. Sort by Rating (Selection Sort)\n";
-            std::cout << "10. User Login/Switch\n";
-            std::cout << "11. Rate a Movie\n";
-            std::cout << "12. View My Ratings\n";
-            std::cout << "13. Get Movie Recommendations\n";
-            std::cout << "14. Find Similar Movies\n";
-            std::cout << "15. Save Database\n"; // New option
-            std::cout << "16. Exit\n";          // Changed to 16
-            std::cout << "Enter your choice: ";
-            std::cin >> choice;
-            std::cin.ignore(); // Ignore the newline character left in the input buffer
+            rows[userSlot].count = -1;
+        }
+    }
 
-            // Display current user if logged in
-            if (currentUserId != -1)
+    // The movie at a position was deleted: mark rows that use it stale
+    void movieRemoved(int position)
+    {
+        for (int u = 0; u < rowCount; u++)
+        {
+            RecommendationRow &row = rows[u];
+            bool uses = row.basedOn == position;
+            for (int i = 0; i < row.count && !uses; i++)
             {
-                for (int i = 0; i < userCount; i++)
-                {
-                    if (users[i].userId == currentUserId)
-                    {
-                        std::cout << "[Currently logged in as: " << users[i].username << "]" << std::endl;
-                        break;
-                    }
-                }
+                uses = row.movieIndex[i] == position;
             }
-
-            switch (choice)
+            if (uses)
             {
-            case 1:
+                row.count = -1;
+            }
+        }
+    }
+
+    // Movies were compacted: remap[old] is the new position (-1 if gone)
+    void remapPositions(const int remap[])
+    {
+        for (int u = 0; u < rowCount; u++)
+        {
+            RecommendationRow &row = rows[u];
+            if (row.count < 0)
             {
-                char title[MAX_STRING_LENGTH];
-                std::cout << "Enter movie title: ";
-                std::cin.getline(title, MAX_STRING_LENGTH);
-                searchByTitle(title);
-                break;
+                continue;
             }
-            case 2:
+            if (row.basedOn >= 0)
             {
-                int year;
-                std::cout << "Enter release year: ";
-                std::cin >> year;
-                searchByYear(year);
-                break;
+                row.basedOn = (short)remap[row.basedOn];
             }
-            case 3:
+            for (int i = 0; i < row.count; i++)
             {
-                Movie movie;
-                char title[MAX_STRING_LENGTH];
-                int releaseYear;
-                char director[MAX_STRING_LENGTH];
-                char genre[MAX_STRING_LENGTH];
-                float rating;
-                int duration;
-
-                std::cout << "Enter movie title: ";
-                std::cin.ignore();
-                std::cin.getline(title, MAX_STRING_LENGTH);
-
-                std::cout << "Enter release year: ";
-                std::cin >> releaseYear;
-
-                std::cout << "Enter director: ";
-                std::cin.ignore();
-                std::cin.getline(director, MAX_STRING_LENGTH);
-
-                std::cout << "Enter genre: ";
-                std::cin.getline(genre, MAX_STRING_LENGTH);
+                row.movieIndex[i] = (short)remap[row.movieIndex[i]];
+            }
+        }
+    }
+};
 
-                std::cout << "Enter rating: ";
-                std::cin >> rating;
+// Similarity/recommendation cache size: shards x entries per shard
+const int CACHE_SHARDS = 4;
+const int CACHE_SHARD_ENTRIES = 16;
+
+// Cache of findSimilarMovies and getRecommendations results.
+// Movie entries hold the positions of the similar movies; user entries hold the
+// movie a user's recommendations are based on, so a user hit is served
+// through the movie entries. Each shard evicts with the CLOCK algorithm and
+// has its own lock. Entries are dropped precisely when their inputs change
+// instead of on a timer.
+class ResultCache
+{
+public:
+    struct Entry
+    {
+        bool used;
+        bool referenced; // CLOCK bit, set on every hit
+        bool isUser;
+        unsigned int hash;
+        int userId;                   // User entries
+        char key[MAX_STRING_LENGTH];  // Movie title, or the title a user entry is based on
+        int count;                    // Movie entries: number of similar movies
+        float threshold;              // Movie entries: score of the last similar movie
+        int results[RECOMMENDATION_COUNT]; // Movie entries: catalog positions
+    };
 
-                std::cout << "Enter duration (in minutes): ";
-                std::cin >> duration;
+private:
+    struct Shard
+    {
+        std::mutex lock;
+        Entry entries[CACHE_SHARD_ENTRIES];
+        int hand;
+        long long hits;
+        long long misses;
+        long long evictions;
+        long long invalidations;
+    };
+    Shard shards[CACHE_SHARDS];
 
-                int castCount;
-                std::cout << "Enter number of cast members (max 5): ";
-                std::cin >> castCount;
-                if (castCount > MAX_CAST)
-                    castCount = MAX_CAST;
-                std::cin.ignore();
+    static unsigned int hashUser(int userId)
+    {
+        return (unsigned int)userId * 2654435761u;
+    }
 
-                char castList[MAX_CAST][MAX_STRING_LENGTH];
-                for (int i = 0; i < castCount; i++)
-                {
-                    std::cout << "Enter cast member " << i + 1 << ": ";
-                    std::cin.getline(castList[i], MAX_STRING_LENGTH);
-                }
+    Shard &shardFor(unsigned int hash)
+    {
+        return shards[hash % CACHE_SHARDS];
+    }
 
-                movie.initialize(title, releaseYear, director, castList, castCount, genre, rating, duration);
-                addMovie(movie);
-                break;
+    // Find an entry in a shard (caller holds the lock)
+    static Entry *find(Shard &shard, bool isUser, unsigned int hash, int userId, const char *title)
+    {
+        for (int i = 0; i < CACHE_SHARD_ENTRIES; i++)
+        {
+            Entry &e = shard.entries[i];
+            if (e.used && e.isUser == isUser && e.hash == hash &&
+                (isUser ? e.userId == userId : strcmp(e.key, title) == 0))
+            {
+                return &e;
             }
-            case 4:
+        }
+        return nullptr;
+    }
+
+    // Pick a slot for a new entry: a free one, or the first the CLOCK hand
+    // finds without its referenced bit (caller holds the lock)
+    static Entry *allocate(Shard &shard)
+    {
+        for (int i = 0; i < CACHE_SHARD_ENTRIES; i++)
+        {
+            if (!shard.entries[i].used)
             {
-                char title[MAX_STRING_LENGTH];
-                std::cout << "Enter movie title to delete: ";
-                std::cin.getline(title, MAX_STRING_LENGTH);
-                deleteMovie(title);
-                break;
+                return &shard.entries[i];
             }
-            case 5:
-                viewAllMovies();
-                break;
-            case 6:
+        }
+        while (true)
+        {
+            Entry &e = shard.entries[shard.hand];
+            shard.hand = (shard.hand + 1) % CACHE_SHARD_ENTRIES;
+            if (!e.referenced)
             {
-                char genre[MAX_STRING_LENGTH];
-                std::cout << "Enter genre: ";
-                std::cin.getline(genre, MAX_STRING_LENGTH);
-                searchByGenre(genre);
-                break;
+                shard.evictions++;
+                return &e;
             }
-            case 7:
+            e.referenced = false;
+        }
+    }
+
+    static bool containsResult(const Entry &e, int position)
+    {
+        for (int i = 0; i < e.count; i++)
+        {
+            if (e.results[i] == position)
             {
-                char director[MAX_STRING_LENGTH];
-                std::cout << "Enter director: ";
-                std::cin.getline(director, MAX_STRING_LENGTH);
-                searchByDirector(director);
-                break;
+                return true;
             }
-            case 8:
-                sortByRatingBubble();
-                viewAllMovies();
-                break;
-            case 9:
-                sortByRatingSelection();
-                viewAllMovies();
-                break;
-            case 10:
+        }
+        return false;
+    }
+
+    static void drop(Shard &shard, Entry &e)
+    {
+        e.used = false;
+        shard.invalidations++;
+    }
+
+public:
+    ResultCache()
+    {
+        for (int s = 0; s < CACHE_SHARDS; s++)
+        {
+            shards[s].hand = 0;
+            shards[s].hits = shards[s].misses = shards[s].evictions = shards[s].invalidations = 0;
+            for (int i = 0; i < CACHE_SHARD_ENTRIES; i++)
             {
-                int option;
-                std::cout << "1. Login as existing user\n";
-                std::cout << "2. Create new user\n";
-                std::cout << "Enter option: ";
-                std::cin >> option;
+                shards[s].entries[i].used = false;
+            }
+        }
+    }
 
-                if (option == 1)
+    // Copy the cached similar movie positions of a movie; false on a miss
+    bool lookupSimilar(const char *title, int &count, int results[])
+    {
+        unsigned int hash = hashTitle(title);
+        Shard &shard = shardFor(hash);
+        std::lock_guard<std::mutex> guard(shard.lock);
+        Entry *e = find(shard, false, hash, 0, title);
+        if (e == nullptr)
+        {
+            shard.misses++;
+            return false;
+        }
+        e->referenced = true;
+        shard.hits++;
+        count = e->count;
+        for (int i = 0; i < count; i++)
+        {
+            results[i] = e->results[i];
+        }
+        return true;
+    }
+
+    void storeSimilar(const char *title, int count, const int results[], float threshold)
+    {
+        unsigned int hash = hashTitle(title);
+        Shard &shard = shardFor(hash);
+        std::lock_guard<std::mutex> guard(shard.lock);
+        Entry *e = find(shard, false, hash, 0, title);
+        if (e == nullptr)
+        {
+            e = allocate(shard);
+        }
+        e->used = true;
+        e->referenced = false;
+        e->isUser = false;
+        e->hash = hash;
+        strcpy(e->key, title);
+        e->count = count;
+        e->threshold = threshold;
+        for (int i = 0; i < count; i++)
+        {
+            e->results[i] = results[i];
+        }
+    }
+
+    // Copy the title a user's recommendations are based on; false on a miss
+    bool lookupUser(int userId, char *basedOn)
+    {
+        unsigned int hash = hashUser(userId);
+        Shard &shard = shardFor(hash);
+        std::lock_guard<std::mutex> guard(shard.lock);
+        Entry *e = find(shard, true, hash, userId, nullptr);
+        if (e == nullptr)
+        {
+            shard.misses++;
+            return false;
+        }
+        e->referenced = true;
+        shard.hits++;
+        strcpy(basedOn, e->key);
+        return true;
+    }
+
+    void storeUser(int userId, const char *basedOn)
+    {
+        unsigned int hash = hashUser(userId);
+        Shard &shard = shardFor(hash);
+        std::lock_guard<std::mutex> guard(shard.lock);
+        Entry *e = find(shard, true, hash, userId, nullptr);
+        if (e == nullptr)
+        {
+            e = allocate(shard);
+        }
+        e->used = true;
+        e->referenced = false;
+        e->isUser = true;
+        e->hash = hash;
+        e->userId = userId;
+        strcpy(e->key, basedOn);
+        e->count = 0;
+    }
+
+    // A user's ratings changed
+    void invalidateUser(int userId)
+    {
+        unsigned int hash = hashUser(userId);
+        Shard &shard = shardFor(hash);
+        std::lock_guard<std::mutex> guard(shard.lock);
+        Entry *e = find(shard, true, hash, userId, nullptr);
+        if (e != nullptr)
+        {
+            drop(shard, *e);
+        }
+    }
+
+    // A title changed: drop the movie entry for it. With includeUsers, also
+    // drop user entries based on it (e.g. when it is deleted).
+    void invalidateTitle(const char *title, bool includeUsers)
+    {
+        for (int s = 0; s < CACHE_SHARDS; s++)
+        {
+            std::lock_guard<std::mutex> guard(shards[s].lock);
+            for (int i = 0; i < CACHE_SHARD_ENTRIES; i++)
+            {
+                Entry &e = shards[s].entries[i];
+                if (e.used && (!e.isUser || includeUsers) && strcmp(e.key, title) == 0)
                 {
-                    int userId;
-                    std::cout << "Available users:" << std::endl;
-                    for (int i = 0; i < userCount; i++)
-                    {
-                        std::cout << users[i].userId << ": " << users[i].username << std::endl;
-                    }
-                    std::cout << "Enter user ID: ";
-                    std::cin >> userId;
-                    loginUser(userId);
+                    drop(shards[s], e);
                 }
-                else if (option == 2)
+            }
+        }
+    }
+
+    // The movie at a position changed: drop movie entries that list it
+    void invalidatePosition(int position)
+    {
+        for (int s = 0; s < CACHE_SHARDS; s++)
+        {
+            std::lock_guard<std::mutex> guard(shards[s].lock);
+            for (int i = 0; i < CACHE_SHARD_ENTRIES; i++)
+            {
+                Entry &e = shards[s].entries[i];
+                if (e.used && !e.isUser && containsResult(e, position))
                 {
-                    char username[MAX_STRING_LENGTH];
-                    std::cout << "Enter username: ";
-                    std::cin.ignore();
-                    std::cin.getline(username, MAX_STRING_LENGTH);
-                    createUser(username);
+                    drop(shards[s], e);
                 }
-                break;
             }
-            case 11:
+        }
+    }
+
+    // Movies were compacted: remap[old] is the new position of each movie.
+    // Entries never list deleted movies, so every position has a new one.
+    void remapPositions(const int remap[])
+    {
+        for (int s = 0; s < CACHE_SHARDS; s++)
+        {
+            std::lock_guard<std::mutex> guard(shards[s].lock);
+            for (int i = 0; i < CACHE_SHARD_ENTRIES; i++)
             {
-                if (currentUserId == -1)
+                Entry &e = shards[s].entries[i];
+                for (int j = 0; e.used && !e.isUser && j < e.count; j++)
                 {
-                    std::cout << "Please login first!" << std::endl;
-                    break;
+                    e.results[j] = remap[e.results[j]];
                 }
+            }
+        }
+    }
 
-                char title[MAX_STRING_LENGTH];
-                float rating;
-
-                std::cout << "Available movies:" << std::endl;
-                for (int i = 0; i < movieCount; i++)
+    // A movie was added or its score changed: drop the movie entries it
+    // could now enter. scoreFor gives its similarity to an entry's movie.
+    // Tying the last entry is enough: ties go to the earlier position,
+    // which may be this movie's.
+    void invalidateCandidates(const std::function<float(const char *key)> &scoreFor)
+    {
+        for (int s = 0; s < CACHE_SHARDS; s++)
+        {
+            std::lock_guard<std::mutex> guard(shards[s].lock);
+            for (int i = 0; i < CACHE_SHARD_ENTRIES; i++)
+            {
+                Entry &e = shards[s].entries[i];
+                if (e.used && !e.isUser && (e.count < RECOMMENDATION_COUNT || scoreFor(e.key) >= e.threshold))
                 {
-                    std::cout << "- " << movies[i].title << std::endl;
+                    drop(shards[s], e);
                 }
+            }
+        }
+    }
 
-                std::cout << "Enter movie title: ";
-                std::cin.getline(title, MAX_STRING_LENGTH);
+    // Drop every movie entry (catalog reordered) or every user entry (model retrained)
+    void invalidateAll(bool users)
+    {
+        for (int s = 0; s < CACHE_SHARDS; s++)
+        {
+            std::lock_guard<std::mutex> guard(shards[s].lock);
+            for (int i = 0; i < CACHE_SHARD_ENTRIES; i++)
+            {
+                Entry &e = shards[s].entries[i];
+                if (e.used && e.isUser == users)
+                {
+                    drop(shards[s], e);
+                }
+            }
+        }
+    }
 
-                std::cout << "Enter rating (0-10): ";
-                std::cin >> rating;
+    // Hits and misses over all shards
+    void counters(long long &hits, long long &misses)
+    {
+        hits = misses = 0;
+        for (int s = 0; s < CACHE_SHARDS; s++)
+        {
+            std::lock_guard<std::mutex> guard(shards[s].lock);
+            hits += shards[s].hits;
+            misses += shards[s].misses;
+        }
+    }
 
-                rateMovie(title, rating);
-                break;
-            }
-            case 12:
-                displayUserRatings();
-                break;
-            case 13:
-                getRecommendations();
-                break;
-            case 14:
+    // Display hit/miss counters and memory use
+    void displayStats()
+    {
+        long long hits = 0, misses = 0, evictions = 0, invalidations = 0;
+        int used = 0;
+        for (int s = 0; s < CACHE_SHARDS; s++)
+        {
+            std::lock_guard<std::mutex> guard(shards[s].lock);
+            hits += shards[s].hits;
+            misses += shards[s].misses;
+            evictions += shards[s].evictions;
+            invalidations += shards[s].invalidations;
+            for (int i = 0; i < CACHE_SHARD_ENTRIES; i++)
             {
-                char title[MAX_STRING_LENGTH];
-                std::cout << "Enter movie title to find similar movies: ";
-                std::cin.getline(title, MAX_STRING_LENGTH);
-                findSimilarMovies(title);
-                break;
+                if (shards[s].entries[i].used)
+                {
+                    used++;
+                }
             }
-            case 15:
-                // Save database to file
-                saveToFile();
-                break;
+        }
+        long long lookups = hits + misses;
+        std::cout << "Result cache: " << used << "/" << CACHE_SHARDS * CACHE_SHARD_ENTRIES << " entries, "
+                  << used * sizeof(Entry) << "/" << CACHE_SHARDS * CACHE_SHARD_ENTRIES * sizeof(Entry) << " bytes" << std::endl;
+        std::cout << "Hits: " << hits << ", Misses: " << misses;
+        if (lookups > 0)
+        {
+            std::cout << " (hit ratio " << (100.0 * hits / lookups) << "%)";
+        }
+        std::cout << std::endl;
+        std::cout << "Evictions: " << evictions << ", Invalidations: " << invalidations << std::endl;
+    }
+};
 
-            case 16:
-                // Save database before exiting
-                std::cout << "Saving database before exiting..." << std::endl;
-                saveToFile();
-                std::cout << "Exiting..." << std::endl;
-                break;
+// Near-duplicate detection settings (MinHash + locality-sensitive hashing).
+// With 16 bands of 4 rows, pairs above roughly 50% similarity share a band.
+const int MINHASH_SIZE = 64;
+const int LSH_BANDS = 16;
+const int LSH_ROWS = MINHASH_SIZE / LSH_BANDS;
+const int LSH_TABLE_SIZE = 128; // Power of two, at least 2 * MAX_MOVIES
+const float DUPLICATE_THRESHOLD = 0.5f;
 
-            default:
-                std::cout << "Invalid choice. Please try again." << std::endl;
+// MinHash signature of a movie's title, director and cast shingles
+struct MinHashSignature
+{
+    unsigned int values[MINHASH_SIZE];
+};
+
+// Finds movies that are probably the same film entered twice.
+// Each movie gets a MinHash signature over its title trigrams, director
+// and cast names. The signature is split into bands, and movies sharing
+// any band are candidates that get checked by their estimated similarity.
+class DuplicateDetector
+{
+private:
+    MinHashSignature signatures[MAX_MOVIES];
+    unsigned int bandKeys[MAX_MOVIES][LSH_BANDS];
+    int bucketHead[LSH_BANDS][LSH_TABLE_SIZE];
+    int nextInBucket[MAX_MOVIES][LSH_BANDS];
+    bool removed[MAX_MOVIES]; // Deleted movies stay in the buckets until compaction
+    int indexedCount;         // Positions [0, indexedCount) are in the index
+    bool valid;
+
+    // One of MINHASH_SIZE independent hash functions of a shingle
+    static unsigned int minhash(unsigned int shingle, int k)
+    {
+        unsigned long long x = shingle + 0x9E3779B97F4A7C15ULL * (k + 1);
+        x ^= x >> 30;
+        x *= 0xBF58476D1CE4E5B9ULL;
+        x ^= x >> 27;
+        x *= 0x94D049BB133111EBULL;
+        x ^= x >> 31;
+        return (unsigned int)x;
+    }
+
+    static void addShingle(MinHashSignature &sig, char kind, const char *text, int length)
+    {
+        unsigned int hash = 2166136261u;
+        hash = (hash ^ (unsigned char)kind) * 16777619u;
+        for (int i = 0; i < length; i++)
+        {
+            hash = (hash ^ (unsigned char)text[i]) * 16777619u;
+        }
+        for (int k = 0; k < MINHASH_SIZE; k++)
+        {
+            unsigned int value = minhash(hash, k);
+            if (value < sig.values[k])
+            {
+                sig.values[k] = value;
             }
-        } while (choice != 16); // Changed to 16
+        }
     }
 
-    // Initialize the database with sample data
-    void initializeWithSampleData()
+    static unsigned int bandKey(const MinHashSignature &sig, int band)
     {
-        // Sample data for The Shawshank Redemption
-        char cast1[MAX_CAST][MAX_STRING_LENGTH] = {"Tim Robbins", "Morgan Freeman", "Bob Gunton"};
-        Movie movie1;
-        movie1.initialize("The Shawshank Redemption", 1994, "Frank Darabont", cast1, 3, "Drama", 9.3f, 142);
-        addMovie(movie1);
+        unsigned int hash = 2166136261u;
+        for (int r = 0; r < LSH_ROWS; r++)
+        {
+            hash = (hash ^ sig.values[band * LSH_ROWS + r]) * 16777619u;
+        }
+        return hash;
+    }
 
-        // Sample data for The Godfather
-        char cast2[MAX_CAST][MAX_STRING_LENGTH] = {"Marlon Brando", "Al Pacino", "James Caan"};
-        Movie movie2;
-        movie2.initialize("The Godfather", 1972, "Francis Ford Coppola", cast2, 3, "Crime", 9.2f, 175);
-        addMovie(movie2);
+public:
+    DuplicateDetector() : indexedCount(0), valid(false) {}
 
-        // Sample data for The Dark Knight
-        char cast3[MAX_CAST][MAX_STRING_LENGTH] = {"Christian Bale", "Heath Ledger", "Aaron Eckhart"};
-        Movie movie3;
-        movie3.initialize("The Dark Knight", 2008, "Christopher Nolan", cast3, 3, "Action", 8.9f, 152);
-        addMovie(movie3);
+    // Lowercase letters and digits; everything else becomes a single space
+    static void normalize(const char *in, char *out)
+    {
+        int length = 0;
+        for (const char *p = in; *p != '\0' && length < MAX_STRING_LENGTH - 1; p++)
+        {
+            char c = *p;
+            if (c >= 'A' && c <= 'Z')
+            {
+                c = c - 'A' + 'a';
+            }
+            if ((c >= 'a' && c <= 'z') || (c >= '0' && c <= '9'))
+            {
+                out[length++] = c;
+            }
+            else if (length > 0 && out[length - 1] != ' ')
+            {
+                out[length++] = ' ';
+            }
+        }
+        if (length > 0 && out[length - 1] == ' ')
+        {
+            length--;
+        }
+        out[length] = '\0';
+    }
 
-        // Sample data for Pulp Fiction
-        char cast4[MAX_CAST][MAX_STRING_LENGTH] = {"John Travolta", "Uma Thurman", "Samuel L. Jackson"};
-        Movie movie4;
-        movie4.initialize("Pulp Fiction", 1994, "Quentin Tarantino", cast4, 3, "Crime", 8.5f, 154);
-        addMovie(movie4);
+    static void computeSignature(const Movie &movie, MinHashSignature &sig)
+    {
+        for (int k = 0; k < MINHASH_SIZE; k++)
+        {
+            sig.values[k] = 0xFFFFFFFFu;
+        }
 
-        // Sample data for Inception
-        char cast5[MAX_CAST][MAX_STRING_LENGTH] = {"Leonardo DiCaprio", "Joseph Gordon-Levitt", "Elliot Page"};
-        Movie movie5;
-        movie5.initialize("Inception", 2010, "Christopher Nolan", cast5, 3, "Sci-Fi", 8.8f, 148);
-        addMovie(movie5);
+        char text[MAX_STRING_LENGTH];
+        normalize(movie.title, text);
+        int length = strlen(text);
+        if (length < 3)
+        {
+            addShingle(sig, 't', text, length);
+        }
+        for (int i = 0; i + 3 <= length; i++)
+        {
+            addShingle(sig, 't', text + i, 3);
+        }
 
-        // Add recent English and Hindi movies (2020-2025)
-        addRecentMovies();
+        normalize(movie.director, text);
+        addShingle(sig, 'd', text, strlen(text));
+        for (int i = 0; i < movie.castCount; i++)
+        {
+            normalize(movie.cast[i], text);
+            addShingle(sig, 'c', text, strlen(text));
+        }
     }
 
-    // Function to add recent English and Hindi movies (2020-2025)
-    void addRecentMovies()
+    // Estimated Jaccard similarity of the two shingle sets
+    static float similarity(const MinHashSignature &a, const MinHashSignature &b)
     {
-        // English Movies (2020-2025)
+        int equal = 0;
+        for (int k = 0; k < MINHASH_SIZE; k++)
+        {
+            if (a.values[k] == b.values[k])
+            {
+                equal++;
+            }
+        }
+        return (float)equal / MINHASH_SIZE;
+    }
 
-        // Dune (2021)
-        char castDune[MAX_CAST][MAX_STRING_LENGTH] = {"Timothee Chalamet", "Rebecca Ferguson", "Zendaya", "Oscar Isaac", "Jason Momoa"};
-        Movie dune;
-        dune.initialize("Dune", 2021, "Denis Villeneuve", castDune, 5, "Sci-Fi", 8.0f, 155);
-        addMovie(dune);
+    bool isValid(int movieCount) const
+    {
+        return valid && indexedCount == movieCount;
+    }
 
-        // No Time To Die (2021)
-        char castBond[MAX_CAST][MAX_STRING_LENGTH] = {"Daniel Craig", "Lea Seydoux", "Rami Malek", "Lashana Lynch", "Ana de Armas"};
-        Movie noTimeToDie;
-        noTimeToDie.initialize("No Time To Die", 2021, "Cary Joji Fukunaga", castBond, 5, "Action", 7.3f, 163);
-        addMovie(noTimeToDie);
+    // Movies moved or were removed; the index must be rebuilt before use
+    void invalidate()
+    {
+        valid = false;
+    }
 
-        // Oppenheimer (2023)
-        char castOppenheimer[MAX_CAST][MAX_STRING_LENGTH] = {"Cillian Murphy", "Emily Blunt", "Matt Damon", "Robert Downey Jr.", "Florence Pugh"};
-        Movie oppenheimer;
-        oppenheimer.initialize("Oppenheimer", 2023, "Christopher Nolan", castOppenheimer, 5, "Drama", 8.4f, 180);
-        addMovie(oppenheimer);
+    const MinHashSignature &getSignature(int position) const
+    {
+        return signatures[position];
+    }
 
-        // Barbie (2023)
-        char castBarbie[MAX_CAST][MAX_STRING_LENGTH] = {"Margot Robbie", "Ryan Gosling", "America Ferrera", "Kate McKinnon", "Issa Rae"};
-        Movie barbie;
-        barbie.initialize("Barbie", 2023, "Greta Gerwig", castBarbie, 5, "Comedy", 7.0f, 114);
-        addMovie(barbie);
+    // Set a signature without indexing it (safe from several threads
+    // as long as the positions differ); call rebuildIndex afterwards
+    void setSignature(int position, const MinHashSignature &sig)
+    {
+        signatures[position] = sig;
+    }
 
-        // Inside Out 2 (2024)
-        char castInsideOut[MAX_CAST][MAX_STRING_LENGTH] = {"Amy Poehler", "Maya Hawke", "Kensington Tallman", "Liza Lapira", "Lewis Black"};
-        Movie insideOut2;
-        insideOut2.initialize("Inside Out 2", 2024, "Kelsey Mann", castInsideOut, 5, "Animation", 7.9f, 96);
-        addMovie(insideOut2);
+    // Index the signatures of positions [0, count)
+    void rebuildIndex(int count)
+    {
+        for (int b = 0; b < LSH_BANDS; b++)
+        {
+            for (int i = 0; i < LSH_TABLE_SIZE; i++)
+            {
+                bucketHead[b][i] = -1;
+            }
+        }
+        indexedCount = 0;
+        for (int i = 0; i < count; i++)
+        {
+            append(signatures[i]);
+        }
+        valid = true;
+    }
 
-        // Tenet (2020)
-        char castTenet[MAX_CAST][MAX_STRING_LENGTH] = {"John David Washington", "Robert Pattinson", "Elizabeth Debicki", "Kenneth Branagh", "Dimple Kapadia"};
-        Movie tenet;
-        tenet.initialize("Tenet", 2020, "Christopher Nolan", castTenet, 5, "Sci-Fi", 7.3f, 150);
-        addMovie(tenet);
+    // Index a signature for the next position. O(bands).
+    void append(const MinHashSignature &sig)
+    {
+        int position = indexedCount++;
+        signatures[position] = sig;
+        removed[position] = false;
+        for (int b = 0; b < LSH_BANDS; b++)
+        {
+            bandKeys[position][b] = bandKey(sig, b);
+            int bucket = bandKeys[position][b] & (LSH_TABLE_SIZE - 1);
+            nextInBucket[position][b] = bucketHead[b][bucket];
+            bucketHead[b][bucket] = position;
+        }
+    }
 
-        // The Batman (2022)
-        char castBatman[MAX_CAST][MAX_STRING_LENGTH] = {"Robert Pattinson", "Zoe Kravitz", "Paul Dano", "Jeffrey Wright", "Colin Farrell"};
-        Movie theBatman;
-        theBatman.initialize("The Batman", 2022, "Matt Reeves", castBatman, 5, "Action", 7.8f, 176);
-        addMovie(theBatman);
+    // The movie at a position was deleted; it is no longer reported
+    void remove(int position)
+    {
+        if (position < indexedCount)
+        {
+            removed[position] = true;
+        }
+    }
 
-        // Everything Everywhere All at Once (2022)
-        char castEverything[MAX_CAST][MAX_STRING_LENGTH] = {"Michelle Yeoh", "Ke Huy Quan", "Stephanie Hsu", "Jamie Lee Curtis", "James Hong"};
-        Movie everything;
-        everything.initialize("Everything Everywhere All at Once", 2022, "Daniel Kwan, Daniel Scheinert", castEverything, 5, "Sci-Fi", 7.8f, 139);
-        addMovie(everything);
+    // Movies were compacted: move the signatures to their new positions
+    // (remap[old], -1 if gone) and re-bucket them without recomputing any
+    void compact(const int remap[], int oldCount)
+    {
+        int count = 0;
+        for (int i = 0; i < oldCount; i++)
+        {
+            if (remap[i] != -1)
+            {
+                signatures[remap[i]] = signatures[i];
+                count++;
+            }
+        }
+        if (valid && indexedCount == oldCount)
+        {
+            rebuildIndex(count);
+        }
+        else
+        {
+            valid = false;
+        }
+    }
 
-        // Killers of the Flower Moon (2023)
-        char castKillers[MAX_CAST][MAX_STRING_LENGTH] = {"Leonardo DiCaprio", "Robert De Niro", "Lily Gladstone", "Jesse Plemons", "Tantoo Cardinal"};
-        Movie killers;
-        killers.initialize("Killers of the Flower Moon", 2023, "Martin Scorsese", castKillers, 5, "Crime", 7.7f, 206);
-        addMovie(killers);
+    // Find the most similar movie above the threshold among the indexed
+    // positions before limit. Returns its position or -1.
+    int findDuplicate(const MinHashSignature &sig, int limit, float &bestSimilarity) const
+    {
+        int best = -1;
+        bestSimilarity = 0.0f;
+        for (int b = 0; b < LSH_BANDS; b++)
+        {
+            unsigned int key = bandKey(sig, b);
+            for (int p = bucketHead[b][key & (LSH_TABLE_SIZE - 1)]; p != -1; p = nextInBucket[p][b])
+            {
+                if (p >= limit || bandKeys[p][b] != key || removed[p])
+                {
+                    continue;
+                }
+                float sim = similarity(sig, signatures[p]);
+                if (sim >= DUPLICATE_THRESHOLD && (sim > bestSimilarity || (sim == bestSimilarity && p < best)))
+                {
+                    best = p;
+                    bestSimilarity = sim;
+                }
+            }
+        }
+        return best;
+    }
+};
 
-        // Dune: Part Two (2024)
-        char castDune2[MAX_CAST][MAX_STRING_LENGTH] = {"Timothee Chalamet", "Zendaya", "Rebecca Ferguson", "Austin Butler", "Florence Pugh"};
-        Movie dune2;
-        dune2.initialize("Dune: Part Two", 2024, "Denis Villeneuve", castDune2, 5, "Sci-Fi", 8.6f, 166);
-        addMovie(dune2);
+// Memory accounting. Every allocation is charged to a subsystem: fixed
+// arrays when the object that holds them is created, containers through
+// TrackedAllocator. Live and peak bytes are kept per subsystem.
+enum MemorySubsystem
+{
+    MEM_RECORDS,          // Movie and user fields other than strings and ratings
+    MEM_STRINGS,          // Fixed-size string fields of movies and users
+    MEM_RATINGS,          // Users' rating slots and the per-movie aggregates
+    MEM_USER_INDEX,
+    MEM_DUPLICATE_INDEX,
+    MEM_SNAPSHOTS,        // Snapshot copies of the catalog
+    MEM_SNAPSHOT_INDEXES, // Shard indexes of the snapshots
+    MEM_RESULT_CACHE,
+    MEM_RECOMMENDATIONS,  // Precomputed recommendation table
+    MEM_TRENDING,
+    MEM_CHANGE_STORE,
+    MEM_METRICS,
+    MEM_TRACING,          // Recorded trace spans
+    MEM_NAMES,            // Name dictionary
+    MEM_QUERY_CACHE,      // Cached search results
+    MEMORY_SUBSYSTEM_COUNT
+};
 
-        // Hindi Movies (2020-2025)
+const char *MEMORY_SUBSYSTEM_NAMES[MEMORY_SUBSYSTEM_COUNT] = {
+    "records", "strings", "ratings", "user_index", "duplicate_index", "snapshots", "snapshot_indexes",
+    "result_cache", "recommendations", "trending", "change_store", "metrics", "tracing", "names", "query_cache"};
 
-        // Pathaan (2023)
-        char castPathaan[MAX_CAST][MAX_STRING_LENGTH] = {"Shah Rukh Khan", "Deepika Padukone", "John Abraham", "Dimple Kapadia", "Ashutosh Rana"};
-        Movie pathaan;
-        pathaan.initialize("Pathaan", 2023, "Siddharth Anand", castPathaan, 5, "Action", 5.9f, 146);
-        addMovie(pathaan);
+struct MemoryAccount
+{
+    std::atomic<long long> live;
+    std::atomic<long long> peak;
+};
 
-        // Brahmastra: Part One (2022)
-        char castBrahmastra[MAX_CAST][MAX_STRING_LENGTH] = {"Ranbir Kapoor", "Alia Bhatt", "Amitabh Bachchan", "Nagarjuna Akkineni", "Mouni Roy"};
+MemoryAccount memoryAccounts[MEMORY_SUBSYSTEM_COUNT];
+
+// Charge (or, with a negative size, release) bytes to a subsystem
+void trackMemory(MemorySubsystem subsystem, long long bytes)
+{
+    MemoryAccount &account = memoryAccounts[subsystem];
+    long long live = account.live.fetch_add(bytes, std::memory_order_relaxed) + bytes;
+    long long peak = account.peak.load(std::memory_order_relaxed);
+    while (live > peak && !account.peak.compare_exchange_weak(peak, live, std::memory_order_relaxed))
+    {
+    }
+}
+
+// Standard allocator that charges what it allocates to a subsystem
+template <typename T, MemorySubsystem S>
+struct TrackedAllocator
+{
+    typedef T value_type;
+
+    template <typename U>
+    struct rebind
+    {
+        typedef TrackedAllocator<U, S> other;
+    };
+
+    TrackedAllocator() {}
+
+    template <typename U>
+    TrackedAllocator(const TrackedAllocator<U, S> &) {}
+
+    T *allocate(size_t n)
+    {
+        trackMemory(S, (long long)(n * sizeof(T)));
+        return std::allocator<T>().allocate(n);
+    }
+
+    void deallocate(T *p, size_t n)
+    {
+        trackMemory(S, -(long long)(n * sizeof(T)));
+        std::allocator<T>().deallocate(p, n);
+    }
+
+    template <typename U>
+    bool operator==(const TrackedAllocator<U, S> &) const { return true; }
+
+    template <typename U>
+    bool operator!=(const TrackedAllocator<U, S> &) const { return false; }
+};
+
+// Name dictionary settings
+const int NAME_CAPACITY = 1 << 14;     // Distinct names one run can hold
+const int NAME_CHUNK = 256;            // Names allocated at a time
+const int NAME_TABLE_SIZE = 1 << 15;   // Power of two, at least 2 * NAME_CAPACITY
+
+// Interning dictionary of genre, director and cast names. Every distinct
+// name gets a small integer ID, ignoring case and extra whitespace, so
+// movies compare names as integers. The spelling a name was first added
+// with is kept for display. IDs are never removed or reused.
+// Adding a name takes a lock; finding one does not, so reader threads can
+// resolve a query's name while a writer adds new ones.
+class NameDictionary
+{
+private:
+    struct Name
+    {
+        char key[MAX_STRING_LENGTH];     // Normalized
+        char display[MAX_STRING_LENGTH]; // As first added
+    };
+
+    std::atomic<Name *> chunks[NAME_CAPACITY / NAME_CHUNK];
+    std::atomic<int> table[NAME_TABLE_SIZE]; // ID + 1 of the name stored here; 0 when empty
+    std::atomic<int> count;
+    std::mutex addLock;
+    bool full; // Reported once
+
+    const Name &at(int id) const
+    {
+        return chunks[id / NAME_CHUNK].load(std::memory_order_acquire)[id % NAME_CHUNK];
+    }
+
+    // ID of a normalized name, or -1 with slot set to where it would go
+    int probe(const char *key, int &slot) const
+    {
+        slot = (int)(hashTitle(key) & (NAME_TABLE_SIZE - 1));
+        while (true)
+        {
+            int entry = table[slot].load(std::memory_order_acquire);
+            if (entry == 0)
+            {
+                return -1;
+            }
+            if (strcmp(at(entry - 1).key, key) == 0)
+            {
+                return entry - 1;
+            }
+            slot = (slot + 1) & (NAME_TABLE_SIZE - 1);
+        }
+    }
+
+public:
+    NameDictionary() : count(0), full(false)
+    {
+        for (int i = 0; i < NAME_CAPACITY / NAME_CHUNK; i++)
+        {
+            chunks[i] = nullptr;
+        }
+        for (int i = 0; i < NAME_TABLE_SIZE; i++)
+        {
+            table[i] = 0;
+        }
+        trackMemory(MEM_NAMES, sizeof(NameDictionary));
+    }
+
+    ~NameDictionary()
+    {
+        for (int i = 0; i < NAME_CAPACITY / NAME_CHUNK; i++)
+        {
+            if (chunks[i].load() != nullptr)
+            {
+                trackMemory(MEM_NAMES, -(long long)(sizeof(Name) * NAME_CHUNK));
+                delete[] chunks[i].load();
+            }
+        }
+        trackMemory(MEM_NAMES, -(long long)sizeof(NameDictionary));
+    }
+
+    // Lowercase, with every run of whitespace made one space and none at the ends
+    static void normalize(const char *in, char *out)
+    {
+        int length = 0;
+        bool space = false;
+        for (const char *p = in; *p != '\0' && length < MAX_STRING_LENGTH - 1; p++)
+        {
+            char c = *p;
+            if (c == ' ' || c == '\t' || c == '\r' || c == '\n')
+            {
+                space = (length > 0);
+                continue;
+            }
+            if (space)
+            {
+                if (length >= MAX_STRING_LENGTH - 2)
+                {
+                    break;
+                }
+                out[length++] = ' ';
+                space = false;
+            }
+            out[length++] = (c >= 'A' && c <= 'Z') ? c - 'A' + 'a' : c;
+        }
+        out[length] = '\0';
+    }
+
+    // ID of a name, or -1 if it has never been added
+    int find(const char *name) const
+    {
+        char key[MAX_STRING_LENGTH];
+        normalize(name, key);
+        int slot;
+        return probe(key, slot);
+    }
+
+    // ID of a name, adding it if it is new. Returns -1 when the name is new
+    // and the dictionary is full; -1 is never a name's ID.
+    int intern(const char *name)
+    {
+        char key[MAX_STRING_LENGTH];
+        normalize(name, key);
+        int slot;
+        int id = probe(key, slot);
+        if (id != -1)
+        {
+            return id;
+        }
+
+        std::lock_guard<std::mutex> guard(addLock);
+        id = probe(key, slot); // Another thread may have added it meanwhile
+        if (id != -1)
+        {
+            return id;
+        }
+        id = count.load(std::memory_order_relaxed);
+        if (id == NAME_CAPACITY)
+        {
+            if (!full)
+            {
+                full = true;
+                std::cout << "Warning: The name dictionary is full (" << NAME_CAPACITY
+                          << " names); movies with new names cannot be added." << std::endl;
+            }
+            return -1;
+        }
+        if (id % NAME_CHUNK == 0)
+        {
+            chunks[id / NAME_CHUNK].store(new Name[NAME_CHUNK], std::memory_order_release);
+            trackMemory(MEM_NAMES, sizeof(Name) * NAME_CHUNK);
+        }
+        Name &added = chunks[id / NAME_CHUNK].load(std::memory_order_relaxed)[id % NAME_CHUNK];
+        strcpy(added.key, key);
+        snprintf(added.display, sizeof(added.display), "%s", name);
+        count.store(id + 1, std::memory_order_release);
+        table[slot].store(id + 1, std::memory_order_release); // Published last
+        return id;
+    }
+
+    // Normalized text of an ID
+    const char *text(int id) const
+    {
+        return at(id).key;
+    }
+
+    // The name as it was first added
+    const char *display(int id) const
+    {
+        return at(id).display;
+    }
+
+    int size() const
+    {
+        return count.load(std::memory_order_acquire);
+    }
+
+    bool isFull() const
+    {
+        return size() == NAME_CAPACITY;
+    }
+};
+
+NameDictionary nameDictionary;
+
+
+// Look up (adding if new) the dictionary IDs of a movie's names. Returns
+// false if one of them is new and the dictionary is full; the movie must
+// then not be stored, as it has no ID for that name.
+bool internNames(Movie &movie)
+{
+    movie.genreId = nameDictionary.intern(movie.genre);
+    movie.directorId = nameDictionary.intern(movie.director);
+    bool interned = movie.genreId != -1 && movie.directorId != -1;
+    for (int i = 0; i < movie.castCount && i < MAX_CAST; i++)
+    {
+        movie.castIds[i] = nameDictionary.intern(movie.cast[i]);
+        interned = interned && movie.castIds[i] != -1;
+    }
+    return interned;
+}
+
+// Search result cache size: shards x bytes per shard
+const int QUERY_CACHE_SHARDS = 8;
+const long long QUERY_CACHE_SHARD_BYTES = 64 * 1024;
+static_assert(MAX_MOVIES <= 65536, "Cached positions are stored in 16 bits");
+
+// Cache of title, genre, director and year search results. Keys are the
+// normalized query: a kind letter and its argument (exact title text, name
+// dictionary ID or year). Each entry holds the matching positions and the
+// catalog version they were computed at; every change to the catalog bumps
+// the version, so an entry from another version is never served and is
+// dropped when found. Each shard has its own lock and byte budget and
+// evicts with the CLOCK algorithm.
+class QueryCache
+{
+private:
+    struct Entry
+    {
+        bool used;
+        bool referenced; // CLOCK bit, set on every hit
+        unsigned long long version;
+        std::string key;
+        std::vector<unsigned short> positions;
+    };
+
+    struct Shard
+    {
+        std::mutex lock;
+        std::vector<Entry> slots;
+        std::unordered_map<std::string, int> index; // Key to slot
+        std::vector<int> freeSlots;
+        int hand;
+        long long bytes;
+        long long hits;
+        long long misses;
+        long long stale; // Misses that found an entry from another version
+        long long evictions;
+    };
+    Shard shards[QUERY_CACHE_SHARDS];
+
+    // Bytes charged for an entry: the slot, the key (held by the entry and
+    // the index) and the positions
+    static long long entryBytes(const std::string &key, size_t count)
+    {
+        return (long long)(sizeof(Entry) + sizeof(std::pair<const std::string, int>) + 2 * sizeof(void *) +
+                           2 * key.size() + count * sizeof(unsigned short));
+    }
+
+    Shard &shardFor(const std::string &key)
+    {
+        return shards[hashTitle(key.c_str()) % QUERY_CACHE_SHARDS];
+    }
+
+    // Remove the entry in a slot (caller holds the lock)
+    static void release(Shard &shard, int slot)
+    {
+        Entry &e = shard.slots[slot];
+        long long bytes = entryBytes(e.key, e.positions.size());
+        shard.bytes -= bytes;
+        trackMemory(MEM_QUERY_CACHE, -bytes);
+        shard.index.erase(e.key);
+        e.used = false;
+        e.key.clear();
+        e.positions.clear();
+        shard.freeSlots.push_back(slot);
+    }
+
+    // Evict with the CLOCK hand until bytes more fit (caller holds the lock)
+    static void makeRoom(Shard &shard, long long bytes)
+    {
+        while (shard.bytes + bytes > QUERY_CACHE_SHARD_BYTES && !shard.index.empty())
+        {
+            Entry &e = shard.slots[shard.hand];
+            int slot = shard.hand;
+            shard.hand = (shard.hand + 1) % (int)shard.slots.size();
+            if (!e.used)
+            {
+                continue;
+            }
+            if (e.referenced)
+            {
+                e.referenced = false;
+                continue;
+            }
+            release(shard, slot);
+            shard.evictions++;
+        }
+    }
+
+public:
+    QueryCache()
+    {
+        for (int s = 0; s < QUERY_CACHE_SHARDS; s++)
+        {
+            shards[s].hand = 0;
+            shards[s].bytes = 0;
+            shards[s].hits = shards[s].misses = shards[s].stale = shards[s].evictions = 0;
+        }
+    }
+
+    ~QueryCache()
+    {
+        for (int s = 0; s < QUERY_CACHE_SHARDS; s++)
+        {
+            trackMemory(MEM_QUERY_CACHE, -shards[s].bytes);
+        }
+    }
+
+    // Normalized key of a query: its kind letter followed by its argument
+    static void makeKey(char kind, const char *argument, std::string &key)
+    {
+        key.assign(1, kind);
+        key += argument;
+    }
+
+    // Copy the positions cached for a key at a catalog version; -1 on a miss
+    int lookup(const std::string &key, unsigned long long version, int results[])
+    {
+        Shard &shard = shardFor(key);
+        std::lock_guard<std::mutex> guard(shard.lock);
+        auto it = shard.index.find(key);
+        if (it == shard.index.end())
+        {
+            shard.misses++;
+            return -1;
+        }
+        Entry &e = shard.slots[it->second];
+        if (e.version != version)
+        {
+            shard.misses++;
+            shard.stale++;
+            if (e.version < version)
+            {
+                release(shard, it->second);
+            }
+            return -1;
+        }
+        e.referenced = true;
+        shard.hits++;
+        int count = (int)e.positions.size();
+        for (int i = 0; i < count; i++)
+        {
+            results[i] = e.positions[i];
+        }
+        return count;
+    }
+
+    // Cache the positions a query found at a catalog version. An entry
+    // from a later version (stored by a reader on a newer snapshot) is kept.
+    void store(const std::string &key, unsigned long long version, const int results[], int count)
+    {
+        long long bytes = entryBytes(key, count);
+        if (bytes > QUERY_CACHE_SHARD_BYTES)
+        {
+            return;
+        }
+        Shard &shard = shardFor(key);
+        std::lock_guard<std::mutex> guard(shard.lock);
+        auto it = shard.index.find(key);
+        if (it != shard.index.end())
+        {
+            if (shard.slots[it->second].version >= version)
+            {
+                return;
+            }
+            release(shard, it->second);
+        }
+        makeRoom(shard, bytes);
+
+        int slot;
+        if (!shard.freeSlots.empty())
+        {
+            slot = shard.freeSlots.back();
+            shard.freeSlots.pop_back();
+        }
+        else
+        {
+            slot = (int)shard.slots.size();
+            shard.slots.emplace_back();
+        }
+        Entry &e = shard.slots[slot];
+        e.used = true;
+        e.referenced = false;
+        e.version = version;
+        e.key = key;
+        e.positions.assign(results, results + count);
+        shard.index[key] = slot;
+        shard.bytes += bytes;
+        trackMemory(MEM_QUERY_CACHE, bytes);
+    }
+
+    // Hits and misses over all shards
+    void counters(long long &hits, long long &misses)
+    {
+        hits = misses = 0;
+        for (int s = 0; s < QUERY_CACHE_SHARDS; s++)
+        {
+            std::lock_guard<std::mutex> guard(shards[s].lock);
+            hits += shards[s].hits;
+            misses += shards[s].misses;
+        }
+    }
+
+    // Display hit/miss counters and memory use
+    void displayStats()
+    {
+        long long hits = 0, misses = 0, stale = 0, evictions = 0, bytes = 0;
+        size_t used = 0;
+        for (int s = 0; s < QUERY_CACHE_SHARDS; s++)
+        {
+            std::lock_guard<std::mutex> guard(shards[s].lock);
+            hits += shards[s].hits;
+            misses += shards[s].misses;
+            stale += shards[s].stale;
+            evictions += shards[s].evictions;
+            bytes += shards[s].bytes;
+            used += shards[s].index.size();
+        }
+        long long lookups = hits + misses;
+        std::cout << "Search cache: " << used << " entries, " << bytes << "/"
+                  << QUERY_CACHE_SHARDS * QUERY_CACHE_SHARD_BYTES << " bytes" << std::endl;
+        std::cout << "Hits: " << hits << ", Misses: " << misses;
+        if (lookups > 0)
+        {
+            std::cout << " (hit ratio " << (100.0 * hits / lookups) << "%)";
+        }
+        std::cout << std::endl;
+        std::cout << "Evictions: " << evictions << ", Stale (older catalog version): " << stale << std::endl;
+    }
+};
+
+// Facet settings
+const int FACET_FIRST_DECADE = 1880; // Earlier years are counted in the first decade
+const int FACET_DECADES = 24;        // Up to the 2110s; later years are counted in the last
+const int FACET_RATING_BUCKETS = 10; // Whole rating points: 0-1, 1-2, ... 9-10
+const int FACET_LANES = 4;           // Counter copies a counting pass rotates through
+const int FACET_TOP = 10;            // Genres and directors listed per facet
+
+int facetDecade(int year)
+{
+    int decade = (year - FACET_FIRST_DECADE) / 10;
+    return decade < 0 ? 0 : (decade >= FACET_DECADES ? FACET_DECADES - 1 : decade);
+}
+
+int facetRatingBucket(float rating)
+{
+    int bucket = (int)rating;
+    return bucket < 0 ? 0 : (bucket >= FACET_RATING_BUCKETS ? FACET_RATING_BUCKETS - 1 : bucket);
+}
+
+// Number of movies per facet value: genre and director (indexed by name
+// ID), decade, and whole rating point
+struct FacetCounts
+{
+    int total;
+    std::vector<int> genres;      // Count per name ID, or per entry of genreIds
+    std::vector<int> directors;
+    std::vector<int> genreIds;    // Ascending name IDs of the genres counted; empty when genres is indexed by ID
+    std::vector<int> directorIds;
+    int decades[FACET_DECADES];
+    int ratings[FACET_RATING_BUCKETS];
+
+    FacetCounts()
+    {
+        clear();
+    }
+
+    void clear()
+    {
+        total = 0;
+        genres.clear();
+        directors.clear();
+        genreIds.clear();
+        directorIds.clear();
+        memset(decades, 0, sizeof(decades));
+        memset(ratings, 0, sizeof(ratings));
+    }
+
+    static void bump(std::vector<int> &counts, int id, int delta)
+    {
+        if (id >= (int)counts.size())
+        {
+            counts.resize(id + 1, 0);
+        }
+        counts[id] += delta;
+    }
+
+    // Count a movie in (delta 1) or out (delta -1). Only for counts
+    // indexed by ID, not compacted ones.
+    void add(const Movie &movie, int delta)
+    {
+        total += delta;
+        bump(genres, movie.genreId, delta);
+        bump(directors, movie.directorId, delta);
+        decades[facetDecade(movie.releaseYear)] += delta;
+        ratings[facetRatingBucket(movie.rating)] += delta;
+    }
+
+    // Keep only the names with movies, so copies and visits cost what the
+    // catalog holds rather than every name the dictionary has seen
+    void compact()
+    {
+        compactNames(genres, genreIds);
+        compactNames(directors, directorIds);
+    }
+
+    static void compactNames(std::vector<int> &counts, std::vector<int> &ids)
+    {
+        if (!ids.empty())
+        {
+            return;
+        }
+        std::vector<int> kept;
+        for (int id = 0; id < (int)counts.size(); id++)
+        {
+            if (counts[id] > 0)
+            {
+                ids.push_back(id);
+                kept.push_back(counts[id]);
+            }
+        }
+        counts.swap(kept);
+    }
+
+    static int nameAt(const std::vector<int> &ids, int i)
+    {
+        return ids.empty() ? i : ids[i];
+    }
+
+    // Entries of the k largest name counts, largest first (ties by ID)
+    static int top(const std::vector<int> &counts, int ids[], int k)
+    {
+        int found = 0;
+        for (int id = 0; id < (int)counts.size(); id++)
+        {
+            if (counts[id] <= 0)
+            {
+                continue;
+            }
+            int i = (found < k) ? found++ : k;
+            while (i > 0 && counts[ids[i - 1]] < counts[id])
+            {
+                if (i < k)
+                {
+                    ids[i] = ids[i - 1];
+                }
+                i--;
+            }
+            if (i < k)
+            {
+                ids[i] = id;
+            }
+        }
+        return found;
+    }
+
+    // Call visit(facet, value, count) for every value with movies: genres
+    // and directors by count (the FACET_TOP largest), decades and rating
+    // points in order
+    void visit(const std::function<void(const char *, const char *, int)> &visitValue) const
+    {
+        int ids[FACET_TOP];
+        int n = top(genres, ids, FACET_TOP);
+        for (int i = 0; i < n; i++)
+        {
+            visitValue("genre", nameDictionary.display(nameAt(genreIds, ids[i])), genres[ids[i]]);
+        }
+        n = top(directors, ids, FACET_TOP);
+        for (int i = 0; i < n; i++)
+        {
+            visitValue("director", nameDictionary.display(nameAt(directorIds, ids[i])), directors[ids[i]]);
+        }
+        char value[16];
+        for (int d = 0; d < FACET_DECADES; d++)
+        {
+            if (decades[d] > 0)
+            {
+                snprintf(value, sizeof(value), "%ds", FACET_FIRST_DECADE + d * 10);
+                visitValue("decade", value, decades[d]);
+            }
+        }
+        for (int r = 0; r < FACET_RATING_BUCKETS; r++)
+        {
+            if (ratings[r] > 0)
+            {
+                snprintf(value, sizeof(value), "%d-%d", r, r + 1);
+                visitValue("rating", value, ratings[r]);
+            }
+        }
+    }
+
+    void display() const
+    {
+        const char *current = "";
+        visit([&current](const char *facet, const char *value, int count)
+              {
+            if (strcmp(facet, current) != 0)
+            {
+                std::cout << (current[0] != '\0' ? "\n" : "") << "  " << facet << ":";
+                current = facet;
+            }
+            std::cout << " " << value << " (" << count << ")"; });
+        std::cout << std::endl;
+    }
+};
+
+// Column copies of the facet fields of a catalog. Counting a result set
+// reads these small arrays instead of whole movie records. Genres and
+// directors are numbered again from 0 among the catalog's own names, so
+// counting never depends on how many names the dictionary holds.
+struct FacetColumns
+{
+    typedef std::vector<int, TrackedAllocator<int, MEM_SNAPSHOT_INDEXES>> Column;
+    Column genre;        // Index into genreNames
+    Column director;     // Index into directorNames
+    Column genreNames;   // Ascending name IDs of the catalog's genres
+    Column directorNames;
+    std::vector<unsigned char, TrackedAllocator<unsigned char, MEM_SNAPSHOT_INDEXES>> decade;
+    std::vector<unsigned char, TrackedAllocator<unsigned char, MEM_SNAPSHOT_INDEXES>> rating;
+
+    static void number(const Movie movies[], int count, int Movie::*field, Column &column, Column &names)
+    {
+        names.clear();
+        for (int i = 0; i < count; i++)
+        {
+            names.push_back(movies[i].*field);
+        }
+        std::sort(names.begin(), names.end());
+        names.erase(std::unique(names.begin(), names.end()), names.end());
+        column.resize(count);
+        for (int i = 0; i < count; i++)
+        {
+            column[i] = (int)(std::lower_bound(names.begin(), names.end(), movies[i].*field) - names.begin());
+        }
+    }
+
+    void build(const Movie movies[], int count)
+    {
+        number(movies, count, &Movie::genreId, genre, genreNames);
+        number(movies, count, &Movie::directorId, director, directorNames);
+        decade.resize(count);
+        rating.resize(count);
+        for (int i = 0; i < count; i++)
+        {
+            decade[i] = (unsigned char)facetDecade(movies[i].releaseYear);
+            rating[i] = (unsigned char)facetRatingBucket(movies[i].rating);
+        }
+    }
+
+    // Names with movies in the lanes, summed, as (ID, count) entries
+    static void fold(const int lanes[FACET_LANES][MAX_MOVIES], const Column &names,
+                     std::vector<int> &counts, std::vector<int> &ids)
+    {
+        for (int local = 0; local < (int)names.size(); local++)
+        {
+            int n = 0;
+            for (int lane = 0; lane < FACET_LANES; lane++)
+            {
+                n += lanes[lane][local];
+            }
+            if (n > 0)
+            {
+                ids.push_back(names[local]);
+                counts.push_back(n);
+            }
+        }
+    }
+
+    // Count the movies at positions in one pass. Rows take turns between
+    // FACET_LANES copies of every counter, so runs of the same value do not
+    // wait on each other's increments; the copies are summed at the end.
+    void count(const int positions[], int rows, FacetCounts &counts) const
+    {
+        int genreLanes[FACET_LANES][MAX_MOVIES] = {};
+        int directorLanes[FACET_LANES][MAX_MOVIES] = {};
+        int decadeLanes[FACET_LANES][FACET_DECADES] = {};
+        int ratingLanes[FACET_LANES][FACET_RATING_BUCKETS] = {};
+        int i = 0;
+        for (; i + FACET_LANES <= rows; i += FACET_LANES)
+        {
+            for (int lane = 0; lane < FACET_LANES; lane++)
+            {
+                int p = positions[i + lane];
+                genreLanes[lane][genre[p]]++;
+                directorLanes[lane][director[p]]++;
+                decadeLanes[lane][decade[p]]++;
+                ratingLanes[lane][rating[p]]++;
+            }
+        }
+        for (; i < rows; i++)
+        {
+            int p = positions[i];
+            genreLanes[0][genre[p]]++;
+            directorLanes[0][director[p]]++;
+            decadeLanes[0][decade[p]]++;
+            ratingLanes[0][rating[p]]++;
+        }
+
+        counts.clear();
+        counts.total = rows;
+        fold(genreLanes, genreNames, counts.genres, counts.genreIds);
+        fold(directorLanes, directorNames, counts.directors, counts.directorIds);
+        for (int lane = 0; lane < FACET_LANES; lane++)
+        {
+            for (int d = 0; d < FACET_DECADES; d++)
+            {
+                counts.decades[d] += decadeLanes[lane][d];
+            }
+            for (int r = 0; r < FACET_RATING_BUCKETS; r++)
+            {
+                counts.ratings[r] += ratingLanes[lane][r];
+            }
+        }
+    }
+};
+
+// Appends JSON values to a reusable buffer. Numbers are formatted on the
+// stack, so a line costs no allocations once the buffer has grown.
+class JsonWriter
+{
+private:
+    std::string &out;
+
+public:
+    JsonWriter(std::string &buffer) : out(buffer) {}
+
+    void raw(const char *text)
+    {
+        out += text;
+    }
+
+    void string(const char *text)
+    {
+        static const char hex[] = "0123456789abcdef";
+        out += '"';
+        const char *run = text;
+        for (const char *p = text; *p != '\0'; p++)
+        {
+            unsigned char c = (unsigned char)*p;
+            if (c >= 0x20 && c != '"' && c != '\\')
+            {
+                continue;
+            }
+            out.append(run, p - run);
+            run = p + 1;
+            if (c == '"' || c == '\\')
+            {
+                out += '\\';
+                out += (char)c;
+            }
+            else if (c == '\t')
+            {
+                out += "\\t";
+            }
+            else
+            {
+                char escaped[7] = {'\\', 'u', '0', '0', hex[c >> 4], hex[c & 15], '\0'};
+                out += escaped;
+            }
+        }
+        out += run;
+        out += '"';
+    }
+
+    void number(long long value)
+    {
+        char digits[24];
+        int length = 0;
+        unsigned long long magnitude = (value < 0) ? 0ULL - (unsigned long long)value : (unsigned long long)value;
+        do
+        {
+            digits[length++] = (char)('0' + magnitude % 10);
+            magnitude /= 10;
+        } while (magnitude > 0);
+        if (value < 0)
+        {
+            out += '-';
+        }
+        while (length > 0)
+        {
+            out += digits[--length];
+        }
+    }
+
+    void number(double value, int decimals)
+    {
+        char text[32];
+        snprintf(text, sizeof(text), "%.*f", decimals, value);
+        out += text;
+    }
+
+    void key(const char *name)
+    {
+        if (out.back() != '{')
+        {
+            out += ',';
+        }
+        out += '"';
+        out += name;
+        out += "\":";
+    }
+};
+
+// Tracing settings. Tracing is off unless it is asked for on the command
+// line; it then records a span for every stage of every request.
+const int TRACE_MAX_EVENTS = 1 << 20; // Spans kept for the trace file; later requests are dropped
+const char *SLOW_QUERY_FILENAME = "movies_database.slow.jsonl";
+
+// One timed stage of a request. Spans are not linked to their parent: a
+// span that starts and ends inside another on the same thread is its child.
+struct TraceEvent
+{
+    const char *name;   // Static text
+    std::string detail; // What the request was about: the query line, a title, a user
+    long long start;    // ns since tracing started
+    long long duration; // ns
+    int thread;
+};
+
+typedef std::vector<TraceEvent, TrackedAllocator<TraceEvent, MEM_TRACING>> TraceEventList;
+
+std::atomic<int> traceThreadCount(0);
+
+// Spans of the request running on one thread. Threads are numbered in the
+// order they first record a span.
+struct TraceThread
+{
+    int id;
+    int depth; // Spans open on this thread; the request ends when it drops to 0
+    TraceEventList events;
+
+    TraceThread() : id(++traceThreadCount), depth(0) {}
+};
+
+TraceThread &currentTraceThread()
+{
+    thread_local TraceThread thread;
+    return thread;
+}
+
+// Collects the spans of finished requests. Every thread records its current
+// request on its own, and hands it over when the outermost span ends: it is
+// kept for the trace file, written to the slow query log if it took longer
+// than the threshold, or both. Both files use the Chrome trace event format
+// (chrome://tracing, Perfetto).
+class Tracer
+{
+private:
+    std::atomic<bool> active;
+    std::chrono::steady_clock::time_point origin;
+    char tracePath[256]; // Empty when no trace file is written
+    long long slowNanos; // Slow query threshold, or -1 for no slow query log
+
+    std::mutex lock; // Guards the fields below
+    TraceEventList kept;
+    long long droppedRequests;
+    FILE *slowLog;
+    bool slowLogFailed;
+    long long slowRequests;
+
+    // Complete event ("X") with its time and duration in microseconds
+    static void writeEvent(JsonWriter &json, const TraceEvent &event)
+    {
+        json.raw("{");
+        json.key("name");
+        json.string(event.name);
+        json.key("ph");
+        json.string("X");
+        json.key("ts");
+        json.number(event.start / 1000.0, 3);
+        json.key("dur");
+        json.number(event.duration / 1000.0, 3);
+        json.key("pid");
+        json.number(1LL);
+        json.key("tid");
+        json.number((long long)event.thread);
+        if (!event.detail.empty())
+        {
+            json.key("args");
+            json.raw("{");
+            json.key("detail");
+            json.string(event.detail.c_str());
+            json.raw("}");
+        }
+        json.raw("}");
+    }
+
+    static void writeEvents(JsonWriter &json, const TraceEventList &events, const char *separator)
+    {
+        json.key("traceEvents");
+        json.raw("[");
+        for (size_t i = 0; i < events.size(); i++)
+        {
+            if (i > 0)
+            {
+                json.raw(separator);
+            }
+            writeEvent(json, events[i]);
+        }
+        json.raw("]");
+    }
+
+    // One line per slow request, which is a trace file of its own
+    void logSlowRequest(const TraceEventList &events)
+    {
+        std::string line;
+        JsonWriter json(line);
+        json.raw("{");
+        json.key("request");
+        json.string(events[0].name);
+        json.key("detail");
+        json.string(events[0].detail.c_str());
+        json.key("duration_ms");
+        json.number(events[0].duration / 1000000.0, 3);
+        json.key("tid");
+        json.number((long long)events[0].thread);
+        writeEvents(json, events, ",");
+        json.raw("}\n");
+
+        std::lock_guard<std::mutex> guard(lock);
+        if (slowLog == nullptr && !slowLogFailed)
+        {
+            slowLog = fopen(SLOW_QUERY_FILENAME, "ab");
+            if (slowLog == nullptr)
+            {
+                std::cout << "Error: Could not open " << SLOW_QUERY_FILENAME << "; slow requests are not logged." << std::endl;
+                slowLogFailed = true;
+            }
+        }
+        if (slowLog == nullptr)
+        {
+            return;
+        }
+        fwrite(line.data(), 1, line.size(), slowLog);
+        fflush(slowLog);
+        slowRequests++;
+    }
+
+public:
+    Tracer() : active(false), origin(std::chrono::steady_clock::now()), slowNanos(-1), droppedRequests(0),
+               slowLog(nullptr), slowLogFailed(false), slowRequests(0)
+    {
+        tracePath[0] = '\0';
+    }
+
+    ~Tracer()
+    {
+        if (tracePath[0] != '\0')
+        {
+            writeTrace();
+        }
+        if (slowLog != nullptr)
+        {
+            fclose(slowLog);
+            std::cout << slowRequests << " slow request(s) logged to " << SLOW_QUERY_FILENAME << std::endl;
+        }
+    }
+
+    // Keep every request and write them all to path when the program exits
+    void enableTrace(const char *path)
+    {
+        strncpy(tracePath, path, sizeof(tracePath) - 1);
+        tracePath[sizeof(tracePath) - 1] = '\0';
+        active = true;
+        std::cout << "Tracing requests to " << tracePath << std::endl;
+    }
+
+    // Log the trace of every request that takes longer than milliseconds
+    void enableSlowQueryLog(double milliseconds)
+    {
+        slowNanos = (long long)(milliseconds * 1000000.0);
+        active = true;
+        std::cout << "Logging requests slower than " << milliseconds << " ms to " << SLOW_QUERY_FILENAME << std::endl;
+    }
+
+    bool isActive() const
+    {
+        return active.load(std::memory_order_relaxed);
+    }
+
+    long long now() const
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - origin).count();
+    }
+
+    // Called when the outermost span of a thread's request ends
+    void finish(TraceThread &thread)
+    {
+        if (slowNanos >= 0 && thread.events[0].duration > slowNanos)
+        {
+            logSlowRequest(thread.events);
+        }
+        if (tracePath[0] != '\0')
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            if (kept.size() + thread.events.size() <= (size_t)TRACE_MAX_EVENTS)
+            {
+                kept.insert(kept.end(), thread.events.begin(), thread.events.end());
+            }
+            else
+            {
+                droppedRequests++;
+            }
+        }
+        thread.events.clear();
+    }
+
+    bool writeTrace()
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        std::string text;
+        JsonWriter json(text);
+        json.raw("{");
+        json.key("displayTimeUnit");
+        json.string("ms");
+        writeEvents(json, kept, ",\n");
+        json.raw("}\n");
+
+        char tempPath[sizeof(tracePath) + 8];
+        snprintf(tempPath, sizeof(tempPath), "%s.tmp", tracePath);
+        FILE *fp = fopen(tempPath, "wb");
+        if (fp == nullptr)
+        {
+            std::cout << "Error: Could not write " << tracePath << std::endl;
+            return false;
+        }
+        bool ok = fwrite(text.data(), 1, text.size(), fp) == text.size();
+        ok = (fclose(fp) == 0) && ok;
+        if (!ok || rename(tempPath, tracePath) != 0)
+        {
+            remove(tempPath);
+            std::cout << "Error: Could not write " << tracePath << std::endl;
+            return false;
+        }
+        std::cout << "Trace of " << kept.size() << " spans written to " << tracePath << std::endl;
+        if (droppedRequests > 0)
+        {
+            std::cout << droppedRequests << " request(s) were not kept: the trace is limited to "
+                      << TRACE_MAX_EVENTS << " spans." << std::endl;
+        }
+        return true;
+    }
+};
+
+Tracer tracer;
+
+// Records one stage of a request for as long as it is in scope. Costs one
+// relaxed load when tracing is off.
+class TraceSpan
+{
+private:
+    TraceThread *thread; // nullptr when tracing is off
+    size_t index;        // Position of the span in the thread's events
+
+public:
+    TraceSpan(const char *name, const char *detail = nullptr) : thread(nullptr), index(0)
+    {
+        if (!tracer.isActive())
+        {
+            return;
+        }
+        thread = &currentTraceThread();
+        index = thread->events.size();
+        thread->events.push_back(TraceEvent());
+        TraceEvent &event = thread->events.back();
+        event.name = name;
+        if (detail != nullptr)
+        {
+            event.detail = detail;
+        }
+        event.thread = thread->id;
+        event.duration = 0;
+        thread->depth++;
+        event.start = tracer.now();
+    }
+
+    ~TraceSpan()
+    {
+        if (thread == nullptr)
+        {
+            return;
+        }
+        TraceEvent &event = thread->events[index];
+        event.duration = tracer.now() - event.start;
+        if (--thread->depth == 0)
+        {
+            tracer.finish(*thread);
+        }
+    }
+
+    void describe(const char *detail)
+    {
+        if (thread != nullptr)
+        {
+            thread->events[index].detail = detail;
+        }
+    }
+};
+
+// Concurrent access settings
+const int MAX_READER_THREADS = 64; // Threads that can read snapshots at once without locks
+const int MAX_RETIRED_SNAPSHOTS = 64;
+const int WRITE_BATCH_SIZE = 32;   // Queued writes that trigger publishing a new snapshot
+const int CATALOG_SHARDS = 4;      // Partitions of every snapshot, picked by title hash
+const float COMPACTION_DEAD_RATIO = 0.25f; // Share of tombstoned movies that triggers compaction
+
+// One partition of a snapshot's movies. Movies are assigned by the hash of
+// their title, so every copy of a title lands in the same shard. A shard
+// keeps its own exact-match indexes to the positions with a key, in catalog
+// order. Titles are indexed by hash, and callers check the title to rule
+// out collisions; names are indexed by their dictionary ID, which is exact.
+struct CatalogShard
+{
+    typedef std::vector<int, TrackedAllocator<int, MEM_SNAPSHOT_INDEXES>> PositionList;
+    template <typename Key>
+    using Index = std::unordered_map<Key, PositionList, std::hash<Key>, std::equal_to<Key>,
+                                     TrackedAllocator<std::pair<const Key, PositionList>, MEM_SNAPSHOT_INDEXES>>;
+
+    PositionList positions; // Movies owned by this shard, in catalog order
+    Index<unsigned int> byTitle;
+    Index<int> byGenre;
+    Index<int> byDirector;
+    Index<int> byYear;
+
+    static int shardOf(const char *title)
+    {
+        return (int)(hashTitle(title) % CATALOG_SHARDS);
+    }
+
+    void add(int position, const Movie &movie)
+    {
+        positions.push_back(position);
+        byTitle[hashTitle(movie.title)].push_back(position);
+        byGenre[movie.genreId].push_back(position);
+        byDirector[movie.directorId].push_back(position);
+        byYear[movie.releaseYear].push_back(position);
+    }
+
+    // Positions listed under an exact key
+    int lookup(const Index<int> &index, int key, int results[], int maxResults) const
+    {
+        Index<int>::const_iterator it = index.find(key);
+        int found = 0;
+        for (; it != index.end() && found < (int)it->second.size() && found < maxResults; found++)
+        {
+            results[found] = it->second[found];
+        }
+        return found;
+    }
+
+    // Positions listed under a string key whose field really matches
+    int lookup(const Index<unsigned int> &index, const char *key,
+               const Movie *movies, const char *(*field)(const Movie &), int results[], int maxResults) const
+    {
+        Index<unsigned int>::const_iterator it = index.find(hashTitle(key));
+        int found = 0;
+        if (it == index.end())
+        {
+            return 0;
+        }
+        for (size_t i = 0; i < it->second.size() && found < maxResults; i++)
+        {
+            if (strcmp(field(movies[it->second[i]]), key) == 0)
+            {
+                results[found++] = it->second[i];
+            }
+        }
+        return found;
+    }
+};
+
+// The movie half of a snapshot: the copied movies, their shards and facet
+// columns. It depends on the catalog alone, so snapshots published while
+// the catalog version stays the same (rating changes) share one copy.
+struct CatalogMovies
+{
+    unsigned long long catalogVersion;
+    Movie *movies;
+    bool *tombstone; // Deleted movies keep their position; no shard lists them
+    int movieCount;
+    CatalogShard shards[CATALOG_SHARDS];
+    FacetColumns facetColumns;
+    FacetCounts facets; // Whole catalog, copied from the database's running counts
+
+    explicit CatalogMovies(int movies_) : catalogVersion(0), movieCount(movies_)
+    {
+        movies = new Movie[movies_ > 0 ? movies_ : 1];
+        tombstone = new bool[movies_ > 0 ? movies_ : 1];
+        trackMemory(MEM_SNAPSHOTS, footprint());
+    }
+
+    ~CatalogMovies()
+    {
+        trackMemory(MEM_SNAPSHOTS, -footprint());
+        delete[] movies;
+        delete[] tombstone;
+    }
+
+    CatalogMovies(const CatalogMovies &) = delete;
+    CatalogMovies &operator=(const CatalogMovies &) = delete;
+
+    // Bytes of the copy and its arrays (the shard indexes are charged
+    // separately as they grow)
+    long long footprint() const
+    {
+        long long movieSlots = movieCount > 0 ? movieCount : 1;
+        return (long long)sizeof(CatalogMovies) + movieSlots * (long long)(sizeof(Movie) + sizeof(bool));
+    }
+
+    // Partition the movies once they have been copied in
+    void buildShards()
+    {
+        facetColumns.build(movies, movieCount);
+        for (int i = 0; i < movieCount; i++)
+        {
+            if (!tombstone[i])
+            {
+                shards[CatalogShard::shardOf(movies[i].title)].add(i, movies[i]);
+            }
+        }
+    }
+};
+
+// One user's row of a snapshot. Rows are never changed once built: every
+// snapshot published while the user's ratings stay the same shares it.
+struct SnapshotUser
+{
+    int userId;
+    char username[MAX_STRING_LENGTH];
+    char topRated[MAX_STRING_LENGTH]; // Title of the user's highest rating, or ""
+};
+
+typedef std::shared_ptr<const SnapshotUser> SnapshotUserRef;
+typedef std::shared_ptr<const CatalogMovies> CatalogMoviesRef;
+typedef std::shared_ptr<const UserIndex> UserIndexRef;
+
+// Immutable view of the catalog that reader threads query without locks.
+// User scores are captured when it is built; the movies, the user rows and
+// the user index are shared with the previous snapshot when unchanged.
+struct CatalogSnapshot
+{
+    unsigned long long version;
+    unsigned long long catalogVersion; // Of the database when it was built
+    CatalogMoviesRef catalog;
+    const Movie *movies;          // The shared copy's arrays
+    const bool *tombstone;
+    const CatalogShard *shards;
+    float *userScores;
+    int movieCount;
+    std::vector<SnapshotUserRef> userRows;
+    int userCount;
+    UserIndexRef userIndex;
+    mutable std::atomic<int> holds; // SnapshotRefs that keep a retired snapshot alive
+
+    CatalogSnapshot(const CatalogMoviesRef &catalog_, const std::vector<SnapshotUserRef> &userRows_, const UserIndexRef &userIndex_)
+        : version(0), catalogVersion(catalog_->catalogVersion), catalog(catalog_), movies(catalog_->movies),
+          tombstone(catalog_->tombstone), shards(catalog_->shards), movieCount(catalog_->movieCount),
+          userRows(userRows_), userCount((int)userRows_.size()), userIndex(userIndex_), holds(0)
+    {
+        userScores = new float[movieCount > 0 ? movieCount : 1];
+        trackMemory(MEM_SNAPSHOTS, footprint());
+    }
+
+    ~CatalogSnapshot()
+    {
+        trackMemory(MEM_SNAPSHOTS, -footprint());
+        delete[] userScores;
+    }
+
+    // Bytes of this version alone: what it shares is charged once, where
+    // it was built
+    long long footprint() const
+    {
+        long long movieSlots = movieCount > 0 ? movieCount : 1;
+        return (long long)sizeof(CatalogSnapshot) + movieSlots * (long long)sizeof(float) +
+               (long long)userRows.size() * (long long)sizeof(SnapshotUserRef);
+    }
+
+    const FacetCounts &facets() const
+    {
+        return catalog->facets;
+    }
+
+    // Movies that are not deleted
+    int liveCount() const
+    {
+        int live = 0;
+        for (int s = 0; s < CATALOG_SHARDS; s++)
+        {
+            live += (int)shards[s].positions.size();
+        }
+        return live;
+    }
+
+    // User slot for an ID or a username, or -1
+    int findUser(int userId) const
+    {
+        return userIndex->findId(userId);
+    }
+
+    int findUserByName(const char *username) const
+    {
+        return userIndex->findName(username, [this](int slot)
+                                   { return (const char *)userRows[slot]->username; });
+    }
+
+    static const char *titleOf(const Movie &movie) { return movie.title; }
+
+    // Scatter a query to every shard and merge the partial results, which
+    // each shard returns in catalog order, back into catalog order
+    int gather(const std::function<int(const CatalogShard &, int[], int)> &query, int results[], int maxResults) const
+    {
+        if (maxResults > MAX_MOVIES)
+        {
+            maxResults = MAX_MOVIES;
+        }
+        int partial[CATALOG_SHARDS][MAX_MOVIES];
+        int counts[CATALOG_SHARDS];
+        int next[CATALOG_SHARDS];
+        for (int s = 0; s < CATALOG_SHARDS; s++)
+        {
+            counts[s] = query(shards[s], partial[s], maxResults);
+            next[s] = 0;
+        }
+
+        int found = 0;
+        while (found < maxResults)
+        {
+            int best = -1;
+            for (int s = 0; s < CATALOG_SHARDS; s++)
+            {
+                if (next[s] < counts[s] && (best == -1 || partial[s][next[s]] < partial[best][next[best]]))
+                {
+                    best = s;
+                }
+            }
+            if (best == -1)
+            {
+                break;
+            }
+            results[found++] = partial[best][next[best]++];
+        }
+        return found;
+    }
+
+    // First position of a title: only its own shard can hold it
+    int findByTitle(const char *title) const
+    {
+        int position;
+        const CatalogShard &shard = shards[CatalogShard::shardOf(title)];
+        return (shard.lookup(shard.byTitle, title, movies, titleOf, &position, 1) == 1) ? position : -1;
+    }
+
+    // Positions of movies whose title contains text
+    int searchByTitle(const char *text, int results[], int maxResults) const
+    {
+        return gather([this, text](const CatalogShard &shard, int partial[], int limit)
+                      {
+            int found = 0;
+            for (size_t i = 0; i < shard.positions.size() && found < limit; i++)
+            {
+                if (strstr(movies[shard.positions[i]].title, text) != nullptr)
+                {
+                    partial[found++] = shard.positions[i];
+                }
+            }
+            return found; }, results, maxResults);
+    }
+
+    // Facet counts of the movies at positions
+    void countFacets(const int positions[], int count, FacetCounts &counts) const
+    {
+        catalog->facetColumns.count(positions, count, counts);
+    }
+
+    // Positions of movies with a genre or director, matched without case
+    // or extra whitespace
+    int searchByGenre(const char *genre, int results[], int maxResults) const
+    {
+        int id = nameDictionary.find(genre);
+        if (id == -1)
+        {
+            return 0;
+        }
+        return gather([id](const CatalogShard &shard, int partial[], int limit)
+                      { return shard.lookup(shard.byGenre, id, partial, limit); },
+                      results, maxResults);
+    }
+
+    int searchByDirector(const char *director, int results[], int maxResults) const
+    {
+        int id = nameDictionary.find(director);
+        if (id == -1)
+        {
+            return 0;
+        }
+        return gather([id](const CatalogShard &shard, int partial[], int limit)
+                      { return shard.lookup(shard.byDirector, id, partial, limit); },
+                      results, maxResults);
+    }
+
+    int searchByYear(int year, int results[], int maxResults) const
+    {
+        return gather([year](const CatalogShard &shard, int partial[], int limit)
+                      { return shard.lookup(shard.byYear, year, partial, limit); },
+                      results, maxResults);
+    }
+
+    // Positions of the movies most similar to the movie at target. Every
+    // shard keeps its own top list; merging them by score, then position,
+    // gives the same order as one scan over the whole catalog.
+    int findSimilar(int target, int results[], int maxResults) const
+    {
+        const Movie &movie = movies[target];
+        TopSimilar partial[CATALOG_SHARDS];
+        {
+            TraceSpan span("similarity scan");
+            for (int s = 0; s < CATALOG_SHARDS; s++)
+            {
+                partial[s] = TopSimilar(maxResults);
+                for (size_t i = 0; i < shards[s].positions.size(); i++)
+                {
+                    int position = shards[s].positions[i];
+                    if (strcmp(movies[position].title, movie.title) != 0)
+                    {
+                        partial[s].offer(position, scoreSimilarity(movie, userScores[target], movies[position], userScores[position]));
+                    }
+                }
+            }
+        }
+
+        TraceSpan span("merge shards");
+        int found = 0;
+        int next[CATALOG_SHARDS] = {0};
+        while (found < partial[0].limit)
+        {
+            int best = -1;
+            for (int s = 0; s < CATALOG_SHARDS; s++)
+            {
+                if (next[s] < partial[s].count &&
+                    (best == -1 || partial[s].scores[next[s]] > partial[best].scores[next[best]] ||
+                     (partial[s].scores[next[s]] == partial[best].scores[next[best]] &&
+                      partial[s].positions[next[s]] < partial[best].positions[next[best]])))
+                {
+                    best = s;
+                }
+            }
+            if (best == -1)
+            {
+                break;
+            }
+            results[found++] = partial[best].positions[next[best]++];
+        }
+        return found;
+    }
+
+    // Recommendations for a user: movies similar to their top rated movie.
+    // basedOn is set to that movie's position, or -1 if there is none.
+    int recommendFor(int userId, int results[], int maxResults, int &basedOn) const
+    {
+        {
+            TraceSpan span("user lookup");
+            int u = findUser(userId);
+            basedOn = (u != -1 && userRows[u]->topRated[0] != '\0') ? findByTitle(userRows[u]->topRated) : -1;
+        }
+        return (basedOn == -1) ? 0 : findSimilar(basedOn, results, maxResults);
+    }
+};
+
+std::atomic<bool> readerSlotClaimed[MAX_READER_THREADS];
+
+// Epoch slot owned by one thread, released when the thread exits
+struct ReaderSlot
+{
+    int index;
+    int depth; // Nested reads on this thread
+
+    ReaderSlot() : index(-1), depth(0)
+    {
+        for (int i = 0; i < MAX_READER_THREADS; i++)
+        {
+            bool expected = false;
+            if (readerSlotClaimed[i].compare_exchange_strong(expected, true))
+            {
+                index = i;
+                break;
+            }
+        }
+    }
+
+    ~ReaderSlot()
+    {
+        if (index != -1)
+        {
+            readerSlotClaimed[index] = false;
+        }
+    }
+};
+
+ReaderSlot &currentReaderSlot()
+{
+    thread_local ReaderSlot slot;
+    return slot;
+}
+
+// Epoch-based reclamation of catalog snapshots.
+// A reader records the global epoch in its slot before loading the snapshot
+// pointer and clears it when done. The writer stamps each replaced snapshot
+// with the epoch at the time of the swap and frees it only once every active
+// reader has a later epoch, so no reader can still be using it.
+class EpochManager
+{
+private:
+    std::atomic<unsigned long long> globalEpoch;
+    std::atomic<unsigned long long> readerEpochs[MAX_READER_THREADS]; // 0 = not reading
+    std::atomic<int> overflowReaders; // Readers without a slot block all reclamation
+
+    struct Retired
+    {
+        CatalogSnapshot *snapshot;
+        unsigned long long epoch;
+    };
+    Retired retired[MAX_RETIRED_SNAPSHOTS]; // Only touched by the writer
+    int retiredCount;
+
+public:
+    EpochManager() : globalEpoch(1), overflowReaders(0), retiredCount(0)
+    {
+        for (int i = 0; i < MAX_READER_THREADS; i++)
+        {
+            readerEpochs[i] = 0;
+        }
+    }
+
+    ~EpochManager()
+    {
+        for (int i = 0; i < retiredCount; i++)
+        {
+            delete retired[i].snapshot;
+        }
+    }
+
+    void enter()
+    {
+        ReaderSlot &slot = currentReaderSlot();
+        if (slot.index == -1)
+        {
+            overflowReaders++;
+        }
+        else if (slot.depth == 0)
+        {
+            readerEpochs[slot.index].store(globalEpoch.load());
+        }
+        slot.depth++;
+    }
+
+    void exit()
+    {
+        ReaderSlot &slot = currentReaderSlot();
+        slot.depth--;
+        if (slot.index == -1)
+        {
+            overflowReaders--;
+        }
+        else if (slot.depth == 0)
+        {
+            readerEpochs[slot.index].store(0);
+        }
+    }
+
+    // Whether the calling thread has a snapshot pinned. It must not
+    // publish one: retiring waits for readers, this thread among them.
+    bool reading() const
+    {
+        return currentReaderSlot().depth > 0;
+    }
+
+    // Free retired snapshots that no reader can still see (writer only)
+    void reclaim()
+    {
+        if (overflowReaders.load() > 0)
+        {
+            return;
+        }
+        unsigned long long oldestActive = ~0ULL;
+        for (int i = 0; i < MAX_READER_THREADS; i++)
+        {
+            unsigned long long epoch = readerEpochs[i].load();
+            if (epoch != 0 && epoch < oldestActive)
+            {
+                oldestActive = epoch;
+            }
+        }
+        int kept = 0;
+        for (int i = 0; i < retiredCount; i++)
+        {
+            if (retired[i].epoch < oldestActive && retired[i].snapshot->holds.load() == 0)
+            {
+                delete retired[i].snapshot;
+            }
+            else
+            {
+                retired[kept++] = retired[i];
+            }
+        }
+        retiredCount = kept;
+    }
+
+    // Hand over a snapshot that was just replaced (writer only)
+    void retire(CatalogSnapshot *snapshot)
+    {
+        while (retiredCount == MAX_RETIRED_SNAPSHOTS)
+        {
+            reclaim();
+            std::this_thread::yield();
+        }
+        retired[retiredCount].snapshot = snapshot;
+        retired[retiredCount].epoch = globalEpoch.fetch_add(1);
+        retiredCount++;
+        reclaim();
+    }
+
+    int getRetiredCount() const { return retiredCount; }
+};
+
+// Keeps the published snapshot alive while a reader uses it
+class SnapshotReader
+{
+private:
+    EpochManager &epochs;
+    const CatalogSnapshot *snapshot;
+
+public:
+    SnapshotReader(EpochManager &manager, const std::atomic<CatalogSnapshot *> &current)
+        : epochs(manager)
+    {
+        epochs.enter();
+        snapshot = current.load();
+    }
+
+    ~SnapshotReader()
+    {
+        epochs.exit();
+    }
+
+    SnapshotReader(const SnapshotReader &) = delete;
+    SnapshotReader &operator=(const SnapshotReader &) = delete;
+
+    const CatalogSnapshot *operator->() const { return snapshot; }
+    const CatalogSnapshot *get() const { return snapshot; }
+};
+
+// Counted reference to a snapshot. Unlike SnapshotReader it is not tied to
+// the thread's epoch slot, so it can be copied, stored and held across
+// coroutine suspensions or threads. Retired snapshots are only freed once
+// no reference is left.
+class SnapshotRef
+{
+private:
+    const CatalogSnapshot *snapshot;
+
+public:
+    SnapshotRef() : snapshot(nullptr) {}
+
+    // Take a reference while the snapshot is pinned by a reader
+    explicit SnapshotRef(const SnapshotReader &reader) : snapshot(reader.get())
+    {
+        if (snapshot != nullptr)
+        {
+            snapshot->holds++;
+        }
+    }
+
+    SnapshotRef(const SnapshotRef &other) : snapshot(other.snapshot)
+    {
+        if (snapshot != nullptr)
+        {
+            snapshot->holds++;
+        }
+    }
+
+    SnapshotRef(SnapshotRef &&other) noexcept : snapshot(other.snapshot)
+    {
+        other.snapshot = nullptr;
+    }
+
+    SnapshotRef &operator=(SnapshotRef other) noexcept
+    {
+        std::swap(snapshot, other.snapshot);
+        return *this;
+    }
+
+    ~SnapshotRef()
+    {
+        if (snapshot != nullptr)
+        {
+            snapshot->holds--;
+        }
+    }
+
+    const CatalogSnapshot *operator->() const { return snapshot; }
+    const CatalogSnapshot *get() const { return snapshot; }
+};
+
+// Longest query line accepted by the server and batch mode
+const int MAX_QUERY_LENGTH = 512;
+
+// Result of one protocol query: positions in the snapshot it ran on
+struct QueryResult
+{
+    bool ok;
+    const char *error;
+    bool queuedWrite; // A rating was queued and still has to be saved
+    int count;
+    int positions[MAX_MOVIES];
+    bool faceted; // FACETS: the answer is the facet counts, not the movies
+    FacetCounts facets;
+
+    // An empty answer: positions and facets are only read up to what is set
+    QueryResult() : ok(true), error(nullptr), queuedWrite(false), count(0), faceted(false) {}
+};
+
+// Replication log settings. The primary appends every committed change to
+// the log; followers replay it on top of a snapshot of the database file.
+const char *LOG_FILENAME = "movies_database.log";
+const unsigned int LOG_RECORD_MAGIC = 0x474C564D; // "MVLG"
+const int LOG_MAX_PAYLOAD = 1024;
+const int REPLICATION_POLL_RECORDS = 4096; // Records a follower applies per poll
+
+enum LogRecordType
+{
+    LOG_ADD_MOVIE = 1, // Movie
+    LOG_DELETE_MOVIE,  // LogMovieRef
+    LOG_RATE_MOVIE,    // LogRating
+    LOG_ADD_USER,      // LogUser
+    LOG_MERGE_MOVIES,  // LogMerge
+    LOG_REORDER        // LogReorder
+};
+
+struct LogRecordHeader
+{
+    unsigned int magic;
+    int type;
+    unsigned long long sequence;
+    long long committedAt; // Microseconds since the epoch, for follower lag
+    int size;              // Payload bytes after the header
+};
+
+struct LogMovieRef
+{
+    int position;
+    char title[MAX_STRING_LENGTH]; // Checked before a position is trusted
+};
+
+struct LogRating
+{
+    int userId;
+    float rating;
+    char title[MAX_STRING_LENGTH];
+};
+
+struct LogUser
+{
+    int userId;
+    char username[MAX_STRING_LENGTH];
+};
+
+struct LogMerge
+{
+    LogMovieRef keep;
+    LogMovieRef duplicate;
+};
+
+struct LogReorder
+{
+    int count;
+    int order[MAX_MOVIES]; // New position i holds the movie from position order[i]
+};
+
+static_assert(sizeof(Movie) <= LOG_MAX_PAYLOAD, "log records must fit a movie");
+
+// Append-only file of log records. The primary writes it; followers read it
+// while it grows and stop at a record that is not completely written yet.
+class ReplicationLog
+{
+private:
+    FILE *fp;
+    bool appending;
+    long offset; // Next record to read, or the end of the file when appending
+    unsigned long long lastSequence;
+
+public:
+    ReplicationLog() : fp(nullptr), appending(false), offset(0), lastSequence(0) {}
+
+    ~ReplicationLog()
+    {
+        close();
+    }
+
+    void close()
+    {
+        if (fp != nullptr)
+        {
+            fclose(fp);
+            fp = nullptr;
+        }
+    }
+
+    bool openForReading(const char *path)
+    {
+        close();
+        fp = fopen(path, "rb");
+        appending = false;
+        offset = 0;
+        return fp != nullptr;
+    }
+
+    // Continue the log after its last complete record. A record torn by a
+    // crash is cut off, so followers never wait on it.
+    bool openForAppending(const char *path, long end, unsigned long long sequence)
+    {
+        close();
+#ifdef __linux__
+        if (truncate(path, end) != 0 && errno != ENOENT)
+        {
+            perror("Log truncate error");
+        }
+#endif
+        fp = fopen(path, "ab");
+        appending = true;
+        offset = end;
+        lastSequence = sequence;
+        return fp != nullptr;
+    }
+
+    long getOffset() const { return offset; }
+    unsigned long long getLastSequence() const { return lastSequence; }
+
+    // Read from position if the record with nextSequence starts there (or
+    // the log ends there); otherwise read the whole log from the start
+    void resume(long position, unsigned long long nextSequence)
+    {
+        LogRecordHeader header;
+        offset = 0;
+        clearerr(fp);
+        if (position <= 0 || fseek(fp, 0, SEEK_END) != 0 || ftell(fp) < position)
+        {
+            return;
+        }
+        if (ftell(fp) == position)
+        {
+            offset = position;
+            return;
+        }
+        if (fseek(fp, position, SEEK_SET) == 0 && fread(&header, sizeof(header), 1, fp) == 1 &&
+            header.magic == LOG_RECORD_MAGIC && header.sequence == nextSequence)
+        {
+            offset = position;
+        }
+    }
+
+    // Read the next complete record. Returns false at the end of the log
+    // (the position is kept, so a later call sees newly appended records).
+    bool readNext(LogRecordHeader &header, char payload[LOG_MAX_PAYLOAD])
+    {
+        clearerr(fp);
+        if (fseek(fp, offset, SEEK_SET) != 0 ||
+            fread(&header, sizeof(header), 1, fp) != 1)
+        {
+            return false;
+        }
+        if (header.magic != LOG_RECORD_MAGIC || header.size < 0 || header.size > LOG_MAX_PAYLOAD)
+        {
+            return false; // Torn or foreign data: wait for the primary to cut it off
+        }
+        if (fread(payload, 1, header.size, fp) != (size_t)header.size)
+        {
+            return false;
+        }
+        offset += (long)sizeof(header) + header.size;
+        lastSequence = header.sequence;
+        return true;
+    }
+
+    // Append a record; it reaches followers on the next commit()
+    unsigned long long append(int type, const void *payload, int size)
+    {
+        LogRecordHeader header;
+        memset(&header, 0, sizeof(header));
+        header.magic = LOG_RECORD_MAGIC;
+        header.type = type;
+        header.sequence = ++lastSequence;
+        header.committedAt = std::chrono::duration_cast<std::chrono::microseconds>(
+                                 std::chrono::system_clock::now().time_since_epoch())
+                                 .count();
+        header.size = size;
+        if (fwrite(&header, sizeof(header), 1, fp) != 1 || fwrite(payload, 1, size, fp) != (size_t)size)
+        {
+            perror("Log write error");
+        }
+        offset += (long)sizeof(header) + size;
+        return header.sequence;
+    }
+
+    void commit()
+    {
+        fflush(fp);
+    }
+};
+
+// Block codec for database files and change store segments. Numeric
+// fields are first taken out of the records (see RecordLayout), then both
+// parts are compressed with a byte-oriented LZ77 variant: each sequence is
+// a token (literal count in the high nibble, match length - LZ_MIN_MATCH
+// in the low nibble; 15 means more length bytes follow), the literals, and
+// a 2-byte match offset. A block always ends with literals. Blocks are
+// independent of each other.
+const int LZ_MIN_MATCH = 4;
+const int LZ_HASH_BITS = 13;        // Positions remembered by the match finder
+const int LZ_MAX_OFFSET = 65535;    // Matches reach this far back
+const int LZ_LAST_LITERALS = 5;     // A block ends with at least this many literals
+const int LZ_SKIP_STRENGTH = 6;     // Unmatched runs are scanned faster as they grow
+
+// Largest compressed size of size bytes
+int lzBound(int size)
+{
+    return size + size / 255 + 16;
+}
+
+unsigned char *lzWriteLength(unsigned char *out, size_t length)
+{
+    for (; length >= 255; length -= 255)
+    {
+        *out++ = 255;
+    }
+    *out++ = (unsigned char)length;
+    return out;
+}
+
+unsigned char *lzWriteSequence(unsigned char *out, const unsigned char *literals, size_t literalCount,
+                               int offset, size_t matchLength)
+{
+    unsigned char *token = out++;
+    *token = (unsigned char)((literalCount < 15 ? literalCount : 15) << 4);
+    if (literalCount >= 15)
+    {
+        out = lzWriteLength(out, literalCount - 15);
+    }
+    memcpy(out, literals, literalCount);
+    out += literalCount;
+    if (matchLength == 0)
+    {
+        return out; // The last sequence of the block
+    }
+    *out++ = (unsigned char)offset;
+    *out++ = (unsigned char)(offset >> 8);
+    matchLength -= LZ_MIN_MATCH;
+    *token |= (unsigned char)(matchLength < 15 ? matchLength : 15);
+    if (matchLength >= 15)
+    {
+        out = lzWriteLength(out, matchLength - 15);
+    }
+    return out;
+}
+
+// Compress size bytes into dest, which holds at least lzBound(size)
+// bytes. Returns the compressed size.
+int lzCompress(const char *source, int size, char *dest)
+{
+    const unsigned char *src = (const unsigned char *)source;
+    unsigned char *out = (unsigned char *)dest;
+    int table[1 << LZ_HASH_BITS];
+    for (int i = 0; i < (1 << LZ_HASH_BITS); i++)
+    {
+        table[i] = -1;
+    }
+    int anchor = 0; // Start of the literals not yet written
+    int position = 0;
+    int matchLimit = size - LZ_LAST_LITERALS;
+    while (position + LZ_MIN_MATCH <= matchLimit)
+    {
+        unsigned int word;
+        memcpy(&word, src + position, 4);
+        unsigned int hash = (word * 2654435761u) >> (32 - LZ_HASH_BITS);
+        int candidate = table[hash];
+        table[hash] = position;
+        bool found = candidate >= 0 && position - candidate <= LZ_MAX_OFFSET;
+        if (found)
+        {
+            unsigned int previous;
+            memcpy(&previous, src + candidate, 4);
+            found = previous == word;
+        }
+        if (!found)
+        {
+            position += 1 + ((position - anchor) >> LZ_SKIP_STRENGTH);
+            continue;
+        }
+
+        // Extend the match backwards over the pending literals, then forwards
+        while (position > anchor && candidate > 0 && src[position - 1] == src[candidate - 1])
+        {
+            position--;
+            candidate--;
+        }
+        int length = LZ_MIN_MATCH;
+        while (position + length + 8 <= matchLimit)
+        {
+            unsigned long long a, b;
+            memcpy(&a, src + position + length, 8);
+            memcpy(&b, src + candidate + length, 8);
+            if (a != b)
+            {
+                break;
+            }
+            length += 8;
+        }
+        while (position + length < matchLimit && src[position + length] == src[candidate + length])
+        {
+            length++;
+        }
+        out = lzWriteSequence(out, src + anchor, position - anchor, position - candidate, length);
+        position += length;
+        anchor = position;
+    }
+    out = lzWriteSequence(out, src + anchor, size - anchor, 0, 0);
+    return (int)(out - (unsigned char *)dest);
+}
+
+bool lzReadLength(const unsigned char *&in, const unsigned char *end, size_t &length)
+{
+    unsigned char more;
+    do
+    {
+        if (in == end)
+        {
+            return false;
+        }
+        more = *in++;
+        length += more;
+    } while (more == 255);
+    return true;
+}
+
+// Decompress a block into exactly rawSize bytes. Damaged input is
+// rejected rather than read or written out of bounds.
+bool lzDecompress(const char *source, int size, char *dest, int rawSize)
+{
+    const unsigned char *in = (const unsigned char *)source;
+    const unsigned char *inEnd = in + size;
+    unsigned char *out = (unsigned char *)dest;
+    unsigned char *outEnd = out + rawSize;
+    while (in < inEnd)
+    {
+        unsigned int token = *in++;
+        size_t literals = token >> 4;
+
+        // Most sequences are a few literals and a short match from at
+        // least 16 bytes back: copy them in fixed-size steps while both
+        // buffers have room to spare
+        if (literals < 15 && (token & 15) < 15 && inEnd - in >= 18 && outEnd - out >= 48)
+        {
+            size_t offset = in[literals] | ((size_t)in[literals + 1] << 8);
+            if (offset >= 16 && offset <= (size_t)(out + literals - (unsigned char *)dest))
+            {
+                memcpy(out, in, 16);
+                out += literals;
+                in += literals + 2;
+                memcpy(out, out - offset, 16);
+                memcpy(out + 16, out + 16 - offset, 16);
+                out += (token & 15) + LZ_MIN_MATCH;
+                continue;
+            }
+        }
+
+        if (literals == 15 && !lzReadLength(in, inEnd, literals))
+        {
+            return false;
+        }
+        if ((size_t)(inEnd - in) < literals || (size_t)(outEnd - out) < literals)
+        {
+            return false;
+        }
+        if (literals <= 16 && inEnd - in >= 16 && outEnd - out >= 16)
+        {
+            memcpy(out, in, 16); // One fixed-size copy; the excess is overwritten next
+        }
+        else
+        {
+            memcpy(out, in, literals);
+        }
+        out += literals;
+        in += literals;
+        if (in == inEnd)
+        {
+            break; // The last sequence has no match
+        }
+
+        if (inEnd - in < 2)
+        {
+            return false;
+        }
+        size_t offset = in[0] | ((size_t)in[1] << 8);
+        in += 2;
+        size_t length = token & 15;
+        if (length == 15 && !lzReadLength(in, inEnd, length))
+        {
+            return false;
+        }
+        length += LZ_MIN_MATCH;
+        if (offset == 0 || offset > (size_t)(out - (unsigned char *)dest) || (size_t)(outEnd - out) < length)
+        {
+            return false;
+        }
+        const unsigned char *match = out - offset;
+        if (offset == 1)
+        {
+            memset(out, *match, length); // A run of one byte, e.g. string padding
+        }
+        else if (offset >= 16 && (size_t)(outEnd - out) >= length + 16)
+        {
+            // Fixed-size steps, each reading only bytes already written
+            for (size_t i = 0; i < length; i += 16)
+            {
+                memcpy(out + i, match + i, 16);
+            }
+        }
+        else
+        {
+            // The match repeats every offset bytes, so it is copied in
+            // growing pieces that never overlap what they read
+            for (size_t done = 0; done < length;)
+            {
+                size_t piece = (length - done < offset + done) ? length - done : offset + done;
+                memcpy(out + done, match, piece);
+                done += piece;
+            }
+        }
+        out += length;
+    }
+    return out == outEnd;
+}
+
+// How records are prepared for compression. Numeric fields (4 bytes) are
+// taken out of the records and stored as columns: each value is the
+// difference from the same field of the previous record, zigzag varint
+// encoded, so sorted IDs and nearby years take a byte each. What is left
+// of the records (names and padding, numeric fields zeroed) is compressed
+// as it is, so it decompresses straight into place.
+struct RecordLayout
+{
+    int recordSize;
+    std::vector<int> numericOffsets;
+
+    RecordLayout(int size, const std::vector<int> &offsets) : recordSize(size), numericOffsets(offsets) {}
+
+    // Largest size of the numeric columns of count records
+    int numericBound(int count) const
+    {
+        return count * (int)numericOffsets.size() * 5; // A 4-byte varint takes up to 5 bytes
+    }
+
+    // Write the numeric columns of count records to numbers, and a copy of
+    // the records without them to rest. Returns the size of the columns.
+    int encode(const char *records, int count, char *numbers, char *rest) const
+    {
+        unsigned char *out = (unsigned char *)numbers;
+        memcpy(rest, records, (size_t)count * recordSize);
+        for (size_t c = 0; c < numericOffsets.size(); c++)
+        {
+            unsigned int previous = 0;
+            for (int r = 0; r < count; r++)
+            {
+                size_t at = (size_t)r * recordSize + numericOffsets[c];
+                unsigned int value;
+                memcpy(&value, records + at, 4);
+                memset(rest + at, 0, 4);
+                unsigned int delta = value - previous;
+                unsigned int zigzag = (delta << 1) ^ ((delta >> 31) ? 0xFFFFFFFFu : 0u);
+                while (zigzag >= 0x80)
+                {
+                    *out++ = (unsigned char)(zigzag | 0x80);
+                    zigzag >>= 7;
+                }
+                *out++ = (unsigned char)zigzag;
+                previous = value;
+            }
+        }
+        return (int)(out - (unsigned char *)numbers);
+    }
+
+    // Put the numeric columns back into count records; false if they do
+    // not fit
+    bool decode(const char *numbers, int size, int count, char *records) const
+    {
+        const unsigned char *in = (const unsigned char *)numbers;
+        const unsigned char *end = in + size;
+        for (size_t c = 0; c < numericOffsets.size(); c++)
+        {
+            unsigned int previous = 0;
+            char *field = records + numericOffsets[c];
+            for (int r = 0; r < count; r++, field += recordSize)
+            {
+                unsigned int zigzag = 0;
+                for (int shift = 0;; shift += 7)
+                {
+                    if (in == end || shift > 28)
+                    {
+                        return false;
+                    }
+                    unsigned int byte = *in++;
+                    zigzag |= (byte & 0x7F) << shift;
+                    if (byte < 0x80)
+                    {
+                        break;
+                    }
+                }
+                previous += (zigzag >> 1) ^ (0u - (zigzag & 1));
+                memcpy(field, &previous, 4);
+            }
+        }
+        return in == end;
+    }
+};
+
+// A compressed block: this header, the compressed numeric columns, then
+// the rest of the records compressed separately
+struct BlockHeader
+{
+    int count;         // Records
+    int numericSize;   // Bytes of numeric columns
+    int numericPacked; // Their compressed size
+};
+
+// Compress count records as a block, appended to out
+void packBlock(const RecordLayout &layout, const char *records, int count, std::string &out)
+{
+    int restSize = count * layout.recordSize;
+    std::vector<char> numbers(layout.numericBound(count) + 1);
+    std::vector<char> rest(restSize + 1);
+    BlockHeader header;
+    header.count = count;
+    header.numericSize = layout.encode(records, count, numbers.data(), rest.data());
+    size_t start = out.size();
+    out.resize(start + sizeof(header) + lzBound(header.numericSize) + lzBound(restSize));
+    char *packed = &out[start + sizeof(header)];
+    header.numericPacked = lzCompress(numbers.data(), header.numericSize, packed);
+    int restPacked = lzCompress(rest.data(), restSize, packed + header.numericPacked);
+    memcpy(&out[start], &header, sizeof(header));
+    out.resize(start + sizeof(header) + header.numericPacked + restPacked);
+}
+
+// Read a block's header; false if it cannot be a block of at most
+// maxCount records
+bool readBlockHeader(const RecordLayout &layout, const char *data, int size, int maxCount, BlockHeader &header)
+{
+    if (size < (int)sizeof(header))
+    {
+        return false;
+    }
+    memcpy(&header, data, sizeof(header));
+    return header.count > 0 && header.count <= maxCount && header.numericSize >= 0 &&
+           header.numericSize <= layout.numericBound(header.count) && header.numericPacked >= 0 &&
+           header.numericPacked <= size - (int)sizeof(header);
+}
+
+// Decompress a block whose header was checked into its records; scratch
+// holds the numeric columns and is reused between calls
+bool unpackBlock(const RecordLayout &layout, const char *data, int size, const BlockHeader &header,
+                 std::vector<char> &scratch, char *records)
+{
+    const char *numbers = data + sizeof(header);
+    const char *rest = numbers + header.numericPacked;
+    scratch.resize(header.numericSize + 1);
+    return lzDecompress(rest, size - (int)sizeof(header) - header.numericPacked, records, header.count * layout.recordSize) &&
+           lzDecompress(numbers, header.numericPacked, scratch.data(), header.numericSize) &&
+           layout.decode(scratch.data(), header.numericSize, header.count, records);
+}
+
+// Storage engine settings. Ratings and new users are written to a
+// log-structured merge tree between saves of the whole database.
+const int STORE_MEMTABLE_LIMIT = 256;   // Changes buffered in memory before a flush
+const int STORE_LOG_LIMIT = 4096;       // Logged changes before the log is rewritten from the memtable
+const int STORE_MAX_SEGMENTS = 4;       // Segments that trigger a compaction
+const int STORE_BLOOM_BITS = 10;        // Bloom filter bits per entry (about 1% false positives)
+const int STORE_BLOOM_HASHES = 7;
+const unsigned int STORE_SEGMENT_MAGIC = 0x47535643; // "CVSG": bare entries (older segments)
+const unsigned int STORE_BLOCKED_SEGMENT_MAGIC = 0x42535643; // "CVSB": compressed blocks
+const int STORE_BLOCK_ENTRIES = 64;   // Entries per compressed segment block
+const unsigned int STORE_MANIFEST_MAGIC = 0x4D535643; // "CVSM"
+const unsigned int STORE_LOG_MAGIC = 0x4C535643;      // "CVSL"
+
+// One stored change: a user's rating of a title, or a user's existence
+struct StoreEntry
+{
+    int userId;
+    char kind;                   // 'R' rating, 'U' user
+    char key[MAX_STRING_LENGTH]; // Title for a rating, username for a user
+    float rating;
+};
+
+// Segments hold entries sorted by user, so the user IDs delta encode to
+// about a byte each
+const RecordLayout storeEntryLayout(sizeof(StoreEntry), {(int)offsetof(StoreEntry, userId), (int)offsetof(StoreEntry, rating)});
+
+// Log-structured store for the changes made since the last save. Changes
+// go to a sorted in-memory table; a full table is frozen and written out in
+// the background as an immutable segment sorted by key, with a Bloom filter
+// so lookups only read segments that may hold the key. Segments are
+// written as compressed blocks of STORE_BLOCK_ENTRIES entries, indexed by
+// their first key: a lookup decompresses the one block that may hold its
+// key. Once
+// STORE_MAX_SEGMENTS pile up they are merged into one, newest value first.
+// A save of the whole database makes every segment obsolete.
+// Every change is also appended to a log and flushed before put returns,
+// so the tables in memory can be rebuilt after a crash; a table's log is
+// removed once its segment is in the manifest.
+// Files: "<db>.lsm" lists the live segments oldest first; "<db>.seg<N>" is
+// a segment; "<db>.wal" logs the memtable and "<db>.wal.prev" the frozen table.
+class RatingStore
+{
+private:
+    // Keys, tables and filters are charged to the change store's memory
+    typedef std::basic_string<char, std::char_traits<char>, TrackedAllocator<char, MEM_CHANGE_STORE>> Key;
+    typedef std::map<Key, StoreEntry, std::less<Key>, TrackedAllocator<std::pair<const Key, StoreEntry>, MEM_CHANGE_STORE>> Table;
+    typedef std::vector<unsigned long long, TrackedAllocator<unsigned long long, MEM_CHANGE_STORE>> Bloom;
+
+    struct SegmentBlock
+    {
+        Key firstKey;
+        long offset; // In the segment file
+        int size;    // Compressed bytes
+    };
+    typedef std::vector<SegmentBlock, TrackedAllocator<SegmentBlock, MEM_CHANGE_STORE>> BlockIndex;
+
+    // Index entry of a segment block in the file
+    struct BlockIndexEntry
+    {
+        int size;
+        StoreEntry first;
+    };
+
+    struct Segment
+    {
+        int id;
+        int count;
+        Bloom bloom;
+        bool blocked;      // Compressed blocks; older segments hold bare entries
+        BlockIndex blocks; // Blocked segments: oldest key first
+    };
+
+    char basePath[MAX_STRING_LENGTH];
+    bool writable;
+    std::mutex lock;
+    std::condition_variable idle;
+    Table memtable;
+    Table frozen; // Being written by the background flush
+    FILE *log;    // Appends to "<db>.wal" while writable
+    int logged;   // Entries in "<db>.wal", counting overwritten ones
+    std::vector<Segment> segments;            // Oldest first
+    int nextSegmentId;
+    bool busy; // A flush or compaction is running
+    WorkStealingPool background;
+    long long flushes;
+    long long compactions;
+    long long bloomSkips;
+    long long unchangedWrites;
+
+    // Keys sort by user ID, then the user's own entry before their ratings
+    // (so a replay creates a user before rating as them), then title
+    static Key sortKey(int userId, char kind, const char *key)
+    {
+        Key result(5, '\0');
+        unsigned int id = (unsigned int)userId ^ 0x80000000u; // Negative IDs sort first
+        result[0] = (char)(id >> 24);
+        result[1] = (char)(id >> 16);
+        result[2] = (char)(id >> 8);
+        result[3] = (char)id;
+        result[4] = (kind == 'U') ? 0 : 1;
+        if (kind == 'R')
+        {
+            result += key;
+        }
+        return result;
+    }
+
+    static Key sortKey(const StoreEntry &entry)
+    {
+        return sortKey(entry.userId, entry.kind, entry.key);
+    }
+
+    // Double hashing: probe i is h1 + i * h2
+    static void bloomHashes(const Key &key, unsigned int &h1, unsigned int &h2)
+    {
+        h1 = 2166136261u;
+        for (size_t i = 0; i < key.size(); i++)
+        {
+            h1 = (h1 ^ (unsigned char)key[i]) * 16777619u;
+        }
+        h2 = h1 * 0x9E3779B1u;
+        h2 ^= h2 >> 15;
+        h2 |= 1;
+    }
+
+    static bool bloomMayContain(const Bloom &bloom, const Key &key)
+    {
+        unsigned int h1, h2;
+        bloomHashes(key, h1, h2);
+        unsigned long long bits = bloom.size() * 64;
+        for (int i = 0; i < STORE_BLOOM_HASHES; i++)
+        {
+            unsigned long long bit = (h1 + (unsigned long long)i * h2) % bits;
+            if ((bloom[bit / 64] & (1ULL << (bit % 64))) == 0)
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    static void bloomAdd(Bloom &bloom, const Key &key)
+    {
+        unsigned int h1, h2;
+        bloomHashes(key, h1, h2);
+        unsigned long long bits = bloom.size() * 64;
+        for (int i = 0; i < STORE_BLOOM_HASHES; i++)
+        {
+            unsigned long long bit = (h1 + (unsigned long long)i * h2) % bits;
+            bloom[bit / 64] |= 1ULL << (bit % 64);
+        }
+    }
+
+    void segmentPath(int id, char *path) const
+    {
+        snprintf(path, MAX_STRING_LENGTH + 16, "%s.seg%d", basePath, id);
+    }
+
+    void manifestPath(char *path) const
+    {
+        snprintf(path, MAX_STRING_LENGTH + 16, "%s.lsm", basePath);
+    }
+
+    // Log of the memtable, or of the frozen table
+    void logPath(bool previous, char *path) const
+    {
+        snprintf(path, MAX_STRING_LENGTH + 16, previous ? "%s.wal.prev" : "%s.wal", basePath);
+    }
+
+    // Write a file under a temporary name and rename it into place
+    static bool replaceFile(const char *path, const std::function<bool(FILE *)> &write)
+    {
+        char tempName[MAX_STRING_LENGTH + 24];
+        snprintf(tempName, sizeof(tempName), "%s.tmp", path);
+        FILE *fp = fopen(tempName, "wb");
+        if (fp == nullptr)
+        {
+            perror("Store write error");
+            return false;
+        }
+        bool ok = write(fp);
+        ok = (fclose(fp) == 0) && ok;
+#ifdef _WIN32
+        remove(path);
+#endif
+        if (!ok || rename(tempName, path) != 0)
+        {
+            perror("Store write error");
+            remove(tempName);
+            return false;
+        }
+        return true;
+    }
+
+    // Segment file: magic, entry count, Bloom filter word count, block
+    // count, the filter, the block index (each block's size and first
+    // entry), then the blocks
+    bool writeSegment(int id, const std::vector<StoreEntry> &entries, Segment &segment)
+    {
+        segment.id = id;
+        segment.count = (int)entries.size();
+        segment.bloom.assign((entries.size() * STORE_BLOOM_BITS + 63) / 64 + 1, 0);
+        for (size_t i = 0; i < entries.size(); i++)
+        {
+            bloomAdd(segment.bloom, sortKey(entries[i]));
+        }
+
+        segment.blocked = true;
+        segment.blocks.clear();
+        std::vector<BlockIndexEntry> index;
+        std::string blocks;
+        for (int first = 0; first < segment.count; first += STORE_BLOCK_ENTRIES)
+        {
+            int count = (segment.count - first < STORE_BLOCK_ENTRIES) ? segment.count - first : STORE_BLOCK_ENTRIES;
+            size_t start = blocks.size();
+            packBlock(storeEntryLayout, (const char *)&entries[first], count, blocks);
+            BlockIndexEntry entry;
+            entry.size = (int)(blocks.size() - start);
+            entry.first = entries[first];
+            index.push_back(entry);
+            SegmentBlock block;
+            block.firstKey = sortKey(entries[first]);
+            block.offset = (long)start; // Moved past the header below
+            block.size = entry.size;
+            segment.blocks.push_back(block);
+        }
+        long headerSize = (long)(4 * sizeof(int) + segment.bloom.size() * sizeof(unsigned long long) +
+                                 index.size() * sizeof(BlockIndexEntry));
+        for (size_t b = 0; b < segment.blocks.size(); b++)
+        {
+            segment.blocks[b].offset += headerSize;
+        }
+
+        char path[MAX_STRING_LENGTH + 16];
+        segmentPath(id, path);
+        return replaceFile(path, [&segment, &index, &blocks](FILE *fp)
+                           {
+            int words = (int)segment.bloom.size();
+            int blockCount = (int)index.size();
+            return fwrite(&STORE_BLOCKED_SEGMENT_MAGIC, sizeof(unsigned int), 1, fp) == 1 &&
+                   fwrite(&segment.count, sizeof(int), 1, fp) == 1 &&
+                   fwrite(&words, sizeof(int), 1, fp) == 1 &&
+                   fwrite(&blockCount, sizeof(int), 1, fp) == 1 &&
+                   fwrite(segment.bloom.data(), sizeof(unsigned long long), words, fp) == (size_t)words &&
+                   fwrite(index.data(), sizeof(BlockIndexEntry), index.size(), fp) == index.size() &&
+                   fwrite(blocks.data(), 1, blocks.size(), fp) == blocks.size(); });
+    }
+
+    // Open a segment and read its header and block index; the file is
+    // left at the first entry or block
+    FILE *openSegment(int id, Segment &segment) const
+    {
+        char path[MAX_STRING_LENGTH + 16];
+        segmentPath(id, path);
+        FILE *fp = fopen(path, "rb");
+        unsigned int magic;
+        int words;
+        int blockCount = 0;
+        bool valid = fp != nullptr && fread(&magic, sizeof(unsigned int), 1, fp) == 1 &&
+                     (magic == STORE_SEGMENT_MAGIC || magic == STORE_BLOCKED_SEGMENT_MAGIC) &&
+                     fread(&segment.count, sizeof(int), 1, fp) == 1 && fread(&words, sizeof(int), 1, fp) == 1 &&
+                     segment.count >= 0 && words >= 1;
+        if (valid && magic == STORE_BLOCKED_SEGMENT_MAGIC)
+        {
+            valid = fread(&blockCount, sizeof(int), 1, fp) == 1 &&
+                    blockCount == (segment.count + STORE_BLOCK_ENTRIES - 1) / STORE_BLOCK_ENTRIES;
+        }
+        if (!valid)
+        {
+            if (fp != nullptr)
+            {
+                fclose(fp);
+            }
+            return nullptr;
+        }
+        segment.id = id;
+        segment.blocked = magic == STORE_BLOCKED_SEGMENT_MAGIC;
+        segment.bloom.resize(words);
+        std::vector<BlockIndexEntry> index(blockCount);
+        if (fread(segment.bloom.data(), sizeof(unsigned long long), words, fp) != (size_t)words ||
+            fread(index.data(), sizeof(BlockIndexEntry), blockCount, fp) != (size_t)blockCount)
+        {
+            fclose(fp);
+            return nullptr;
+        }
+        segment.blocks.clear();
+        long offset = ftell(fp);
+        for (int b = 0; b < blockCount; b++)
+        {
+            SegmentBlock block;
+            block.firstKey = sortKey(index[b].first);
+            block.offset = offset;
+            block.size = index[b].size;
+            segment.blocks.push_back(block);
+            offset += index[b].size;
+        }
+        return fp;
+    }
+
+    // Decompress one block of a segment
+    static bool readBlock(FILE *fp, const SegmentBlock &block, std::vector<StoreEntry> &entries)
+    {
+        std::vector<char> data(block.size > 0 ? block.size : 0);
+        std::vector<char> scratch;
+        BlockHeader header;
+        if (block.size <= 0 || fseek(fp, block.offset, SEEK_SET) != 0 ||
+            fread(data.data(), 1, block.size, fp) != (size_t)block.size ||
+            !readBlockHeader(storeEntryLayout, data.data(), block.size, STORE_BLOCK_ENTRIES, header))
+        {
+            return false;
+        }
+        entries.resize(header.count);
+        return unpackBlock(storeEntryLayout, data.data(), block.size, header, scratch, (char *)entries.data());
+    }
+
+    // Read every entry of an opened segment. A damaged segment yields the
+    // entries before the damage.
+    static bool readEntries(FILE *fp, const Segment &segment, std::vector<StoreEntry> &entries)
+    {
+        entries.clear();
+        if (!segment.blocked)
+        {
+            StoreEntry entry;
+            for (int e = 0; e < segment.count; e++)
+            {
+                if (fread(&entry, sizeof(entry), 1, fp) != 1)
+                {
+                    return false;
+                }
+                entries.push_back(entry);
+            }
+            return true;
+        }
+        std::vector<StoreEntry> block;
+        for (size_t b = 0; b < segment.blocks.size(); b++)
+        {
+            if (!readBlock(fp, segment.blocks[b], block))
+            {
+                return false;
+            }
+            entries.insert(entries.end(), block.begin(), block.end());
+        }
+        return (int)entries.size() == segment.count;
+    }
+
+    static long entryOffset(const Segment &segment, int index)
+    {
+        return (long)(2 * sizeof(int) + sizeof(unsigned int) + segment.bloom.size() * sizeof(unsigned long long) +
+                      (size_t)index * sizeof(StoreEntry));
+    }
+
+    // Binary search a block of entries for a key
+    static bool findInEntries(const std::vector<StoreEntry> &entries, const Key &key, StoreEntry &found)
+    {
+        int low = 0, high = (int)entries.size() - 1;
+        while (low <= high)
+        {
+            int middle = (low + high) / 2;
+            int order = sortKey(entries[middle]).compare(key);
+            if (order == 0)
+            {
+                found = entries[middle];
+                return true;
+            }
+            else if (order < 0)
+            {
+                low = middle + 1;
+            }
+            else
+            {
+                high = middle - 1;
+            }
+        }
+        return false;
+    }
+
+    // Binary search one segment file for a key. Blocked segments only
+    // decompress the last block whose first key is not past it.
+    bool findInSegment(const Segment &segment, const Key &key, StoreEntry &found) const
+    {
+        char path[MAX_STRING_LENGTH + 16];
+        segmentPath(segment.id, path);
+        FILE *fp = fopen(path, "rb");
+        if (fp == nullptr)
+        {
+            return false;
+        }
+        bool hit = false;
+        if (segment.blocked)
+        {
+            int low = 0, high = (int)segment.blocks.size() - 1, pick = -1;
+            while (low <= high)
+            {
+                int middle = (low + high) / 2;
+                if (segment.blocks[middle].firstKey.compare(key) <= 0)
+                {
+                    pick = middle;
+                    low = middle + 1;
+                }
+                else
+                {
+                    high = middle - 1;
+                }
+            }
+            std::vector<StoreEntry> entries;
+            hit = pick != -1 && readBlock(fp, segment.blocks[pick], entries) && findInEntries(entries, key, found);
+            fclose(fp);
+            return hit;
+        }
+
+        int low = 0, high = segment.count - 1;
+        while (low <= high && !hit)
+        {
+            int middle = (low + high) / 2;
+            StoreEntry entry;
+            if (fseek(fp, entryOffset(segment, middle), SEEK_SET) != 0 || fread(&entry, sizeof(entry), 1, fp) != 1)
+            {
+                break;
+            }
+            int order = sortKey(entry).compare(key);
+            if (order == 0)
+            {
+                found = entry;
+                hit = true;
+            }
+            else if (order < 0)
+            {
+                low = middle + 1;
+            }
+            else
+            {
+                high = middle - 1;
+            }
+        }
+        fclose(fp);
+        return hit;
+    }
+
+    // Newest stored value of a key (caller holds the lock)
+    bool findLocked(const Key &key, StoreEntry &found)
+    {
+        Table::const_iterator it = memtable.find(key);
+        if (it != memtable.end() || (it = frozen.find(key)) != frozen.end())
+        {
+            found = it->second;
+            return true;
+        }
+        for (int i = (int)segments.size() - 1; i >= 0; i--)
+        {
+            if (!bloomMayContain(segments[i].bloom, key))
+            {
+                bloomSkips++;
+                continue;
+            }
+            if (findInSegment(segments[i], key, found))
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Manifest: magic, next segment ID, segment count, IDs oldest first
+    // (caller holds the lock)
+    bool writeManifestLocked()
+    {
+        char path[MAX_STRING_LENGTH + 16];
+        manifestPath(path);
+        int count = (int)segments.size();
+        std::vector<int> ids;
+        for (int i = 0; i < count; i++)
+        {
+            ids.push_back(segments[i].id);
+        }
+        int next = nextSegmentId;
+        return replaceFile(path, [count, next, &ids](FILE *fp)
+                           { return fwrite(&STORE_MANIFEST_MAGIC, sizeof(unsigned int), 1, fp) == 1 &&
+                                    fwrite(&next, sizeof(int), 1, fp) == 1 &&
+                                    fwrite(&count, sizeof(int), 1, fp) == 1 &&
+                                    (count == 0 || fwrite(ids.data(), sizeof(int), count, fp) == (size_t)count); });
+    }
+
+    void removeSegmentFile(int id) const
+    {
+        char path[MAX_STRING_LENGTH + 16];
+        segmentPath(id, path);
+        remove(path);
+    }
+
+    // Merge segments [0, count) into one. Every input is sorted, so a
+    // single pass picks the smallest key and keeps the newest value of it.
+    bool mergeSegments(const std::vector<Segment> &inputs, int id, Segment &merged)
+    {
+        int count = (int)inputs.size();
+        std::vector<std::vector<StoreEntry>> entries(count);
+        std::vector<size_t> next(count, 0);
+        bool ok = true;
+        for (int i = 0; i < count && ok; i++)
+        {
+            Segment header;
+            FILE *fp = openSegment(inputs[i].id, header);
+            ok = fp != nullptr && readEntries(fp, header, entries[i]);
+            if (fp != nullptr)
+            {
+                fclose(fp);
+            }
+        }
+
+        std::vector<StoreEntry> output;
+        while (ok)
+        {
+            int pick = -1;
+            Key smallest;
+            for (int i = count - 1; i >= 0; i--) // Newest first wins ties
+            {
+                if (next[i] < entries[i].size() && (pick == -1 || sortKey(entries[i][next[i]]) < smallest))
+                {
+                    pick = i;
+                    smallest = sortKey(entries[i][next[i]]);
+                }
+            }
+            if (pick == -1)
+            {
+                break;
+            }
+            output.push_back(entries[pick][next[pick]]);
+            for (int i = 0; i < count; i++)
+            {
+                if (next[i] < entries[i].size() && sortKey(entries[i][next[i]]) == smallest)
+                {
+                    next[i]++;
+                }
+            }
+        }
+        return ok && writeSegment(id, output, merged);
+    }
+
+    // Log file: magic, then whole entries oldest first
+    static bool writeLog(const char *path, const Table &table)
+    {
+        return replaceFile(path, [&table](FILE *fp)
+                           {
+            bool ok = fwrite(&STORE_LOG_MAGIC, sizeof(unsigned int), 1, fp) == 1;
+            for (Table::const_iterator it = table.begin(); it != table.end() && ok; ++it)
+            {
+                ok = fwrite(&it->second, sizeof(StoreEntry), 1, fp) == 1;
+            }
+            return ok; });
+    }
+
+    // Read a log into the memtable, passing each entry to apply. A crash
+    // can leave a partial entry at the end, which is ignored.
+    int replayLog(bool previous, const std::function<void(const StoreEntry &)> &apply)
+    {
+        char path[MAX_STRING_LENGTH + 16];
+        logPath(previous, path);
+        FILE *fp = fopen(path, "rb");
+        if (fp == nullptr)
+        {
+            return 0;
+        }
+        unsigned int magic;
+        int replayed = 0;
+        StoreEntry entry;
+        if (fread(&magic, sizeof(unsigned int), 1, fp) != 1 || magic != STORE_LOG_MAGIC)
+        {
+            std::cout << "Warning: Ignoring an invalid store log." << std::endl;
+        }
+        else
+        {
+            while (fread(&entry, sizeof(StoreEntry), 1, fp) == 1)
+            {
+                if ((entry.kind != 'R' && entry.kind != 'U') || memchr(entry.key, '\0', MAX_STRING_LENGTH) == nullptr)
+                {
+                    std::cout << "Warning: Store log is damaged after " << replayed << " changes." << std::endl;
+                    break;
+                }
+                apply(entry);
+                memtable[sortKey(entry)] = entry;
+                replayed++;
+            }
+        }
+        fclose(fp);
+        return replayed;
+    }
+
+    // Start "<db>.wal" over with what is in the memtable (caller holds the lock)
+    void startLogLocked()
+    {
+        if (log != nullptr)
+        {
+            fclose(log);
+            log = nullptr;
+        }
+        char path[MAX_STRING_LENGTH + 16];
+        logPath(false, path);
+        if (writeLog(path, memtable))
+        {
+            log = fopen(path, "ab");
+        }
+        logged = (int)memtable.size();
+        if (log == nullptr)
+        {
+            std::cout << "Warning: Changes are not logged until the next flush." << std::endl;
+        }
+    }
+
+    // Freeze the memtable for a flush and give it its own log. Changes
+    // left by a failed flush stay frozen, below the newer ones.
+    void freezeLocked()
+    {
+        char previous[MAX_STRING_LENGTH + 16];
+        logPath(true, previous);
+        if (frozen.empty())
+        {
+            char current[MAX_STRING_LENGTH + 16];
+            logPath(false, current);
+            if (log != nullptr)
+            {
+                fclose(log);
+                log = nullptr;
+            }
+            remove(previous);
+            rename(current, previous);
+            frozen.swap(memtable);
+        }
+        else
+        {
+            for (Table::const_iterator it = memtable.begin(); it != memtable.end(); ++it)
+            {
+                frozen[it->first] = it->second;
+            }
+            memtable.clear();
+            writeLog(previous, frozen);
+        }
+        startLogLocked();
+    }
+
+    // Background work: write frozen tables out and compact, until there
+    // is nothing left to do
+    void backgroundWork()
+    {
+        std::unique_lock<std::mutex> guard(lock);
+        while (!frozen.empty())
+        {
+            std::vector<StoreEntry> entries;
+            for (Table::const_iterator it = frozen.begin(); it != frozen.end(); ++it)
+            {
+                entries.push_back(it->second);
+            }
+            int id = nextSegmentId++;
+            guard.unlock();
+            Segment segment;
+            bool written = writeSegment(id, entries, segment);
+            guard.lock();
+            if (!written)
+            {
+                break; // Keep the changes in memory; the next save covers them
+            }
+            segments.push_back(segment);
+            frozen.clear();
+            if (writeManifestLocked())
+            {
+                char previous[MAX_STRING_LENGTH + 16];
+                logPath(true, previous);
+                remove(previous); // The segment holds the frozen table's changes now
+            }
+            flushes++;
+
+            if ((int)segments.size() >= STORE_MAX_SEGMENTS)
+            {
+                std::vector<Segment> inputs = segments;
+                int mergedId = nextSegmentId++;
+                guard.unlock();
+                Segment merged;
+                bool compacted = mergeSegments(inputs, mergedId, merged);
+                guard.lock();
+                if (compacted)
+                {
+                    // Flushes only append, so the inputs are still the oldest segments
+                    segments.erase(segments.begin(), segments.begin() + inputs.size());
+                    segments.insert(segments.begin(), merged);
+                    writeManifestLocked();
+                    for (size_t i = 0; i < inputs.size(); i++)
+                    {
+                        removeSegmentFile(inputs[i].id);
+                    }
+                    compactions++;
+                }
+            }
+
+            if ((int)memtable.size() >= STORE_MEMTABLE_LIMIT)
+            {
+                freezeLocked();
+            }
+        }
+        busy = false;
+        idle.notify_all();
+    }
+
+    void waitIdle(std::unique_lock<std::mutex> &guard)
+    {
+        idle.wait(guard, [this]()
+                  { return !busy; });
+    }
+
+public:
+    RatingStore() : writable(false), log(nullptr), logged(0), nextSegmentId(1), busy(false), background(1),
+                    flushes(0), compactions(0), bloomSkips(0), unchangedWrites(0)
+    {
+        basePath[0] = '\0';
+    }
+
+    ~RatingStore()
+    {
+        close();
+    }
+
+    // Replay every stored change, oldest segment first and then the logs
+    // of the tables that were in memory, on top of the database file at
+    // dbPath. Returns the number of changes replayed.
+    int load(const char *dbPath, const std::function<void(const StoreEntry &)> &apply)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        strncpy(basePath, dbPath, MAX_STRING_LENGTH - 1);
+        basePath[MAX_STRING_LENGTH - 1] = '\0';
+        segments.clear();
+        memtable.clear();
+        nextSegmentId = 1;
+
+        char path[MAX_STRING_LENGTH + 16];
+        manifestPath(path);
+        FILE *fp = fopen(path, "rb");
+        unsigned int magic;
+        int count = 0;
+        bool complete = false;
+        std::vector<int> ids;
+        if (fp != nullptr)
+        {
+            if (fread(&magic, sizeof(unsigned int), 1, fp) != 1 || magic != STORE_MANIFEST_MAGIC ||
+                fread(&nextSegmentId, sizeof(int), 1, fp) != 1 || fread(&count, sizeof(int), 1, fp) != 1 || count < 0)
+            {
+                std::cout << "Warning: Ignoring an invalid store manifest." << std::endl;
+                nextSegmentId = 1;
+                count = 0;
+            }
+            ids.resize(count);
+            complete = fread(ids.data(), sizeof(int), count, fp) == (size_t)count;
+            fclose(fp);
+        }
+
+        int replayed = 0;
+        for (int i = 0; i < count && complete; i++)
+        {
+            Segment segment;
+            FILE *segmentFile = openSegment(ids[i], segment);
+            if (segmentFile == nullptr)
+            {
+                std::cout << "Warning: Store segment " << ids[i] << " is missing or damaged." << std::endl;
+                continue;
+            }
+            std::vector<StoreEntry> entries;
+            readEntries(segmentFile, segment, entries); // Replays what can be read of a damaged segment
+            fclose(segmentFile);
+            for (size_t e = 0; e < entries.size(); e++)
+            {
+                apply(entries[e]);
+                replayed++;
+            }
+            segments.push_back(segment);
+        }
+        replayed += replayLog(true, apply);
+        replayed += replayLog(false, apply);
+        return replayed;
+    }
+
+    // Start taking changes for the database file at dbPath (background
+    // flushes and compactions)
+    void open(const char *dbPath)
+    {
+        if (writable)
+        {
+            return;
+        }
+        std::lock_guard<std::mutex> guard(lock);
+        if (strcmp(basePath, dbPath) != 0)
+        {
+            strncpy(basePath, dbPath, MAX_STRING_LENGTH - 1); // Nothing was loaded for this file
+            basePath[MAX_STRING_LENGTH - 1] = '\0';
+            segments.clear();
+            memtable.clear();
+        }
+        // One log for everything replayed from both logs; the previous
+        // one goes once the new one is in place
+        startLogLocked();
+        char previous[MAX_STRING_LENGTH + 16];
+        logPath(true, previous);
+        remove(previous);
+        writable = true;
+        background.start();
+    }
+
+    bool isOpen() const { return writable; }
+
+    // Record a change. Writes that would not change the stored value are
+    // dropped; the Bloom filters keep that check cheap for new keys.
+    void put(const StoreEntry &entry)
+    {
+        if (!writable)
+        {
+            return;
+        }
+        std::lock_guard<std::mutex> guard(lock);
+        Key key = sortKey(entry);
+        StoreEntry current;
+        if (findLocked(key, current) && current.rating == entry.rating && strcmp(current.key, entry.key) == 0)
+        {
+            unchangedWrites++;
+            return;
+        }
+        if (log != nullptr && (fwrite(&entry, sizeof(StoreEntry), 1, log) != 1 || fflush(log) != 0))
+        {
+            perror("Store log error");
+        }
+        memtable[key] = entry;
+        logged++;
+        if ((int)memtable.size() >= STORE_MEMTABLE_LIMIT && !busy)
+        {
+            freezeLocked();
+            busy = true;
+            background.submit([this]()
+                              { backgroundWork(); });
+        }
+        else if (logged >= STORE_LOG_LIMIT)
+        {
+            startLogLocked(); // The same keys keep changing: keep only their newest values
+        }
+    }
+
+    // Newest stored value of a user's rating of a title
+    bool findRating(int userId, const char *title, float &rating)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        StoreEntry entry;
+        if (!findLocked(sortKey(userId, 'R', title), entry))
+        {
+            return false;
+        }
+        rating = entry.rating;
+        return true;
+    }
+
+    // The database file at path now holds every change: drop them all
+    void checkpoint(const char *path)
+    {
+        if (basePath[0] == '\0' || strcmp(path, basePath) != 0)
+        {
+            return;
+        }
+        std::unique_lock<std::mutex> guard(lock);
+        waitIdle(guard);
+        memtable.clear();
+        frozen.clear();
+        std::vector<Segment> obsolete;
+        obsolete.swap(segments);
+        writeManifestLocked();
+        for (size_t i = 0; i < obsolete.size(); i++)
+        {
+            removeSegmentFile(obsolete[i].id);
+        }
+        char logFile[MAX_STRING_LENGTH + 16];
+        logPath(true, logFile);
+        remove(logFile);
+        if (writable)
+        {
+            startLogLocked();
+        }
+        else
+        {
+            logPath(false, logFile);
+            remove(logFile);
+        }
+    }
+
+    // Write out what is still in memory and stop the background worker
+    void close()
+    {
+        if (!writable)
+        {
+            return;
+        }
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            waitIdle(guard);
+            if (!memtable.empty())
+            {
+                freezeLocked();
+                busy = true;
+                guard.unlock();
+                backgroundWork();
+            }
+        }
+        background.shutdown();
+        if (log != nullptr)
+        {
+            fclose(log);
+            log = nullptr;
+        }
+        writable = false;
+    }
+
+    void displayStats()
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        long long stored = 0;
+        for (size_t i = 0; i < segments.size(); i++)
+        {
+            stored += segments[i].count;
+        }
+        std::cout << "Change store: " << memtable.size() << " changes in memory, " << segments.size()
+                  << " segments with " << stored << " changes" << std::endl;
+        std::cout << "Flushes: " << flushes << ", Compactions: " << compactions
+                  << ", Bloom filter skips: " << bloomSkips << ", Unchanged writes dropped: " << unchangedWrites << std::endl;
+    }
+};
+
+// Instrumentation settings. Every thread counts into its own slot, and the
+// slots are merged when statistics are read.
+const int MAX_METRICS_THREADS = 64;  // Threads that are counted
+const int HISTOGRAM_SUB_BUCKETS = 8; // Buckets per power of two (within 12.5%)
+const int HISTOGRAM_BUCKETS = HISTOGRAM_SUB_BUCKETS * 40; // Up to 2^40 ns (about 18 minutes)
+const char *METRICS_FILENAME = "movies_database.prom";
+const double METRICS_DUMP_INTERVAL = 10.0; // Seconds between dumps in server mode
+
+// Instrumented operations: menu entry points, then protocol queries
+enum Operation
+{
+    OP_SEARCH_TITLE,
+    OP_SEARCH_YEAR,
+    OP_SEARCH_GENRE,
+    OP_SEARCH_DIRECTOR,
+    OP_SIMILAR,
+    OP_RECOMMEND,
+    OP_RATE,
+    OP_ADD_MOVIE,
+    OP_DELETE_MOVIE,
+    OP_SORT,
+    OP_TOP_RATED,
+    OP_DUPLICATES,
+    OP_PRECOMPUTE,
+    OP_FLUSH_WRITES,
+    OP_SAVE,
+    OP_LOAD,
+    OP_RELOAD,
+    OP_FACETS,
+    OP_QUERY_SEARCH,
+    OP_QUERY_GENRE,
+    OP_QUERY_DIRECTOR,
+    OP_QUERY_YEAR,
+    OP_QUERY_SIMILAR,
+    OP_QUERY_RECOMMEND,
+    OP_QUERY_RATE,
+    OP_QUERY_FACETS,
+    OPERATION_COUNT
+};
+
+// Name of each operation, and which of its calls are timed: a call is
+// timed when the thread's call count ANDed with the mask is zero. Timing
+// one in 16 or 64 of the sub-microsecond queries keeps the two clock
+// reads out of their cost; slower operations are timed every call.
+struct OperationInfo
+{
+    const char *name;
+    unsigned int sampleMask;
+};
+
+const OperationInfo OPERATIONS[OPERATION_COUNT] = {
+    {"search_title", 15}, {"search_year", 15}, {"search_genre", 15}, {"search_director", 15},
+    {"similar", 15}, {"recommend", 15}, {"rate", 15}, {"add_movie", 0}, {"delete_movie", 0},
+    {"sort", 0}, {"top_rated", 0}, {"duplicates", 0}, {"precompute", 0}, {"flush_writes", 0},
+    {"save", 0}, {"load", 0}, {"reload", 0}, {"facets", 15}, {"query_search", 63}, {"query_genre", 63},
+    {"query_director", 63}, {"query_year", 63}, {"query_similar", 63}, {"query_recommend", 63},
+    {"query_rate", 63}, {"query_facets", 63}};
+
+// Counters that are not tied to one operation
+enum MetricsCounter
+{
+    COUNTER_INDEX_HITS,   // Snapshot index lookups that found the key
+    COUNTER_INDEX_MISSES, // ...and that did not
+    METRICS_COUNTER_COUNT
+};
+
+std::atomic<bool> metricsSlotClaimed[MAX_METRICS_THREADS];
+
+// Metrics slot owned by one thread, released when the thread exits. A
+// later thread may take the slot over and keeps adding to its counts.
+struct MetricsThread
+{
+    int index;
+
+    MetricsThread() : index(-1)
+    {
+        for (int i = 0; i < MAX_METRICS_THREADS; i++)
+        {
+            bool expected = false;
+            if (metricsSlotClaimed[i].compare_exchange_strong(expected, true))
+            {
+                index = i;
+                break;
+            }
+        }
+    }
+
+    ~MetricsThread()
+    {
+        if (index != -1)
+        {
+            metricsSlotClaimed[index] = false;
+        }
+    }
+};
+
+int currentMetricsThread()
+{
+    thread_local MetricsThread thread;
+    return thread.index;
+}
+
+// Counts of one thread. Only the owning thread writes them, so updates are
+// a plain load and store; readers may see a count a moment late.
+struct MetricsSlot
+{
+    std::atomic<long long> calls[OPERATION_COUNT];
+    std::atomic<long long> rowsScanned[OPERATION_COUNT];
+    std::atomic<long long> rowsReturned[OPERATION_COUNT];
+    std::atomic<long long> timedNanos[OPERATION_COUNT];
+    std::atomic<long long> histogram[OPERATION_COUNT][HISTOGRAM_BUCKETS];
+    std::atomic<long long> counters[METRICS_COUNTER_COUNT];
+
+    static void add(std::atomic<long long> &counter, long long amount)
+    {
+        counter.store(counter.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+    }
+};
+
+// Log-linear latency histogram buckets, as in HDR histograms: values below
+// HISTOGRAM_SUB_BUCKETS ns get a bucket each, and every power of two above
+// is split into HISTOGRAM_SUB_BUCKETS equal buckets
+int histogramBucket(long long nanos)
+{
+    if (nanos < HISTOGRAM_SUB_BUCKETS)
+    {
+        return nanos < 0 ? 0 : (int)nanos;
+    }
+    int top = 0; // Highest set bit
+    while ((nanos >> (top + 1)) != 0)
+    {
+        top++;
+    }
+    int bucket = (top - 2) * HISTOGRAM_SUB_BUCKETS + (int)((nanos >> (top - 3)) & (HISTOGRAM_SUB_BUCKETS - 1));
+    return bucket < HISTOGRAM_BUCKETS ? bucket : HISTOGRAM_BUCKETS - 1;
+}
+
+// Largest value that falls in a bucket
+long long histogramBucketLimit(int bucket)
+{
+    if (bucket < HISTOGRAM_SUB_BUCKETS)
+    {
+        return bucket;
+    }
+    int top = bucket / HISTOGRAM_SUB_BUCKETS + 2;
+    long long width = 1LL << (top - 3);
+    return (HISTOGRAM_SUB_BUCKETS + bucket % HISTOGRAM_SUB_BUCKETS) * width + width - 1;
+}
+
+// Per-operation call counts, rows scanned and returned, and latency
+// histograms, merged from the slots of every thread on read
+class Metrics
+{
+private:
+    std::atomic<MetricsSlot *> slots[MAX_METRICS_THREADS];
+    unsigned long long id; // Never reused, so a thread's cached slot cannot outlive its instance
+
+    static std::atomic<unsigned long long> nextId;
+
+public:
+    // Merged view of all slots
+    struct Totals
+    {
+        long long calls[OPERATION_COUNT];
+        long long rowsScanned[OPERATION_COUNT];
+        long long rowsReturned[OPERATION_COUNT];
+        long long timedNanos[OPERATION_COUNT];
+        long long timedCalls[OPERATION_COUNT];
+        long long histogram[OPERATION_COUNT][HISTOGRAM_BUCKETS];
+        long long counters[METRICS_COUNTER_COUNT];
+
+        // Latency at a percentile (0-100) of the timed calls, in ns
+        long long percentile(int op, double percent) const
+        {
+            long long rank = (long long)(timedCalls[op] * percent / 100.0);
+            rank = (rank < timedCalls[op]) ? rank : timedCalls[op] - 1;
+            long long seen = 0;
+            for (int b = 0; b < HISTOGRAM_BUCKETS; b++)
+            {
+                seen += histogram[op][b];
+                if (seen > rank)
+                {
+                    return histogramBucketLimit(b);
+                }
+            }
+            return 0;
+        }
+    };
+
+    Metrics() : id(++nextId)
+    {
+        for (int i = 0; i < MAX_METRICS_THREADS; i++)
+        {
+            slots[i] = nullptr;
+        }
+    }
+
+    ~Metrics()
+    {
+        for (int i = 0; i < MAX_METRICS_THREADS; i++)
+        {
+            MetricsSlot *slot = slots[i].load();
+            if (slot != nullptr)
+            {
+                trackMemory(MEM_METRICS, -(long long)sizeof(MetricsSlot));
+                delete slot;
+            }
+        }
+    }
+
+    // Slot of the calling thread, allocated on its first use; nullptr when
+    // every slot is taken (that thread is not counted)
+    MetricsSlot *slot()
+    {
+        // The last instance a thread counted into is remembered, so the
+        // common case is two thread-local reads
+        thread_local unsigned long long cachedId = 0;
+        thread_local MetricsSlot *cachedSlot = nullptr;
+        if (cachedId == id)
+        {
+            return cachedSlot;
+        }
+        int thread = currentMetricsThread();
+        MetricsSlot *mine = nullptr;
+        if (thread != -1)
+        {
+            mine = slots[thread].load(std::memory_order_acquire);
+            if (mine == nullptr)
+            {
+                mine = new MetricsSlot(); // Value-initialized: all counts zero
+                trackMemory(MEM_METRICS, sizeof(MetricsSlot));
+                slots[thread].store(mine, std::memory_order_release);
+            }
+        }
+        cachedId = id;
+        cachedSlot = mine;
+        return mine;
+    }
+
+    void collect(Totals &totals) const
+    {
+        memset(&totals, 0, sizeof(totals));
+        for (int i = 0; i < MAX_METRICS_THREADS; i++)
+        {
+            const MetricsSlot *s = slots[i].load(std::memory_order_acquire);
+            if (s == nullptr)
+            {
+                continue;
+            }
+            for (int op = 0; op < OPERATION_COUNT; op++)
+            {
+                totals.calls[op] += s->calls[op].load(std::memory_order_relaxed);
+                totals.rowsScanned[op] += s->rowsScanned[op].load(std::memory_order_relaxed);
+                totals.rowsReturned[op] += s->rowsReturned[op].load(std::memory_order_relaxed);
+                totals.timedNanos[op] += s->timedNanos[op].load(std::memory_order_relaxed);
+                for (int b = 0; b < HISTOGRAM_BUCKETS; b++)
+                {
+                    long long n = s->histogram[op][b].load(std::memory_order_relaxed);
+                    totals.histogram[op][b] += n;
+                    totals.timedCalls[op] += n;
+                }
+            }
+            for (int c = 0; c < METRICS_COUNTER_COUNT; c++)
+            {
+                totals.counters[c] += s->counters[c].load(std::memory_order_relaxed);
+            }
+        }
+    }
+};
+
+std::atomic<unsigned long long> Metrics::nextId(0);
+
+// Counts one call of an operation for as long as it is in scope, and
+// times it when the call is sampled. Set the rows before it goes out of
+// scope (they stay zero for operations that do not scan). When tracing is
+// on, the operation is also a span named after it.
+class OperationTimer
+{
+private:
+    MetricsSlot *slot;
+    int op;
+    bool timed;
+    std::chrono::steady_clock::time_point start;
+    long long scanned;
+    long long returned;
+    int indexHits;
+    int indexMisses;
+    TraceSpan span;
+
+public:
+    OperationTimer(Metrics &metrics, Operation operation)
+        : slot(metrics.slot()), op(operation), timed(false), scanned(0), returned(0), indexHits(0), indexMisses(0),
+          span(OPERATIONS[operation].name)
+    {
+        if (slot == nullptr)
+        {
+            return;
+        }
+        long long calls = slot->calls[op].load(std::memory_order_relaxed);
+        slot->calls[op].store(calls + 1, std::memory_order_relaxed);
+        if (((unsigned int)calls & OPERATIONS[op].sampleMask) == 0)
+        {
+            timed = true;
+            start = std::chrono::steady_clock::now();
+        }
+    }
+
+    ~OperationTimer()
+    {
+        if (slot == nullptr)
+        {
+            return;
+        }
+        if (timed)
+        {
+            long long nanos = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+            MetricsSlot::add(slot->histogram[op][histogramBucket(nanos)], 1);
+            MetricsSlot::add(slot->timedNanos[op], nanos);
+        }
+        if (scanned != 0 || returned != 0)
+        {
+            MetricsSlot::add(slot->rowsScanned[op], scanned);
+            MetricsSlot::add(slot->rowsReturned[op], returned);
+        }
+        if (indexHits != 0 || indexMisses != 0)
+        {
+            MetricsSlot::add(slot->counters[COUNTER_INDEX_HITS], indexHits);
+            MetricsSlot::add(slot->counters[COUNTER_INDEX_MISSES], indexMisses);
+        }
+    }
+
+    void rows(long long rowsScanned, long long rowsReturned)
+    {
+        scanned = rowsScanned;
+        returned = rowsReturned;
+    }
+
+    void indexLookup(bool found)
+    {
+        (found ? indexHits : indexMisses)++;
+    }
+
+    // Record what the call is about in its trace span
+    void describe(const char *detail)
+    {
+        span.describe(detail);
+    }
+};
+
+// CRC32C (Castagnoli polynomial), the checksum the SSE 4.2 and ARMv8 CRC
+// instructions compute. Without them, a table-driven version handles 8
+// bytes per step.
+const unsigned int CRC32C_POLYNOMIAL = 0x82F63B78; // Bit-reflected
+
+struct Crc32cTable
+{
+    unsigned int entries[8][256];
+
+    Crc32cTable()
+    {
+        for (unsigned int i = 0; i < 256; i++)
+        {
+            unsigned int crc = i;
+            for (int bit = 0; bit < 8; bit++)
+            {
+                crc = (crc >> 1) ^ ((crc & 1) ? CRC32C_POLYNOMIAL : 0);
+            }
+            entries[0][i] = crc;
+        }
+        for (int i = 0; i < 256; i++)
+        {
+            for (int k = 1; k < 8; k++)
+            {
+                entries[k][i] = (entries[k - 1][i] >> 8) ^ entries[0][entries[k - 1][i] & 0xFF];
+            }
+        }
+    }
+};
+
+const Crc32cTable crc32cTable;
+
+// Words are read little-endian, like every other field of the database file
+unsigned int crc32cSoftware(unsigned int crc, const unsigned char *p, size_t size)
+{
+    const unsigned int(*t)[256] = crc32cTable.entries;
+    for (; size >= 8; p += 8, size -= 8)
+    {
+        unsigned int low, high;
+        memcpy(&low, p, 4);
+        memcpy(&high, p + 4, 4);
+        low ^= crc;
+        crc = t[7][low & 0xFF] ^ t[6][(low >> 8) & 0xFF] ^ t[5][(low >> 16) & 0xFF] ^ t[4][low >> 24] ^
+              t[3][high & 0xFF] ^ t[2][(high >> 8) & 0xFF] ^ t[1][(high >> 16) & 0xFF] ^ t[0][high >> 24];
+    }
+    for (; size > 0; p++, size--)
+    {
+        crc = (crc >> 8) ^ t[0][(crc ^ *p) & 0xFF];
+    }
+    return crc;
+}
+
+#if defined(MOVIEDB_CRC32C_SSE42)
+__attribute__((target("sse4.2"))) unsigned int crc32cHardware(unsigned int crc, const unsigned char *p, size_t size)
+{
+    unsigned long long wide = crc;
+    for (; size >= 8; p += 8, size -= 8)
+    {
+        unsigned long long word;
+        memcpy(&word, p, 8);
+        wide = __builtin_ia32_crc32di(wide, word);
+    }
+    crc = (unsigned int)wide;
+    for (; size > 0; p++, size--)
+    {
+        crc = __builtin_ia32_crc32qi(crc, *p);
+    }
+    return crc;
+}
+
+bool crc32cHardwareAvailable()
+{
+    return __builtin_cpu_supports("sse4.2");
+}
+#elif defined(MOVIEDB_CRC32C_ARM)
+unsigned int crc32cHardware(unsigned int crc, const unsigned char *p, size_t size)
+{
+    for (; size >= 8; p += 8, size -= 8)
+    {
+        unsigned long long word;
+        memcpy(&word, p, 8);
+        crc = __crc32cd(crc, word);
+    }
+    for (; size > 0; p++, size--)
+    {
+        crc = __crc32cb(crc, *p);
+    }
+    return crc;
+}
+
+bool crc32cHardwareAvailable()
+{
+    return true; // Compiled for a processor that has it
+}
+#endif
+
+// CRC32C of a buffer. Pass the CRC of the data before it to continue one.
+unsigned int crc32c(const void *data, size_t size, unsigned int crc = 0)
+{
+    const unsigned char *p = (const unsigned char *)data;
+#if defined(MOVIEDB_CRC32C_SSE42) || defined(MOVIEDB_CRC32C_ARM)
+    static const bool hardware = crc32cHardwareAvailable();
+    if (hardware)
+    {
+        return ~crc32cHardware(~crc, p, size);
+    }
+#endif
+    return ~crc32cSoftware(~crc, p, size);
+}
+
+// Database file sections. Version 102 and 103 files hold the signature,
+// the movie and user counts, then nothing but sections: a header with the
+// payload size and its CRC32C, then the payload. Movies and users are
+// stored in chunk sections of about SNAPSHOT_CHUNK_BYTES of records
+// ("MOVS" and "USRS": the position of the first record, then the records;
+// in version 103, the records as a compressed block), so a load can
+// verify and decode them in parallel. Older versions store the records
+// bare and their trailing sections without a checksum.
+const int SNAPSHOT_CHUNK_BYTES = 64 * 1024;
+const int NAME_REMAP_GRAIN = 256; // Movies whose name IDs one load task translates
+
+struct SectionHeader
+{
+    char tag[4];
+    int size;         // Payload bytes
+    unsigned int crc; // CRC32C of the payload
+};
+
+// Columns of the records in compressed chunks: the numbers of a movie,
+// and each user's ID (users are added with increasing IDs), rating
+// values and rating count
+RecordLayout movieLayout()
+{
+    std::vector<int> numeric;
+    numeric.push_back(offsetof(Movie, releaseYear));
+    numeric.push_back(offsetof(Movie, castCount));
+    numeric.push_back(offsetof(Movie, rating));
+    numeric.push_back(offsetof(Movie, duration));
+    numeric.push_back(offsetof(Movie, genreId));
+    numeric.push_back(offsetof(Movie, directorId));
+    for (int i = 0; i < MAX_CAST; i++)
+    {
+        numeric.push_back(offsetof(Movie, castIds) + i * sizeof(int));
+    }
+    numeric.push_back(offsetof(Movie, reserved));
+    return RecordLayout(sizeof(Movie), numeric);
+}
+
+RecordLayout userLayout()
+{
+    std::vector<int> numeric;
+    numeric.push_back(offsetof(User, userId));
+    for (int i = 0; i < MAX_MOVIES; i++)
+    {
+        numeric.push_back(offsetof(User, ratings) + i * sizeof(User::Rating) + offsetof(User::Rating, rating));
+    }
+    numeric.push_back(offsetof(User, ratingCount));
+    return RecordLayout(sizeof(User), numeric);
+}
+
+const RecordLayout movieRecordLayout = movieLayout();
+const RecordLayout userRecordLayout = userLayout();
+
+// Write a section and its checksum
+bool writeSection(FILE *fp, const char tag[4], const void *payload, int size)
+{
+    SectionHeader header;
+    memcpy(header.tag, tag, 4);
+    header.size = size;
+    header.crc = crc32c(payload, size);
+    return fwrite(&header, sizeof(header), 1, fp) == 1 &&
+           (size == 0 || fwrite(payload, 1, size, fp) == (size_t)size);
+}
+
+// Write records as compressed chunk sections. The chunks are compressed
+// on all cores, then written in order.
+bool writeRecordChunks(FILE *fp, const char tag[4], const void *records, int count, const RecordLayout &layout)
+{
+    int perChunk = SNAPSHOT_CHUNK_BYTES / layout.recordSize;
+    if (perChunk < 1)
+    {
+        perChunk = 1;
+    }
+    int chunks = (count + perChunk - 1) / perChunk;
+    std::vector<std::string> payloads(chunks);
+    int cores = WorkStealingPool::defaultWorkerCount();
+    WorkStealingPool pool((chunks < cores) ? (chunks > 0 ? chunks : 1) : cores);
+    pool.parallelFor(chunks, 1, [&](int begin, int end)
+                     {
+        for (int c = begin; c < end; c++)
+        {
+            int first = c * perChunk;
+            int chunk = (count - first < perChunk) ? count - first : perChunk;
+            payloads[c].assign((const char *)&first, sizeof(int));
+            packBlock(layout, (const char *)records + (size_t)first * layout.recordSize, chunk, payloads[c]);
+        } });
+    for (int c = 0; c < chunks; c++)
+    {
+        if (!writeSection(fp, tag, payloads[c].data(), (int)payloads[c].size()))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Database class to manage movies and users
+class MovieDatabase
+{
+private:
+    Movie movies[MAX_MOVIES];
+    int movieCount; // Positions in use, including tombstones
+
+    // Deleting a movie only marks its slot, so every other movie keeps its
+    // position (its ID) and whatever refers to it stays valid. Compaction
+    // closes the gaps once enough of the catalog is dead.
+    bool tombstone[MAX_MOVIES];
+    int tombstoneCount;
+
+    User users[MAX_USERS];
+    int userCount;
+
+    // User ID and username lookups for sessions
+    UserIndex userIndex;
+
+    // Per-movie aggregates of user ratings, kept up to date by rateMovie
+    RatingAggregates ratingAggregates;
+
+    // Live movies per genre, director, decade and rating point, kept up to
+    // date as movies are added and deleted
+    FacetCounts catalogFacets;
+
+    // Time-decayed activity per movie for the trending list
+    TrendingTracker trending;
+
+    // Precomputed recommendations from the batch job
+    RecommendationTable recommendationTable;
+    int layoutVersion; // Bumped whenever movie positions change
+
+    // Cached similarity and recommendation results
+    ResultCache resultCache;
+
+    // Cached search results, stamped with the catalog version
+    QueryCache queryCache;
+    unsigned long long catalogVersion; // Bumped whenever a movie is added, deleted or moved
+
+    // MinHash/LSH index used to flag near-duplicate movies
+    DuplicateDetector duplicates;
+
+    // Concurrent mode: readers query the published snapshot without locks,
+    // writers queue changes that are applied and published in batches
+    std::atomic<CatalogSnapshot *> publishedSnapshot;
+    unsigned long long snapshotVersion;
+    std::vector<SnapshotUserRef> userRows; // Of the last snapshot, by slot; dropped when the user changes
+    EpochManager epochs;
+    std::mutex writerLock; // Serializes applying writes and publishing
+
+    struct PendingWrite
+    {
+        enum Type
+        {
+            ADD_MOVIE,
+            DELETE_MOVIE,
+            RATE_MOVIE
+        } type;
+        Movie movie;                  // ADD_MOVIE
+        char title[MAX_STRING_LENGTH]; // DELETE_MOVIE, RATE_MOVIE
+        int userId;                   // RATE_MOVIE
+        float rating;
+    };
+    std::mutex pendingLock;
+    std::deque<PendingWrite> pendingWrites;
+
+    // Replication: a primary logs every committed change; a follower replays
+    // the primary's log and accepts no writes of its own
+    ReplicationLog *replicationLog; // nullptr unless primary or follower
+    bool follower;
+    unsigned long long appliedSequence; // Last log record reflected in the state
+    long appliedLogOffset;              // Log position just after that record
+    int logSuppressed;                  // Changes made as part of a logged change
+    int logBatchDepth;                  // Inside a write batch: commit at its end
+    long long lastApplyDelay;           // Follower: commit-to-apply time of the last record (us)
+    std::chrono::steady_clock::time_point lastLagReport;
+
+    // Ratings and new users made since the last save, on disk
+    RatingStore changeStore;
+
+    // Call counts, rows and latency histograms of the entry points
+    Metrics metrics;
+
+    // Hot reload of the database file, requested by RELOAD or a file watch
+    std::mutex reloadLock; // One reload at a time
+    std::atomic<bool> reloadRequested;
+    bool writesHeld; // A reload is staging: flushWrites leaves the queue alone (under writerLock)
+
+    // A database file that exists but failed to load. It is moved aside to
+    // "<file>.corrupt" before anything is saved in its place.
+    char damagedFile[MAX_STRING_LENGTH];
+
+    bool loggingChanges() const
+    {
+        return replicationLog != nullptr && !follower && logSuppressed == 0;
+    }
+
+    // Append a committed change to the log (primary only)
+    void logChange(int type, const void *payload, int size)
+    {
+        if (!loggingChanges())
+        {
+            return;
+        }
+        appliedSequence = replicationLog->append(type, payload, size);
+        appliedLogOffset = replicationLog->getOffset();
+        if (logBatchDepth == 0)
+        {
+            replicationLog->commit();
+        }
+    }
+
+    // Keep a rating or a new user in the change store until the next save
+    void storeChange(int userId, char kind, const char *key, float rating)
+    {
+        if (!changeStore.isOpen())
+        {
+            return;
+        }
+        StoreEntry entry;
+        memset(&entry, 0, sizeof(entry));
+        entry.userId = userId;
+        entry.kind = kind;
+        strcpy(entry.key, key);
+        entry.rating = rating;
+        changeStore.put(entry);
+    }
+
+    // Apply the changes stored since the file was saved (after the user
+    // index is built, before the rating aggregates are)
+    int replayChangeStore(const char *filename)
+    {
+        TraceSpan span("replay change store");
+        return changeStore.load(filename, [this](const StoreEntry &entry)
+                                {
+            int slot = findUserSlot(entry.userId);
+            if (entry.kind == 'U' && slot == -1 && userCount < MAX_USERS)
+            {
+                users[userCount].initialize(entry.userId, entry.key);
+                userIndex.insert(userCount, entry.userId, entry.key);
+                userCount++;
+            }
+            else if (entry.kind == 'R' && slot != -1)
+            {
+                users[slot].setRating(entry.key, entry.rating);
+                userRowChanged(slot);
+            } });
+    }
+
+    static LogMovieRef movieRef(int position, const char *title)
+    {
+        LogMovieRef ref;
+        memset(&ref, 0, sizeof(ref));
+        ref.position = position;
+        strcpy(ref.title, title);
+        return ref;
+    }
+
+    // Position a logged movie reference points at, checked by title
+    int resolveMovieRef(const LogMovieRef &ref)
+    {
+        if (ref.position >= 0 && ref.position < movieCount && !tombstone[ref.position] &&
+            strcmp(movies[ref.position].title, ref.title) == 0)
+        {
+            return ref.position;
+        }
+        for (int i = 0; i < movieCount; i++)
+        {
+            if (!tombstone[i] && strcmp(movies[i].title, ref.title) == 0)
+            {
+                return i;
+            }
+        }
+        return -1;
+    }
+
+    // Copy the catalog before a sort so the new order can be logged
+    bool captureOrder(Movie before[])
+    {
+        if (!loggingChanges())
+        {
+            return false;
+        }
+        for (int i = 0; i < movieCount; i++)
+        {
+            before[i] = movies[i];
+        }
+        return true;
+    }
+
+    // Log the order a sort produced. Identical movies are interchangeable.
+    void logReorder(const Movie before[])
+    {
+        TraceSpan span("log reorder");
+        LogReorder reorder;
+        bool taken[MAX_MOVIES] = {false};
+        reorder.count = movieCount;
+        for (int i = 0; i < movieCount; i++)
+        {
+            for (int j = 0; j < movieCount; j++)
+            {
+                if (!taken[j] && memcmp(&movies[i], &before[j], sizeof(Movie)) == 0)
+                {
+                    reorder.order[i] = j;
+                    taken[j] = true;
+                    break;
+                }
+            }
+        }
+        logChange(LOG_REORDER, &reorder, (int)sizeof(int) * (1 + movieCount));
+    }
+
+    void applyReorder(const LogReorder &reorder)
+    {
+        compactCatalog(); // The primary compacts before it sorts, too
+        if (reorder.count != movieCount)
+        {
+            return;
+        }
+        Movie sorted[MAX_MOVIES];
+        bool taken[MAX_MOVIES] = {false};
+        for (int i = 0; i < movieCount; i++)
+        {
+            int from = reorder.order[i];
+            if (from < 0 || from >= movieCount || taken[from])
+            {
+                return; // Not a permutation
+            }
+            taken[from] = true;
+            sorted[i] = movies[from];
+        }
+        for (int i = 0; i < movieCount; i++)
+        {
+            movies[i] = sorted[i];
+        }
+        catalogReordered();
+    }
+
+    // Replay one log record. Sizes are checked so a bad record is skipped.
+    void applyLogRecord(const LogRecordHeader &header, const char *payload)
+    {
+        switch (header.type)
+        {
+        case LOG_ADD_MOVIE:
+            if (header.size == (int)sizeof(Movie) || header.size == (int)MOVIE_RECORD_V100)
+            {
+                Movie movie;
+                memcpy(&movie, payload, header.size); // Name IDs are looked up again
+                int dup;
+                float similarity;
+                insertMovie(movie, dup, similarity);
+            }
+            break;
+        case LOG_DELETE_MOVIE:
+            if (header.size == (int)sizeof(LogMovieRef))
+            {
+                LogMovieRef ref;
+                memcpy(&ref, payload, sizeof(ref));
+                int position = resolveMovieRef(ref);
+                if (position != -1)
+                {
+                    deleteMovieAt(position);
+                }
+            }
+            break;
+        case LOG_RATE_MOVIE:
+            if (header.size == (int)sizeof(LogRating))
+            {
+                LogRating change;
+                memcpy(&change, payload, sizeof(change));
+                Movie *movie = getMovieByTitle(change.title);
+                int userSlot = findUserSlot(change.userId);
+                if (movie != nullptr && userSlot != -1)
+                {
+                    applyRating(userSlot, *movie, change.rating);
+                }
+            }
+            break;
+        case LOG_ADD_USER:
+            if (header.size == (int)sizeof(LogUser))
+            {
+                LogUser user;
+                memcpy(&user, payload, sizeof(user));
+                if (findUserSlot(user.userId) == -1 && userCount < MAX_USERS)
+                {
+                    User newUser;
+                    newUser.initialize(user.userId, user.username);
+                    userIndex.insert(userCount, user.userId, user.username);
+                    users[userCount++] = newUser;
+                }
+            }
+            break;
+        case LOG_MERGE_MOVIES:
+            if (header.size == (int)sizeof(LogMerge))
+            {
+                LogMerge merge;
+                memcpy(&merge, payload, sizeof(merge));
+                int keep = resolveMovieRef(merge.keep);
+                int duplicate = resolveMovieRef(merge.duplicate);
+                if (keep != -1 && duplicate != -1 && keep != duplicate)
+                {
+                    mergeMovieInto(keep, duplicate);
+                }
+            }
+            break;
+        case LOG_REORDER:
+            if (header.size >= (int)sizeof(int) && header.size <= (int)sizeof(LogReorder))
+            {
+                LogReorder reorder;
+                memcpy(&reorder, payload, header.size);
+                if (header.size == (int)sizeof(int) * (1 + reorder.count))
+                {
+                    applyReorder(reorder);
+                }
+            }
+            break;
+        }
+        appliedSequence = header.sequence;
+        appliedLogOffset = replicationLog->getOffset();
+        lastApplyDelay = std::chrono::duration_cast<std::chrono::microseconds>(
+                             std::chrono::system_clock::now().time_since_epoch())
+                             .count() -
+                         header.committedAt;
+    }
+
+    // Apply up to maxRecords log records after appliedSequence (caller holds writerLock)
+    int replayLogLocked(int maxRecords)
+    {
+        LogRecordHeader header;
+        char payload[LOG_MAX_PAYLOAD];
+        int applied = 0;
+        while (applied < maxRecords && replicationLog->readNext(header, payload))
+        {
+            if (header.sequence > appliedSequence) // Older records are already in the snapshot
+            {
+                applyLogRecord(header, payload);
+                applied++;
+            }
+        }
+        return applied;
+    }
+
+    // Build and publish a snapshot of the current state (caller holds writerLock)
+    void publishSnapshotLocked()
+    {
+        TraceSpan span("publish snapshot");
+        const CatalogSnapshot *previous = publishedSnapshot.load();
+
+        // Parts that have not changed since the last snapshot are shared with it
+        CatalogMoviesRef catalog;
+        if (previous != nullptr && previous->catalogVersion == catalogVersion)
+        {
+            catalog = previous->catalog;
+        }
+        else
+        {
+            CatalogMovies *copy = new CatalogMovies(movieCount);
+            copy->catalogVersion = catalogVersion;
+            for (int i = 0; i < movieCount; i++)
+            {
+                copy->movies[i] = movies[i];
+                copy->tombstone[i] = tombstone[i];
+            }
+            copy->facets = catalogFacets;
+            copy->facets.compact();
+            copy->buildShards();
+            catalog.reset(copy);
+        }
+        UserIndexRef index;
+        if (previous != nullptr && previous->userIndex->version() == userIndex.version())
+        {
+            index = previous->userIndex;
+        }
+        else
+        {
+            index = std::allocate_shared<UserIndex>(TrackedAllocator<UserIndex, MEM_SNAPSHOTS>(), userIndex);
+        }
+        userRows.resize(userCount);
+        for (int u = 0; u < userCount; u++)
+        {
+            if (userRows[u] == nullptr || userRows[u]->userId != users[u].userId)
+            {
+                SnapshotUser row;
+                row.userId = users[u].userId;
+                strcpy(row.username, users[u].username);
+                findHighestRated(users[u], row.topRated);
+                userRows[u] = std::allocate_shared<SnapshotUser>(TrackedAllocator<SnapshotUser, MEM_SNAPSHOTS>(), row);
+            }
+        }
+
+        CatalogSnapshot *snapshot = new CatalogSnapshot(catalog, userRows, index);
+        snapshot->version = ++snapshotVersion;
+        for (int i = 0; i < movieCount; i++)
+        {
+            snapshot->userScores[i] = getUserScore(movies[i]);
+        }
+
+        CatalogSnapshot *old = publishedSnapshot.exchange(snapshot);
+        if (old != nullptr)
+        {
+            epochs.retire(old);
+        }
+    }
+
+    // A full batch is applied by the thread that queues into it, unless
+    // that thread reads a snapshot; then the next flush applies it (the
+    // server's timer, or the batch runner after each block)
+    void queueWrite(const PendingWrite &write)
+    {
+        bool flush;
+        {
+            std::lock_guard<std::mutex> guard(pendingLock);
+            pendingWrites.push_back(write);
+            flush = pendingWrites.size() >= (size_t)WRITE_BATCH_SIZE;
+        }
+        if (flush && !epochs.reading())
+        {
+            flushWrites();
+        }
+    }
+
+    void catalogLayoutChanged()
+    {
+        layoutVersion++;
+        catalogVersion++;
+    }
+
+    // Movies changed order: ties in similarity are broken by position,
+    // so cached similarity lists may no longer match
+    void catalogReordered()
+    {
+        catalogLayoutChanged();
+        resultCache.invalidateAll(false);
+        duplicates.invalidate();
+    }
+
+    // Compute the signatures of the whole catalog in parallel and index them
+    void rebuildDuplicateIndex()
+    {
+        WorkStealingPool pool;
+        pool.parallelFor(movieCount, 8, [this](int begin, int end)
+                         {
+            for (int i = begin; i < end; i++)
+            {
+                MinHashSignature sig;
+                DuplicateDetector::computeSignature(movies[i], sig);
+                duplicates.setSignature(i, sig);
+            } });
+        duplicates.rebuildIndex(movieCount);
+        for (int i = 0; i < movieCount; i++)
+        {
+            if (tombstone[i])
+            {
+                duplicates.remove(i);
+            }
+        }
+    }
+
+    // Close the gaps left by deleted movies. Live movies keep their order,
+    // so ranking ties still come out the same; cached results, precomputed
+    // recommendations and the duplicate index are renumbered, not rebuilt.
+    void compactCatalog()
+    {
+        if (tombstoneCount == 0)
+        {
+            return;
+        }
+        TraceSpan span("compact");
+        int remap[MAX_MOVIES];
+        int live = 0;
+        for (int i = 0; i < movieCount; i++)
+        {
+            if (tombstone[i])
+            {
+                remap[i] = -1;
+                tombstone[i] = false;
+                continue;
+            }
+            remap[i] = live;
+            if (live != i)
+            {
+                movies[live] = movies[i];
+            }
+            live++;
+        }
+        resultCache.remapPositions(remap);
+        recommendationTable.remapPositions(remap);
+        duplicates.compact(remap, movieCount);
+        movieCount = live;
+        tombstoneCount = 0;
+        catalogVersion++;
+    }
+
+    // Merge a duplicate movie into the one kept: cast members missing from
+    // the kept movie are added and user ratings move over to its title
+    void mergeMovieInto(int keep, int duplicate)
+    {
+        // Followers replay the whole merge, including the delete at its end
+        LogMerge merge;
+        merge.keep = movieRef(keep, movies[keep].title);
+        merge.duplicate = movieRef(duplicate, movies[duplicate].title);
+        logChange(LOG_MERGE_MOVIES, &merge, sizeof(merge));
+        logSuppressed++;
+
+        Movie &kept = movies[keep];
+        const Movie &dup = movies[duplicate];
+        for (int i = 0; i < dup.castCount && kept.castCount < MAX_CAST; i++)
+        {
+            bool present = false;
+            for (int j = 0; j < kept.castCount; j++)
+            {
+                if (kept.castIds[j] == dup.castIds[i])
+                {
+                    present = true;
+                    break;
+                }
+            }
+            if (!present)
+            {
+                kept.castIds[kept.castCount] = dup.castIds[i];
+                strcpy(kept.cast[kept.castCount++], dup.cast[i]);
+            }
+        }
+
+        if (strcmp(kept.title, dup.title) != 0)
+        {
+            for (int u = 0; u < userCount; u++)
+            {
+                for (int r = 0; r < MAX_MOVIES; r++)
+                {
+                    User::Rating &rating = users[u].ratings[r];
+                    if (rating.used && strcmp(rating.movieTitle, dup.title) == 0 && !users[u].hasRated(kept.title))
+                    {
+                        strcpy(rating.movieTitle, kept.title);
+                        resultCache.invalidateUser(users[u].userId);
+                        recommendationTable.invalidateUser(u);
+                        userRowChanged(u);
+                    }
+                }
+            }
+            seedRatingAggregates(kept.title);
+        }
+        resultCache.invalidateTitle(kept.title, true);
+        resultCache.invalidatePosition(keep);
+        invalidateCachedCandidates(kept);
+        deleteMovieAt(duplicate);
+        logSuppressed--;
+    }
+
+    // Drop cached similarity lists that a movie could now enter
+    void invalidateCachedCandidates(const Movie &changed)
+    {
+        resultCache.invalidateCandidates([this, &changed](const char *key)
+                                         {
+            Movie *keyMovie = getMovieByTitle(key);
+            return (keyMovie != nullptr) ? calculateMovieSimilarity(*keyMovie, changed) : 1e9f; });
+    }
+
+    // Drop cached results that depend on the user score of a title
+    void userScoreChanged(const char *title)
+    {
+        resultCache.invalidateTitle(title, false);
+        for (int j = 0; j < movieCount; j++)
+        {
+            if (!tombstone[j] && strcmp(movies[j].title, title) == 0)
+            {
+                resultCache.invalidatePosition(j);
+                invalidateCachedCandidates(movies[j]);
+            }
+        }
+    }
+
+    // Find the title of a user's highest rated movie, or "" if there is none
+    static void findHighestRated(const User &user, char *title)
+    {
+        float highestRating = 0;
+        title[0] = '\0';
+        for (int i = 0; i < MAX_MOVIES; i++)
+        {
+            if (user.ratings[i].used && user.ratings[i].rating > highestRating)
+            {
+                highestRating = user.ratings[i].rating;
+                strcpy(title, user.ratings[i].movieTitle);
+            }
+        }
+    }
+
+    // Write the recommendation table as a trailing "RECS" section
+    bool writeRecommendationSection(FILE *fp)
+    {
+        if (!recommendationTable.valid || recommendationTable.layoutVersion != layoutVersion)
+        {
+            return true; // Nothing worth saving
+        }
+        std::string payload((const char *)&recommendationTable.rowCount, sizeof(int));
+        payload.append((const char *)recommendationTable.rows, recommendationTable.rowCount * sizeof(RecommendationRow));
+        return writeSection(fp, "RECS", payload.data(), (int)payload.size());
+    }
+
+    // Write an "LSN " section: the last replication log record included in
+    // this file, and where the log continues after it
+    bool writeLogPositionSection(FILE *fp)
+    {
+        if (appliedSequence == 0)
+        {
+            return true;
+        }
+        char payload[sizeof(unsigned long long) + sizeof(long long)];
+        long long offset = appliedLogOffset;
+        memcpy(payload, &appliedSequence, sizeof(unsigned long long));
+        memcpy(payload + sizeof(unsigned long long), &offset, sizeof(long long));
+        return writeSection(fp, "LSN ", payload, sizeof(payload));
+    }
+
+    // Write a "DICT" section: the dictionary entries of the names the movies
+    // use (as displayed), so a load gives them the same IDs without looking
+    // them up
+    bool writeNameSection(FILE *fp)
+    {
+        std::vector<int> used;
+        for (int i = 0; i < movieCount; i++)
+        {
+            used.push_back(movies[i].genreId);
+            used.push_back(movies[i].directorId);
+            for (int c = 0; c < movies[i].castCount && c < MAX_CAST; c++)
+            {
+                used.push_back(movies[i].castIds[c]);
+            }
+        }
+        std::sort(used.begin(), used.end());
+        used.erase(std::unique(used.begin(), used.end()), used.end());
+
+        // The count, then entries of the ID, the length and the text without its NUL
+        int count = (int)used.size();
+        std::string payload((const char *)&count, sizeof(int));
+        for (size_t i = 0; i < used.size(); i++)
+        {
+            const char *name = nameDictionary.display(used[i]);
+            unsigned char length = (unsigned char)strlen(name);
+            payload.append((const char *)&used[i], sizeof(int));
+            payload += (char)length;
+            payload.append(name, length);
+        }
+        return writeSection(fp, "DICT", payload.data(), (int)payload.size());
+    }
+
+    // Read a "DICT" section into a table from each saved ID to the ID of
+    // the same name in this run (-1 for IDs the file does not list)
+    bool readNameSection(const char *data, int size, std::vector<int> &nameIds)
+    {
+        int count;
+        if (size < (int)sizeof(int))
+        {
+            return false;
+        }
+        memcpy(&count, data, sizeof(int));
+        if (count < 0 || count > NAME_CAPACITY)
+        {
+            return false;
+        }
+        const char *p = data + sizeof(int);
+        int remaining = size - (int)sizeof(int);
+        for (int i = 0; i < count; i++)
+        {
+            int id;
+            unsigned char length;
+            char name[MAX_STRING_LENGTH];
+            remaining -= (int)(sizeof(int) + 1);
+            if (remaining < 0)
+            {
+                return false;
+            }
+            memcpy(&id, p, sizeof(int));
+            length = (unsigned char)p[sizeof(int)];
+            p += sizeof(int) + 1;
+            if (id < 0 || id >= NAME_CAPACITY || length >= MAX_STRING_LENGTH || length > remaining)
+            {
+                return false;
+            }
+            memcpy(name, p, length);
+            p += length;
+            remaining -= length;
+            name[length] = '\0';
+            if (id >= (int)nameIds.size())
+            {
+                nameIds.resize(id + 1, -1);
+            }
+            nameIds[id] = nameDictionary.intern(name);
+        }
+        return remaining == 0;
+    }
+
+    // Translate a loaded movie's saved name IDs. Returns false if one of
+    // them is not in the table, and the names have to be looked up instead.
+    static bool remapNames(Movie &movie, const std::vector<int> &nameIds)
+    {
+        int *ids[2 + MAX_CAST] = {&movie.genreId, &movie.directorId};
+        int count = 2;
+        for (int i = 0; i < movie.castCount && i < MAX_CAST; i++)
+        {
+            ids[count++] = &movie.castIds[i];
+        }
+        for (int i = 0; i < count; i++)
+        {
+            if (*ids[i] < 0 || *ids[i] >= (int)nameIds.size() || nameIds[*ids[i]] == -1)
+            {
+                return false;
+            }
+        }
+        for (int i = 0; i < count; i++)
+        {
+            *ids[i] = nameIds[*ids[i]];
+        }
+        return true;
+    }
+
+    // Read a "RECS" section written by writeRecommendationSection
+    bool readRecommendationSection(const char *data, int size)
+    {
+        int rows = -1;
+        if (size >= (int)sizeof(int))
+        {
+            memcpy(&rows, data, sizeof(int));
+        }
+        if (rows < 0 || rows > userCount || size != (int)(sizeof(int) + rows * sizeof(RecommendationRow)))
+        {
+            recommendationTable.clear();
+            return false;
+        }
+        memcpy(recommendationTable.rows, data + sizeof(int), rows * sizeof(RecommendationRow));
+        for (int i = 0; i < rows; i++)
+        {
+            const RecommendationRow &row = recommendationTable.rows[i];
+            if (row.count > RECOMMENDATION_COUNT || row.basedOn >= movieCount)
+            {
+                recommendationTable.clear();
+                return false;
+            }
+            for (int j = 0; j < row.count; j++)
+            {
+                if (row.movieIndex[j] < 0 || row.movieIndex[j] >= movieCount)
+                {
+                    recommendationTable.clear();
+                    return false;
+                }
+            }
+        }
+        recommendationTable.rowCount = rows;
+        recommendationTable.layoutVersion = layoutVersion;
+        recommendationTable.valid = true;
+        return true;
+    }
+
+    // Seed the aggregates of one title from the ratings users already have
+    void seedRatingAggregates(const char *title)
+    {
+        ratingAggregates.remove(title);
+        for (int i = 0; i < userCount; i++)
+        {
+            float rating = users[i].getRating(title);
+            if (rating >= 0)
+            {
+                ratingAggregates.getOrCreate(title)->add(rating);
+            }
+        }
+    }
+
+    // Index the users after they were replaced; none of the last
+    // snapshot's user rows is reused
+    void rebuildUserIndex()
+    {
+        TraceSpan span("rebuild user index");
+        userIndex.clear();
+        for (int i = 0; i < userCount; i++)
+        {
+            userIndex.insert(i, users[i].userId, users[i].username);
+        }
+        userRows.clear();
+    }
+
+    // A user's ratings changed: the next snapshot builds a new row for them
+    void userRowChanged(int slot)
+    {
+        if (slot < (int)userRows.size())
+        {
+            userRows[slot].reset();
+        }
+    }
+
+    // Rebuild all aggregates from the user ratings (used after loading)
+    void rebuildRatingAggregates()
+    {
+        TraceSpan span("rebuild rating aggregates");
+        ratingAggregates.clear();
+        for (int i = 0; i < userCount; i++)
+        {
+            for (int j = 0; j < MAX_MOVIES; j++)
+            {
+                if (users[i].ratings[j].used && getMovieByTitle(users[i].ratings[j].movieTitle) != nullptr)
+                {
+                    ratingAggregates.getOrCreate(users[i].ratings[j].movieTitle)->add(users[i].ratings[j].rating);
+                }
+            }
+        }
+    }
+
+    // Count the whole catalog into the facet counts
+    void rebuildFacets()
+    {
+        catalogFacets.clear();
+        for (int i = 0; i < movieCount; i++)
+        {
+            if (!tombstone[i])
+            {
+                catalogFacets.add(movies[i], 1);
+            }
+        }
+    }
+
+    static void addRatedTitles(const User &user, std::vector<std::string> &titles)
+    {
+        for (int r = 0; r < MAX_MOVIES; r++)
+        {
+            if (user.ratings[r].used)
+            {
+                titles.push_back(user.ratings[r].movieTitle);
+            }
+        }
+    }
+
+    // Take over a freshly read copy of the database file (caller holds
+    // writerLock). Movies and users that did not change are left alone, and
+    // only the aggregates and cached results of changed ones are rebuilt.
+    // Returns the number of movies and users that changed.
+    int swapInLocked(MovieDatabase &staged)
+    {
+        TraceSpan span("swap in");
+        int changed = 0;
+        std::vector<std::string> rescored; // Titles whose ratings may differ
+        compactCatalog();                  // Files never hold tombstones
+
+        bool catalogChanged = staged.movieCount != movieCount;
+        for (int i = 0; i < movieCount && !catalogChanged; i++)
+        {
+            catalogChanged = memcmp(&movies[i], &staged.movies[i], sizeof(Movie)) != 0;
+        }
+        if (catalogChanged)
+        {
+            for (int i = 0; i < movieCount; i++)
+            {
+                if (staged.getMovieByTitle(movies[i].title) == nullptr)
+                {
+                    trending.removeMovie(movies[i]);
+                    ratingAggregates.remove(movies[i].title);
+                }
+            }
+            for (int i = 0; i < staged.movieCount; i++)
+            {
+                if (i >= movieCount || memcmp(&movies[i], &staged.movies[i], sizeof(Movie)) != 0)
+                {
+                    changed++;
+                    rescored.push_back(staged.movies[i].title);
+                    if (i < movieCount)
+                    {
+                        catalogFacets.add(movies[i], -1);
+                    }
+                    movies[i] = staged.movies[i];
+                    catalogFacets.add(movies[i], 1);
+                }
+            }
+            for (int i = staged.movieCount; i < movieCount; i++)
+            {
+                catalogFacets.add(movies[i], -1);
+            }
+            changed += (movieCount > staged.movieCount) ? movieCount - staged.movieCount : 0;
+            movieCount = staged.movieCount;
+
+            // Positions moved: cached lists and the duplicate index are stale
+            catalogLayoutChanged();
+            resultCache.invalidateAll(false);
+            resultCache.invalidateAll(true);
+            duplicates.invalidate();
+        }
+
+        bool identitiesChanged = staged.userCount != userCount;
+        for (int u = 0; u < staged.userCount; u++)
+        {
+            if (u < userCount && memcmp(&users[u], &staged.users[u], sizeof(User)) == 0)
+            {
+                continue;
+            }
+            changed++;
+            if (u < userCount)
+            {
+                identitiesChanged = identitiesChanged || users[u].userId != staged.users[u].userId ||
+                                    strcmp(users[u].username, staged.users[u].username) != 0;
+                addRatedTitles(users[u], rescored);
+                resultCache.invalidateUser(users[u].userId);
+            }
+            addRatedTitles(staged.users[u], rescored);
+            resultCache.invalidateUser(staged.users[u].userId);
+            users[u] = staged.users[u];
+            userRowChanged(u);
+        }
+        for (int u = staged.userCount; u < userCount; u++)
+        {
+            changed++;
+            addRatedTitles(users[u], rescored);
+            resultCache.invalidateUser(users[u].userId);
+        }
+        userCount = staged.userCount;
+        if (identitiesChanged)
+        {
+            rebuildUserIndex();
+        }
+
+        std::sort(rescored.begin(), rescored.end());
+        rescored.erase(std::unique(rescored.begin(), rescored.end()), rescored.end());
+        for (size_t i = 0; i < rescored.size(); i++)
+        {
+            const char *title = rescored[i].c_str();
+            if (getMovieByTitle(title) == nullptr)
+            {
+                ratingAggregates.remove(title);
+                continue;
+            }
+            seedRatingAggregates(title);
+            userScoreChanged(title);
+        }
+
+        // The file's precomputed recommendations match its catalog
+        recommendationTable = staged.recommendationTable;
+        recommendationTable.layoutVersion = layoutVersion;
+        appliedSequence = staged.appliedSequence;
+        appliedLogOffset = staged.appliedLogOffset;
+        return changed;
+    }
+
+    // Charge (sign 1) or release (sign -1) the fixed arrays of this
+    // database. The string fields of a movie are its title, director,
+    // genre and cast.
+    void trackFixedMemory(int sign)
+    {
+        const long long movieStrings = (long long)MAX_STRING_LENGTH * (3 + MAX_CAST);
+        const long long userRatings = (long long)sizeof(User::Rating) * MAX_MOVIES;
+        trackMemory(MEM_RECORDS, sign * ((long long)MAX_MOVIES * ((long long)sizeof(Movie) - movieStrings) + (long long)sizeof(tombstone) +
+                                         (long long)MAX_USERS * ((long long)sizeof(User) - MAX_STRING_LENGTH - userRatings)));
+        trackMemory(MEM_STRINGS, sign * ((long long)MAX_MOVIES * movieStrings + (long long)MAX_USERS * MAX_STRING_LENGTH));
+        trackMemory(MEM_RATINGS, sign * ((long long)MAX_USERS * userRatings + (long long)sizeof(ratingAggregates)));
+        trackMemory(MEM_USER_INDEX, sign * (long long)sizeof(userIndex));
+        trackMemory(MEM_DUPLICATE_INDEX, sign * (long long)sizeof(duplicates));
+        trackMemory(MEM_RESULT_CACHE, sign * (long long)sizeof(resultCache));
+        trackMemory(MEM_QUERY_CACHE, sign * (long long)sizeof(queryCache));
+        trackMemory(MEM_RECOMMENDATIONS, sign * (long long)sizeof(recommendationTable));
+        trackMemory(MEM_TRENDING, sign * (long long)sizeof(trending));
+        trackMemory(MEM_METRICS, sign * (long long)sizeof(metrics));
+    }
+
+public:
+    MovieDatabase() : movieCount(0), tombstone(), tombstoneCount(0), userCount(0), layoutVersion(0), catalogVersion(0),
+                      publishedSnapshot(nullptr), snapshotVersion(0),
+                      replicationLog(nullptr), follower(false), appliedSequence(0), appliedLogOffset(0),
+                      logSuppressed(0), logBatchDepth(0), lastApplyDelay(0), reloadRequested(false),
+                      writesHeld(false)
+    {
+        damagedFile[0] = '\0';
+        trackFixedMemory(1);
+    }
+
+    ~MovieDatabase()
+    {
+        trackFixedMemory(-1);
+        delete replicationLog;
+        delete publishedSnapshot.load();
+    }
+
+    // Compact once the share of deleted movies passes the threshold. The
+    // menu calls this right after a delete; the server calls
+    // compactWhileServing from its maintenance task instead.
+    bool compactIfNeeded()
+    {
+        if (tombstoneCount > 0 && tombstoneCount >= COMPACTION_DEAD_RATIO * movieCount)
+        {
+            compactCatalog();
+            return true;
+        }
+        return false;
+    }
+
+    // Compact from the server's 100 ms maintenance task, a pool task of
+    // its own: write batches only leave tombstones, so no request waits
+    // for a compaction
+    void compactWhileServing()
+    {
+        std::lock_guard<std::mutex> guard(writerLock);
+        if (compactIfNeeded())
+        {
+            publishSnapshotLocked();
+        }
+    }
+
+    // Publish the current state for concurrent readers. Call once after
+    // loading; afterwards flushWrites publishes every applied batch.
+    void publishSnapshot()
+    {
+        std::lock_guard<std::mutex> guard(writerLock);
+        publishSnapshotLocked();
+    }
+
+    // Pin the published snapshot for reading. Lock-free; the snapshot stays
+    // valid until the reader goes out of scope.
+    SnapshotReader readSnapshot()
+    {
+        return SnapshotReader(epochs, publishedSnapshot);
+    }
+
+    // Reference the published snapshot for as long as the caller needs it
+    SnapshotRef holdSnapshot()
+    {
+        SnapshotReader reader = readSnapshot();
+        return SnapshotRef(reader);
+    }
+
+    // Become a replication primary: replay any log records the database file
+    // does not include yet (changes made after the last save), then log every
+    // change from now on. Saves a fresh snapshot for new followers.
+    bool startPrimary(const char *logPath = LOG_FILENAME)
+    {
+        std::lock_guard<std::mutex> guard(writerLock);
+        ReplicationLog *log = new ReplicationLog();
+        long end = 0;
+        int replayed = 0;
+        if (log->openForReading(logPath))
+        {
+            log->resume(appliedLogOffset, appliedSequence + 1);
+            replicationLog = log;
+            logSuppressed++;
+            replayed = replayLogLocked(INT_MAX);
+            logSuppressed--;
+            end = log->getOffset();
+        }
+        unsigned long long last = (log->getLastSequence() > appliedSequence) ? log->getLastSequence() : appliedSequence;
+        if (!log->openForAppending(logPath, end, last))
+        {
+            std::cout << "Error: Could not open replication log " << logPath << std::endl;
+            replicationLog = nullptr;
+            delete log;
+            return false;
+        }
+        replicationLog = log;
+        appliedSequence = last;
+        appliedLogOffset = end;
+        std::cout << "Replication primary: " << replayed << " log records replayed, logging to " << logPath
+                  << " from sequence " << last + 1 << std::endl;
+        return saveToFile();
+    }
+
+    // Become a read-only follower of a primary: replay the log tail after the
+    // snapshot that was loaded, then keep applying it with pollReplication()
+    bool startFollower(const char *logPath = LOG_FILENAME)
+    {
+        std::lock_guard<std::mutex> guard(writerLock);
+        ReplicationLog *log = new ReplicationLog();
+        if (!log->openForReading(logPath))
+        {
+            std::cout << "Error: Could not open replication log " << logPath << std::endl;
+            delete log;
+            return false;
+        }
+        log->resume(appliedLogOffset, appliedSequence + 1);
+        replicationLog = log;
+        follower = true;
+        int replayed = replayLogLocked(INT_MAX);
+        publishSnapshotLocked();
+        lastLagReport = std::chrono::steady_clock::now();
+        std::cout << "Follower bootstrapped at sequence " << appliedSequence << " (" << replayed
+                  << " log records replayed after the snapshot)" << std::endl;
+        return true;
+    }
+
+    bool isFollower() const { return follower; }
+
+    // Follower: apply new log records and publish them. Reports the lag
+    // (time from commit on the primary to apply here) every few seconds.
+    int pollReplication()
+    {
+        if (!follower)
+        {
+            return 0;
+        }
+        std::lock_guard<std::mutex> guard(writerLock);
+        int applied = replayLogLocked(REPLICATION_POLL_RECORDS);
+        if (applied == 0)
+        {
+            return 0;
+        }
+        compactIfNeeded();
+        publishSnapshotLocked();
+
+        auto now = std::chrono::steady_clock::now();
+        if (std::chrono::duration<double>(now - lastLagReport).count() >= 5.0)
+        {
+            lastLagReport = now;
+            std::cout << "Replica at sequence " << appliedSequence << ", last change applied "
+                      << lastApplyDelay / 1000.0 << " ms after commit" << std::endl;
+        }
+        return applied;
+    }
+
+    // Keep ratings and new users on disk as they are made, so they survive
+    // until the next save even if the process does not get to make it
+    void openChangeStore(const char *filename = DB_FILENAME)
+    {
+        changeStore.open(filename);
+    }
+
+    // A primary's file only ever holds its own state, so it never reloads
+    bool acceptsReloads() const { return replicationLog == nullptr || follower; }
+
+    // Ask the server to reload the database file; requests made while one
+    // is pending are served by the same reload
+    void requestReload() { reloadRequested = true; }
+    bool takeReloadRequest() { return reloadRequested.exchange(false); }
+
+    // Hot reload: read the database file into a staging copy without holding
+    // any lock, then swap in what changed under the writer lock and publish.
+    // Queries already running finish on the snapshot they pinned. Queued
+    // writes are held from before the file and the change store are read
+    // until after the swap, so the staged copy never misses one of them and
+    // cannot undo it; they are applied right after.
+    bool reloadFromFile(const char *filename = DB_FILENAME)
+    {
+        if (!acceptsReloads())
+        {
+            std::cout << "Reload skipped: a replication primary owns " << filename << std::endl;
+            return false;
+        }
+        std::lock_guard<std::mutex> reloadGuard(reloadLock);
+        OperationTimer timer(metrics, OP_RELOAD);
+        auto start = std::chrono::steady_clock::now();
+        holdWrites(true);
+        MovieDatabase *staged = new MovieDatabase(); // Too large for the stack
+        if (!staged->readDatabaseFile(filename))
+        {
+            std::cout << "Reload failed: keeping the current database." << std::endl;
+            delete staged;
+            holdWrites(false);
+            return false;
+        }
+        staged->rebuildUserIndex();
+        staged->replayChangeStore(filename);
+
+        int changed;
+        {
+            std::lock_guard<std::mutex> guard(writerLock);
+            writesHeld = false;
+            if (follower && staged->appliedSequence < appliedSequence)
+            {
+                std::cout << "Reload skipped: " << filename << " is older than this replica." << std::endl;
+                delete staged;
+                return false;
+            }
+            changed = swapInLocked(*staged);
+            if (follower)
+            {
+                replicationLog->resume(appliedLogOffset, appliedSequence + 1);
+            }
+            if (changed > 0)
+            {
+                publishSnapshotLocked();
+            }
+        }
+        delete staged;
+        flushWrites(); // Those held during the reload
+        double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        std::cout << "Reloaded " << filename << ": " << changed << " movies and users changed ("
+                  << elapsed * 1000 << " ms)" << std::endl;
+        return true;
+    }
+
+    // Save while other threads keep queueing writes
+    bool saveWhileServing(const char *filename = DB_FILENAME)
+    {
+        std::lock_guard<std::mutex> guard(writerLock);
+        return saveToFile(filename);
+    }
+
+    // Queue changes from any thread; they become visible to readers when
+    // the batch is flushed (automatically every WRITE_BATCH_SIZE writes)
+    void submitAddMovie(const Movie &movie)
+    {
+        PendingWrite write;
+        write.type = PendingWrite::ADD_MOVIE;
+        write.movie = movie;
+        queueWrite(write);
+    }
+
+    void submitDeleteMovie(const char *title)
+    {
+        PendingWrite write;
+        write.type = PendingWrite::DELETE_MOVIE;
+        strcpy(write.title, title);
+        queueWrite(write);
+    }
+
+    void submitRating(int userId, const char *title, float rating)
+    {
+        PendingWrite write;
+        write.type = PendingWrite::RATE_MOVIE;
+        strcpy(write.title, title);
+        write.userId = userId;
+        write.rating = rating;
+        queueWrite(write);
+    }
+
+    // Stop or restart applying queued writes (see reloadFromFile)
+    void holdWrites(bool held)
+    {
+        std::lock_guard<std::mutex> guard(writerLock);
+        writesHeld = held;
+    }
+
+    // Apply all queued writes as one batch and publish a new snapshot.
+    // Returns the number of writes applied (none while a reload holds them).
+    int flushWrites()
+    {
+        std::lock_guard<std::mutex> guard(writerLock);
+        if (writesHeld)
+        {
+            return 0;
+        }
+        std::deque<PendingWrite> batch;
+        {
+            std::lock_guard<std::mutex> pendingGuard(pendingLock);
+            batch.swap(pendingWrites);
+        }
+        if (batch.empty())
+        {
+            return 0;
+        }
+        OperationTimer timer(metrics, OP_FLUSH_WRITES);
+
+        logBatchDepth++;
+        {
+            TraceSpan span("apply writes");
+            for (size_t i = 0; i < batch.size(); i++)
+            {
+                const PendingWrite &write = batch[i];
+                if (write.type == PendingWrite::ADD_MOVIE)
+                {
+                    int dup;
+                    float similarity;
+                    insertMovie(write.movie, dup, similarity);
+                }
+                else if (write.type == PendingWrite::DELETE_MOVIE)
+                {
+                    for (int m = 0; m < movieCount; m++)
+                    {
+                        if (!tombstone[m] && strcmp(movies[m].title, write.title) == 0)
+                        {
+                            deleteMovieAt(m);
+                            break;
+                        }
+                    }
+                }
+                else
+                {
+                    Movie *movie = getMovieByTitle(write.title);
+                    int userSlot = findUserSlot(write.userId);
+                    if (movie != nullptr && userSlot != -1)
+                    {
+                        applyRating(userSlot, *movie, write.rating);
+                    }
+                }
+            }
+        }
+        if (--logBatchDepth == 0 && loggingChanges())
+        {
+            replicationLog->commit(); // The whole batch reaches followers at once
+        }
+        publishSnapshotLocked();
+        return (int)batch.size();
+    }
+
+    // Score used for ranking: the catalog rating blended with user ratings
+    float getUserScore(const Movie &movie) const
+    {
+        const RatingStats *stats = ratingAggregates.get(movie.title);
+        if (stats == nullptr || stats->count == 0)
+        {
+            return movie.rating;
+        }
+        return stats->bayesianScore(movie.rating);
+    }
+
+    // Save database to file
+    bool saveToFile(const char *filename = DB_FILENAME)
+    {
+        OperationTimer timer(metrics, OP_SAVE);
+        if (damagedFile[0] != '\0' && strcmp(filename, damagedFile) == 0)
+        {
+            char aside[MAX_STRING_LENGTH + 16];
+            snprintf(aside, sizeof(aside), "%s.corrupt", filename);
+#ifdef _WIN32
+            remove(aside); // rename() does not replace files on Windows
+#endif
+            if (rename(filename, aside) != 0)
+            {
+                std::cout << "Error: Could not move " << filename << " aside; not saving over it." << std::endl;
+                perror("Rename error");
+                return false;
+            }
+            std::cout << "Moved the damaged database file to " << aside << std::endl;
+            damagedFile[0] = '\0';
+        }
+        compactCatalog(); // Files hold live movies only
+        TraceSpan span("write file");
+        std::cout << "Attempting to save database to " << filename << std::endl;
+        std::cout << "Current movies: " << movieCount << ", Current users: " << userCount << std::endl;
+
+        // Write a temporary file and rename it over the old one, so readers
+        // (followers, reloads) never see a half-written database
+        char tempName[MAX_STRING_LENGTH + 8];
+        snprintf(tempName, sizeof(tempName), "%s.tmp", filename);
+        FILE *fp = fopen(tempName, "wb");
+        if (!fp)
+        {
+            std::cout << "Error: Could not open file for writing! Make sure you have write permissions." << std::endl;
+            perror("File open error");
+            return false;
+        }
+
+        // Write file signature (version 103: checksummed sections with
+        // compressed movie and user chunks, movies carry name dictionary IDs)
+        const char signature[8] = "MVDB103";
+        size_t sigWritten = fwrite(signature, sizeof(char), 8, fp);
+        if (sigWritten != 8)
+        {
+            std::cout << "Error: Failed to write file signature." << std::endl;
+            perror("Write error");
+            fclose(fp);
+            return false;
+        }
+
+        // Write movie and user counts
+        if (fwrite(&movieCount, sizeof(int), 1, fp) != 1 || fwrite(&userCount, sizeof(int), 1, fp) != 1)
+        {
+            std::cout << "Error: Failed to write movie and user counts." << std::endl;
+            perror("Write error");
+            fclose(fp);
+            return false;
+        }
+
+        // Write the movies, then the users, in compressed, checksummed chunks
+        if (!writeRecordChunks(fp, "MOVS", movies, movieCount, movieRecordLayout))
+        {
+            std::cout << "Error: Failed to write movie data." << std::endl;
+            perror("Write error");
+            fclose(fp);
+            return false;
+        }
+        if (!writeRecordChunks(fp, "USRS", users, userCount, userRecordLayout))
+        {
+            std::cout << "Error: Failed to write user data." << std::endl;
+            perror("Write error");
+            fclose(fp);
+            return false;
+        }
+
+        // Write optional sections
+        if (!writeRecommendationSection(fp))
+        {
+            std::cout << "Error: Failed to write precomputed recommendations." << std::endl;
+            perror("Write error");
+            fclose(fp);
+            return false;
+        }
+        if (!writeLogPositionSection(fp))
+        {
+            std::cout << "Error: Failed to write the replication log position." << std::endl;
+            perror("Write error");
+            fclose(fp);
+            return false;
+        }
+        if (!writeNameSection(fp))
+        {
+            std::cout << "Error: Failed to write the name dictionary." << std::endl;
+            perror("Write error");
+            fclose(fp);
+            return false;
+        }
+
+        // Flush and close the file, then put it in place
+        fflush(fp);
+        fclose(fp);
+#ifdef _WIN32
+        remove(filename); // rename() does not replace files on Windows
+#endif
+        if (rename(tempName, filename) != 0)
+        {
+            std::cout << "Error: Could not replace " << filename << "." << std::endl;
+            perror("Rename error");
+            return false;
+        }
+        changeStore.checkpoint(filename); // The file now holds every stored change
+
+        // Verify file was created with non-zero size
+        FILE *check = fopen(filename, "rb");
+        if (!check)
+        {
+            std::cout << "Warning: Could not verify database file was created." << std::endl;
+            return false;
+        }
+
+        // Get file size
+        fseek(check, 0, SEEK_END);
+        long fileSize = ftell(check);
+        fclose(check);
+
+        if (fileSize > 0)
+        {
+            std::cout << "Database saved successfully to " << filename << " (" << fileSize << " bytes)" << std::endl;
+            return true;
+        }
+        else
+        {
+            std::cout << "Error: Database file was created but appears to be empty!" << std::endl;
+            return false;
+        }
+    }
+
+private:
+    // A section of a database file. Uncompressed chunks are read straight
+    // into the movies or users; compressed chunks and other payloads are
+    // kept for decoding and parsing.
+    struct FileSection
+    {
+        SectionHeader header;
+        std::string payload;
+        int first;      // Chunks: position of the first record
+        int count;      // Chunks: records in the chunk
+        char *records;  // Chunks: where the records go
+        bool verified;  // The checksum matches, or the file version has none
+        bool decoded;   // Compressed chunks: the records were decompressed
+    };
+
+    // Whether a section is a chunk of movie or user records
+    static bool isRecordChunk(const SectionHeader &header, bool &isMovies)
+    {
+        isMovies = memcmp(header.tag, "MOVS", 4) == 0;
+        return isMovies || memcmp(header.tag, "USRS", 4) == 0;
+    }
+
+    // Workers for a parallel load step of the given number of tasks
+    static int loadWorkers(int tasks)
+    {
+        int cores = WorkStealingPool::defaultWorkerCount();
+        return (tasks < cores) ? (tasks > 0 ? tasks : 1) : cores;
+    }
+
+    // Read the bare movie and user records of a version 100 or 101 file,
+    // then its trailing sections (which have no checksum)
+    bool readBareRecords(FILE *fp, size_t recordSize, std::vector<FileSection> &sections)
+    {
+        for (int i = 0; i < movieCount; i++)
+        {
+            movies[i] = Movie();
+            if (fread(&movies[i], recordSize, 1, fp) != 1)
+            {
+                std::cout << "Error: Failed to read movie data. Creating a new database." << std::endl;
+                return false;
+            }
+        }
+
+        // Read user count
+        if (fread(&userCount, sizeof(int), 1, fp) != 1)
+        {
+            std::cout << "Error: Failed to read user count. Creating a new database." << std::endl;
+            return false;
+        }
+
+        if (userCount < 0 || userCount > MAX_USERS)
+        {
+            std::cout << "Error: Corrupted database file (invalid user count). Creating a new database." << std::endl;
+            return false;
+        }
+
+        // Read each user
+        for (int i = 0; i < userCount; i++)
+        {
+            if (fread(&users[i], sizeof(User), 1, fp) != 1)
+            {
+                std::cout << "Error: Failed to read user data. Creating a new database." << std::endl;
+                return false;
+            }
+        }
+
+        FileSection section;
+        section.header.crc = 0;
+        section.verified = true;
+        while (fread(section.header.tag, sizeof(char), 4, fp) == 4 && fread(&section.header.size, sizeof(int), 1, fp) == 1 &&
+               section.header.size >= 0 && readPayload(fp, section))
+        {
+            sections.push_back(section);
+        }
+        return true;
+    }
+
+    // Read a section's payload; false if the file ends first
+    static bool readPayload(FILE *fp, FileSection &section)
+    {
+        const int step = 65536; // Sizes are only trusted as far as the file goes
+        section.payload.clear();
+        while ((int)section.payload.size() < section.header.size)
+        {
+            size_t offset = section.payload.size();
+            size_t want = (section.header.size - offset < (size_t)step) ? section.header.size - offset : step;
+            section.payload.resize(offset + want);
+            if (fread(&section.payload[offset], 1, want, fp) != want)
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Read the sections of a version 102 or 103 file. The chunks must cover
+    // the movies and users in order. Their checksums are then verified, and
+    // compressed chunks decompressed into place, on all cores; a bad chunk
+    // fails the load, while a bad trailing section is only skipped.
+    bool readChunkedRecords(FILE *fp, bool compressed, std::vector<FileSection> &sections)
+    {
+        if (fread(&userCount, sizeof(int), 1, fp) != 1 || userCount < 0 || userCount > MAX_USERS)
+        {
+            std::cout << "Error: Corrupted database file (invalid user count). Creating a new database." << std::endl;
+            return false;
+        }
+
+        std::vector<FileSection> all;
+        int moviesSeen = 0, usersSeen = 0;
+        FileSection section;
+        section.verified = false;
+        section.decoded = !compressed;
+        while (fread(&section.header, sizeof(SectionHeader), 1, fp) == 1)
+        {
+            bool isMovies;
+            bool ok = section.header.size >= 0;
+            if (ok && isRecordChunk(section.header, isMovies))
+            {
+                const RecordLayout &layout = isMovies ? movieRecordLayout : userRecordLayout;
+                int &seen = isMovies ? moviesSeen : usersSeen;
+                int total = isMovies ? movieCount : userCount;
+                bool placed;
+                if (compressed)
+                {
+                    BlockHeader block;
+                    ok = readPayload(fp, section);
+                    placed = ok && section.header.size >= (int)sizeof(int) &&
+                             readBlockHeader(layout, section.payload.data() + sizeof(int), section.header.size - (int)sizeof(int),
+                                             total - seen, block);
+                    if (placed)
+                    {
+                        memcpy(&section.first, section.payload.data(), sizeof(int));
+                        section.count = block.count;
+                        placed = section.first == seen;
+                    }
+                }
+                else
+                {
+                    int bytes = section.header.size - (int)sizeof(int);
+                    section.count = (bytes >= 0) ? bytes / layout.recordSize : 0;
+                    placed = bytes >= 0 && bytes % layout.recordSize == 0 && fread(&section.first, sizeof(int), 1, fp) == 1 &&
+                             section.first == seen && section.count <= total - seen;
+                }
+                if (ok && !placed)
+                {
+                    std::cout << "Error: Corrupted database file (misplaced chunk). Creating a new database." << std::endl;
+                    return false;
+                }
+                section.records = isMovies ? (char *)&movies[seen] : (char *)&users[seen];
+                if (ok && !compressed)
+                {
+                    size_t bytes = (size_t)section.count * layout.recordSize;
+                    ok = fread(section.records, 1, bytes, fp) == bytes;
+                }
+                seen += section.count;
+            }
+            else if (ok)
+            {
+                section.records = nullptr;
+                ok = readPayload(fp, section);
+            }
+            if (!ok)
+            {
+                std::cout << "Error: Corrupted database file (truncated section). Creating a new database." << std::endl;
+                return false;
+            }
+            all.push_back(section);
+        }
+        if (moviesSeen != movieCount || usersSeen != userCount)
+        {
+            std::cout << "Error: Corrupted database file (missing chunks). Creating a new database." << std::endl;
+            return false;
+        }
+
+        {
+            TraceSpan verify(compressed ? "verify and decompress chunks" : "verify chunks");
+            WorkStealingPool pool(loadWorkers((int)all.size()));
+            pool.parallelFor((int)all.size(), 1, [&all, compressed](int begin, int end)
+                             {
+                std::vector<char> scratch;
+                for (int s = begin; s < end; s++)
+                {
+                    FileSection &chunk = all[s];
+                    unsigned int crc = (chunk.records != nullptr && !compressed)
+                                           ? crc32c(chunk.records, chunk.header.size - sizeof(int), crc32c(&chunk.first, sizeof(int)))
+                                           : crc32c(chunk.payload.data(), chunk.payload.size());
+                    chunk.verified = crc == chunk.header.crc;
+                    if (chunk.records != nullptr && compressed && chunk.verified)
+                    {
+                        bool isMovies;
+                        isRecordChunk(chunk.header, isMovies);
+                        const RecordLayout &layout = isMovies ? movieRecordLayout : userRecordLayout;
+                        const char *block = chunk.payload.data() + sizeof(int);
+                        int size = chunk.header.size - (int)sizeof(int);
+                        BlockHeader header;
+                        chunk.decoded = readBlockHeader(layout, block, size, chunk.count, header) &&
+                                        unpackBlock(layout, block, size, header, scratch, chunk.records);
+                        chunk.payload.clear();
+                        chunk.payload.shrink_to_fit();
+                    }
+                } });
+        }
+        for (size_t s = 0; s < all.size(); s++)
+        {
+            bool isMovies;
+            if (all[s].records == nullptr)
+            {
+                sections.push_back(all[s]);
+            }
+            else if (!all[s].verified || !all[s].decoded)
+            {
+                isRecordChunk(all[s].header, isMovies);
+                std::cout << "Error: Corrupted database file (" << (all[s].verified ? "undecodable" : "checksum mismatch in")
+                          << " " << (isMovies ? "movie" : "user") << " data). Creating a new database." << std::endl;
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Read the movies, users and trailing sections of a database file into
+    // this object. Derived indexes are left to the caller.
+    bool readDatabaseFile(const char *filename)
+    {
+        TraceSpan span("read file");
+        FILE *fp = fopen(filename, "rb");
+        if (!fp)
+        {
+            std::cout << "Warning: Could not open database file for reading. Creating a new database." << std::endl;
+            return false;
+        }
+        catalogVersion++; // Even a failed read leaves the catalog changed
+
+        // Read and verify file signature. Version 100 files have no name IDs:
+        // their movie records end before them. Version 102 files are
+        // checksummed sections; version 103 compresses the record chunks.
+        char signature[8];
+        if (fread(signature, sizeof(char), 8, fp) != 8 ||
+            (strncmp(signature, "MVDB100", 7) != 0 && strncmp(signature, "MVDB101", 7) != 0 &&
+             strncmp(signature, "MVDB102", 7) != 0 && strncmp(signature, "MVDB103", 7) != 0))
+        {
+            std::cout << "Error: Invalid database file format. Creating a new database." << std::endl;
+            fclose(fp);
+            return false;
+        }
+
+        // Read movie count
+        if (fread(&movieCount, sizeof(int), 1, fp) != 1)
+        {
+            std::cout << "Error: Failed to read movie count. Creating a new database." << std::endl;
+            fclose(fp);
+            movieCount = 0;
+            return false;
+        }
+
+        if (movieCount < 0 || movieCount > MAX_MOVIES)
+        {
+            std::cout << "Error: Corrupted database file (invalid movie count). Creating a new database." << std::endl;
+            fclose(fp);
+            movieCount = 0;
+            return false;
+        }
+        for (int i = 0; i < MAX_MOVIES; i++)
+        {
+            tombstone[i] = false;
+        }
+        tombstoneCount = 0;
+
+        // Read the movies and users
+        std::vector<FileSection> sections;
+        bool read = (signature[6] >= '2') ? readChunkedRecords(fp, signature[6] == '3', sections)
+                                          : readBareRecords(fp, (signature[6] == '0') ? MOVIE_RECORD_V100 : sizeof(Movie), sections);
+        fclose(fp);
+        if (!read)
+        {
+            movieCount = 0;
+            userCount = 0;
+            return false;
+        }
+
+        // Read optional trailing sections, skipping any we do not know
+        catalogLayoutChanged();
+        recommendationTable.clear();
+        appliedSequence = 0;
+        appliedLogOffset = 0;
+        std::vector<int> nameIds; // Saved ID -> ID in this run, from the "DICT" section
+        for (size_t s = 0; s < sections.size(); s++)
+        {
+            const SectionHeader &header = sections[s].header;
+            const char *payload = sections[s].payload.data();
+            if (!sections[s].verified)
+            {
+                std::cout << "Warning: Ignoring a section with a bad checksum ("
+                          << std::string(header.tag, 4) << ")." << std::endl;
+            }
+            else if (memcmp(header.tag, "RECS", 4) == 0)
+            {
+                if (!readRecommendationSection(payload, header.size))
+                {
+                    std::cout << "Warning: Ignoring invalid precomputed recommendations." << std::endl;
+                }
+            }
+            else if (memcmp(header.tag, "LSN ", 4) == 0 && header.size == (int)(sizeof(unsigned long long) + sizeof(long long)))
+            {
+                long long offset;
+                memcpy(&appliedSequence, payload, sizeof(unsigned long long));
+                memcpy(&offset, payload + sizeof(unsigned long long), sizeof(long long));
+                appliedLogOffset = (long)offset;
+            }
+            else if (memcmp(header.tag, "DICT", 4) == 0 && !readNameSection(payload, header.size, nameIds))
+            {
+                std::cout << "Warning: Ignoring an invalid name dictionary." << std::endl;
+                nameIds.clear();
+            }
+        }
+
+        // Movies keep the names' saved IDs when the dictionary came with
+        // them, translated in parallel; otherwise (older files) the names
+        // are looked up, in order, so they get the same IDs on every load
+        std::vector<char> remapped(movieCount, 0);
+        WorkStealingPool pool(loadWorkers((movieCount + NAME_REMAP_GRAIN - 1) / NAME_REMAP_GRAIN));
+        pool.parallelFor(movieCount, NAME_REMAP_GRAIN, [this, &nameIds, &remapped](int begin, int end)
+                         {
+            for (int i = begin; i < end; i++)
+            {
+                remapped[i] = remapNames(movies[i], nameIds);
+            } });
+        for (int i = 0; i < movieCount; i++)
+        {
+            if (!remapped[i] && !internNames(movies[i]))
+            {
+                std::cout << "Error: The name dictionary has no room for the names in " << filename << std::endl;
+                return false;
+            }
+        }
+        return true;
+    }
+
+public:
+    // Load database from file
+    bool loadFromFile(const char *filename = DB_FILENAME)
+    {
+        OperationTimer timer(metrics, OP_LOAD);
+        if (!readDatabaseFile(filename))
+        {
+            FILE *fp = fopen(filename, "rb");
+            if (fp != nullptr && nameDictionary.isFull())
+            {
+                fclose(fp); // The file is fine; this run has no room for its names
+            }
+            else if (fp != nullptr)
+            {
+                fclose(fp);
+                strncpy(damagedFile, filename, MAX_STRING_LENGTH - 1);
+                damagedFile[MAX_STRING_LENGTH - 1] = '\0';
+                std::cout << "The damaged file is kept: it is renamed to " << filename
+                          << ".corrupt before a new database is saved." << std::endl;
+            }
+            return false;
+        }
+        rebuildUserIndex();
+        int stored = replayChangeStore(filename);
+        {
+            // The aggregates and the facet counts read the movies and users
+            // but not each other, so they are rebuilt side by side
+            WorkStealingPool pool(loadWorkers(2));
+            pool.submit([this]()
+                        { rebuildRatingAggregates(); });
+            pool.submit([this]()
+                        { rebuildFacets(); });
+            pool.run();
+        }
+        resultCache.invalidateAll(false);
+        resultCache.invalidateAll(true);
+        duplicates.invalidate();
+        std::cout << "Database loaded successfully from " << filename << std::endl;
+        std::cout << "Loaded " << movieCount << " movies and " << userCount << " users." << std::endl;
+        if (stored > 0)
+        {
+            std::cout << "Replayed " << stored << " changes made since the last save." << std::endl;
+        }
+        return true;
+    }
+
+    // Insert a movie without printing. Returns false when the database, or
+    // the name dictionary for the movie's new names, is full.
+    // duplicateOf is set to the position of a near-duplicate movie, or -1.
+    bool insertMovie(const Movie &movie, int &duplicateOf, float &similarity)
+    {
+        duplicateOf = -1;
+        if (movieCount >= MAX_MOVIES)
+        {
+            compactCatalog(); // Reuse the slots of deleted movies
+        }
+        Movie added = movie;
+        if (movieCount >= MAX_MOVIES || !internNames(added))
+        {
+            return false;
+        }
+
+        // Flag near-duplicates of movies already in the catalog
+        if (!duplicates.isValid(movieCount))
+        {
+            rebuildDuplicateIndex();
+        }
+        MinHashSignature sig;
+        DuplicateDetector::computeSignature(movie, sig);
+        duplicateOf = duplicates.findDuplicate(sig, movieCount, similarity);
+        duplicates.append(sig);
+
+        tombstone[movieCount] = false;
+        movies[movieCount++] = added;
+        catalogFacets.add(movies[movieCount - 1], 1);
+        seedRatingAggregates(movie.title);
+        catalogLayoutChanged();
+        resultCache.invalidateTitle(movie.title, true);
+        invalidateCachedCandidates(movies[movieCount - 1]);
+        logChange(LOG_ADD_MOVIE, &movies[movieCount - 1], sizeof(Movie));
+        return true;
+    }
+
+    // Add a movie to the database
+    void addMovie(const Movie &movie)
+    {
+        OperationTimer timer(metrics, OP_ADD_MOVIE);
+        int dup;
+        float similarity;
+        if (insertMovie(movie, dup, similarity))
+        {
+            if (dup != -1)
+            {
+                std::cout << "Warning: \"" << movie.title << "\" looks like a duplicate of \""
+                          << movies[dup].title << "\" (" << (int)(similarity * 100) << "% similar)." << std::endl;
+            }
+            std::cout << "Movie added successfully!" << std::endl;
+        }
+        else if (movieCount >= MAX_MOVIES)
+        {
+            std::cout << "Error: Database is full." << std::endl;
+        }
+        else
+        {
+            std::cout << "Error: The name dictionary is full." << std::endl;
+        }
+    }
+
+    // Add a user to the database
+    void addUser(const User &user)
+    {
+        if (userCount < MAX_USERS)
+        {
+            userIndex.insert(userCount, user.userId, user.username);
+            users[userCount++] = user;
+            logUserAdded(user);
+            std::cout << "User added successfully!" << std::endl;
+        }
+        else
+        {
+            std::cout << "Error: Maximum users reached." << std::endl;
+        }
+    }
+
+    // Get movie by title
+    Movie *getMovieByTitle(const char *title)
+    {
+        for (int i = 0; i < movieCount; i++)
+        {
+            if (!tombstone[i] && strcmp(movies[i].title, title) == 0)
+            {
+                return &movies[i];
+            }
+        }
+        return nullptr;
+    }
+
+    // Run a search through the query cache: positions found at this
+    // catalog version are reused, otherwise search runs and its results are
+    // cached. hit tells which happened.
+    int cachedSearch(char kind, const char *argument, unsigned long long version, int results[],
+                     const std::function<int(int[])> &search, bool &hit)
+    {
+        std::string key;
+        QueryCache::makeKey(kind, argument, key);
+        int count = queryCache.lookup(key, version, results);
+        hit = (count != -1);
+        if (!hit)
+        {
+            count = search(results);
+            queryCache.store(key, version, results, count);
+        }
+        return count;
+    }
+
+    // Positions of the live movies that match, in catalog order
+    int scanMovies(int results[], const std::function<bool(const Movie &)> &matches) const
+    {
+        int found = 0;
+        for (int i = 0; i < movieCount; i++)
+        {
+            if (!tombstone[i] && matches(movies[i]))
+            {
+                results[found++] = i;
+            }
+        }
+        return found;
+    }
+
+    // Linear search movies by partial title
+    void searchByTitle(const char *title)
+    {
+        OperationTimer timer(metrics, OP_SEARCH_TITLE);
+        timer.describe(title);
+        int matches[MAX_MOVIES];
+        int found;
+        bool hit;
+        {
+            TraceSpan span("scan");
+            found = cachedSearch('T', title, catalogVersion, matches, [this, title](int results[])
+                                 { return scanMovies(results, [title](const Movie &movie)
+                                                     { return strstr(movie.title, title) != nullptr; }); }, hit);
+        }
+        timer.rows(hit ? 0 : movieCount - tombstoneCount, found);
+        TraceSpan span("output");
+        for (int i = 0; i < found; i++)
+        {
+            movies[matches[i]].display();
+            trending.recordSearch(movies[matches[i]]);
+        }
+        if (!found)
+        {
+            std::cout << "No movies found with title: " << title << std::endl;
+        }
+    }
+
+    // Search by exact year
+    void searchByYear(int year)
+    {
+        OperationTimer timer(metrics, OP_SEARCH_YEAR);
+        char detail[16];
+        snprintf(detail, sizeof(detail), "%d", year);
+        timer.describe(detail);
+        int matches[MAX_MOVIES];
+        int found;
+        bool hit;
+        {
+            TraceSpan span("scan");
+            found = cachedSearch('Y', detail, catalogVersion, matches, [this, year](int results[])
+                                 { return scanMovies(results, [year](const Movie &movie)
+                                                     { return movie.releaseYear == year; }); }, hit);
+        }
+        timer.rows(hit ? 0 : movieCount - tombstoneCount, found);
+        TraceSpan span("output");
+        for (int i = 0; i < found; i++)
+        {
+            movies[matches[i]].display();
+        }
+        if (!found)
+        {
+            std::cout << "No movies found with release year: " << year << std::endl;
+        }
+    }
+
+    // Search by genre (ignoring case and extra whitespace)
+    void searchByGenre(const char *genre)
+    {
+        OperationTimer timer(metrics, OP_SEARCH_GENRE);
+        timer.describe(genre);
+        int id = nameDictionary.find(genre); // Unknown names match nothing
+        char key[16];
+        snprintf(key, sizeof(key), "%d", id);
+        int matches[MAX_MOVIES];
+        int found;
+        bool hit;
+        {
+            TraceSpan span("scan");
+            found = cachedSearch('G', key, catalogVersion, matches, [this, id](int results[])
+                                 { return scanMovies(results, [id](const Movie &movie)
+                                                     { return id != -1 && movie.genreId == id; }); }, hit);
+        }
+        timer.rows(hit ? 0 : movieCount - tombstoneCount, found);
+        TraceSpan span("output");
+        for (int i = 0; i < found; i++)
+        {
+            movies[matches[i]].display();
+        }
+        if (!found)
+        {
+            std::cout << "No movies found with genre: " << genre << std::endl;
+        }
+    }
+
+    // Search by director (ignoring case and extra whitespace)
+    void searchByDirector(const char *director)
+    {
+        OperationTimer timer(metrics, OP_SEARCH_DIRECTOR);
+        timer.describe(director);
+        int id = nameDictionary.find(director); // Unknown names match nothing
+        char key[16];
+        snprintf(key, sizeof(key), "%d", id);
+        int matches[MAX_MOVIES];
+        int found;
+        bool hit;
+        {
+            TraceSpan span("scan");
+            found = cachedSearch('D', key, catalogVersion, matches, [this, id](int results[])
+                                 { return scanMovies(results, [id](const Movie &movie)
+                                                     { return id != -1 && movie.directorId == id; }); }, hit);
+        }
+        timer.rows(hit ? 0 : movieCount - tombstoneCount, found);
+        TraceSpan span("output");
+        for (int i = 0; i < found; i++)
+        {
+            movies[matches[i]].display();
+        }
+        if (!found)
+        {
+            std::cout << "No movies found with director: " << director << std::endl;
+        }
+    }
+
+    // Delete the movie at a position. O(1): the slot becomes a tombstone and
+    // no other movie moves, so only results that list this one are dropped.
+    void deleteMovieAt(int i)
+    {
+        char title[MAX_STRING_LENGTH];
+        strcpy(title, movies[i].title);
+        LogMovieRef ref = movieRef(i, title);
+        logChange(LOG_DELETE_MOVIE, &ref, sizeof(ref));
+
+        trending.removeMovie(movies[i]);
+        resultCache.invalidateTitle(title, true);
+        resultCache.invalidatePosition(i);
+        recommendationTable.movieRemoved(i);
+        duplicates.remove(i);
+        catalogFacets.add(movies[i], -1);
+        tombstone[i] = true;
+        tombstoneCount++;
+        catalogVersion++;
+
+        // Another movie may share the title and keep its ratings
+        if (getMovieByTitle(title) == nullptr)
+        {
+            ratingAggregates.remove(title);
+        }
+    }
+
+    // Delete a movie
+    void deleteMovie(const char *title)
+    {
+        OperationTimer timer(metrics, OP_DELETE_MOVIE);
+        for (int i = 0; i < movieCount; i++)
+        {
+            if (!tombstone[i] && strcmp(movies[i].title, title) == 0)
+            {
+                deleteMovieAt(i);
+                std::cout << "Movie deleted successfully!" << std::endl;
+                return;
+            }
+        }
+        std::cout << "Movie not found!" << std::endl;
+    }
+
+    // Batch pass over the whole catalog: report groups of near-duplicate
+    // movies and optionally merge each group into its first movie
+    void findDuplicateMovies(bool merge)
+    {
+        OperationTimer timer(metrics, OP_DUPLICATES);
+        auto start = std::chrono::steady_clock::now();
+        compactCatalog();
+        rebuildDuplicateIndex();
+
+        // For every movie, the most similar earlier movie (or -1)
+        int keepOf[MAX_MOVIES];
+        float similarityOf[MAX_MOVIES];
+        WorkStealingPool pool;
+        pool.parallelFor(movieCount, 8, [this, &keepOf, &similarityOf](int begin, int end)
+                         {
+            for (int i = begin; i < end; i++)
+            {
+                keepOf[i] = duplicates.findDuplicate(duplicates.getSignature(i), i, similarityOf[i]);
+            } });
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        int found = 0;
+        for (int i = 0; i < movieCount; i++)
+        {
+            if (keepOf[i] != -1)
+            {
+                // Follow the chain to the first movie of the group
+                while (keepOf[keepOf[i]] != -1)
+                {
+                    keepOf[i] = keepOf[keepOf[i]];
+                }
+                std::cout << "\"" << movies[i].title << "\" (" << movies[i].releaseYear << ") looks like a duplicate of \""
+                          << movies[keepOf[i]].title << "\" (" << movies[keepOf[i]].releaseYear << "), "
+                          << (int)(similarityOf[i] * 100) << "% similar" << std::endl;
+                found++;
+            }
+        }
+        std::cout << "Checked " << movieCount << " movies on " << pool.getWorkerCount() << " threads in "
+                  << seconds * 1000.0 << " ms: " << found << " possible duplicates found." << std::endl;
+
+        if (merge && found > 0)
+        {
+            // Merge from the back so earlier positions stay valid
+            for (int i = movieCount - 1; i >= 0; i--)
+            {
+                if (keepOf[i] != -1)
+                {
+                    mergeMovieInto(keepOf[i], i);
+                }
+            }
+            std::cout << "Merged " << found << " duplicate movies." << std::endl;
+        }
+    }
+
+    // View all movies
+    void viewAllMovies()
+    {
+        if (movieCount == tombstoneCount)
+        {
+            std::cout << "No movies in the database." << std::endl;
+            return;
+        }
+
+        for (int i = 0; i < movieCount; i++)
+        {
+            if (!tombstone[i])
+            {
+                movies[i].display();
+            }
+        }
+    }
+
+    // Sort movies by rating using bubble sort
+    void sortByRatingBubble()
+    {
+        OperationTimer timer(metrics, OP_SORT);
+        compactCatalog();
+        Movie before[MAX_MOVIES];
+        bool logging = captureOrder(before);
+        {
+            TraceSpan span("sort");
+            for (int i = 0; i < movieCount; i++)
+            {
+                for (int j = 0; j < movieCount - i - 1; j++)
+                {
+                    if (movies[j].rating < movies[j + 1].rating)
+                    {
+                        // Swap movies
+                        Movie temp = movies[j];
+                        movies[j] = movies[j + 1];
+                        movies[j + 1] = temp;
+                    }
+                }
+            }
+        }
+        catalogReordered();
+        if (logging)
+        {
+            logReorder(before);
+        }
+        std::cout << "Movies sorted by rating (Bubble Sort)!" << std::endl;
+    }
+
+    // Sort movies by rating using selection sort
+    void sortByRatingSelection()
+    {
+        OperationTimer timer(metrics, OP_SORT);
+        compactCatalog();
+        Movie before[MAX_MOVIES];
+        bool logging = captureOrder(before);
+        {
+            TraceSpan span("sort");
+            for (int i = 0; i < movieCount; i++)
+            {
+                int maxIndex = i;
+                for (int j = i + 1; j < movieCount; j++)
+                {
+                    if (movies[j].rating > movies[maxIndex].rating)
+                    {
+                        maxIndex = j;
+                    }
+                }
+                // Swap movies
+                if (maxIndex != i)
+                {
+                    Movie temp = movies[i];
+                    movies[i] = movies[maxIndex];
+                    movies[maxIndex] = temp;
+                }
+            }
+        }
+        catalogReordered();
+        if (logging)
+        {
+            logReorder(before);
+        }
+        std::cout << "Movies sorted by rating (Selection Sort)!" << std::endl;
+    }
+
+    // Sort movies by user score (catalog rating blended with user ratings)
+    void sortByUserScore()
+    {
+        OperationTimer timer(metrics, OP_SORT);
+        compactCatalog();
+        Movie before[MAX_MOVIES];
+        bool logging = captureOrder(before);
+
+        // Insertion sort keeps movies with equal scores in their current order
+        {
+            TraceSpan span("sort");
+            for (int i = 1; i < movieCount; i++)
+            {
+                Movie key = movies[i];
+                float keyScore = getUserScore(key);
+                int j = i - 1;
+                while (j >= 0 && getUserScore(movies[j]) < keyScore)
+                {
+                    movies[j + 1] = movies[j];
+                    j--;
+                }
+                movies[j + 1] = key;
+            }
+        }
+        catalogReordered();
+        if (logging)
+        {
+            logReorder(before);
+        }
+        std::cout << "Movies sorted by user score!" << std::endl;
+    }
+
+    // Display facet counts of the movies whose title contains text, or of
+    // the whole catalog when text is empty
+    void displayFacets(const char *text)
+    {
+        OperationTimer timer(metrics, OP_FACETS);
+        FacetCounts counts;
+        if (text[0] == '\0')
+        {
+            counts = catalogFacets;
+            timer.rows(0, counts.total);
+        }
+        else
+        {
+            TraceSpan span("count");
+            for (int i = 0; i < movieCount; i++)
+            {
+                if (!tombstone[i] && strstr(movies[i].title, text) != nullptr)
+                {
+                    counts.add(movies[i], 1);
+                }
+            }
+            timer.rows(movieCount - tombstoneCount, counts.total);
+        }
+
+        TraceSpan span("output");
+        if (counts.total == 0)
+        {
+            std::cout << "No movies found." << std::endl;
+            return;
+        }
+        std::cout << "Facets for " << counts.total << " movies:" << std::endl;
+        counts.display();
+    }
+
+    // Display the top K movies by user score along with their rating statistics
+    void displayTopRated(int k)
+    {
+        OperationTimer timer(metrics, OP_TOP_RATED);
+        if (movieCount == tombstoneCount)
+        {
+            std::cout << "No movies in the database." << std::endl;
+            return;
+        }
+
+        // Partial selection: only the first K positions are ordered
+        int order[MAX_MOVIES];
+        int live = 0;
+        int limit;
+        {
+            TraceSpan span("select");
+            for (int i = 0; i < movieCount; i++)
+            {
+                if (!tombstone[i])
+                {
+                    order[live++] = i;
+                }
+            }
+            limit = (k < live) ? k : live;
+            timer.rows(live, limit);
+            for (int i = 0; i < limit; i++)
+            {
+                int best = i;
+                for (int j = i + 1; j < live; j++)
+                {
+                    if (getUserScore(movies[order[j]]) > getUserScore(movies[order[best]]))
+                    {
+                        best = j;
+                    }
+                }
+                int temp = order[i];
+                order[i] = order[best];
+                order[best] = temp;
+            }
+        }
+
+        TraceSpan span("output");
+        std::cout << "Top " << limit << " movies by user score:" << std::endl;
+        for (int i = 0; i < limit; i++)
+        {
+            const Movie &movie = movies[order[i]];
+            const RatingStats *stats = ratingAggregates.get(movie.title);
+            std::cout << i + 1 << ". " << movie.title << " - score " << getUserScore(movie);
+            if (stats != nullptr && stats->count > 0)
+            {
+                std::cout << " (" << stats->count << " user ratings, mean " << stats->mean
+                          << ", std dev " << sqrt(stats->variance()) << ")";
+            }
+            else
+            {
+                std::cout << " (no user ratings)";
+            }
+            std::cout << std::endl;
+        }
+    }
+
+    // Display trending movies, overall or for one genre
+    void displayTrending(const char *genre)
+    {
+        trending.displayTrending(genre, nameDictionary.find(genre), 10);
+    }
+
+    // Display result cache hit/miss counters and memory use, and the
+    // state of the change store
+    void displayCacheStats()
+    {
+        resultCache.displayStats();
+        queryCache.displayStats();
+        changeStore.displayStats();
+    }
+
+    // Display call counts, latency percentiles (of the timed calls) and rows
+    // scanned per row returned for every operation used so far
+    void displayStatistics()
+    {
+        Metrics::Totals *totals = new Metrics::Totals(); // Too large for the stack
+        metrics.collect(*totals);
+        std::cout << "Operation statistics (latency in microseconds):" << std::endl;
+        bool any = false;
+        for (int op = 0; op < OPERATION_COUNT; op++)
+        {
+            if (totals->calls[op] == 0)
+            {
+                continue;
+            }
+            any = true;
+            std::cout << OPERATIONS[op].name << ": " << totals->calls[op] << " calls";
+            if (totals->timedCalls[op] > 0)
+            {
+                std::cout << ", p50 " << totals->percentile(op, 50) / 1000.0 << ", p90 " << totals->percentile(op, 90) / 1000.0
+                          << ", p99 " << totals->percentile(op, 99) / 1000.0 << ", max " << totals->percentile(op, 100) / 1000.0
+                          << " (" << totals->timedCalls[op] << " timed)";
+            }
+            if (totals->rowsScanned[op] > 0)
+            {
+                std::cout << ", " << totals->rowsScanned[op] << " rows scanned, " << totals->rowsReturned[op] << " returned";
+            }
+            std::cout << std::endl;
+        }
+        if (!any)
+        {
+            std::cout << "No operations yet." << std::endl;
+        }
+
+        long long indexLookups = totals->counters[COUNTER_INDEX_HITS] + totals->counters[COUNTER_INDEX_MISSES];
+        long long cacheHits, cacheMisses;
+        resultCache.counters(cacheHits, cacheMisses);
+        if (indexLookups > 0)
+        {
+            std::cout << "Index lookups: " << indexLookups << " (hit ratio "
+                      << (100.0 * totals->counters[COUNTER_INDEX_HITS] / indexLookups) << "%)" << std::endl;
+        }
+        if (cacheHits + cacheMisses > 0)
+        {
+            std::cout << "Result cache lookups: " << cacheHits + cacheMisses << " (hit ratio "
+                      << (100.0 * cacheHits / (cacheHits + cacheMisses)) << "%)" << std::endl;
+        }
+        queryCache.counters(cacheHits, cacheMisses);
+        if (cacheHits + cacheMisses > 0)
+        {
+            std::cout << "Search cache lookups: " << cacheHits + cacheMisses << " (hit ratio "
+                      << (100.0 * cacheHits / (cacheHits + cacheMisses)) << "%)" << std::endl;
+        }
+        delete totals;
+    }
+
+    // Display live and peak bytes per subsystem (every database and snapshot
+    // in the process), bytes per live movie, and how much of the fixed-size
+    // string fields holds text
+    void displayMemoryReport()
+    {
+        int live = movieCount - tombstoneCount;
+        long long totalLive = 0, totalPeak = 0;
+        std::cout << "Memory by subsystem (bytes):" << std::endl;
+        for (int m = 0; m < MEMORY_SUBSYSTEM_COUNT; m++)
+        {
+            long long bytes = memoryAccounts[m].live.load();
+            long long peak = memoryAccounts[m].peak.load();
+            totalLive += bytes;
+            totalPeak += peak;
+            std::cout << MEMORY_SUBSYSTEM_NAMES[m] << ": " << bytes << " live, " << peak << " peak";
+            if (live > 0)
+            {
+                std::cout << ", " << bytes / live << " per movie";
+            }
+            std::cout << std::endl;
+        }
+        std::cout << "Total: " << totalLive << " live";
+        if (live > 0)
+        {
+            std::cout << ", " << totalLive / live << " per movie";
+        }
+        std::cout << " (peak of each subsystem summed: " << totalPeak << ")" << std::endl;
+
+        // Text in the string fields of live movies and users, against the
+        // space the fields reserve
+        long long used = 0, reserved = 0;
+        for (int i = 0; i < movieCount; i++)
+        {
+            if (tombstone[i])
+            {
+                continue;
+            }
+            used += strlen(movies[i].title) + strlen(movies[i].director) + strlen(movies[i].genre) + 3;
+            for (int c = 0; c < movies[i].castCount; c++)
+            {
+                used += strlen(movies[i].cast[c]) + 1;
+            }
+            reserved += (long long)MAX_STRING_LENGTH * (3 + MAX_CAST);
+        }
+        int ratingsUsed = 0;
+        for (int u = 0; u < userCount; u++)
+        {
+            used += strlen(users[u].username) + 1;
+            reserved += MAX_STRING_LENGTH;
+            ratingsUsed += users[u].ratingCount;
+        }
+        if (reserved > 0)
+        {
+            std::cout << "String fields in use: " << used << " of " << reserved << " bytes ("
+                      << (100.0 * (reserved - used) / reserved) << "% padding)" << std::endl;
+        }
+        std::cout << "Rating slots in use: " << ratingsUsed << " of " << (long long)userCount * MAX_MOVIES << std::endl;
+        std::cout << "Fixed arrays hold " << MAX_MOVIES << " movies and " << MAX_USERS << " users; "
+                  << live << " movies and " << userCount << " users are in use." << std::endl;
+    }
+
+    // Write the statistics in Prometheus text format (for a textfile
+    // collector), replacing the file by rename so scrapes never see half
+    bool writeMetrics(const char *filename = METRICS_FILENAME)
+    {
+        Metrics::Totals *totals = new Metrics::Totals();
+        metrics.collect(*totals);
+        long long cacheHits, cacheMisses, searchHits, searchMisses;
+        resultCache.counters(cacheHits, cacheMisses);
+        queryCache.counters(searchHits, searchMisses);
+
+        char tempName[MAX_STRING_LENGTH + 8];
+        snprintf(tempName, sizeof(tempName), "%s.tmp", filename);
+        FILE *fp = fopen(tempName, "w");
+        if (!fp)
+        {
+            delete totals;
+            return false;
+        }
+        const char *counters[3][3] = {
+            {"moviedb_operations_total", "Calls of each operation.", "calls"},
+            {"moviedb_rows_scanned_total", "Movies examined by each operation.", "scanned"},
+            {"moviedb_rows_returned_total", "Movies returned by each operation.", "returned"}};
+        for (int c = 0; c < 3; c++)
+        {
+            fprintf(fp, "# HELP %s %s\n# TYPE %s counter\n", counters[c][0], counters[c][1], counters[c][0]);
+            for (int op = 0; op < OPERATION_COUNT; op++)
+            {
+                long long value = (c == 0) ? totals->calls[op] : (c == 1) ? totals->rowsScanned[op] : totals->rowsReturned[op];
+                fprintf(fp, "%s{operation=\"%s\"} %lld\n", counters[c][0], OPERATIONS[op].name, value);
+            }
+        }
+
+        // Histogram buckets end at powers of two, so every "le" bound
+        // below is exact
+        fprintf(fp, "# HELP moviedb_operation_duration_seconds Latency of the timed calls of each operation.\n");
+        fprintf(fp, "# TYPE moviedb_operation_duration_seconds histogram\n");
+        for (int op = 0; op < OPERATION_COUNT; op++)
+        {
+            long long cumulative = 0;
+            int bucket = 0;
+            for (int power = 8; power <= 36; power++) // 256 ns to about 69 s
+            {
+                long long bound = 1LL << power;
+                while (bucket < HISTOGRAM_BUCKETS && histogramBucketLimit(bucket) < bound)
+                {
+                    cumulative += totals->histogram[op][bucket++];
+                }
+                fprintf(fp, "moviedb_operation_duration_seconds_bucket{operation=\"%s\",le=\"%.9g\"} %lld\n",
+                        OPERATIONS[op].name, bound / 1e9, cumulative);
+            }
+            fprintf(fp, "moviedb_operation_duration_seconds_bucket{operation=\"%s\",le=\"+Inf\"} %lld\n",
+                    OPERATIONS[op].name, totals->timedCalls[op]);
+            fprintf(fp, "moviedb_operation_duration_seconds_sum{operation=\"%s\"} %.9f\n", OPERATIONS[op].name, totals->timedNanos[op] / 1e9);
+            fprintf(fp, "moviedb_operation_duration_seconds_count{operation=\"%s\"} %lld\n", OPERATIONS[op].name, totals->timedCalls[op]);
+        }
+
+        fprintf(fp, "# HELP moviedb_index_lookups_total Snapshot index lookups by outcome.\n# TYPE moviedb_index_lookups_total counter\n");
+        fprintf(fp, "moviedb_index_lookups_total{result=\"hit\"} %lld\n", totals->counters[COUNTER_INDEX_HITS]);
+        fprintf(fp, "moviedb_index_lookups_total{result=\"miss\"} %lld\n", totals->counters[COUNTER_INDEX_MISSES]);
+        fprintf(fp, "# HELP moviedb_cache_lookups_total Result cache lookups by outcome.\n# TYPE moviedb_cache_lookups_total counter\n");
+        fprintf(fp, "moviedb_cache_lookups_total{result=\"hit\"} %lld\n", cacheHits);
+        fprintf(fp, "moviedb_cache_lookups_total{result=\"miss\"} %lld\n", cacheMisses);
+        fprintf(fp, "# HELP moviedb_search_cache_lookups_total Search cache lookups by outcome.\n# TYPE moviedb_search_cache_lookups_total counter\n");
+        fprintf(fp, "moviedb_search_cache_lookups_total{result=\"hit\"} %lld\n", searchHits);
+        fprintf(fp, "moviedb_search_cache_lookups_total{result=\"miss\"} %lld\n", searchMisses);
+        delete totals;
+
+        fprintf(fp, "# HELP moviedb_memory_live_bytes Bytes allocated per subsystem.\n# TYPE moviedb_memory_live_bytes gauge\n");
+        for (int m = 0; m < MEMORY_SUBSYSTEM_COUNT; m++)
+        {
+            fprintf(fp, "moviedb_memory_live_bytes{subsystem=\"%s\"} %lld\n", MEMORY_SUBSYSTEM_NAMES[m], memoryAccounts[m].live.load());
+        }
+        fprintf(fp, "# HELP moviedb_memory_peak_bytes Most bytes allocated at once per subsystem.\n# TYPE moviedb_memory_peak_bytes gauge\n");
+        for (int m = 0; m < MEMORY_SUBSYSTEM_COUNT; m++)
+        {
+            fprintf(fp, "moviedb_memory_peak_bytes{subsystem=\"%s\"} %lld\n", MEMORY_SUBSYSTEM_NAMES[m], memoryAccounts[m].peak.load());
+        }
+
+        if (fclose(fp) != 0 || rename(tempName, filename) != 0)
+        {
+            remove(tempName);
+            return false;
+        }
+        return true;
+    }
+
+    // Read the user argument of RATE and RECOMMEND: a user ID, or "me" (or
+    // nothing) for the session's user. Returns -1 and sets error if there
+    // is no such user.
+    static int parseQueryUser(const char *&args, const CatalogSnapshot &snapshot, const Session *session, const char *&error)
+    {
+        int userId;
+        int consumed = 0;
+        bool self = false;
+        if ((args[0] == 'm' || args[0] == 'M') && (args[1] == 'e' || args[1] == 'E') && (args[2] == ' ' || args[2] == '\0'))
+        {
+            args += 2;
+            self = true;
+        }
+        else if (args[0] == '\0')
+        {
+            self = true;
+        }
+        else if (sscanf(args, "%d%n", &userId, &consumed) == 1)
+        {
+            args += consumed;
+        }
+        else
+        {
+            error = "User not found";
+            return -1;
+        }
+        while (*args == ' ')
+        {
+            args++;
+        }
+        if (self)
+        {
+            if (session == nullptr)
+            {
+                error = "Sessions are not available here: give a user ID";
+                return -1;
+            }
+            if (!session->loggedIn())
+            {
+                error = "Not logged in: LOGIN first or give a user ID";
+                return -1;
+            }
+            userId = session->userId;
+        }
+        if (snapshot.findUser(userId) == -1)
+        {
+            error = "User not found";
+            return -1;
+        }
+        return userId;
+    }
+
+    // Run one protocol query. Reads use the given pinned snapshot and
+    // ratings are queued as writes, so any number of threads can call this.
+    // The session is the caller's own; nullptr means the client has none.
+    //   SEARCH <text>                  movies whose title contains text
+    //   GENRE <genre>                  movies of a genre
+    //   DIRECTOR <name>                movies by a director
+    //   YEAR <year>                    movies released in a year
+    //   SIMILAR <title>                the most similar movies
+    //   RECOMMEND [userId|me]          recommendations for a user
+    //   RATE <userId|me> <rating> <title> rate a movie as a user
+    //   FACETS [SEARCH|GENRE|DIRECTOR|YEAR <arg>] facet counts of the
+    //                                  catalog or of a search's results
+    //   LOGIN <userId|username>        set the session's user
+    //   LOGOUT                         clear the session's user
+    //   RELOAD                         reload the database file (server only)
+    //   PING                           check the connection
+    void executeQuery(const char *line, const CatalogSnapshot &snapshot, Session *session, QueryResult &result)
+    {
+        result.ok = true;
+        result.error = nullptr;
+        result.queuedWrite = false;
+        result.count = 0;
+        result.faceted = false;
+
+        char command[16];
+        int length = 0;
+        while (*line == ' ')
+        {
+            line++;
+        }
+        while (line[length] != '\0' && line[length] != ' ' && length < 15)
+        {
+            char c = line[length];
+            command[length++] = (c >= 'a' && c <= 'z') ? c - 'a' + 'A' : c;
+        }
+        command[length] = '\0';
+        const char *args = line + length;
+        while (*args == ' ')
+        {
+            args++;
+        }
+
+        // Searches go through the query cache, keyed by the snapshot's
+        // catalog version; a hit scans no rows. Index lookups only read the
+        // movies listed under the key, so they scan as many rows as they return.
+        char key[16];
+        bool hit;
+        if (strcmp(command, "SEARCH") == 0)
+        {
+            OperationTimer timer(metrics, OP_QUERY_SEARCH);
+            result.count = cachedSearch('T', args, snapshot.catalogVersion, result.positions, [&snapshot, args](int results[])
+                                        { return snapshot.searchByTitle(args, results, MAX_MOVIES); }, hit);
+            timer.rows(hit ? 0 : snapshot.liveCount(), result.count);
+        }
+        else if (strcmp(command, "GENRE") == 0 || strcmp(command, "DIRECTOR") == 0)
+        {
+            bool genre = command[0] == 'G';
+            OperationTimer timer(metrics, genre ? OP_QUERY_GENRE : OP_QUERY_DIRECTOR);
+            snprintf(key, sizeof(key), "%d", nameDictionary.find(args));
+            result.count = cachedSearch(genre ? 'G' : 'D', key, snapshot.catalogVersion, result.positions, [&snapshot, args, genre](int results[])
+                                        { return genre ? snapshot.searchByGenre(args, results, MAX_MOVIES)
+                                                       : snapshot.searchByDirector(args, results, MAX_MOVIES); }, hit);
+            timer.rows(hit ? 0 : result.count, result.count);
+            timer.indexLookup(result.count > 0);
+        }
+        else if (strcmp(command, "YEAR") == 0)
+        {
+            OperationTimer timer(metrics, OP_QUERY_YEAR);
+            int year = atoi(args);
+            snprintf(key, sizeof(key), "%d", year);
+            result.count = cachedSearch('Y', key, snapshot.catalogVersion, result.positions, [&snapshot, year](int results[])
+                                        { return snapshot.searchByYear(year, results, MAX_MOVIES); }, hit);
+            timer.rows(hit ? 0 : result.count, result.count);
+            timer.indexLookup(result.count > 0);
+        }
+        else if (strcmp(command, "SIMILAR") == 0)
+        {
+            OperationTimer timer(metrics, OP_QUERY_SIMILAR);
+            int target = snapshot.findByTitle(args);
+            timer.indexLookup(target != -1);
+            if (target == -1)
+            {
+                result.ok = false;
+                result.error = "Movie not found";
+                return;
+            }
+            result.count = snapshot.findSimilar(target, result.positions, RECOMMENDATION_COUNT);
+            timer.rows(snapshot.liveCount(), result.count);
+        }
+        else if (strcmp(command, "RECOMMEND") == 0)
+        {
+            OperationTimer timer(metrics, OP_QUERY_RECOMMEND);
+            int userId = parseQueryUser(args, snapshot, session, result.error);
+            if (userId == -1)
+            {
+                result.ok = false;
+                return;
+            }
+            int basedOn;
+            result.count = snapshot.recommendFor(userId, result.positions, RECOMMENDATION_COUNT, basedOn);
+            timer.rows(basedOn == -1 ? 0 : snapshot.liveCount(), result.count);
+            if (basedOn == -1)
+            {
+                result.ok = false;
+                result.error = "No ratings to base recommendations on";
+            }
+        }
+        else if (strcmp(command, "RATE") == 0)
+        {
+            OperationTimer timer(metrics, OP_QUERY_RATE);
+            float rating;
+            int consumed = 0;
+            int userId = parseQueryUser(args, snapshot, session, result.error);
+            if (userId == -1)
+            {
+                result.ok = false;
+            }
+            else if (sscanf(args, "%f %n", &rating, &consumed) < 1 || args[consumed] == '\0')
+            {
+                result.ok = false;
+                result.error = "Usage: RATE <userId|me> <rating> <title>";
+            }
+            else if (rating < 0 || rating > 10)
+            {
+                result.ok = false;
+                result.error = "Rating must be between 0 and 10";
+            }
+            else if (snapshot.findByTitle(args + consumed) == -1)
+            {
+                result.ok = false;
+                result.error = "Movie not found";
+            }
+            else if (follower)
+            {
+                result.ok = false;
+                result.error = "Read-only replica: send writes to the primary";
+            }
+            else
+            {
+                submitRating(userId, args + consumed, rating);
+                result.queuedWrite = true;
+            }
+        }
+        else if (strcmp(command, "FACETS") == 0)
+        {
+            OperationTimer timer(metrics, OP_QUERY_FACETS);
+            if (*args == '\0')
+            {
+                result.facets = snapshot.facets();
+                timer.rows(0, result.facets.total);
+            }
+            else
+            {
+                char inner[16];
+                int n = 0;
+                while (args[n] != '\0' && args[n] != ' ' && n < 15)
+                {
+                    char c = args[n];
+                    inner[n++] = (c >= 'a' && c <= 'z') ? c - 'a' + 'A' : c;
+                }
+                inner[n] = '\0';
+                if (strcmp(inner, "SEARCH") != 0 && strcmp(inner, "GENRE") != 0 &&
+                    strcmp(inner, "DIRECTOR") != 0 && strcmp(inner, "YEAR") != 0)
+                {
+                    result.ok = false;
+                    result.error = "Usage: FACETS [SEARCH|GENRE|DIRECTOR|YEAR <arg>]";
+                    return;
+                }
+                executeQuery(args, snapshot, session, result);
+                snapshot.countFacets(result.positions, result.count, result.facets);
+                timer.rows(result.count, result.facets.total);
+            }
+            result.faceted = true;
+        }
+        else if ((strcmp(command, "LOGIN") == 0 || strcmp(command, "LOGOUT") == 0) && session == nullptr)
+        {
+            result.ok = false;
+            result.error = "Sessions are not available here";
+        }
+        else if (strcmp(command, "LOGOUT") == 0)
+        {
+            session->userId = -1;
+        }
+        else if (strcmp(command, "LOGIN") == 0)
+        {
+            int userId;
+            int consumed = 0;
+            int slot = (sscanf(args, "%d%n", &userId, &consumed) == 1 && args[consumed] == '\0')
+                           ? snapshot.findUser(userId)
+                           : snapshot.findUserByName(args);
+            if (slot == -1)
+            {
+                result.ok = false;
+                result.error = "User not found";
+                return;
+            }
+            session->userId = snapshot.userRows[slot]->userId;
+        }
+        else if (strcmp(command, "RELOAD") == 0)
+        {
+            if (session == nullptr)
+            {
+                result.ok = false;
+                result.error = "Reloads are not available here";
+            }
+            else if (!acceptsReloads())
+            {
+                result.ok = false;
+                result.error = "The primary does not reload its own file";
+            }
+            else
+            {
+                requestReload(); // Served in the background by the server
+            }
+        }
+        else if (strcmp(command, "PING") != 0)
+        {
+            result.ok = false;
+            result.error = "Unknown command";
+        }
+    }
+
+    // Mixed read/write load on snapshots: reader threads run searches and
+    // similarity queries while one writer keeps submitting ratings.
+    // Reports read throughput for an increasing number of reader threads.
+    void runConcurrencyTest(double secondsPerRun)
+    {
+        publishSnapshot();
+        int maxReaders = WorkStealingPool::defaultWorkerCount();
+        if (maxReaders > MAX_READER_THREADS - 1)
+        {
+            maxReaders = MAX_READER_THREADS - 1;
+        }
+
+        std::cout << "Concurrent read test (" << secondsPerRun << " s per run, 1 writer)" << std::endl;
+        for (int readers = 1; readers <= maxReaders; readers *= 2)
+        {
+            std::atomic<bool> stop(false);
+            std::atomic<long long> reads(0);
+            long long writes = 0;
+            unsigned long long firstVersion = snapshotVersion;
+
+            std::thread *threads = new std::thread[readers];
+            for (int t = 0; t < readers; t++)
+            {
+                threads[t] = std::thread([this, &stop, &reads, t]()
+                                         {
+                    const char *queries[] = {"The", "Dune", "Part", "a", "Kill"};
+                    int results[MAX_MOVIES];
+                    long long local = 0;
+                    unsigned int seed = 12345u + t;
+                    while (!stop.load(std::memory_order_relaxed))
+                    {
+                        SnapshotReader snapshot = readSnapshot();
+                        seed = seed * 1103515245u + 12345u;
+                        if (snapshot->movieCount > 0)
+                        {
+                            snapshot->searchByTitle(queries[(seed >> 16) % 5], results, MAX_MOVIES);
+                            snapshot->findSimilar((seed >> 8) % snapshot->movieCount, results, RECOMMENDATION_COUNT);
+                        }
+                        local++;
+                    }
+                    reads += local; });
+            }
+
+            auto start = std::chrono::steady_clock::now();
+            double elapsed = 0.0;
+            while (elapsed < secondsPerRun)
+            {
+                if (userCount > 0 && movieCount > 0)
+                {
+                    submitRating(users[writes % userCount].userId, movies[(writes * 7) % movieCount].title, (float)(writes % 11));
+                    writes++;
+                }
+                std::this_thread::yield();
+                elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            }
+            stop = true;
+            for (int t = 0; t < readers; t++)
+            {
+                threads[t].join();
+            }
+            delete[] threads;
+            flushWrites();
+
+            std::cout << readers << " reader(s): " << (long long)(reads.load() / elapsed) << " reads/sec, "
+                      << (long long)(writes / elapsed) << " writes/sec, "
+                      << snapshotVersion - firstVersion << " snapshots published" << std::endl;
+        }
+    }
+
+    void logUserAdded(const User &user)
+    {
+        LogUser added;
+        memset(&added, 0, sizeof(added));
+        added.userId = user.userId;
+        strcpy(added.username, user.username);
+        logChange(LOG_ADD_USER, &added, sizeof(added));
+        storeChange(user.userId, 'U', user.username, 0.0f);
+    }
+
+    // Slot of a user in the users array, or -1
+    int findUserSlot(int userId) const
+    {
+        return userIndex.findId(userId);
+    }
+
+    int findUserSlotByName(const char *username) const
+    {
+        return userIndex.findName(username, [this](int slot)
+                                  { return (const char *)users[slot].username; });
+    }
+
+    // Slot of the session's user, or -1 when nobody is logged in
+    int sessionUserSlot(const Session &session) const
+    {
+        return session.loggedIn() ? findUserSlot(session.userId) : -1;
+    }
+
+    // Login as a user
+    bool loginUser(Session &session, int userId)
+    {
+        int slot = findUserSlot(userId);
+        if (slot != -1)
+        {
+            session.userId = userId;
+            std::cout << "Logged in as " << users[slot].username << std::endl;
+            return true;
+        }
+        std::cout << "User not found!" << std::endl;
+        return false;
+    }
+
+    // Create a new user
+    void createUser(Session &session, const char *username)
+    {
+        if (userCount < MAX_USERS)
+        {
+            int newId = userCount + 1;
+            while (findUserSlot(newId) != -1) // IDs loaded from a file may not be contiguous
+            {
+                newId++;
+            }
+            User newUser;
+            newUser.initialize(newId, username);
+            userIndex.insert(userCount, newId, username);
+            users[userCount++] = newUser;
+            logUserAdded(newUser);
+            session.userId = newId;
+            std::cout << "Created user " << username << " with ID " << newId << std::endl;
+        }
+        else
+        {
+            std::cout << "Error: Maximum users reached." << std::endl;
+        }
+    }
+
+    // Set a user's rating for a movie and keep every derived structure
+    // (aggregates, trending, precomputed table, caches) in step
+    User::RatingResult applyRating(int userSlot, const Movie &movie, float rating)
+    {
+        const char *title = movie.title;
+        float previous = users[userSlot].getRating(title);
+        User::RatingResult result = users[userSlot].setRating(title, rating);
+        if (result != User::RATING_ADDED && result != User::RATING_UPDATED)
+        {
+            return result;
+        }
+        LogRating change;
+        memset(&change, 0, sizeof(change));
+        change.userId = users[userSlot].userId;
+        change.rating = rating;
+        strcpy(change.title, title);
+        logChange(LOG_RATE_MOVIE, &change, sizeof(change));
+        storeChange(change.userId, 'R', title, rating);
+
+        // Feed the change into the movie's running aggregates
+        if (previous < 0)
+        {
+            ratingAggregates.getOrCreate(title)->add(rating);
+        }
+        else if (rating != previous)
+        {
+            ratingAggregates.getOrCreate(title)->change(previous, rating);
+        }
+        trending.recordRating(movie);
+        recommendationTable.invalidateUser(userSlot);
+
+        if (rating != previous)
+        {
+            // The user's top movie and this movie's score may have changed
+            resultCache.invalidateUser(users[userSlot].userId);
+            userRowChanged(userSlot);
+            userScoreChanged(title);
+        }
+        return result;
+    }
+
+    // Rate a movie
+    void rateMovie(const Session &session, const char *title, float rating)
+    {
+        OperationTimer timer(metrics, OP_RATE);
+        timer.describe(title);
+        int userSlot;
+        {
+            TraceSpan span("user lookup");
+            userSlot = sessionUserSlot(session);
+        }
+        if (userSlot == -1)
+        {
+            std::cout << "Please login first!" << std::endl;
+            return;
+        }
+
+        // Find the movie
+        Movie *movie;
+        {
+            TraceSpan span("movie lookup");
+            movie = getMovieByTitle(title);
+        }
+        if (movie == nullptr)
+        {
+            std::cout << "Movie not found!" << std::endl;
+            return;
+        }
+
+        User::RatingResult result;
+        {
+            TraceSpan span("apply rating");
+            result = applyRating(userSlot, *movie, rating);
+        }
+        User::printRatingResult(result);
+    }
+
+    // Display user ratings
+    void displayUserRatings(const Session &session)
+    {
+        int userSlot = sessionUserSlot(session);
+        if (userSlot == -1)
+        {
+            std::cout << "Please login first!" << std::endl;
+            return;
+        }
+        users[userSlot].displayRatings();
+    }
+
+    // Calculate similarity between two movies
+    float calculateMovieSimilarity(const Movie &movie1, const Movie &movie2) const
+    {
+        return scoreSimilarity(movie1, getUserScore(movie1), movie2, getUserScore(movie2));
+    }
+
+    // Compute the positions of the movies most similar to a target movie,
+    // best first. Does not modify the database, so it is safe to call from
+    // several threads at once.
+    int computeSimilarMovies(const Movie &target, int results[], int maxResults, float *scoresOut = nullptr) const
+    {
+        TopSimilar top(maxResults);
+        for (int i = 0; i < movieCount; i++)
+        {
+            if (!tombstone[i] && strcmp(movies[i].title, target.title) != 0) // Skip the target movie
+            {
+                top.offer(i, calculateMovieSimilarity(target, movies[i]));
+            }
+        }
+        for (int i = 0; i < top.count; i++)
+        {
+            results[i] = top.positions[i];
+            if (scoresOut != nullptr)
+            {
+                scoresOut[i] = top.scores[i];
+            }
+        }
+        return top.count;
+    }
+
+    // Find similar movies
+    void findSimilarMovies(const char *title)
+    {
+        OperationTimer timer(metrics, OP_SIMILAR);
+        timer.describe(title);
+        Movie *targetMovie;
+        {
+            TraceSpan span("movie lookup");
+            targetMovie = getMovieByTitle(title);
+        }
+        if (targetMovie == nullptr)
+        {
+            std::cout << "Movie not found!" << std::endl;
+            return;
+        }
+        trending.recordSearch(*targetMovie);
+
+        // Serve from the cache when the inputs have not changed
+        int similar[RECOMMENDATION_COUNT];
+        int count;
+        bool cached;
+        {
+            TraceSpan span("cache lookup");
+            cached = resultCache.lookupSimilar(targetMovie->title, count, similar);
+        }
+        if (!cached)
+        {
+            float scores[RECOMMENDATION_COUNT];
+            {
+                TraceSpan span("similarity scan");
+                count = computeSimilarMovies(*targetMovie, similar, 5, scores);
+            }
+            resultCache.storeSimilar(targetMovie->title, count, similar, (count > 0) ? scores[count - 1] : 0.0f);
+            timer.rows(movieCount - tombstoneCount, count);
+        }
+        else
+        {
+            timer.rows(0, count);
+        }
+
+        // Display the top 5 similar movies
+        TraceSpan span("output");
+        std::cout << "Similar movies to " << title << ":" << std::endl;
+        for (int i = 0; i < count; i++)
+        {
+            movies[similar[i]].display();
+        }
+    }
+
+    // Get recommendations based on user's highest rated movie
+    void getRecommendations(const Session &session)
+    {
+        OperationTimer timer(metrics, OP_RECOMMEND);
+        if (!session.loggedIn())
+        {
+            std::cout << "Please login first!" << std::endl;
+            return;
+        }
+
+        char detail[16];
+        snprintf(detail, sizeof(detail), "user %d", session.userId);
+        timer.describe(detail);
+
+        // Find the current user
+        int userSlot;
+        {
+            TraceSpan span("user lookup");
+            userSlot = findUserSlot(session.userId);
+        }
+        User *currentUser = (userSlot != -1) ? &users[userSlot] : nullptr;
+
+        if (currentUser == nullptr || currentUser->ratingCount == 0)
+        {
+            std::cout << "Please rate some movies first to get recommendations." << std::endl;
+            return;
+        }
+
+        std::cout << "\n--- Recommendations for " << currentUser->username << " ---" << std::endl;
+
+        // Serve from the precomputed table when the batch job has a fresh row
+        const RecommendationRow *row;
+        {
+            TraceSpan span("precomputed lookup");
+            row = recommendationTable.lookup(userSlot, session.userId, layoutVersion);
+        }
+        if (row != nullptr && row->basedOn >= 0)
+        {
+            TraceSpan span("output");
+            std::cout << "Based on your highest rated movie (" << movies[row->basedOn].title << ") [precomputed]:" << std::endl;
+            for (int i = 0; i < row->count; i++)
+            {
+                movies[row->movieIndex[i]].display();
+            }
+            return;
+        }
+
+        // Find highest rated movie (cached until the user rates again)
+        char highestRatedMovie[MAX_STRING_LENGTH];
+        {
+            TraceSpan span("highest rated");
+            if (!resultCache.lookupUser(session.userId, highestRatedMovie))
+            {
+                findHighestRated(*currentUser, highestRatedMovie);
+                resultCache.storeUser(session.userId, highestRatedMovie);
+            }
+        }
+
+        // Find similar movies to the highest rated
+        if (highestRatedMovie[0] != '\0')
+        {
+            std::cout << "Based on your highest rated movie (" << highestRatedMovie << "):" << std::endl;
+            findSimilarMovies(highestRatedMovie);
+        }
+    }
+
+    // Batch job: precompute the top recommendations of every user in parallel
+    // and keep them in the recommendation table (saved with the database)
+    void precomputeRecommendations()
+    {
+        OperationTimer timer(metrics, OP_PRECOMPUTE);
+        WorkStealingPool pool;
+        auto start = std::chrono::steady_clock::now();
+
+        pool.parallelFor(userCount, 1, [this](int begin, int end)
+                         {
+            for (int u = begin; u < end; u++)
+            {
+                RecommendationRow &row = recommendationTable.rows[u];
+                row.userId = users[u].userId;
+                row.basedOn = -1;
+                row.count = 0;
+
+                char highestRatedMovie[MAX_STRING_LENGTH];
+                findHighestRated(users[u], highestRatedMovie);
+                for (int i = 0; i < movieCount && highestRatedMovie[0] != '\0'; i++)
+                {
+                    if (!tombstone[i] && strcmp(movies[i].title, highestRatedMovie) == 0)
+                    {
+                        int similar[RECOMMENDATION_COUNT];
+                        row.basedOn = (short)i;
+                        row.count = (short)computeSimilarMovies(movies[i], similar, RECOMMENDATION_COUNT);
+                        for (int j = 0; j < row.count; j++)
+                        {
+                            row.movieIndex[j] = (short)similar[j];
+                        }
+                        break;
+                    }
+                }
+            } });
+
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        recommendationTable.rowCount = userCount;
+        recommendationTable.layoutVersion = layoutVersion;
+        recommendationTable.valid = true;
+        resultCache.invalidateAll(true);
+
+        std::cout << "Precomputed recommendations for " << userCount << " users on "
+                  << pool.getWorkerCount() << " threads in " << seconds * 1000.0 << " ms";
+        if (seconds > 0)
+        {
+            std::cout << " (" << (long long)(userCount / seconds) << " users/sec)";
+        }
+        std::cout << std::endl;
+    }
+
+    // Modified runMenu to handle database saving
+    void runMenu()
+    {
+        // If no data loaded from file, add sample users
+        if (userCount == 0)
+        {
+            User user1;
+            user1.initialize(1, "Alice");
+            addUser(user1);
+
+            User user2;
+            user2.initialize(2, "Bob");
+            addUser(user2);
+
+            User user3;
+            user3.initialize(3, "Charlie");
+            addUser(user3);
+        }
+
+        Session session; // The menu is a single session
+        int choice;
+        do
+        {
+            std::cout << "\nMovie Database Search System\n";
+            std::cout << "1. Search by Title\n";
+            std::cout << "2. Search by Release Year\n";
+            std::cout << "3. Add Movie\n";
+            std::cout << "4. Delete Movie\n";
+            std::cout << "5. View All Movies\n";
+            std::cout << "6. Search by Genre\n";
+            std::cout << "7. Search by Director\n";
+            std::cout << "8. Sort by Rating (Bubble Sort)\n";
+            std::cout << "9. Sort by Rating (Selection Sort)\n";
+            std::cout << "10. User Login/Switch\n";
+            std::cout << "11. Rate a Movie\n";
+            std::cout << "12. View My Ratings\n";
+            std::cout << "13. Get Movie Recommendations\n";
+            std::cout << "14. Find Similar Movies\n";
+            std::cout << "15. Save Database\n"; // New option
+            std::cout << "16. Sort by User Score\n";
+            std::cout << "17. Top Rated by Users\n";
+            std::cout << "18. Trending Movies\n";
+            std::cout << "19. Precompute Recommendations (Batch)\n";
+            std::cout << "20. Cache Statistics\n";
+            std::cout << "21. Find Duplicate Movies\n";
+            std::cout << "22. Reload Database File\n";
+            std::cout << "23. Performance Statistics\n";
+            std::cout << "24. Memory Report\n";
+            std::cout << "25. Browse Facets\n";
+            std::cout << "26. Exit\n"; // Changed to 26
+            std::cout << "Enter your choice: ";
+            std::cin >> choice;
+            std::cin.ignore(); // Ignore the newline character left in the input buffer
+
+            // Display current user if logged in
+            int sessionSlot = sessionUserSlot(session);
+            if (sessionSlot != -1)
+            {
+                std::cout << "[Currently logged in as: " << users[sessionSlot].username << "]" << std::endl;
+            }
+
+            switch (choice)
+            {
+            case 1:
+            {
+                char title[MAX_STRING_LENGTH];
+                std::cout << "Enter movie title: ";
+                std::cin.getline(title, MAX_STRING_LENGTH);
+                searchByTitle(title);
+                break;
+            }
+            case 2:
+            {
+                int year;
+                std::cout << "Enter release year: ";
+                std::cin >> year;
+                searchByYear(year);
+                break;
+            }
+            case 3:
+            {
+                Movie movie;
+                char title[MAX_STRING_LENGTH];
+                int releaseYear;
+                char director[MAX_STRING_LENGTH];
+                char genre[MAX_STRING_LENGTH];
+                float rating;
+                int duration;
+
+                std::cout << "Enter movie title: ";
+                std::cin.ignore();
+                std::cin.getline(title, MAX_STRING_LENGTH);
+
+                std::cout << "Enter release year: ";
+                std::cin >> releaseYear;
+
+                std::cout << "Enter director: ";
+                std::cin.ignore();
+                std::cin.getline(director, MAX_STRING_LENGTH);
+
+                std::cout << "Enter genre: ";
+                std::cin.getline(genre, MAX_STRING_LENGTH);
+
+                std::cout << "Enter rating: ";
+                std::cin >> rating;
+
+                std::cout << "Enter duration (in minutes): ";
+                std::cin >> duration;
+
+                int castCount;
+                std::cout << "Enter number of cast members (max 5): ";
+                std::cin >> castCount;
+                if (castCount > MAX_CAST)
+                    castCount = MAX_CAST;
+                std::cin.ignore();
+
+                char castList[MAX_CAST][MAX_STRING_LENGTH];
+                for (int i = 0; i < castCount; i++)
+                {
+                    std::cout << "Enter cast member " << i + 1 << ": ";
+                    std::cin.getline(castList[i], MAX_STRING_LENGTH);
+                }
+
+                movie.initialize(title, releaseYear, director, castList, castCount, genre, rating, duration);
+                addMovie(movie);
+                break;
+            }
+            case 4:
+            {
+                char title[MAX_STRING_LENGTH];
+                std::cout << "Enter movie title to delete: ";
+                std::cin.getline(title, MAX_STRING_LENGTH);
+                deleteMovie(title);
+                compactIfNeeded();
+                break;
+            }
+            case 5:
+                viewAllMovies();
+                break;
+            case 6:
+            {
+                char genre[MAX_STRING_LENGTH];
+                std::cout << "Enter genre: ";
+                std::cin.getline(genre, MAX_STRING_LENGTH);
+                searchByGenre(genre);
+                break;
+            }
+            case 7:
+            {
+                char director[MAX_STRING_LENGTH];
+                std::cout << "Enter director: ";
+                std::cin.getline(director, MAX_STRING_LENGTH);
+                searchByDirector(director);
+                break;
+            }
+            case 8:
+                sortByRatingBubble();
+                viewAllMovies();
+                break;
+            case 9:
+                sortByRatingSelection();
+                viewAllMovies();
+                break;
+            case 10:
+            {
+                int option;
+                std::cout << "1. Login as existing user\n";
+                std::cout << "2. Create new user\n";
+                std::cout << "Enter option: ";
+                std::cin >> option;
+
+                if (option == 1)
+                {
+                    int userId;
+                    std::cout << "Available users:" << std::endl;
+                    for (int i = 0; i < userCount; i++)
+                    {
+                        std::cout << users[i].userId << ": " << users[i].username << std::endl;
+                    }
+                    std::cout << "Enter user ID: ";
+                    std::cin >> userId;
+                    loginUser(session, userId);
+                }
+                else if (option == 2)
+                {
+                    char username[MAX_STRING_LENGTH];
+                    std::cout << "Enter username: ";
+                    std::cin.ignore();
+                    std::cin.getline(username, MAX_STRING_LENGTH);
+                    createUser(session, username);
+                }
+                break;
+            }
+            case 11:
+            {
+                if (!session.loggedIn())
+                {
+                    std::cout << "Please login first!" << std::endl;
+                    break;
+                }
+
+                char title[MAX_STRING_LENGTH];
+                float rating;
+
+                std::cout << "Available movies:" << std::endl;
+                for (int i = 0; i < movieCount; i++)
+                {
+                    if (!tombstone[i])
+                    {
+                        std::cout << "- " << movies[i].title << std::endl;
+                    }
+                }
+
+                std::cout << "Enter movie title: ";
+                std::cin.getline(title, MAX_STRING_LENGTH);
+
+                std::cout << "Enter rating (0-10): ";
+                std::cin >> rating;
+
+                rateMovie(session, title, rating);
+                break;
+            }
+            case 12:
+                displayUserRatings(session);
+                break;
+            case 13:
+                getRecommendations(session);
+                break;
+            case 14:
+            {
+                char title[MAX_STRING_LENGTH];
+                std::cout << "Enter movie title to find similar movies: ";
+                std::cin.getline(title, MAX_STRING_LENGTH);
+                findSimilarMovies(title);
+                break;
+            }
+            case 15:
+                // Save database to file
+                saveToFile();
+                break;
+
+            case 16:
+                sortByUserScore();
+                viewAllMovies();
+                break;
+            case 17:
+                displayTopRated(10);
+                break;
+            case 18:
+            {
+                char genre[MAX_STRING_LENGTH];
+                std::cout << "Enter genre (leave empty for all genres): ";
+                std::cin.getline(genre, MAX_STRING_LENGTH);
+                displayTrending(genre);
+                break;
+            }
+            case 19:
+                precomputeRecommendations();
+                break;
+            case 20:
+                displayCacheStats();
+                break;
+            case 21:
+            {
+                char answer;
+                std::cout << "Merge duplicates into the first copy? (y/n): ";
+                std::cin >> answer;
+                findDuplicateMovies(answer == 'y' || answer == 'Y');
+                compactIfNeeded();
+                break;
+            }
+
+            case 22:
+                reloadFromFile();
+                break;
+
+            case 23:
+                displayStatistics();
+                if (writeMetrics())
+                {
+                    std::cout << "Statistics written to " << METRICS_FILENAME << std::endl;
+                }
+                break;
+
+            case 24:
+                displayMemoryReport();
+                break;
+
+            case 25:
+            {
+                char text[MAX_STRING_LENGTH];
+                std::cout << "Enter title text (leave empty for the whole catalog): ";
+                std::cin.getline(text, MAX_STRING_LENGTH);
+                displayFacets(text);
+                break;
+            }
+
+            case 26:
+                // Save database before exiting
+                std::cout << "Saving database before exiting..." << std::endl;
+                saveToFile();
+                std::cout << "Exiting..." << std::endl;
+                break;
+
+            default:
+                std::cout << "Invalid choice. Please try again." << std::endl;
+            }
+        } while (choice != 26); // Changed to 26
+    }
+
+    // Initialize the database with sample data
+    void initializeWithSampleData()
+    {
+        // Sample data for The Shawshank Redemption
+        char cast1[MAX_CAST][MAX_STRING_LENGTH] = {"Tim Robbins", "Morgan Freeman", "Bob Gunton"};
+        Movie movie1;
+        movie1.initialize("The Shawshank Redemption", 1994, "Frank Darabont", cast1, 3, "Drama", 9.3f, 142);
+        addMovie(movie1);
+
+        // Sample data for The Godfather
+        char cast2[MAX_CAST][MAX_STRING_LENGTH] = {"Marlon Brando", "Al Pacino", "James Caan"};
+        Movie movie2;
+        movie2.initialize("The Godfather", 1972, "Francis Ford Coppola", cast2, 3, "Crime", 9.2f, 175);
+        addMovie(movie2);
+
+        // Sample data for The Dark Knight
+        char cast3[MAX_CAST][MAX_STRING_LENGTH] = {"Christian Bale", "Heath Ledger", "Aaron Eckhart"};
+        Movie movie3;
+        movie3.initialize("The Dark Knight", 2008, "Christopher Nolan", cast3, 3, "Action", 8.9f, 152);
+        addMovie(movie3);
+
+        // Sample data for Pulp Fiction
+        char cast4[MAX_CAST][MAX_STRING_LENGTH] = {"John Travolta", "Uma Thurman", "Samuel L. Jackson"};
+        Movie movie4;
+        movie4.initialize("Pulp Fiction", 1994, "Quentin Tarantino", cast4, 3, "Crime", 8.5f, 154);
+        addMovie(movie4);
+
+        // Sample data for Inception
+        char cast5[MAX_CAST][MAX_STRING_LENGTH] = {"Leonardo DiCaprio", "Joseph Gordon-Levitt", "Elliot Page"};
+        Movie movie5;
+        movie5.initialize("Inception", 2010, "Christopher Nolan", cast5, 3, "Sci-Fi", 8.8f, 148);
+        addMovie(movie5);
+
+        // Add recent English and Hindi movies (2020-2025)
+        addRecentMovies();
+    }
+
+    // Function to add recent English and Hindi movies (2020-2025)
+    void addRecentMovies()
+    {
+        // English Movies (2020-2025)
+
+        // Dune (2021)
+        char castDune[MAX_CAST][MAX_STRING_LENGTH] = {"Timothee Chalamet", "Rebecca Ferguson", "Zendaya", "Oscar Isaac", "Jason Momoa"};
+        Movie dune;
+        dune.initialize("Dune", 2021, "Denis Villeneuve", castDune, 5, "Sci-Fi", 8.0f, 155);
+        addMovie(dune);
+
+        // No Time To Die (2021)
+        char castBond[MAX_CAST][MAX_STRING_LENGTH] = {"Daniel Craig", "Lea Seydoux", "Rami Malek", "Lashana Lynch", "Ana de Armas"};
+        Movie noTimeToDie;
+        noTimeToDie.initialize("No Time To Die", 2021, "Cary Joji Fukunaga", castBond, 5, "Action", 7.3f, 163);
+        addMovie(noTimeToDie);
+
+        // Oppenheimer (2023)
+        char castOppenheimer[MAX_CAST][MAX_STRING_LENGTH] = {"Cillian Murphy", "Emily Blunt", "Matt Damon", "Robert Downey Jr.", "Florence Pugh"};
+        Movie oppenheimer;
+        oppenheimer.initialize("Oppenheimer", 2023, "Christopher Nolan", castOppenheimer, 5, "Drama", 8.4f, 180);
+        addMovie(oppenheimer);
+
+        // Barbie (2023)
+        char castBarbie[MAX_CAST][MAX_STRING_LENGTH] = {"Margot Robbie", "Ryan Gosling", "America Ferrera", "Kate McKinnon", "Issa Rae"};
+        Movie barbie;
+        barbie.initialize("Barbie", 2023, "Greta Gerwig", castBarbie, 5, "Comedy", 7.0f, 114);
+        addMovie(barbie);
+
+        // Inside Out 2 (2024)
+        char castInsideOut[MAX_CAST][MAX_STRING_LENGTH] = {"Amy Poehler", "Maya Hawke", "Kensington Tallman", "Liza Lapira", "Lewis Black"};
+        Movie insideOut2;
+        insideOut2.initialize("Inside Out 2", 2024, "Kelsey Mann", castInsideOut, 5, "Animation", 7.9f, 96);
+        addMovie(insideOut2);
+
+        // Tenet (2020)
+        char castTenet[MAX_CAST][MAX_STRING_LENGTH] = {"John David Washington", "Robert Pattinson", "Elizabeth Debicki", "Kenneth Branagh", "Dimple Kapadia"};
+        Movie tenet;
+        tenet.initialize("Tenet", 2020, "Christopher Nolan", castTenet, 5, "Sci-Fi", 7.3f, 150);
+        addMovie(tenet);
+
+        // The Batman (2022)
+        char castBatman[MAX_CAST][MAX_STRING_LENGTH] = {"Robert Pattinson", "Zoe Kravitz", "Paul Dano", "Jeffrey Wright", "Colin Farrell"};
+        Movie theBatman;
+        theBatman.initialize("The Batman", 2022, "Matt Reeves", castBatman, 5, "Action", 7.8f, 176);
+        addMovie(theBatman);
+
+        // Everything Everywhere All at Once (2022)
+        char castEverything[MAX_CAST][MAX_STRING_LENGTH] = {"Michelle Yeoh", "Ke Huy Quan", "Stephanie Hsu", "Jamie Lee Curtis", "James Hong"};
+        Movie everything;
+        everything.initialize("Everything Everywhere All at Once", 2022, "Daniel Kwan, Daniel Scheinert", castEverything, 5, "Sci-Fi", 7.8f, 139);
+        addMovie(everything);
+
+        // Killers of the Flower Moon (2023)
+        char castKillers[MAX_CAST][MAX_STRING_LENGTH] = {"Leonardo DiCaprio", "Robert De Niro", "Lily Gladstone", "Jesse Plemons", "Tantoo Cardinal"};
+        Movie killers;
+        killers.initialize("Killers of the Flower Moon", 2023, "Martin Scorsese", castKillers, 5, "Crime", 7.7f, 206);
+        addMovie(killers);
+
+        // Dune: Part Two (2024)
+        char castDune2[MAX_CAST][MAX_STRING_LENGTH] = {"Timothee Chalamet", "Zendaya", "Rebecca Ferguson", "Austin Butler", "Florence Pugh"};
+        Movie dune2;
+        dune2.initialize("Dune: Part Two", 2024, "Denis Villeneuve", castDune2, 5, "Sci-Fi", 8.6f, 166);
+        addMovie(dune2);
+
+        // Hindi Movies (2020-2025)
+
+        // Pathaan (2023)
+        char castPathaan[MAX_CAST][MAX_STRING_LENGTH] = {"Shah Rukh Khan", "Deepika Padukone", "John Abraham", "Dimple Kapadia", "Ashutosh Rana"};
+        Movie pathaan;
+        pathaan.initialize("Pathaan", 2023, "Siddharth Anand", castPathaan, 5, "Action", 5.9f, 146);
+        addMovie(pathaan);
+
+        // Brahmastra: Part One (2022)
+        char castBrahmastra[MAX_CAST][MAX_STRING_LENGTH] = {"Ranbir Kapoor", "Alia Bhatt", "Amitabh Bachchan", "Nagarjuna Akkineni", "Mouni Roy"};
         Movie brahmastra;
         brahmastra.initialize("Brahmastra: Part One", 2022, "Ayan Mukerji", castBrahmastra, 5, "Fantasy", 5.5f, 167);
         addMovie(brahmastra);
 
-        // RRR (2022)
-        char castRRR[MAX_CAST][MAX_STRING_LENGTH] = {"N.T. Rama Rao Jr.", "Ram Charan", "Ajay Devgn", "Alia Bhatt", "Shriya Saran"};
-        Movie rrr;
-        rrr.initialize("RRR", 2022, "S.S. Rajamouli", castRRR, 5, "Action", 7.8f, 187);
-        addMovie(rrr);
+        // RRR (2022)
+        char castRRR[MAX_CAST][MAX_STRING_LENGTH] = {"N.T. Rama Rao Jr.", "Ram Charan", "Ajay Devgn", "Alia Bhatt", "Shriya Saran"};
+        Movie rrr;
+        rrr.initialize("RRR", 2022, "S.S. Rajamouli", castRRR, 5, "Action", 7.8f, 187);
+        addMovie(rrr);
+
+        // Animal (2023)
+        char castAnimal[MAX_CAST][MAX_STRING_LENGTH] = {"Ranbir Kapoor", "Anil Kapoor", "Bobby Deol", "Rashmika Mandanna", "Tripti Dimri"};
+        Movie animal;
+        animal.initialize("Animal", 2023, "Sandeep Reddy Vanga", castAnimal, 5, "Crime", 6.1f, 201);
+        addMovie(animal);
+
+        // Jawan (2023)
+        char castJawan[MAX_CAST][MAX_STRING_LENGTH] = {"Shah Rukh Khan", "Nayanthara", "Vijay Sethupathi", "Deepika Padukone", "Priyamani"};
+        Movie jawan;
+        jawan.initialize("Jawan", 2023, "Atlee Kumar", castJawan, 5, "Action", 6.4f, 169);
+        addMovie(jawan);
+
+        // Bhool Bhulaiyaa 2 (2022)
+        char castBhool[MAX_CAST][MAX_STRING_LENGTH] = {"Kartik Aaryan", "Kiara Advani", "Tabu", "Rajpal Yadav", "Sanjay Mishra"};
+        Movie bhool;
+        bhool.initialize("Bhool Bhulaiyaa 2", 2022, "Anees Bazmee", castBhool, 5, "Comedy", 5.7f, 143);
+        addMovie(bhool);
+
+        // Gangubai Kathiawadi (2022)
+        char castGangubai[MAX_CAST][MAX_STRING_LENGTH] = {"Alia Bhatt", "Shantanu Maheshwari", "Vijay Raaz", "Indira Tiwari", "Seema Pahwa"};
+        Movie gangubai;
+        gangubai.initialize("Gangubai Kathiawadi", 2022, "Sanjay Leela Bhansali", castGangubai, 5, "Drama", 7.0f, 157);
+        addMovie(gangubai);
+
+        // Laal Singh Chaddha (2022)
+        char castLaal[MAX_CAST][MAX_STRING_LENGTH] = {"Aamir Khan", "Kareena Kapoor", "Naga Chaitanya", "Mona Singh", "Manav Vij"};
+        Movie laal;
+        laal.initialize("Laal Singh Chaddha", 2022, "Advait Chandan", castLaal, 5, "Drama", 5.3f, 159);
+        addMovie(laal);
+
+        // The Kerala Story (2023)
+        char castKerala[MAX_CAST][MAX_STRING_LENGTH] = {"Adah Sharma", "Yogita Bihani", "Sonia Balani", "Siddhi Idnani", "Devadarshini"};
+        Movie kerala;
+        kerala.initialize("The Kerala Story", 2023, "Sudipto Sen", castKerala, 5, "Drama", 7.2f, 138);
+        addMovie(kerala);
+
+        // Rocky Aur Rani Kii Prem Kahaani (2023)
+        char castRocky[MAX_CAST][MAX_STRING_LENGTH] = {"Ranveer Singh", "Alia Bhatt", "Dharmendra", "Jaya Bachchan", "Shabana Azmi"};
+        Movie rocky;
+        rocky.initialize("Rocky Aur Rani Kii Prem Kahaani", 2023, "Karan Johar", castRocky, 5, "Romance", 6.5f, 168);
+        addMovie(rocky);
+
+        std::cout << "Added 20 recent English and Hindi movies from 2020-2025!" << std::endl;
+    }
+};
+
+#ifdef __linux__
+volatile sig_atomic_t stopRequested = 0;
+
+void requestStop(int)
+{
+    stopRequested = 1;
+}
+
+// Network front end for the query protocol (one request per line).
+// A single epoll reactor thread owns all sockets; complete request lines are
+// handed to the worker pool in batches, at most one batch per connection at a
+// time, so pipelined responses always come back in request order.
+// Responses are one line each: "OK <count>\t<title>\t..." or "ERR <message>".
+class QueryServer
+{
+private:
+    struct Connection
+    {
+        int fd;
+        long long id;
+        std::string input;
+        std::string output;
+        size_t outputOffset;
+        bool busy;       // A batch from this connection is being processed
+        bool peerClosed; // The client will send nothing more
+        bool reading;    // Waiting for EPOLLIN: off while the input is full
+        bool writing;    // Waiting for EPOLLOUT
+        bool closed;     // Closed during this round of events, freed after it
+        Session session; // Handed to the batch in flight and back with its completion
+    };
+
+    struct Completion
+    {
+        long long connectionId;
+        std::string output;
+        Session session;
+    };
+
+    MovieDatabase &db;
+    WorkStealingPool pool;
+    int epollFd;
+    int wakeFd;
+    int listenFds[2];
+    int listenCount;
+    int watchFd;                           // inotify descriptor, or -1
+    char watchedName[MAX_STRING_LENGTH];   // Database file name within the watched directory
+    long long nextConnectionId;
+    std::unordered_map<long long, Connection *> connections;
+    std::vector<Connection *> closedConnections;
+    std::mutex completionLock;
+    std::vector<Completion> completions;
+    std::atomic<long long> queriesServed;
+
+    static const size_t MAX_PENDING_OUTPUT = 1 << 20;
+    static const size_t MAX_PENDING_INPUT = 1 << 20; // Unanswered requests read from one client
+    static const int SNAPSHOT_LINES = 256;            // Request lines answered on one pinned snapshot
+
+    bool addListener(int fd)
+    {
+        if (fd < 0)
+        {
+            return false;
+        }
+        listenFds[listenCount] = fd;
+        epoll_event event;
+        event.events = EPOLLIN;
+        event.data.ptr = &listenFds[listenCount]; // Marks a listening socket
+        epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event);
+        listenCount++;
+        return true;
+    }
+
+    // Request a reload when the watched file was replaced or rewritten
+    void readFileEvents()
+    {
+        char buffer[4096] __attribute__((aligned(__alignof__(inotify_event))));
+        while (true)
+        {
+            ssize_t received = read(watchFd, buffer, sizeof(buffer));
+            if (received <= 0)
+            {
+                return;
+            }
+            for (ssize_t offset = 0; offset < received;)
+            {
+                const inotify_event *event = (const inotify_event *)(buffer + offset);
+                if (event->len > 0 && strcmp(event->name, watchedName) == 0)
+                {
+                    db.requestReload();
+                }
+                offset += sizeof(inotify_event) + event->len;
+            }
+        }
+    }
+
+    void watch(Connection *conn, int op)
+    {
+        epoll_event event;
+        event.events = (conn->reading ? (unsigned int)(EPOLLIN | EPOLLRDHUP) : 0u) | (conn->writing ? (unsigned int)EPOLLOUT : 0u);
+        event.data.ptr = conn;
+        epoll_ctl(epollFd, op, conn->fd, &event);
+    }
+
+    void acceptConnections(int listenFd)
+    {
+        while (true)
+        {
+            int fd = accept4(listenFd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd < 0)
+            {
+                return;
+            }
+            int one = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)); // Fails harmlessly on Unix sockets
+
+            Connection *conn = new Connection();
+            conn->fd = fd;
+            conn->id = nextConnectionId++;
+            conn->outputOffset = 0;
+            conn->busy = false;
+            conn->peerClosed = false;
+            conn->reading = true;
+            conn->writing = false;
+            conn->closed = false;
+            connections[conn->id] = conn;
+            watch(conn, EPOLL_CTL_ADD);
+        }
+    }
+
+    // Later events of the same round may still point at the connection,
+    // so it is only freed once the round is over
+    void closeConnection(Connection *conn)
+    {
+        epoll_ctl(epollFd, EPOLL_CTL_DEL, conn->fd, nullptr);
+        close(conn->fd);
+        connections.erase(conn->id);
+        conn->closed = true;
+        closedConnections.push_back(conn);
+    }
+
+    // Write as much pending output as the socket takes
+    bool flushOutput(Connection *conn)
+    {
+        while (conn->outputOffset < conn->output.size())
+        {
+            ssize_t written = send(conn->fd, conn->output.data() + conn->outputOffset,
+                                   conn->output.size() - conn->outputOffset, MSG_NOSIGNAL);
+            if (written < 0)
+            {
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                {
+                    break;
+                }
+                return false;
+            }
+            conn->outputOffset += written;
+        }
+        if (conn->outputOffset == conn->output.size())
+        {
+            conn->output.clear();
+            conn->outputOffset = 0;
+        }
+        bool wantWrite = !conn->output.empty();
+        if (wantWrite != conn->writing)
+        {
+            conn->writing = wantWrite;
+            watch(conn, EPOLL_CTL_MOD);
+        }
+        return true;
+    }
+
+    // Hand all complete request lines to the pool, unless a batch is running
+    void dispatch(Connection *conn)
+    {
+        if (conn->busy || conn->output.size() > MAX_PENDING_OUTPUT)
+        {
+            return;
+        }
+        size_t end = conn->input.rfind('\n');
+        if (end == std::string::npos)
+        {
+            return;
+        }
+        std::string batch = conn->input.substr(0, end + 1);
+        conn->input.erase(0, end + 1);
+        conn->busy = true;
+        updateReading(conn);
+
+        long long id = conn->id;
+        Session session = conn->session;
+        pool.submit([this, id, batch, session]() mutable
+                    {
+            std::string output;
+            output.reserve(batch.size() * 4);
+            processBatch(batch, session, output);
+            {
+                std::lock_guard<std::mutex> guard(completionLock);
+                completions.push_back(Completion{id, std::move(output), session});
+            }
+            unsigned long long one = 1;
+            ssize_t ignored = write(wakeFd, &one, sizeof(one));
+            (void)ignored; });
+    }
+
+    // Lines are answered in groups of SNAPSHOT_LINES on a pinned snapshot
+    // each. A thread with a snapshot pinned cannot apply queued ratings, so
+    // they are applied between groups and later lines see them.
+    void processBatch(const std::string &batch, Session &session, std::string &output)
+    {
+        QueryResult result;
+        char line[MAX_QUERY_LENGTH];
+        size_t start = 0;
+        long long served = 0;
+        while (start < batch.size())
+        {
+            bool wrote = false;
+            {
+                SnapshotReader snapshot = db.readSnapshot();
+                for (int n = 0; n < SNAPSHOT_LINES && start < batch.size(); n++)
+                {
+                    size_t end = batch.find('\n', start);
+                    size_t length = end - start;
+                    if (length > 0 && batch[end - 1] == '\r')
+                    {
+                        length--;
+                    }
+                    if (length >= (size_t)MAX_QUERY_LENGTH)
+                    {
+                        output += "ERR Query too long\n";
+                    }
+                    else
+                    {
+                        memcpy(line, batch.data() + start, length);
+                        line[length] = '\0';
+                        TraceSpan span("request", line);
+                        db.executeQuery(line, *snapshot.get(), &session, result);
+                        wrote = wrote || result.queuedWrite;
+                        TraceSpan format("format response");
+                        appendResponse(result, *snapshot.get(), output);
+                    }
+                    start = end + 1;
+                    served++;
+                }
+            }
+            if (wrote)
+            {
+                db.flushWrites();
+            }
+        }
+        queriesServed += served;
+    }
+
+    static void appendResponse(const QueryResult &result, const CatalogSnapshot &snapshot, std::string &output)
+    {
+        if (!result.ok)
+        {
+            output += "ERR ";
+            output += result.error;
+            output += '\n';
+            return;
+        }
+        char count[16];
+        if (result.faceted)
+        {
+            snprintf(count, sizeof(count), "OK %d", result.facets.total);
+            output += count;
+            result.facets.visit([&output](const char *facet, const char *value, int n)
+                                {
+                char entry[MAX_STRING_LENGTH + 48];
+                snprintf(entry, sizeof(entry), "\t%s=%s:%d", facet, value, n);
+                output += entry; });
+            output += '\n';
+            return;
+        }
+        snprintf(count, sizeof(count), "OK %d", result.count);
+        output += count;
+        for (int i = 0; i < result.count; i++)
+        {
+            output += '\t';
+            output += snapshot.movies[result.positions[i]].title;
+        }
+        output += '\n';
+    }
+
+    // Watch for input only while the client may send more and its input
+    // has room: a full buffer waits for the batch in flight, and the
+    // socket buffers push back on the client meanwhile
+    void updateReading(Connection *conn)
+    {
+        bool wantRead = !conn->peerClosed && conn->input.size() < MAX_PENDING_INPUT;
+        if (wantRead != conn->reading)
+        {
+            conn->reading = wantRead;
+            watch(conn, EPOLL_CTL_MOD);
+        }
+    }
+
+    void readInput(Connection *conn)
+    {
+        char buffer[16384];
+        while (conn->input.size() < MAX_PENDING_INPUT)
+        {
+            size_t room = std::min(sizeof(buffer), MAX_PENDING_INPUT - conn->input.size());
+            ssize_t received = recv(conn->fd, buffer, room, 0);
+            if (received > 0)
+            {
+                conn->input.append(buffer, received);
+                continue;
+            }
+            if (received == 0)
+            {
+                conn->peerClosed = true;
+            }
+            else if (errno != EAGAIN && errno != EWOULDBLOCK)
+            {
+                conn->peerClosed = true;
+            }
+            break;
+        }
+        rejectLongLine(conn);
+        updateReading(conn);
+    }
+
+    // Input that cannot hold another query is answered with an error and
+    // the connection closed, since it would never drain. Checked after a
+    // read and when a batch completes, so the error follows its answers.
+    void rejectLongLine(Connection *conn)
+    {
+        if (!conn->busy && conn->input.size() > (size_t)MAX_QUERY_LENGTH && conn->input.find('\n') == std::string::npos)
+        {
+            conn->output += "ERR Query too long\n";
+            conn->input.clear();
+            conn->peerClosed = true;
+            updateReading(conn);
+        }
+    }
+
+    // Close a connection once the client is gone and everything is answered
+    bool finishIfDone(Connection *conn)
+    {
+        if (conn->peerClosed && !conn->busy && conn->output.empty())
+        {
+            closeConnection(conn);
+            return true;
+        }
+        return false;
+    }
+
+    void drainCompletions()
+    {
+        unsigned long long count;
+        ssize_t ignored = read(wakeFd, &count, sizeof(count));
+        (void)ignored;
+
+        std::vector<Completion> done;
+        {
+            std::lock_guard<std::mutex> guard(completionLock);
+            done.swap(completions);
+        }
+        for (size_t i = 0; i < done.size(); i++)
+        {
+            std::unordered_map<long long, Connection *>::iterator it = connections.find(done[i].connectionId);
+            if (it == connections.end())
+            {
+                continue; // Client went away
+            }
+            Connection *conn = it->second;
+            conn->busy = false;
+            conn->session = done[i].session;
+            conn->output += done[i].output;
+            rejectLongLine(conn);
+            if (!flushOutput(conn))
+            {
+                closeConnection(conn);
+                continue;
+            }
+            dispatch(conn);
+            finishIfDone(conn);
+        }
+    }
+
+public:
+    QueryServer(MovieDatabase &database, int workers)
+        : db(database), pool(workers), epollFd(-1), wakeFd(-1), listenCount(0), watchFd(-1),
+          nextConnectionId(1), queriesServed(0) {}
+
+    ~QueryServer()
+    {
+        pool.shutdown();
+        for (std::unordered_map<long long, Connection *>::iterator it = connections.begin(); it != connections.end(); ++it)
+        {
+            close(it->second->fd);
+            delete it->second;
+        }
+        for (int i = 0; i < listenCount; i++)
+        {
+            close(listenFds[i]);
+        }
+        if (epollFd >= 0)
+        {
+            close(epollFd);
+        }
+        if (wakeFd >= 0)
+        {
+            close(wakeFd);
+        }
+        if (watchFd >= 0)
+        {
+            close(watchFd);
+        }
+    }
+
+    // Listen on a TCP port of one IPv4 address ("0.0.0.0" for every interface)
+    bool listenTcp(const char *host, int port)
+    {
+        sockaddr_in address;
+        memset(&address, 0, sizeof(address));
+        address.sin_family = AF_INET;
+        address.sin_port = htons(port);
+        if (inet_pton(AF_INET, host, &address.sin_addr) != 1)
+        {
+            std::cout << "Error: Invalid bind address " << host << std::endl;
+            return false;
+        }
+        int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        int one = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (fd < 0 || bind(fd, (sockaddr *)&address, sizeof(address)) != 0 || listen(fd, 1024) != 0)
+        {
+            perror("TCP listen error");
+            if (fd >= 0)
+            {
+                close(fd);
+            }
+            return false;
+        }
+        return addListener(fd);
+    }
+
+    // Listen on a Unix domain socket
+    bool listenUnix(const char *path)
+    {
+        int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        sockaddr_un address;
+        memset(&address, 0, sizeof(address));
+        address.sun_family = AF_UNIX;
+        strncpy(address.sun_path, path, sizeof(address.sun_path) - 1);
+        unlink(path);
+        if (fd < 0 || bind(fd, (sockaddr *)&address, sizeof(address)) != 0 || listen(fd, 1024) != 0)
+        {
+            perror("Unix socket listen error");
+            if (fd >= 0)
+            {
+                close(fd);
+            }
+            return false;
+        }
+        return addListener(fd);
+    }
+
+    bool initialize()
+    {
+        epollFd = epoll_create1(EPOLL_CLOEXEC);
+        wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (epollFd < 0 || wakeFd < 0)
+        {
+            perror("Server setup error");
+            return false;
+        }
+        epoll_event event;
+        event.events = EPOLLIN;
+        event.data.ptr = this; // Marks the wake-up descriptor
+        epoll_ctl(epollFd, EPOLL_CTL_ADD, wakeFd, &event);
+        return true;
+    }
+
+    // Reload the database whenever a new version of its file is put in place.
+    // The directory is watched, since saves rename a finished file over the old one.
+    bool watchFile(const char *path)
+    {
+        char directory[MAX_STRING_LENGTH];
+        const char *slash = strrchr(path, '/');
+        if (slash == nullptr)
+        {
+            strcpy(directory, ".");
+            strncpy(watchedName, path, MAX_STRING_LENGTH - 1);
+        }
+        else
+        {
+            size_t length = (slash == path) ? 1 : (size_t)(slash - path);
+            memcpy(directory, path, length);
+            directory[length] = '\0';
+            strncpy(watchedName, slash + 1, MAX_STRING_LENGTH - 1);
+        }
+        watchedName[MAX_STRING_LENGTH - 1] = '\0';
+
+        watchFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (watchFd < 0 || inotify_add_watch(watchFd, directory, IN_MOVED_TO | IN_CLOSE_WRITE) < 0)
+        {
+            perror("File watch error");
+            return false;
+        }
+        epoll_event event;
+        event.events = EPOLLIN;
+        event.data.ptr = &watchFd; // Marks the file watch
+        epoll_ctl(epollFd, EPOLL_CTL_ADD, watchFd, &event);
+        return true;
+    }
+
+    // Serve until SIGINT/SIGTERM. Queued ratings are flushed (and a follower
+    // applies the primary's log, and deleted movies are compacted away)
+    // every 100 ms; requested reloads start then too.
+    // Statistics are written to METRICS_FILENAME every METRICS_DUMP_INTERVAL.
+    void run()
+    {
+        signal(SIGINT, requestStop);
+        signal(SIGTERM, requestStop);
+        pool.start();
+
+        epoll_event events[256];
+        auto lastFlush = std::chrono::steady_clock::now();
+        auto lastMetricsDump = lastFlush;
+        while (!stopRequested)
+        {
+            int ready = epoll_wait(epollFd, events, 256, 100);
+            for (int i = 0; i < ready; i++)
+            {
+                void *tag = events[i].data.ptr;
+                if (tag == this)
+                {
+                    drainCompletions();
+                    continue;
+                }
+                if (tag == &watchFd)
+                {
+                    readFileEvents();
+                    continue;
+                }
+                if (tag >= (void *)&listenFds[0] && tag < (void *)&listenFds[listenCount])
+                {
+                    acceptConnections(*(int *)tag);
+                    continue;
+                }
+
+                Connection *conn = (Connection *)tag;
+                if (conn->closed)
+                {
+                    continue;
+                }
+                if (events[i].events & (EPOLLERR | EPOLLHUP))
+                {
+                    conn->peerClosed = true;
+                    conn->output.clear();
+                }
+                if (events[i].events & (EPOLLIN | EPOLLRDHUP))
+                {
+                    readInput(conn);
+                }
+                if (!flushOutput(conn))
+                {
+                    closeConnection(conn);
+                    continue;
+                }
+                dispatch(conn);
+                finishIfDone(conn);
+            }
+            for (size_t i = 0; i < closedConnections.size(); i++)
+            {
+                delete closedConnections[i];
+            }
+            closedConnections.clear();
+
+            auto now = std::chrono::steady_clock::now();
+            if (std::chrono::duration<double>(now - lastMetricsDump).count() >= METRICS_DUMP_INTERVAL)
+            {
+                lastMetricsDump = now;
+                pool.submit([this]()
+                            { db.writeMetrics(); });
+            }
+            if (std::chrono::duration<double>(now - lastFlush).count() >= 0.1)
+            {
+                lastFlush = now;
+                pool.submit([this]()
+                            {
+                    db.flushWrites();
+                    db.pollReplication();
+                    db.compactWhileServing(); });
+                if (db.takeReloadRequest())
+                {
+                    pool.submit([this]()
+                                { db.reloadFromFile(); });
+                }
+            }
+        }
+        pool.shutdown();
+        db.flushWrites();
+        db.writeMetrics();
+        std::cout << "Server stopped after " << queriesServed.load() << " queries." << std::endl;
+    }
+};
+
+// Open a blocking client connection: a port on localhost or a Unix socket path
+int connectToServer(const char *target)
+{
+    bool isPort = target[0] != '\0';
+    for (const char *p = target; *p != '\0'; p++)
+    {
+        isPort = isPort && (*p >= '0' && *p <= '9');
+    }
+
+    int fd;
+    if (isPort)
+    {
+        fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        sockaddr_in address;
+        memset(&address, 0, sizeof(address));
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        address.sin_port = htons(atoi(target));
+        if (fd >= 0 && connect(fd, (sockaddr *)&address, sizeof(address)) != 0)
+        {
+            close(fd);
+            return -1;
+        }
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    else
+    {
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        sockaddr_un address;
+        memset(&address, 0, sizeof(address));
+        address.sun_family = AF_UNIX;
+        strncpy(address.sun_path, target, sizeof(address.sun_path) - 1);
+        if (fd >= 0 && connect(fd, (sockaddr *)&address, sizeof(address)) != 0)
+        {
+            close(fd);
+            return -1;
+        }
+    }
+    return fd;
+}
+
+// Load generator for the query server. Each connection sends batches of
+// pipelined requests (searches, similar and recommend, plus a few ratings
+// when writes is set) and times every response from the moment its batch
+// was sent. Ratings are saved by the server, so they are off by default.
+void runLoadGenerator(const char *target, int connectionCount, int pipelineDepth, double seconds, bool writes,
+                      const CatalogSnapshot &catalog)
+{
+    if (catalog.movieCount == 0)
+    {
+        std::cout << "Error: The catalog is empty; nothing to query." << std::endl;
+        return;
+    }
+
+    std::vector<std::vector<float>> latencies(connectionCount); // Microseconds
+    std::atomic<int> failures(0);
+    std::vector<std::thread> threads;
+    auto start = std::chrono::steady_clock::now();
+
+    for (int c = 0; c < connectionCount; c++)
+    {
+        threads.push_back(std::thread([&, c]()
+                                      {
+            int fd = connectToServer(target);
+            if (fd < 0)
+            {
+                failures++;
+                return;
+            }
+            unsigned int seed = 2463534242u + c * 7919u;
+            std::string requests;
+            std::vector<char> buffer(65536);
+            std::vector<float> &samples = latencies[c];
+
+            while (std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() < seconds)
+            {
+                requests.clear();
+                for (int i = 0; i < pipelineDepth; i++)
+                {
+                    seed ^= seed << 13;
+                    seed ^= seed >> 17;
+                    seed ^= seed << 5;
+                    const Movie &movie = catalog.movies[seed % catalog.movieCount];
+                    int kind = (seed >> 8) % 10;
+                    char request[MAX_QUERY_LENGTH];
+                    if (kind < 4)
+                    {
+                        snprintf(request, sizeof(request), "SEARCH %.4s\n", movie.title);
+                    }
+                    else if (kind < 7)
+                    {
+                        snprintf(request, sizeof(request), "SIMILAR %s\n", movie.title);
+                    }
+                    else if ((kind < 9 || !writes) && catalog.userCount > 0)
+                    {
+                        snprintf(request, sizeof(request), "RECOMMEND %d\n", catalog.userRows[(seed >> 12) % catalog.userCount]->userId);
+                    }
+                    else if (catalog.userCount > 0)
+                    {
+                        snprintf(request, sizeof(request), "RATE %d %d %s\n", catalog.userRows[(seed >> 12) % catalog.userCount]->userId, (seed >> 4) % 11, movie.title);
+                    }
+                    else
+                    {
+                        snprintf(request, sizeof(request), "PING\n");
+                    }
+                    requests += request;
+                }
+
+                auto sent = std::chrono::steady_clock::now();
+                if (send(fd, requests.data(), requests.size(), MSG_NOSIGNAL) != (ssize_t)requests.size())
+                {
+                    failures++;
+                    break;
+                }
+                int received = 0;
+                while (received < pipelineDepth)
+                {
+                    ssize_t n = recv(fd, buffer.data(), buffer.size(), 0);
+                    if (n <= 0)
+                    {
+                        failures++;
+                        close(fd);
+                        return;
+                    }
+                    float micros = std::chrono::duration<float, std::micro>(std::chrono::steady_clock::now() - sent).count();
+                    for (ssize_t i = 0; i < n; i++)
+                    {
+                        if (buffer[i] == '\n')
+                        {
+                            samples.push_back(micros);
+                            received++;
+                        }
+                    }
+                }
+            }
+            close(fd); }));
+    }
+    for (size_t i = 0; i < threads.size(); i++)
+    {
+        threads[i].join();
+    }
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    std::vector<float> all;
+    for (int c = 0; c < connectionCount; c++)
+    {
+        all.insert(all.end(), latencies[c].begin(), latencies[c].end());
+    }
+    if (all.empty())
+    {
+        std::cout << "Error: No responses received (" << failures.load() << " connection failures)." << std::endl;
+        return;
+    }
+    std::sort(all.begin(), all.end());
+    std::cout << "Load test: " << connectionCount << " connections, pipeline depth " << pipelineDepth << std::endl;
+    std::cout << "Queries: " << all.size() << " in " << elapsed << " s (" << (long long)(all.size() / elapsed) << " queries/sec)" << std::endl;
+    std::cout << "Latency p50: " << all[all.size() / 2] << " us, p99: " << all[(size_t)(all.size() * 0.99)]
+              << " us, p99.9: " << all[(size_t)(all.size() * 0.999)] << " us, max: " << all.back() << " us" << std::endl;
+    if (failures.load() > 0)
+    {
+        std::cout << "Connection failures: " << failures.load() << std::endl;
+    }
+}
+#endif
+
+// Batch query mode reads input in blocks of this size and answers the
+// lines of each block in parallel, in groups of BATCH_GRAIN lines
+const int BATCH_READ_SIZE = 1 << 20;
+const int BATCH_GRAIN = 256;
+
+// Non-interactive query mode: runs protocol queries from a file or stream
+// (one per line) and writes one JSON object per query, in input order.
+// Every group of lines runs on its own pinned snapshot. The ratings of a
+// block are applied once it is answered, so later blocks see them.
+class BatchQueryRunner
+{
+private:
+    MovieDatabase &db;
+    WorkStealingPool pool;
+    std::vector<std::string> outputs; // One buffer per group, reused between blocks
+    long long queriesRun;
+    bool writesQueued;
+
+    // "count" and a "facets" object of facet name to [{value, count}]
+    static void appendFacets(const FacetCounts &facets, JsonWriter &json)
+    {
+        json.key("count");
+        json.number((long long)facets.total);
+        json.key("facets");
+        json.raw("{");
+        const char *current = "";
+        facets.visit([&current, &json](const char *facet, const char *value, int n)
+                     {
+            bool first = strcmp(facet, current) != 0;
+            if (first)
+            {
+                json.raw(current[0] != '\0' ? "]," : "");
+                json.string(facet);
+                json.raw(":[");
+                current = facet;
+            }
+            json.raw(first ? "{" : ",{");
+            json.key("value");
+            json.string(value);
+            json.key("count");
+            json.number((long long)n);
+            json.raw("}"); });
+        json.raw(current[0] != '\0' ? "]}" : "}");
+    }
+
+    void answer(const char *line, long long lineNumber, const CatalogSnapshot &snapshot, QueryResult &result, std::string &output)
+    {
+        TraceSpan span("request", line);
+        JsonWriter json(output);
+        json.raw("{");
+        json.key("line");
+        json.number(lineNumber);
+        json.key("query");
+        json.string(line);
+
+        if (strlen(line) >= (size_t)MAX_QUERY_LENGTH)
+        {
+            result.ok = false;
+            result.error = "Query too long";
+        }
+        else
+        {
+            db.executeQuery(line, snapshot, nullptr, result);
+        }
+
+        TraceSpan format("format response");
+        json.key("ok");
+        json.raw(result.ok ? "true" : "false");
+        if (!result.ok)
+        {
+            json.key("error");
+            json.string(result.error);
+            json.raw("}\n");
+            return;
+        }
+        if (result.faceted)
+        {
+            appendFacets(result.facets, json);
+            json.raw("}\n");
+            return;
+        }
+        json.key("count");
+        json.number((long long)result.count);
+        json.key("results");
+        json.raw("[");
+        for (int i = 0; i < result.count; i++)
+        {
+            int position = result.positions[i];
+            const Movie &movie = snapshot.movies[position];
+            if (i > 0)
+            {
+                json.raw(",");
+            }
+            json.raw("{");
+            json.key("title");
+            json.string(movie.title);
+            json.key("year");
+            json.number((long long)movie.releaseYear);
+            json.key("genre");
+            json.string(movie.genre);
+            json.key("director");
+            json.string(movie.director);
+            json.key("rating");
+            json.number(movie.rating, 1);
+            json.key("userScore");
+            json.number(snapshot.userScores[position], 2);
+            json.raw("}");
+        }
+        json.raw("]}\n");
+    }
+
+    // Answer complete lines; lines are NUL-terminated in place
+    bool runBlock(const std::vector<char *> &lines, long long firstLine, FILE *out)
+    {
+        int lineCount = (int)lines.size();
+        int groups = (lineCount + BATCH_GRAIN - 1) / BATCH_GRAIN;
+        if ((int)outputs.size() < groups)
+        {
+            outputs.resize(groups);
+        }
+        std::atomic<bool> wrote(false);
+        pool.parallelFor(lineCount, BATCH_GRAIN, [this, &lines, firstLine, &wrote](int begin, int end)
+                         {
+            std::string &output = outputs[begin / BATCH_GRAIN];
+            output.clear();
+            SnapshotReader snapshot = db.readSnapshot();
+            QueryResult result;
+            for (int i = begin; i < end; i++)
+            {
+                answer(lines[i], firstLine + i, *snapshot.get(), result, output);
+                if (result.queuedWrite)
+                {
+                    wrote = true;
+                }
+            } });
+        if (wrote.load())
+        {
+            writesQueued = true;
+            db.flushWrites();
+        }
+        queriesRun += lineCount;
+
+        for (int g = 0; g < groups; g++)
+        {
+            if (fwrite(outputs[g].data(), 1, outputs[g].size(), out) != outputs[g].size())
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+public:
+    BatchQueryRunner(MovieDatabase &database, int workers)
+        : db(database), pool(workers), queriesRun(0), writesQueued(false) {}
+
+    long long getQueriesRun() const { return queriesRun; }
+    bool hasQueuedWrites() const { return writesQueued; }
+
+    // Run every line of in and write the answers to out
+    bool run(FILE *in, FILE *out)
+    {
+        std::vector<char> block(BATCH_READ_SIZE + 1);
+        std::vector<char *> lines;
+        size_t filled = 0;
+        long long nextLine = 1;
+        bool atEnd = false;
+
+        while (!atEnd)
+        {
+            if (filled == block.size() - 1)
+            {
+                block.resize(block.size() * 2); // One line is longer than the block
+            }
+            size_t received = fread(block.data() + filled, 1, block.size() - 1 - filled, in);
+            filled += received;
+            atEnd = (received == 0);
+            if (ferror(in))
+            {
+                std::cout << "Error: Could not read queries." << std::endl;
+                return false;
+            }
+
+            // Split off the complete lines; at the end, a last unterminated line counts too
+            lines.clear();
+            size_t start = 0;
+            for (size_t i = 0; i < filled; i++)
+            {
+                if (block[i] == '\n')
+                {
+                    block[i] = '\0';
+                    if (i > start && block[i - 1] == '\r')
+                    {
+                        block[i - 1] = '\0';
+                    }
+                    lines.push_back(block.data() + start);
+                    start = i + 1;
+                }
+            }
+            if (atEnd && start < filled)
+            {
+                block[filled] = '\0';
+                lines.push_back(block.data() + start);
+                start = filled;
+            }
+
+            if (!lines.empty() && !runBlock(lines, nextLine, out))
+            {
+                std::cout << "Error: Could not write results." << std::endl;
+                return false;
+            }
+            nextLine += (long long)lines.size();
+            memmove(block.data(), block.data() + start, filled - start);
+            filled -= start;
+        }
+        return fflush(out) == 0;
+    }
+};
+
+#ifdef MOVIEDB_COROUTINES
+// Rows a coroutine scans before it lets other coroutines run. Catalogs
+// hold at most MAX_MOVIES rows, so this is small enough that every scan
+// of more than a handful of movies yields at least once.
+const int ASYNC_SCAN_SLICE = 8;
+
+template <typename T>
+class Task;
+
+// Single-threaded coroutine scheduler. Coroutines run one at a time on the
+// thread that calls run(); blocking work is offloaded to a worker pool and
+// the coroutine is resumed on the scheduler thread when it is done.
+class CoroutineScheduler
+{
+private:
+    std::mutex lock;
+    std::condition_variable wake;
+    std::deque<std::coroutine_handle<>> ready;
+    int outstanding; // Spawned tasks that have not finished
+    WorkStealingPool pool;
+
+    template <typename F>
+    struct OffloadAwaiter
+    {
+        CoroutineScheduler *scheduler;
+        F work;
+        decltype(work()) result;
+
+        bool await_ready() const noexcept { return false; }
+
+        void await_suspend(std::coroutine_handle<> handle)
+        {
+            CoroutineScheduler *target = scheduler;
+            target->pool.submit([this, target, handle]()
+                                {
+                result = work();
+                target->post(handle); });
+        }
+
+        decltype(work()) await_resume() { return std::move(result); }
+    };
+
+public:
+    CoroutineScheduler(int workers = 2) : outstanding(0), pool(workers)
+    {
+        pool.start();
+    }
+
+    // Queue a coroutine to be resumed on the scheduler thread (any thread)
+    void post(std::coroutine_handle<> handle)
+    {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            ready.push_back(handle);
+        }
+        wake.notify_one();
+    }
+
+    // Let the other ready coroutines run before continuing
+    auto yield()
+    {
+        struct YieldAwaiter
+        {
+            CoroutineScheduler *scheduler;
+            bool await_ready() const noexcept { return false; }
+            void await_suspend(std::coroutine_handle<> handle) { scheduler->post(handle); }
+            void await_resume() const noexcept {}
+        };
+        return YieldAwaiter{this};
+    }
+
+    // Run a blocking function on the worker pool and resume with its result
+    template <typename F>
+    OffloadAwaiter<F> offload(F work)
+    {
+        return OffloadAwaiter<F>{this, std::move(work), {}};
+    }
+
+    // Start a task that runs on its own; it is freed when it finishes
+    template <typename T>
+    void spawn(Task<T> task)
+    {
+        std::coroutine_handle<typename Task<T>::promise_type> handle = task.release();
+        handle.promise().detachedOn = this;
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            outstanding++;
+        }
+        post(handle);
+    }
+
+    void finished()
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        outstanding--;
+    }
+
+    // Resume ready coroutines until every spawned task has finished
+    void run()
+    {
+        std::deque<std::coroutine_handle<>> batch;
+        while (true)
+        {
+            {
+                std::unique_lock<std::mutex> guard(lock);
+                wake.wait(guard, [this]()
+                          { return !ready.empty() || outstanding == 0; });
+                if (ready.empty())
+                {
+                    return;
+                }
+                batch.swap(ready);
+            }
+            while (!batch.empty())
+            {
+                std::coroutine_handle<> handle = batch.front();
+                batch.pop_front();
+                handle.resume();
+            }
+        }
+    }
+};
+
+// Lazily started coroutine returning a T. Awaiting a task starts it and
+// resumes the awaiting coroutine when it completes.
+template <typename T>
+class Task
+{
+public:
+    struct promise_type
+    {
+        T value;
+        std::coroutine_handle<> continuation;
+        CoroutineScheduler *detachedOn = nullptr;
+
+        Task get_return_object() { return Task(std::coroutine_handle<promise_type>::from_promise(*this)); }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+
+        struct FinalAwaiter
+        {
+            bool await_ready() const noexcept { return false; }
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> handle) noexcept
+            {
+                promise_type &promise = handle.promise();
+                if (promise.continuation)
+                {
+                    return promise.continuation;
+                }
+                if (promise.detachedOn != nullptr)
+                {
+                    CoroutineScheduler *scheduler = promise.detachedOn;
+                    handle.destroy();
+                    scheduler->finished();
+                }
+                return std::noop_coroutine();
+            }
+            void await_resume() const noexcept {}
+        };
+        FinalAwaiter final_suspend() noexcept { return {}; }
+
+        void return_value(T result) { value = std::move(result); }
+        void unhandled_exception() { std::terminate(); }
+    };
+
+private:
+    std::coroutine_handle<promise_type> coroutine;
+
+    explicit Task(std::coroutine_handle<promise_type> handle) : coroutine(handle) {}
+
+public:
+    Task(Task &&other) noexcept : coroutine(other.coroutine)
+    {
+        other.coroutine = nullptr;
+    }
+
+    Task(const Task &) = delete;
+    Task &operator=(const Task &) = delete;
+
+    ~Task()
+    {
+        if (coroutine)
+        {
+            coroutine.destroy();
+        }
+    }
+
+    std::coroutine_handle<promise_type> release()
+    {
+        std::coroutine_handle<promise_type> handle = coroutine;
+        coroutine = nullptr;
+        return handle;
+    }
+
+    bool await_ready() const noexcept { return false; }
+
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept
+    {
+        coroutine.promise().continuation = awaiting;
+        return coroutine;
+    }
+
+    T await_resume() { return std::move(coroutine.promise().value); }
+};
+
+// Result of an async query: positions in the snapshot it ran on, which the
+// result keeps alive
+struct AsyncResult
+{
+    SnapshotRef snapshot;
+    QueryResult result;
+};
+
+// Coroutine front end of a MovieDatabase. Reads run on held snapshots and
+// long scans yield every ASYNC_SCAN_SLICE rows; saves and writes run on
+// the scheduler's worker pool, so one thread can keep many requests moving.
+//   SnapshotRef catalog = co_await async.snapshot();
+//   AsyncResult found = co_await async.search("Dune");
+class AsyncMovieDatabase
+{
+private:
+    MovieDatabase &db;
+    CoroutineScheduler &scheduler;
+    long long scanYields; // Times a scan let other coroutines run
+    long long offloads;   // Requests sent to the worker pool
+
+public:
+    AsyncMovieDatabase(MovieDatabase &database, CoroutineScheduler &sched)
+        : db(database), scheduler(sched), scanYields(0), offloads(0) {}
+
+    long long getScanYields() const { return scanYields; }
+    long long getOffloads() const { return offloads; }
+
+    Task<SnapshotRef> snapshot()
+    {
+        co_return db.holdSnapshot();
+    }
+
+    // Movies whose title contains text, in catalog order
+    Task<AsyncResult> search(std::string text)
+    {
+        AsyncResult reply;
+        reply.snapshot = db.holdSnapshot();
+        const CatalogSnapshot *catalog = reply.snapshot.get();
+        for (int i = 0; i < catalog->movieCount && reply.result.count < MAX_MOVIES; i++)
+        {
+            if (i > 0 && i % ASYNC_SCAN_SLICE == 0)
+            {
+                scanYields++;
+                co_await scheduler.yield();
+            }
+            if (strstr(catalog->movies[i].title, text.c_str()) != nullptr)
+            {
+                reply.result.positions[reply.result.count++] = i;
+            }
+        }
+        co_return reply;
+    }
+
+    // The movies most similar to a title, best first
+    Task<AsyncResult> similar(std::string title)
+    {
+        AsyncResult reply;
+        reply.snapshot = db.holdSnapshot();
+        const CatalogSnapshot *catalog = reply.snapshot.get();
+        int target = catalog->findByTitle(title.c_str());
+        reply.result.ok = (target != -1);
+        reply.result.error = (target != -1) ? nullptr : "Movie not found";
+        if (target == -1)
+        {
+            co_return reply;
+        }
+
+        const Movie &movie = catalog->movies[target];
+        TopSimilar top(RECOMMENDATION_COUNT);
+        for (int i = 0; i < catalog->movieCount; i++)
+        {
+            if (i > 0 && i % ASYNC_SCAN_SLICE == 0)
+            {
+                scanYields++;
+                co_await scheduler.yield();
+            }
+            if (!catalog->tombstone[i] && strcmp(catalog->movies[i].title, movie.title) != 0)
+            {
+                top.offer(i, scoreSimilarity(movie, catalog->userScores[target], catalog->movies[i], catalog->userScores[i]));
+            }
+        }
+        for (int i = 0; i < top.count; i++)
+        {
+            reply.result.positions[i] = top.positions[i];
+        }
+        reply.result.count = top.count;
+        co_return reply;
+    }
+
+    // Any protocol query (see MovieDatabase::executeQuery), without a session
+    Task<AsyncResult> query(std::string line)
+    {
+        AsyncResult reply;
+        reply.snapshot = db.holdSnapshot();
+        if (strncmp(line.c_str(), "RATE", 4) == 0 || strncmp(line.c_str(), "rate", 4) == 0)
+        {
+            // Queueing a rating can apply a whole write batch, so it runs on the pool
+            MovieDatabase *database = &db;
+            const CatalogSnapshot *catalog = reply.snapshot.get();
+            QueryResult *result = &reply.result;
+            offloads++;
+            co_await scheduler.offload([database, catalog, result, &line]()
+                                       {
+                database->executeQuery(line.c_str(), *catalog, nullptr, *result);
+                return true; });
+        }
+        else
+        {
+            db.executeQuery(line.c_str(), *reply.snapshot.get(), nullptr, reply.result);
+        }
+        co_return reply;
+    }
+
+    // Save the database on the worker pool
+    Task<bool> save(std::string filename = DB_FILENAME)
+    {
+        MovieDatabase *database = &db;
+        offloads++;
+        bool saved = co_await scheduler.offload([database, &filename]()
+                                                { return database->saveWhileServing(filename.c_str()); });
+        co_return saved;
+    }
+};
+
+// Keep many async requests in flight on one thread and report throughput.
+// Every tenth client also rates a movie (changes are not saved). A client
+// is in flight from its start to its end, so the peak counts the clients
+// suspended at once, at a scan's yield or waiting on an offload.
+void runAsyncTest(MovieDatabase &database, int requests)
+{
+    CoroutineScheduler scheduler;
+    AsyncMovieDatabase async(database, scheduler);
+    std::atomic<long long> results(0);
+    int inFlight = 0;
+    int peakInFlight = 0;
+
+    struct Client
+    {
+        static Task<bool> run(AsyncMovieDatabase &async, int id, std::atomic<long long> &results, int &inFlight, int &peakInFlight)
+        {
+            inFlight++;
+            if (inFlight > peakInFlight)
+            {
+                peakInFlight = inFlight;
+            }
+            SnapshotRef catalog = co_await async.snapshot();
+            const Movie &movie = catalog->movies[(unsigned int)id * 2654435761u % catalog->movieCount];
+            char text[8];
+            snprintf(text, sizeof(text), "%.3s", movie.title);
+            AsyncResult found = co_await async.search(text);
+            AsyncResult like = co_await async.similar(movie.title);
+            char line[MAX_QUERY_LENGTH];
+            snprintf(line, sizeof(line), "YEAR %d", movie.releaseYear);
+            AsyncResult year = co_await async.query(line);
+            if (id % 10 == 0 && catalog->userCount > 0)
+            {
+                snprintf(line, sizeof(line), "RATE %d %d %s", catalog->userRows[id % catalog->userCount]->userId, id % 11, movie.title);
+                co_await async.query(line);
+            }
+            results += found.result.count + like.result.count + year.result.count;
+            inFlight--;
+            co_return true;
+        }
+    };
+
+    std::cout << "Async test: " << requests << " clients on one scheduler thread" << std::endl;
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < requests; i++)
+    {
+        scheduler.spawn(Client::run(async, i, results, inFlight, peakInFlight));
+    }
+    const char *scratchFile = "async_test.dat";
+    scheduler.spawn(async.save(scratchFile)); // Overlaps with the queries
+    scheduler.run();
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    remove(scratchFile);
+
+    std::cout << "Completed " << requests * 4LL << " operations in " << elapsed << " s ("
+              << (long long)(requests * 4LL / elapsed) << " ops/sec), " << results.load() << " results" << std::endl;
+    std::cout << "Clients started but not finished at peak: " << peakInFlight << " (" << async.getScanYields()
+              << " scan yields, " << async.getOffloads() << " offloads to the worker pool)" << std::endl;
+}
+#endif
+
+// Benchmark settings
+const int BENCHMARK_MIN_SAMPLES = 5;         // Calls timed per operation, however slow
+const int BENCHMARK_MAX_SAMPLES = 1000000;   // Calls timed per operation, however fast
+const int MIXED_WORKLOAD_KINDS = 7;
+
+// Seeded generator of synthetic catalogs. Genres, directors and cast are
+// drawn from Zipf distributions (a few are very common, most are rare),
+// titles have one to five words, and the number of ratings per user
+// follows a power law. The same seed always gives the same catalog.
+class CatalogGenerator
+{
+private:
+    unsigned long long state;
+    std::vector<double> genreWeights; // Cumulative Zipf weights
+    std::vector<double> directorWeights;
+    std::vector<double> castWeights;
+    std::vector<double> movieWeights; // Popularity of each movie for ratings
+    std::vector<Movie> catalog;
+
+    unsigned long long next()
+    {
+        // xorshift64*
+        state ^= state >> 12;
+        state ^= state << 25;
+        state ^= state >> 27;
+        return state * 2685821657736338717ULL;
+    }
+
+    // Uniform in [0, 1)
+    double uniform()
+    {
+        return (next() >> 11) * (1.0 / 9007199254740992.0);
+    }
+
+    int below(int n)
+    {
+        return (int)(uniform() * n);
+    }
 
-        // Animal (2023)
-        char castAnimal[MAX_CAST][MAX_STRING_LENGTH] = {"Ranbir Kapoor", "Anil Kapoor", "Bobby Deol", "Rashmika Mandanna", "Tripti Dimri"};
-        Movie animal;
-        animal.initialize("Animal", 2023, "Sandeep Reddy Vanga", castAnimal, 5, "Crime", 6.1f, 201);
-        addMovie(animal);
+    static void zipfWeights(std::vector<double> &weights, int n, double exponent)
+    {
+        weights.resize(n);
+        double total = 0.0;
+        for (int k = 0; k < n; k++)
+        {
+            total += 1.0 / pow(k + 1.0, exponent);
+            weights[k] = total;
+        }
+    }
 
-        // Jawan (2023)
-        char castJawan[MAX_CAST][MAX_STRING_LENGTH] = {"Shah Rukh Khan", "Nayanthara", "Vijay Sethupathi", "Deepika Padukone", "Priyamani"};
-        Movie jawan;
-        jawan.initialize("Jawan", 2023, "Atlee Kumar", castJawan, 5, "Action", 6.4f, 169);
-        addMovie(jawan);
+    int zipf(const std::vector<double> &weights)
+    {
+        double target = uniform() * weights.back();
+        int k = (int)(std::upper_bound(weights.begin(), weights.end(), target) - weights.begin());
+        return k < (int)weights.size() ? k : (int)weights.size() - 1;
+    }
 
-        // Bhool Bhulaiyaa 2 (2022)
-        char castBhool[MAX_CAST][MAX_STRING_LENGTH] = {"Kartik Aaryan", "Kiara Advani", "Tabu", "Rajpal Yadav", "Sanjay Mishra"};
-        Movie bhool;
-        bhool.initialize("Bhool Bhulaiyaa 2", 2022, "Anees Bazmee", castBhool, 5, "Comedy", 5.7f, 143);
-        addMovie(bhool);
+    static void personName(int index, char *name)
+    {
+        static const char *first[] = {"Maya", "Arjun", "Elena", "Kenji", "Sofia", "Omar", "Lucas", "Priya",
+                                      "Hana", "Diego", "Nora", "Ravi", "Greta", "Tomas", "Aisha", "Felix"};
+        static const char *last[] = {"Kapoor", "Moreau", "Tanaka", "Okafor", "Lindqvist", "Alvarez", "Novak", "Reyes",
+                                     "Brennan", "Haddad", "Ivanova", "Costa", "Mehta", "Schulz", "Park", "Dubois"};
+        const int firstCount = sizeof(first) / sizeof(first[0]);
+        const int lastCount = sizeof(last) / sizeof(last[0]);
+        int round = index / (firstCount * lastCount);
+        if (round == 0)
+        {
+            snprintf(name, MAX_STRING_LENGTH, "%s %s", first[index % firstCount], last[index / firstCount % lastCount]);
+        }
+        else
+        {
+            snprintf(name, MAX_STRING_LENGTH, "%s %s %d", first[index % firstCount], last[index / firstCount % lastCount], round + 1);
+        }
+    }
 
-        // Gangubai Kathiawadi (2022)
-        char castGangubai[MAX_CAST][MAX_STRING_LENGTH] = {"Alia Bhatt", "Shantanu Maheshwari", "Vijay Raaz", "Indira Tiwari", "Seema Pahwa"};
-        Movie gangubai;
-        gangubai.initialize("Gangubai Kathiawadi", 2022, "Sanjay Leela Bhansali", castGangubai, 5, "Drama", 7.0f, 157);
-        addMovie(gangubai);
+    void makeTitle(char *title, std::unordered_map<std::string, int> &used)
+    {
+        static const char *words[] = {"Night", "River", "Silent", "Last", "Empire", "Shadow", "Garden", "Storm",
+                                      "Glass", "Broken", "Hidden", "City", "Dream", "Iron", "Summer", "Echo",
+                                      "Crimson", "Winter", "Kingdom", "Paper", "Lost", "Golden", "Wild", "Star",
+                                      "Harbor", "Secret", "Long", "Road", "Fire", "Ocean", "Letters", "Machine"};
+        static const int lengthWeights[] = {15, 45, 75, 92, 100}; // Cumulative percent for 1 to 5 words
+        const int wordCount = sizeof(words) / sizeof(words[0]);
+        int roll = below(100);
+        int length = 1;
+        while (roll >= lengthWeights[length - 1])
+        {
+            length++;
+        }
+        std::string text = (uniform() < 0.25) ? "The" : "";
+        for (int w = 0; w < length; w++)
+        {
+            if (!text.empty())
+            {
+                text += ' ';
+            }
+            text += words[below(wordCount)];
+        }
+        int &copies = used[text];
+        copies++;
+        if (copies > 1)
+        {
+            text += ' ' + std::to_string(copies); // A sequel
+        }
+        snprintf(title, MAX_STRING_LENGTH, "%s", text.c_str());
+    }
 
-        // Laal Singh Chaddha (2022)
-        char castLaal[MAX_CAST][MAX_STRING_LENGTH] = {"Aamir Khan", "Kareena Kapoor", "Naga Chaitanya", "Mona Singh", "Manav Vij"};
-        Movie laal;
-        laal.initialize("Laal Singh Chaddha", 2022, "Advait Chandan", castLaal, 5, "Drama", 5.3f, 159);
-        addMovie(laal);
+public:
+    CatalogGenerator(unsigned int seed)
+    {
+        state = 0x9E3779B97F4A7C15ULL ^ ((unsigned long long)seed * 0xBF58476D1CE4E5B9ULL);
+        if (state == 0)
+        {
+            state = 1;
+        }
+    }
 
-        // The Kerala Story (2023)
-        char castKerala[MAX_CAST][MAX_STRING_LENGTH] = {"Adah Sharma", "Yogita Bihani", "Sonia Balani", "Siddhi Idnani", "Devadarshini"};
-        Movie kerala;
-        kerala.initialize("The Kerala Story", 2023, "Sudipto Sen", castKerala, 5, "Drama", 7.2f, 138);
-        addMovie(kerala);
+    // Generate movieCount movies and userCount users with ratings
+    void generate(int movieCount, int userCount, std::vector<User> &users)
+    {
+        static const char *genres[] = {"Drama", "Comedy", "Action", "Thriller", "Romance", "Horror", "Sci-Fi", "Crime",
+                                       "Adventure", "Animation", "Fantasy", "Mystery", "Documentary", "Family", "War", "Western"};
+        const int genreCount = sizeof(genres) / sizeof(genres[0]);
+        int directorCount = movieCount / 4 + 4;
+        int castPool = movieCount * 2 + 10;
+        zipfWeights(genreWeights, genreCount, 1.0);
+        zipfWeights(directorWeights, directorCount, 1.1);
+        zipfWeights(castWeights, castPool, 1.0);
+        zipfWeights(movieWeights, movieCount, 0.9);
+
+        std::unordered_map<std::string, int> usedTitles;
+        catalog.assign(movieCount, Movie());
+        for (int i = 0; i < movieCount; i++)
+        {
+            Movie &movie = catalog[i];
+            makeTitle(movie.title, usedTitles);
+            movie.releaseYear = 2024 - (int)(60 * uniform() * uniform()); // Recent years are more common
+            personName(zipf(directorWeights), movie.director);
+            movie.castCount = 1 + below(MAX_CAST);
+            for (int c = 0; c < movie.castCount; c++)
+            {
+                personName(1000 + zipf(castWeights), movie.cast[c]);
+            }
+            strcpy(movie.genre, genres[zipf(genreWeights)]);
+            double score = 6.5 + 3.0 * (uniform() + uniform() + uniform() - 1.5); // Bell-shaped around 6.5
+            movie.rating = (float)(round((score < 1.0 ? 1.0 : (score > 10.0 ? 10.0 : score)) * 10.0) / 10.0);
+            movie.duration = 80 + below(100);
+        }
 
-        // Rocky Aur Rani Kii Prem Kahaani (2023)
-        char castRocky[MAX_CAST][MAX_STRING_LENGTH] = {"Ranveer Singh", "Alia Bhatt", "Dharmendra", "Jaya Bachchan", "Shabana Azmi"};
-        Movie rocky;
-        rocky.initialize("Rocky Aur Rani Kii Prem Kahaani", 2023, "Karan Johar", castRocky, 5, "Romance", 6.5f, 168);
-        addMovie(rocky);
+        users.assign(userCount, User());
+        for (int u = 0; u < userCount; u++)
+        {
+            User &user = users[u];
+            char name[MAX_STRING_LENGTH];
+            snprintf(name, sizeof(name), "user%d", u + 1);
+            user.initialize(u + 1, name);
+
+            // Pareto with exponent 2: most users rate a few movies, some rate many
+            int wanted = (int)(1.0 / (1.0 - uniform()));
+            int limit = movieCount < MAX_MOVIES ? movieCount : MAX_MOVIES;
+            wanted = wanted > limit ? limit : wanted;
+            for (int r = 0; r < wanted; r++)
+            {
+                const Movie &movie = catalog[zipf(movieWeights)];
+                double rating = movie.rating + 1.5 * (uniform() + uniform() + uniform() - 1.5);
+                rating = round((rating < 0.0 ? 0.0 : (rating > 10.0 ? 10.0 : rating)) * 2.0) / 2.0;
+                user.setRating(movie.title, (float)rating);
+            }
+        }
+    }
 
-        std::cout << "Added 20 recent English and Hindi movies from 2020-2025!" << std::endl;
+    const std::vector<Movie> &movies() const
+    {
+        return catalog;
+    }
+
+    // Random movie of the generated catalog, weighted by popularity
+    const Movie &pickMovie()
+    {
+        return catalog[zipf(movieWeights)];
+    }
+
+    const char *pickGenre()
+    {
+        return catalog[below((int)catalog.size())].genre;
+    }
+
+    int pick(int n)
+    {
+        return below(n);
+    }
+
+    // Write the generated catalog as a database file
+    bool writeDatabase(const char *filename, const std::vector<User> &users)
+    {
+        FILE *fp = fopen(filename, "wb");
+        if (!fp)
+        {
+            return false;
+        }
+        const char signature[8] = "MVDB103"; // Names are looked up on load: there is no "DICT"
+        int movieCount = (int)catalog.size();
+        int userCount = (int)users.size();
+        bool ok = fwrite(signature, sizeof(char), 8, fp) == 8 &&
+                  fwrite(&movieCount, sizeof(int), 1, fp) == 1 &&
+                  fwrite(&userCount, sizeof(int), 1, fp) == 1 &&
+                  writeRecordChunks(fp, "MOVS", catalog.data(), movieCount, movieRecordLayout) &&
+                  writeRecordChunks(fp, "USRS", users.data(), userCount, userRecordLayout);
+        return (fclose(fp) == 0) && ok;
+    }
+};
+
+// Microbenchmarks for each database operation on generated catalogs, and
+// a mixed workload. Every result is one JSON object per line on stdout
+// (latencies in nanoseconds), so runs of different builds can be diffed.
+// Operations print as usual; their output is discarded while timing.
+class BenchmarkRunner
+{
+private:
+    FILE *out;
+    unsigned int seed;
+    double seconds; // Time spent on each operation
+    int movieCount;
+    int userCount;
+
+    void report(const char *name, std::vector<long long> &samples, double elapsed)
+    {
+        std::sort(samples.begin(), samples.end());
+        long long total = 0;
+        for (size_t i = 0; i < samples.size(); i++)
+        {
+            total += samples[i];
+        }
+        size_t n = samples.size();
+        std::string line;
+        JsonWriter json(line);
+        line += '{';
+        json.key("benchmark");
+        json.string(name);
+        json.key("movies");
+        json.number((long long)movieCount);
+        json.key("users");
+        json.number((long long)userCount);
+        json.key("seed");
+        json.number((long long)seed);
+        json.key("iterations");
+        json.number((long long)n);
+        json.key("ops_per_sec");
+        json.number((long long)(n / elapsed));
+        json.key("mean_ns");
+        json.number(total / (long long)n);
+        json.key("p50_ns");
+        json.number(samples[n / 2]);
+        json.key("p90_ns");
+        json.number(samples[(size_t)(n * 0.9)]);
+        json.key("p99_ns");
+        json.number(samples[(size_t)(n * 0.99)]);
+        json.key("p999_ns");
+        json.number(samples[(size_t)(n * 0.999)]);
+        json.key("max_ns");
+        json.number(samples.back());
+        line += "}\n";
+        fwrite(line.data(), 1, line.size(), out);
+        fflush(out);
+    }
+
+    // Time calls of one operation until the time budget is spent. setup
+    // runs untimed before every call (e.g. to undo a sort).
+    void measure(const char *name, const std::function<void(long long)> &operation,
+                 const std::function<void()> &setup = nullptr)
+    {
+        std::vector<long long> samples;
+        double elapsed = 0.0;
+        std::cout.setstate(std::ios::badbit); // Discard what the operation prints
+        for (long long i = 0; (elapsed < seconds || i < BENCHMARK_MIN_SAMPLES) && i < BENCHMARK_MAX_SAMPLES; i++)
+        {
+            if (setup)
+            {
+                setup();
+            }
+            auto before = std::chrono::steady_clock::now();
+            operation(i);
+            long long spent = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - before).count();
+            samples.push_back(spent);
+            elapsed += spent / 1e9;
+        }
+        std::cout.clear();
+        report(name, samples, elapsed);
+    }
+
+    void runMixedWorkload(MovieDatabase &db, CatalogGenerator &generator, const char *scratchFile)
+    {
+        // Mostly reads, like the server sees: searches, similar movies and
+        // recommendations, plus ratings, catalog edits and the odd save
+        static const char *kinds[MIXED_WORKLOAD_KINDS] = {"search", "filter", "similar", "recommend", "rate", "edit", "save"};
+        static const int cumulativePercent[MIXED_WORKLOAD_KINDS] = {40, 55, 70, 80, 95, 99, 100};
+        std::vector<long long> all;
+        std::vector<long long> byKind[MIXED_WORKLOAD_KINDS];
+        Session session;
+        double elapsed = 0.0;
+        double budget = seconds * 5;
+
+        std::cout.setstate(std::ios::badbit);
+        for (long long i = 0; (elapsed < budget || i < BENCHMARK_MIN_SAMPLES) && i < BENCHMARK_MAX_SAMPLES; i++)
+        {
+            int roll = generator.pick(100);
+            int kind = 0;
+            while (roll >= cumulativePercent[kind])
+            {
+                kind++;
+            }
+            const Movie &movie = generator.pickMovie();
+            char word[MAX_STRING_LENGTH];
+            sscanf(movie.title, "%99s", word);
+            session.userId = 1 + generator.pick(userCount);
+
+            auto before = std::chrono::steady_clock::now();
+            switch (kind)
+            {
+            case 0:
+                db.searchByTitle(word);
+                break;
+            case 1:
+                if (i % 3 == 0)
+                {
+                    db.searchByGenre(movie.genre);
+                }
+                else if (i % 3 == 1)
+                {
+                    db.searchByDirector(movie.director);
+                }
+                else
+                {
+                    db.searchByYear(movie.releaseYear);
+                }
+                break;
+            case 2:
+                db.findSimilarMovies(movie.title);
+                break;
+            case 3:
+                db.getRecommendations(session);
+                break;
+            case 4:
+                db.rateMovie(session, movie.title, (float)generator.pick(11));
+                break;
+            case 5:
+                db.deleteMovie(movie.title);
+                db.addMovie(movie);
+                db.compactIfNeeded();
+                break;
+            default:
+                db.saveToFile(scratchFile);
+                break;
+            }
+            long long spent = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - before).count();
+            all.push_back(spent);
+            byKind[kind].push_back(spent);
+            elapsed += spent / 1e9;
+        }
+        std::cout.clear();
+
+        report("mixed", all, elapsed);
+        for (int k = 0; k < MIXED_WORKLOAD_KINDS; k++)
+        {
+            if (!byKind[k].empty())
+            {
+                std::string name = std::string("mixed.") + kinds[k];
+                report(name.c_str(), byKind[k], elapsed);
+            }
+        }
+    }
+
+public:
+    BenchmarkRunner(FILE *output, unsigned int benchmarkSeed, double secondsPerOperation)
+        : out(output), seed(benchmarkSeed), seconds(secondsPerOperation), movieCount(0), userCount(0) {}
+
+    // Run every benchmark on one generated catalog
+    bool run(int movies, int users)
+    {
+        const char *scratchFile = "benchmark.dat";
+        movieCount = movies;
+        userCount = users;
+        CatalogGenerator generator(seed);
+        std::vector<User> generatedUsers;
+        generator.generate(movieCount, userCount, generatedUsers);
+        if (!generator.writeDatabase(scratchFile, generatedUsers))
+        {
+            std::cout << "Error: Could not write " << scratchFile << std::endl;
+            return false;
+        }
+        generatedUsers.clear();
+
+        MovieDatabase *database = new MovieDatabase(); // Too large for the stack
+        MovieDatabase &db = *database;
+        std::cout.setstate(std::ios::badbit);
+        bool loaded = db.loadFromFile(scratchFile);
+        std::cout.clear();
+        if (!loaded)
+        {
+            std::cout << "Error: Could not load " << scratchFile << std::endl;
+            delete database;
+            return false;
+        }
+        std::cout << "Benchmarking " << movieCount << " movies and " << userCount << " users (seed " << seed << ")" << std::endl;
+
+        const std::vector<Movie> &catalog = generator.movies();
+        std::vector<std::string> words(catalog.size());
+        for (size_t i = 0; i < catalog.size(); i++)
+        {
+            char word[MAX_STRING_LENGTH];
+            sscanf(catalog[i].title, "%99s", word);
+            words[i] = word;
+        }
+        Session session;
+
+        measure("searchByTitle", [&](long long i)
+                { db.searchByTitle(words[i % words.size()].c_str()); });
+        measure("searchByYear", [&](long long i)
+                { db.searchByYear(catalog[i % catalog.size()].releaseYear); });
+        measure("searchByGenre", [&](long long)
+                { db.searchByGenre(generator.pickGenre()); });
+        measure("searchByDirector", [&](long long)
+                { db.searchByDirector(generator.pickMovie().director); });
+        measure("getMovieByTitle", [&](long long i)
+                { db.getMovieByTitle(catalog[i % catalog.size()].title); });
+        measure("findSimilarMovies", [&](long long)
+                { db.findSimilarMovies(generator.pickMovie().title); });
+        measure("getRecommendations", [&](long long i)
+                {
+                    session.userId = 1 + (int)(i % userCount);
+                    db.getRecommendations(session); });
+        measure("rateMovie", [&](long long i)
+                {
+                    session.userId = 1 + generator.pick(userCount);
+                    db.rateMovie(session, generator.pickMovie().title, (float)(i % 11)); });
+        measure("displayTopRated", [&](long long)
+                { db.displayTopRated(10); });
+
+        // Each sort starts from the order of a different sort
+        measure("sortByRatingBubble", [&](long long)
+                { db.sortByRatingBubble(); }, [&]()
+                { db.sortByUserScore(); });
+        measure("sortByRatingSelection", [&](long long)
+                { db.sortByRatingSelection(); }, [&]()
+                { db.sortByUserScore(); });
+        measure("sortByUserScore", [&](long long)
+                { db.sortByUserScore(); }, [&]()
+                { db.sortByRatingBubble(); });
+
+        measure("deleteAndAddMovie", [&](long long i)
+                {
+                    const Movie &movie = catalog[i % catalog.size()];
+                    db.deleteMovie(movie.title);
+                    db.addMovie(movie);
+                    db.compactIfNeeded(); });
+
+        db.publishSnapshot();
+        measure("snapshotQuery", [&](long long i)
+                {
+                    char line[MAX_QUERY_LENGTH];
+                    snprintf(line, sizeof(line), (i % 2 == 0) ? "SEARCH %s" : "SIMILAR %s",
+                             (i % 2 == 0) ? words[i % words.size()].c_str() : catalog[i % catalog.size()].title);
+                    SnapshotReader snapshot = db.readSnapshot();
+                    QueryResult result;
+                    db.executeQuery(line, *snapshot.get(), nullptr, result); });
+
+        measure("saveToFile", [&](long long)
+                { db.saveToFile(scratchFile); });
+        measure("loadFromFile", [&](long long)
+                { db.loadFromFile(scratchFile); });
+
+        runMixedWorkload(db, generator, scratchFile);
+        delete database;
+
+        char sideFile[MAX_STRING_LENGTH + 8];
+        remove(scratchFile);
+        snprintf(sideFile, sizeof(sideFile), "%s.lsm", scratchFile);
+        remove(sideFile);
+        return true;
     }
 };
 
-int main()
+int main(int argc, char *argv[])
 {
-    MovieDatabase database;
+    static MovieDatabase database; // Too large for the stack
+
+    // Options that go in front of any mode, e.g. --primary --serve:
+    //   --primary                log every change for replication followers
+    //   --trace <file>           write a trace of every request when the program exits
+    //   --slow-query-ms <ms>     log the trace of every request slower than this
+    bool primary = false;
+    const char *tracePath = nullptr;
+    double slowQueryMs = -1.0;
+    while (argc > 1)
+    {
+        if (strcmp(argv[1], "--primary") == 0)
+        {
+            primary = true;
+            argc--;
+            argv++;
+        }
+        else if (strcmp(argv[1], "--trace") == 0 && argc > 2)
+        {
+            tracePath = argv[2];
+            argc -= 2;
+            argv += 2;
+        }
+        else if (strcmp(argv[1], "--slow-query-ms") == 0 && argc > 2)
+        {
+            char *end;
+            slowQueryMs = strtod(argv[2], &end);
+            if (end == argv[2] || *end != '\0' || slowQueryMs < 0.0)
+            {
+                std::cout << "Error: --slow-query-ms needs a number of milliseconds." << std::endl;
+                return 1;
+            }
+            argc -= 2;
+            argv += 2;
+        }
+        else
+        {
+            break;
+        }
+    }
+
+    // Batch query and benchmark modes keep stdout for results, so messages
+    // go to stderr
+    bool batchQuery = (argc > 1 && strcmp(argv[1], "--batch-query") == 0);
+    bool benchmark = (argc > 1 && strcmp(argv[1], "--benchmark") == 0);
+    if (batchQuery || benchmark)
+    {
+        std::cout.rdbuf(std::cerr.rdbuf());
+    }
+    if (tracePath != nullptr)
+    {
+        tracer.enableTrace(tracePath);
+    }
+    if (slowQueryMs >= 0.0)
+    {
+        tracer.enableSlowQueryLog(slowQueryMs);
+    }
+
+    // Benchmarks on generated catalogs (the database file is not touched):
+    // --benchmark [movie counts, e.g. 10,25,50] [users] [seed] [seconds per operation]
+    if (benchmark)
+    {
+        const char *sizes = (argc > 2) ? argv[2] : "10,25,50";
+        int users = (argc > 3) ? atoi(argv[3]) : 1000;
+        unsigned int seed = (argc > 4) ? (unsigned int)strtoul(argv[4], nullptr, 10) : 42u;
+        double seconds = (argc > 5) ? atof(argv[5]) : 0.2;
+        users = (users < 1) ? 1 : (users > MAX_USERS ? MAX_USERS : users);
+        BenchmarkRunner runner(stdout, seed, seconds > 0.0 ? seconds : 0.2);
+        std::vector<int> done;
+        const char *p = sizes;
+        while (*p != '\0')
+        {
+            char *end;
+            int movies = (int)strtol(p, &end, 10);
+            p = (*end == ',') ? end + 1 : end;
+            if (end == sizes || (*end != ',' && *end != '\0'))
+            {
+                std::cout << "Error: Movie counts must be numbers separated by commas." << std::endl;
+                return 1;
+            }
+            if (movies > MAX_MOVIES)
+            {
+                std::cout << "Note: " << movies << " movies requested, but the catalog holds at most "
+                          << MAX_MOVIES << "; using " << MAX_MOVIES << "." << std::endl;
+                movies = MAX_MOVIES;
+            }
+            if (movies < 1 || std::find(done.begin(), done.end(), movies) != done.end())
+            {
+                continue;
+            }
+            done.push_back(movies);
+            if (!runner.run(movies, users))
+            {
+                return 1;
+            }
+        }
+        return 0;
+    }
 
     // Try to load database from file first
     bool loadedFromFile = database.loadFromFile();
@@ -1243,7 +11365,154 @@ int main()
         std::cout << "Initializing database with sample data..." << std::endl;
         database.initializeWithSampleData();
     }
+    if (primary && !database.startPrimary())
+    {
+        return 1;
+    }
+
+    // Measure concurrent snapshot reads under a steady stream of writes
+    // (changes are not saved)
+    if (argc > 1 && strcmp(argv[1], "--concurrency-test") == 0)
+    {
+        database.runConcurrencyTest(1.0);
+        return 0;
+    }
+
+    // Server mode: answer protocol queries over TCP and a Unix socket.
+    // A follower serves reads from the primary's snapshot and log.
+    if (argc > 1 && (strcmp(argv[1], "--serve") == 0 || strcmp(argv[1], "--follow") == 0 ||
+                     strcmp(argv[1], "--loadgen") == 0))
+    {
+#ifdef __linux__
+        database.publishSnapshot();
+        if (strcmp(argv[1], "--follow") == 0 && (!loadedFromFile || !database.startFollower()))
+        {
+            std::cout << "Error: A follower needs the primary's database file and replication log." << std::endl;
+            return 1;
+        }
+        // Only local clients can connect unless --bind names another
+        // address; the load generator only sends ratings with --writes
+        const char *bindAddress = "127.0.0.1";
+        bool writes = false;
+        int positional = 2;
+        for (int i = 2; i < argc; i++)
+        {
+            if (strcmp(argv[i], "--bind") == 0 && i + 1 < argc)
+            {
+                bindAddress = argv[++i];
+            }
+            else if (strcmp(argv[i], "--writes") == 0)
+            {
+                writes = true;
+            }
+            else
+            {
+                argv[positional++] = argv[i];
+            }
+        }
+        argc = positional;
+        if (strcmp(argv[1], "--loadgen") != 0)
+        {
+            int port = (argc > 2) ? atoi(argv[2]) : 7878;
+            const char *socketPath = (argc > 3) ? argv[3] : "movies.sock";
+            if (!database.isFollower())
+            {
+                database.openChangeStore();
+            }
+            QueryServer server(database, WorkStealingPool::defaultWorkerCount());
+            if (!server.initialize() || !server.listenTcp(bindAddress, port) || !server.listenUnix(socketPath))
+            {
+                return 1;
+            }
+            if (database.acceptsReloads() && server.watchFile(DB_FILENAME))
+            {
+                std::cout << "Watching " << DB_FILENAME << " for new versions" << std::endl;
+            }
+            std::cout << "Serving queries on " << bindAddress << ":" << port << " and " << socketPath << " (Ctrl+C to stop)" << std::endl;
+            server.run();
+            unlink(socketPath);
+            if (database.isFollower())
+            {
+                return 0; // The database file belongs to the primary
+            }
+            return database.saveToFile() ? 0 : 1;
+        }
+
+        // Load generator against a running server
+        const char *target = (argc > 2) ? argv[2] : "7878";
+        int connections = (argc > 3) ? atoi(argv[3]) : 8;
+        int pipeline = (argc > 4) ? atoi(argv[4]) : 16;
+        double seconds = (argc > 5) ? atof(argv[5]) : 5.0;
+        SnapshotReader snapshot = database.readSnapshot();
+        runLoadGenerator(target, connections < 1 ? 1 : connections, pipeline < 1 ? 1 : pipeline, seconds, writes, *snapshot.get());
+        return 0;
+#else
+        std::cout << "Error: Server mode is only supported on Linux." << std::endl;
+        return 1;
+#endif
+    }
+
+    // Async API test: many coroutine clients on one thread, with a save in
+    // the background (C++20 builds only)
+    if (argc > 1 && strcmp(argv[1], "--async-test") == 0)
+    {
+#ifdef MOVIEDB_COROUTINES
+        database.publishSnapshot();
+        int requests = (argc > 2) ? atoi(argv[2]) : 10000;
+        runAsyncTest(database, requests < 1 ? 1 : requests);
+        return 0;
+#else
+        std::cout << "Error: The async API needs a C++20 build with coroutine support." << std::endl;
+        return 1;
+#endif
+    }
+
+    // Offline mode: precompute recommendations for every user and save
+    if (argc > 1 && strcmp(argv[1], "--batch-recommend") == 0)
+    {
+        database.precomputeRecommendations();
+        return database.saveToFile() ? 0 : 1;
+    }
+
+    // Batch query mode: answer queries from a file or stdin as JSON Lines
+    if (batchQuery)
+    {
+        const char *inputPath = (argc > 2) ? argv[2] : "-";
+        const char *outputPath = (argc > 3) ? argv[3] : "-";
+        FILE *in = (strcmp(inputPath, "-") == 0) ? stdin : fopen(inputPath, "rb");
+        FILE *out = (strcmp(outputPath, "-") == 0) ? stdout : fopen(outputPath, "wb");
+        if (in == nullptr || out == nullptr)
+        {
+            std::cout << "Error: Could not open " << (in == nullptr ? inputPath : outputPath) << std::endl;
+            return 1;
+        }
+
+        database.publishSnapshot();
+        database.openChangeStore();
+        BatchQueryRunner runner(database, WorkStealingPool::defaultWorkerCount());
+        auto start = std::chrono::steady_clock::now();
+        bool ok = runner.run(in, out);
+        double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        if (in != stdin)
+        {
+            fclose(in);
+        }
+        if (out != stdout && fclose(out) != 0)
+        {
+            ok = false;
+        }
+        std::cout << "Ran " << runner.getQueriesRun() << " queries in " << elapsed << " s" << std::endl;
+
+        // Ratings from the batch are applied and saved like menu ratings
+        database.flushWrites();
+        if (runner.hasQueuedWrites() && !database.saveToFile())
+        {
+            ok = false;
+        }
+        return ok ? 0 : 1;
+    }
 
+    database.openChangeStore();
     database.runMenu();
     return 0;
 }